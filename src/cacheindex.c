@@ -0,0 +1,348 @@
+#include <fcntl.h>              /* open, O_* */
+#include <stddef.h>             /* offsetof */
+#include <string.h>             /* memcpy, memset, strcmp, strlen */
+#include <sys/mman.h>           /* mmap, msync, munmap */
+#include <sys/stat.h>           /* fstat, struct stat */
+#include <unistd.h>             /* close, ftruncate, pread, pwrite */
+
+#include "cacheindex.h"
+#include "printl.h"
+
+_Static_assert(sizeof(cache_record_t) == CACHE_RECORD_SIZE,
+               "cache_record_t must fill a slot exactly");
+
+
+/* XOR DJB2 algorithm, as in hashmap.c. */
+static inline size_t cache_index_slot(const cache_index_t *idx,
+                                      const char *path)
+{
+    unsigned long hash = 5381;
+    int c;
+
+    while ((c = (unsigned char)*path++))
+        hash = ((hash << 5) + hash) ^ c;
+
+    return hash % idx->nslots;
+}
+
+
+/* FNV-1a of the record, with its checksum field read as 0. */
+static uint32_t cache_record_checksum(const cache_record_t *rec)
+{
+    const unsigned char *p = (const unsigned char *)rec;
+    const size_t skip = offsetof(cache_record_t, checksum);
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(cache_record_t); i++) {
+        hash ^= (i - skip < sizeof(rec->checksum)) ? 0 : p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static inline const char *cache_record_path(const cache_record_t *rec)
+{
+    return rec->data + rec->key_len + 1;
+}
+
+
+/* Return true if a used record is whole and its strings are terminated. */
+static bool cache_record_intact(const cache_record_t *rec)
+{
+    size_t path = rec->key_len + 1;
+    size_t etag = path + rec->path_len + 1;
+    size_t last_modified = etag + rec->etag_len + 1;
+    size_t end = last_modified + rec->last_modified_len + 1;
+
+    return (end <= CACHE_RECORD_DATA &&
+            rec->data[path - 1] == '\0' &&
+            rec->data[etag - 1] == '\0' &&
+            rec->data[last_modified - 1] == '\0' &&
+            rec->data[end - 1] == '\0' &&
+            rec->checksum == cache_record_checksum(rec));
+}
+
+
+/* Point `e' at the fields of intact record `rec'. */
+static void cache_record_entry(const cache_record_t *rec,
+                               cache_index_entry_t *e)
+{
+    e->key = rec->data;
+    e->path = cache_record_path(rec);
+    e->etag = e->path + rec->path_len + 1;
+    e->last_modified = e->etag + rec->etag_len + 1;
+    e->size = rec->size;
+    e->stored = rec->stored;
+    e->expires = rec->expires;
+}
+
+
+/*
+ * Return the record for `path' or NULL. If not found, set `slot' to where
+ * it would go (the first tombstone or free slot on its probe), or NULL if
+ * the index is full.
+ */
+static cache_record_t *cache_index_find(cache_index_t *idx, const char *path,
+                                        cache_record_t **slot)
+{
+    cache_record_t *rec;
+    size_t i = cache_index_slot(idx, path);
+
+    *slot = NULL;
+
+    for (size_t n = 0; n < idx->nslots; n++, i = (i + 1) % idx->nslots) {
+        rec = &idx->records[i];
+
+        if (rec->state == CACHE_RECORD_FREE) {
+            if (*slot == NULL)
+                *slot = rec;
+            break;
+        } else if (rec->state == CACHE_RECORD_DELETED) {
+            if (*slot == NULL)
+                *slot = rec;
+        } else if (!strcmp(cache_record_path(rec), path)) {
+            return rec;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Tombstone slot `i'. Tombstones running up to a free slot end no probe
+ * chain, so they are freed to keep probes short.
+ */
+static void cache_index_drop(cache_index_t *idx, size_t i)
+{
+    idx->records[i].state = CACHE_RECORD_DELETED;
+
+    if (idx->records[(i + 1) % idx->nslots].state != CACHE_RECORD_FREE)
+        return;
+
+    while (idx->records[i].state == CACHE_RECORD_DELETED) {
+        idx->records[i].state = CACHE_RECORD_FREE;
+        i = (i + idx->nslots - 1) % idx->nslots;
+    }
+}
+
+
+/* Truncate the file to a fresh, empty index of `nslots' slots. */
+static int cache_index_create(int fd, size_t nslots)
+{
+    cache_index_header_t hdr = { 0 };
+
+    memcpy(hdr.magic, CACHE_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.record_size = CACHE_RECORD_SIZE;
+    hdr.nslots = nslots;
+
+    /* The file is sparse, so unused slots take no disk space */
+    if (ftruncate(fd, 0) == -1 ||
+        ftruncate(fd, (off_t)(nslots + 1) * CACHE_RECORD_SIZE) == -1 ||
+        pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return -1;
+
+    return 0;
+}
+
+
+int cache_index_open(cache_index_t *idx, const char *file, size_t nslots)
+{
+    cache_index_header_t hdr;
+    pthread_mutexattr_t mutexattr;
+    struct stat st;
+    char *msg;
+
+    memset(idx, 0, sizeof(cache_index_t));
+    idx->fd = -1;
+
+    if (nslots == 0)
+        return -1;
+
+    /* Recursive, since dropping a record at load can evict another */
+    pthread_mutexattr_init(&mutexattr);
+    pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&idx->lock, &mutexattr);
+    pthread_mutexattr_destroy(&mutexattr);
+
+    if ((idx->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1 ||
+        fstat(idx->fd, &st) == -1)
+        goto fail;
+
+    /* Keep an index that is intact, whatever size it was created with */
+    if (pread(idx->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        !memcmp(hdr.magic, CACHE_INDEX_MAGIC, sizeof(hdr.magic)) &&
+        hdr.record_size == CACHE_RECORD_SIZE && hdr.nslots &&
+        (uint64_t)st.st_size == (hdr.nslots + 1) * CACHE_RECORD_SIZE) {
+        nslots = hdr.nslots;
+    } else {
+        if (st.st_size) {
+            msg = LOG_WARN "Cache index %s is not valid - starting over\n";
+            printl(msg, file);
+        }
+        if (cache_index_create(idx->fd, nslots) == -1)
+            goto fail;
+    }
+
+    idx->nslots = nslots;
+    idx->map_len = (nslots + 1) * CACHE_RECORD_SIZE;
+    idx->base = mmap(NULL, idx->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     idx->fd, 0);
+    if (idx->base == MAP_FAILED)
+        goto fail;
+
+    idx->records = (cache_record_t *)((char *)idx->base + CACHE_RECORD_SIZE);
+
+    return 0;
+
+fail:
+    if (idx->fd > -1)
+        close(idx->fd);
+    idx->fd = -1;
+    idx->base = NULL;
+
+    return -1;
+}
+
+
+void cache_index_close(cache_index_t *idx)
+{
+    if (idx->fd > -1) {
+        msync(idx->base, idx->map_len, MS_SYNC);
+        munmap(idx->base, idx->map_len);
+        close(idx->fd);
+        idx->fd = -1;
+    }
+
+    pthread_mutex_destroy(&idx->lock);
+}
+
+
+void cache_index_load(cache_index_t *idx, cache_index_visitor visit,
+                      void *arg)
+{
+    cache_record_t *rec;
+    cache_index_entry_t e;
+
+    if (idx->fd < 0)
+        return;
+
+    pthread_mutex_lock(&idx->lock);
+
+    idx->used = 0;
+
+    for (size_t i = 0; i < idx->nslots; i++) {
+        rec = &idx->records[i];
+
+        if (rec->state == CACHE_RECORD_FREE ||
+            rec->state == CACHE_RECORD_DELETED)
+            continue;
+
+        if (rec->state != CACHE_RECORD_USED || !cache_record_intact(rec)) {
+            printl(LOG_DEBUG "Dropping torn cache index record %zu\n", i);
+            cache_index_drop(idx, i);
+            continue;
+        }
+
+        idx->used++;
+        cache_record_entry(rec, &e);
+
+        if (!visit(arg, &e) && rec->state == CACHE_RECORD_USED) {
+            cache_index_drop(idx, i);
+            idx->used--;
+        }
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+}
+
+
+int cache_index_put(cache_index_t *idx, const cache_index_entry_t *e)
+{
+    cache_record_t new = { 0 }, *rec, *slot;
+    const char *etag = e->etag ? e->etag : "";
+    const char *last_modified = e->last_modified ? e->last_modified : "";
+    size_t key_len = strlen(e->key), path_len = strlen(e->path);
+    size_t etag_len = strlen(etag), last_modified_len = strlen(last_modified);
+    char *p = new.data;
+
+    if (idx->fd < 0 ||
+        key_len + path_len + etag_len + last_modified_len + 4 >
+        CACHE_RECORD_DATA)
+        return -1;
+
+    new.state = CACHE_RECORD_USED;
+    new.size = e->size;
+    new.stored = e->stored;
+    new.expires = e->expires;
+    new.key_len = key_len;
+    new.path_len = path_len;
+    new.etag_len = etag_len;
+    new.last_modified_len = last_modified_len;
+    memcpy(p, e->key, key_len + 1);
+    memcpy(p += key_len + 1, e->path, path_len + 1);
+    memcpy(p += path_len + 1, etag, etag_len + 1);
+    memcpy(p += etag_len + 1, last_modified, last_modified_len + 1);
+    new.checksum = cache_record_checksum(&new);
+
+    pthread_mutex_lock(&idx->lock);
+
+    if ((rec = cache_index_find(idx, e->path, &slot)) == NULL) {
+        if ((rec = slot) == NULL) {
+            pthread_mutex_unlock(&idx->lock);
+            return -1;
+        }
+        idx->used++;
+    }
+
+    /* A crash partway through leaves a record whose checksum won't match */
+    memcpy(rec, &new, sizeof(cache_record_t));
+
+    pthread_mutex_unlock(&idx->lock);
+
+    return 0;
+}
+
+
+int cache_index_get(cache_index_t *idx, const char *path, cache_record_t *rec,
+                    cache_index_entry_t *e)
+{
+    cache_record_t *found, *slot;
+
+    if (idx->fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&idx->lock);
+
+    if ((found = cache_index_find(idx, path, &slot)) != NULL)
+        memcpy(rec, found, sizeof(cache_record_t));
+
+    pthread_mutex_unlock(&idx->lock);
+
+    if (found == NULL)
+        return -1;
+
+    cache_record_entry(rec, e);
+
+    return 0;
+}
+
+
+void cache_index_del(cache_index_t *idx, const char *path)
+{
+    cache_record_t *rec, *slot;
+
+    if (idx->fd < 0)
+        return;
+
+    pthread_mutex_lock(&idx->lock);
+
+    if ((rec = cache_index_find(idx, path, &slot)) != NULL) {
+        cache_index_drop(idx, rec - idx->records);
+        idx->used--;
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+}
@@ -0,0 +1,105 @@
+#ifndef CACHEINDEX_H
+#define CACHEINDEX_H
+
+#include <pthread.h>            /* pthread_mutex_* */
+#include <stdbool.h>            /* bool */
+#include <stdint.h>             /* uint*_t */
+#include <stdlib.h>             /* size_t */
+#include <time.h>               /* time_t */
+
+#define CACHE_INDEX_MAGIC "TOYIDX4"
+#define CACHE_RECORD_SIZE 2048  /* bytes per slot, the header takes slot 0 */
+#define CACHE_RECORD_DATA (CACHE_RECORD_SIZE - 40) /* string bytes */
+
+
+/* What a slot of the index holds. */
+typedef enum cache_record_state {
+    CACHE_RECORD_FREE = 0,      /* never used - ends a probe */
+    CACHE_RECORD_USED = 1,      /* a cached object */
+    CACHE_RECORD_DELETED = 2    /* tombstone - probes continue past it */
+} cache_record_state_t;
+
+/*
+ * One cached object, keyed by its cache file path. The checksum covers the
+ * whole record, so one torn by a crash mid-update is dropped at load.
+ */
+typedef struct cache_record {
+    uint32_t state;             /* cache_record_state_t */
+    uint32_t checksum;          /* FNV-1a of the record with this field 0 */
+    uint64_t size;              /* cache file size */
+    int64_t stored;             /* time the object was cached */
+    int64_t expires;            /* time the object goes stale (0 = timeout) */
+    uint16_t key_len;           /* key bytes at the start of data */
+    uint16_t path_len;          /* path bytes after the key's NUL */
+    uint16_t etag_len;          /* ETag bytes after the path's NUL */
+    uint16_t last_modified_len; /* Last-Modified bytes after the ETag's NUL */
+    char data[CACHE_RECORD_DATA]; /* "key\0path\0etag\0last-modified\0" */
+} cache_record_t;
+
+/* The first slot of the index file. */
+typedef struct cache_index_header {
+    char magic[8];              /* CACHE_INDEX_MAGIC */
+    uint32_t record_size;       /* CACHE_RECORD_SIZE */
+    uint32_t reserved;
+    uint64_t nslots;            /* record slots following the header */
+} cache_index_header_t;
+
+/*
+ * An open-addressed table of cache records in a memory-mapped file, so the
+ * cache survives restarts. Records are updated in place in the shared
+ * mapping and written back by the kernel.
+ */
+typedef struct cache_index {
+    int fd;                     /* index file or -1 if not open */
+    void *base;                 /* mapping of the whole file */
+    size_t map_len;             /* bytes mapped */
+    cache_record_t *records;    /* slots after the header */
+    size_t nslots;              /* number of record slots */
+    size_t used;                /* slots holding an object */
+    pthread_mutex_t lock;       /* index lock for multithreading support */
+} cache_index_t;
+
+/* What the index knows about a cached object. */
+typedef struct cache_index_entry {
+    const char *key;            /* cache key */
+    const char *path;           /* cache file */
+    size_t size;                /* cache file size */
+    time_t stored;              /* when the origin generated the response */
+    time_t expires;             /* when it goes stale (0 = cache timeout) */
+    const char *etag;           /* ETag to revalidate with or "" */
+    const char *last_modified;  /* Last-Modified to revalidate with or "" */
+} cache_index_entry_t;
+
+/* Called for each object at load. Return false to drop its record. */
+typedef bool (*cache_index_visitor)(void *arg, const cache_index_entry_t *e);
+
+/*
+ * Map the index at `file', creating it with `nslots' slots if it doesn't
+ * exist or isn't a valid index. Return 0 or -1 (the index stays closed).
+ */
+int cache_index_open(cache_index_t *idx, const char *file, size_t nslots);
+/* Write the index back and unmap it. */
+void cache_index_close(cache_index_t *idx);
+/*
+ * Call `visit' with each intact record, dropping torn records and those it
+ * rejects. `visit' may call cache_index_del().
+ */
+void cache_index_load(cache_index_t *idx, cache_index_visitor visit,
+                      void *arg);
+/*
+ * Record the object `e' describes, replacing any record for its path. NULL
+ * validators are stored as "". Return -1 if the index isn't open, is full,
+ * or the strings don't fit in a record.
+ */
+int cache_index_put(cache_index_t *idx, const cache_index_entry_t *e);
+/*
+ * Copy the record for `path' to `rec' and point `e' into the copy. Return
+ * -1 if there is none.
+ */
+int cache_index_get(cache_index_t *idx, const char *path, cache_record_t *rec,
+                    cache_index_entry_t *e);
+/* Drop the record for `path', if any. */
+void cache_index_del(cache_index_t *idx, const char *path);
+
+
+#endif  /* CACHEINDEX_H */
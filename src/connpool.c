@@ -0,0 +1,202 @@
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* fcntl, O_NONBLOCK */
+#include <stdint.h>             /* uint32_t */
+#include <string.h>             /* memcpy */
+#include <sys/socket.h>         /* recv, MSG_* */
+#include <unistd.h>             /* close */
+
+#include "connpool.h"
+#include "printl.h"
+
+
+static inline size_t connpool_index(const connpool_t *pool,
+                                    const struct sockaddr_in *addr)
+{
+    uint32_t h = addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16);
+
+    return (h * 2654435761u) % pool->bucket_size;
+}
+
+
+static inline bool connpool_addrs_equal(const struct sockaddr_in *a,
+                                        const struct sockaddr_in *b)
+{
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr &&
+            a->sin_port == b->sin_port);
+}
+
+
+/* Return true if an idle socket is still open and has nothing to read. */
+static bool connpool_healthy(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    /* 0 is an orderly close, data means a stray response */
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+static int connpool_set_nonblock(int fd, bool nonblock)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1)
+        return -1;
+
+    flags = nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+
+    return fcntl(fd, F_SETFL, flags);
+}
+
+
+int connpool_init(connpool_t *pool, size_t max_idle,
+                  unsigned long idle_timeout)
+{
+    pool->bucket = calloc(CONNPOOL_BUCKETS, sizeof(connpool_entry_t *));
+    if (pool->bucket == NULL)
+        return -1;
+
+    pool->bucket_size = CONNPOOL_BUCKETS;
+    pool->size = 0;
+    pool->max_idle = max_idle;
+    pool->idle_timeout = idle_timeout;
+
+    if (pthread_mutex_init(&pool->lock, NULL)) {
+        free(pool->bucket);
+        pool->bucket = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void connpool_destroy(connpool_t *pool)
+{
+    connpool_entry_t *entry, *next;
+
+    if (pool == NULL || pool->bucket == NULL)
+        return;
+
+    for (size_t i = 0; i < pool->bucket_size; i++) {
+        for (entry = pool->bucket[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            close(entry->fd);
+            free(entry);
+        }
+    }
+
+    free(pool->bucket);
+    pool->bucket = NULL;
+    pool->size = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+
+int connpool_checkout(connpool_t *pool, const struct sockaddr_in *addr,
+                      bool nonblock)
+{
+    connpool_entry_t **link, *entry;
+    int fd = -1;
+    bool entry_nonblock = false;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool->lock);
+
+    /* Newest first, so the most recently used socket is reused */
+    link = &pool->bucket[connpool_index(pool, addr)];
+    while ((entry = *link) != NULL) {
+        if (!connpool_addrs_equal(&entry->addr, addr)) {
+            link = &entry->next;
+            continue;
+        }
+
+        *link = entry->next;
+        pool->size--;
+
+        if ((unsigned long)(now - entry->idle_since) <= pool->idle_timeout &&
+            connpool_healthy(entry->fd)) {
+            fd = entry->fd;
+            entry_nonblock = entry->nonblock;
+            free(entry);
+            break;
+        }
+
+        printl(LOG_DEBUG "Closing stale upstream socket %d\n", entry->fd);
+        close(entry->fd);
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (fd > -1 && entry_nonblock != nonblock &&
+        connpool_set_nonblock(fd, nonblock) == -1) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+
+void connpool_checkin(connpool_t *pool, const struct sockaddr_in *addr, int fd,
+                      bool nonblock)
+{
+    connpool_entry_t **head, *entry;
+    size_t nidle = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    head = &pool->bucket[connpool_index(pool, addr)];
+    for (entry = *head; entry != NULL; entry = entry->next)
+        nidle += connpool_addrs_equal(&entry->addr, addr);
+
+    if (nidle >= pool->max_idle ||
+        (entry = malloc(sizeof(connpool_entry_t))) == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        close(fd);
+        return;
+    }
+
+    memcpy(&entry->addr, addr, sizeof(struct sockaddr_in));
+    entry->fd = fd;
+    entry->nonblock = nonblock;
+    entry->idle_since = time(NULL);
+    entry->next = *head;
+    *head = entry;
+    pool->size++;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+size_t connpool_expire(connpool_t *pool)
+{
+    connpool_entry_t **link, *entry;
+    size_t nclosed = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (size_t i = 0; i < pool->bucket_size; i++) {
+        link = &pool->bucket[i];
+        while ((entry = *link) != NULL) {
+            if ((unsigned long)(now - entry->idle_since) <=
+                pool->idle_timeout) {
+                link = &entry->next;
+                continue;
+            }
+
+            *link = entry->next;
+            close(entry->fd);
+            free(entry);
+            pool->size--;
+            nclosed++;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return nclosed;
+}
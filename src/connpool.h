@@ -0,0 +1,58 @@
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <netinet/in.h>         /* struct sockaddr_in */
+#include <pthread.h>            /* pthread_mutex_* */
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+#include <time.h>               /* time_t */
+
+#define CONNPOOL_BUCKETS 64     /* origin hash buckets */
+#define CONNPOOL_MAX_IDLE 8     /* idle sockets kept per origin */
+#define CONNPOOL_IDLE_TIMEOUT_S 30  /* close sockets idle longer than this */
+
+
+/* An idle upstream socket. */
+typedef struct connpool_entry {
+    struct connpool_entry *next; /* next entry in the bucket, newest first */
+    struct sockaddr_in addr;    /* origin the socket is connected to */
+    int fd;                     /* connected socket */
+    bool nonblock;              /* O_NONBLOCK is set on fd */
+    time_t idle_since;          /* when the socket was checked in */
+} connpool_entry_t;
+
+/* Idle keep-alive upstream sockets shared by every connection handler. */
+typedef struct connpool {
+    connpool_entry_t **bucket;  /* entries hashed by origin ip:port */
+    size_t bucket_size;         /* size of the "bucket" array */
+    size_t size;                /* number of idle sockets held */
+    size_t max_idle;            /* idle sockets kept per origin */
+    unsigned long idle_timeout; /* age in secs to close an idle socket */
+    pthread_mutex_t lock;       /* pool lock for multithreading support */
+} connpool_t;
+
+/* Initialize an empty pool. Return -1 for OOM. */
+int connpool_init(connpool_t *pool, size_t max_idle,
+                  unsigned long idle_timeout);
+/* Close every idle socket and free the pool. */
+void connpool_destroy(connpool_t *pool);
+/*
+ * Return an idle socket connected to `addr' or -1 if there is none.
+ *
+ * Sockets the peer has closed (or that have unexpected data waiting) are
+ * discarded. The socket is switched to non-blocking mode if `nonblock'.
+ */
+int connpool_checkout(connpool_t *pool, const struct sockaddr_in *addr,
+                      bool nonblock);
+/*
+ * Hand socket `fd' connected to `addr' back to the pool once a response has
+ * been read in full. It is closed if the origin already has max_idle idle
+ * sockets.
+ */
+void connpool_checkin(connpool_t *pool, const struct sockaddr_in *addr, int fd,
+                      bool nonblock);
+/* Close sockets idle longer than the timeout. Return the number closed. */
+size_t connpool_expire(connpool_t *pool);
+
+
+#endif  /* CONNPOOL_H */
@@ -0,0 +1,1439 @@
+#define _GNU_SOURCE             /* accept4, splice */
+
+#include <arpa/inet.h>          /* inet_addr */
+#include <errno.h>              /* errno */
+#include <fcntl.h>              /* open, splice, O_* */
+#include <pthread.h>            /* pthread_* */
+#include <stdint.h>             /* uint64_t */
+#include <stdlib.h>             /* calloc, free, malloc */
+#include <string.h>             /* memcpy, strerror */
+#include <sys/epoll.h>          /* epoll_* */
+#include <sys/eventfd.h>        /* eventfd */
+#include <sys/socket.h>         /* accept4, send, getsockopt */
+#include <sys/stat.h>           /* fstat, struct stat */
+#include <unistd.h>             /* close, pipe2, read */
+
+#include "connpool.h"
+#include "eventloop.h"
+#include "hashmap.h"
+#include "printl.h"
+#include "toyproxy.h"
+
+#define MAX_EVENTS 256          /* events handled per epoll_wait */
+#define LOOP_TICK_MS 1000       /* wake at least this often to check timers */
+#define CONN_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+#define CONNECT_TIMEOUT_S 10    /* max wait for an upstream connect */
+#define UPSTREAM_TIMEOUT_S 30   /* max upstream stall before a 504 */
+#define SEND_TIMEOUT_S 30       /* max stall writing to the client */
+
+
+/* Run the state machine until it blocks on a socket or closes. */
+static void conn_pump(event_loop_t *loop, conn_t *c);
+
+
+static void conn_list_remove(conn_t **list, conn_t *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        *list = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+
+    c->prev = c->next = NULL;
+}
+
+
+static void conn_list_push(conn_t **list, conn_t *c)
+{
+    c->prev = NULL;
+    c->next = *list;
+    if (*list)
+        (*list)->prev = c;
+    *list = c;
+}
+
+
+static void conn_clear_out(conn_t *c)
+{
+    if (c->out_owned)
+        free(c->out);
+
+    c->out = NULL;
+    c->out_owned = false;
+    c->out_len = c->out_off = 0;
+}
+
+
+static void conn_close_pipe(conn_t *c)
+{
+    if (c->pipefd[0] < 0)
+        return;
+
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+    c->pipefd[0] = c->pipefd[1] = -1;
+}
+
+
+/* Free an in-progress upstream response without caching it. */
+static void conn_release_response(conn_t *c)
+{
+    free(c->resbuf);
+    c->resbuf = NULL;
+    c->res_len = c->res_off = 0;
+    c->splice = false;
+
+    /* A pipe still holding part of an abandoned body can't be reused */
+    if (c->pipe_len) {
+        conn_close_pipe(c);
+        c->pipe_len = 0;
+    }
+
+    if (c->res_active) {
+        cache_writer_close(&c->writer, false);
+        if (c->out == c->res.raw)
+            conn_clear_out(c);
+        response_destroy(&c->res);
+        c->res_active = false;
+    }
+}
+
+
+static void conn_close_upstream(event_loop_t *loop, conn_t *c)
+{
+    if (c->sfd < 0)
+        return;
+
+    printl(LOG_DEBUG "[%d] Closing socket %d\n", loop->id, c->sfd);
+    close(c->sfd);              /* also removes it from the epoll set */
+    c->sfd = -1;
+    memset(&c->server_addr, 0, sizeof(c->server_addr));
+}
+
+
+/* Hand a reusable upstream socket to the pool instead of closing it. */
+static void conn_release_upstream(event_loop_t *loop, conn_t *c)
+{
+    if (c->sfd < 0)
+        return;
+
+    printl(LOG_DEBUG "[%d] Pooling socket %d\n", loop->id, c->sfd);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->sfd, NULL);
+    connpool_checkin(&upstream_pool, &c->server_addr, c->sfd, true);
+    c->sfd = -1;
+    memset(&c->server_addr, 0, sizeof(c->server_addr));
+}
+
+
+/*
+ * Watch the fetch a conn follows through the loop's wakefd, and put the conn
+ * on the loop's followers, which are all a wakeup moves on. Return -1 for
+ * OOM.
+ */
+static int conn_follow(event_loop_t *loop, conn_t *c)
+{
+    if (inflight_watch(&inflight_fetches, c->flight, loop->wakefd) == -1)
+        return -1;
+
+    c->fprev = NULL;
+    c->fnext = loop->followers;
+    if (loop->followers)
+        loop->followers->fprev = c;
+    loop->followers = c;
+
+    return 0;
+}
+
+
+/* Undo conn_follow(). */
+static void conn_unfollow(event_loop_t *loop, conn_t *c)
+{
+    inflight_unwatch(&inflight_fetches, c->flight, loop->wakefd);
+
+    if (c->fprev)
+        c->fprev->fnext = c->fnext;
+    else
+        loop->followers = c->fnext;
+
+    if (c->fnext)
+        c->fnext->fprev = c->fprev;
+
+    c->fprev = c->fnext = NULL;
+}
+
+
+/* Let go of the fetch this conn makes or follows. */
+static void conn_release_flight(event_loop_t *loop, conn_t *c)
+{
+    if (c->flight == NULL)
+        return;
+
+    /* Followers of a fetch that never finished go fetch it themselves */
+    if (c->flight_leader)
+        inflight_end(&inflight_fetches, c->flight, false);
+    else
+        conn_unfollow(loop, c);
+
+    inflight_release(&inflight_fetches, c->flight);
+    c->flight = NULL;
+    c->flight_leader = false;
+}
+
+
+static void conn_destroy(event_loop_t *loop, conn_t *c)
+{
+    printl(LOG_DEBUG "[%d] Closing socket %d\n", loop->id, c->cfd);
+    close(c->cfd);
+    conn_close_upstream(loop, c);
+
+    if (c->file_fd > -1)
+        close(c->file_fd);
+    if (c->mem)
+        memcache_release(&mem_cache, c->mem);
+
+    conn_release_response(c);
+    conn_release_flight(loop, c);
+    conn_close_pipe(c);
+    conn_clear_out(c);
+    request_destroy(&c->req);
+    free(c);
+}
+
+
+static void conn_create(event_loop_t *loop, int fd, struct sockaddr_in *addr)
+{
+    conn_t *c;
+    struct epoll_event ev = { 0 };
+    int id = loop->id;
+
+    if ((c = calloc(1, sizeof(conn_t))) == NULL) {
+        printl(LOG_ERR "[%d] Out of memory accepting socket %d\n", id, fd);
+        close(fd);
+        return;
+    }
+
+    c->state = CONN_READ_REQUEST;
+    c->cfd = fd;
+    c->sfd = -1;
+    c->file_fd = -1;
+    c->writer.fill = NULL;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->last_active = time(NULL);
+    memcpy(&c->client_addr, addr, sizeof(struct sockaddr_in));
+    request_init(&c->req, fd, &c->client_addr);
+    c->req.thread_id = id;
+
+    ev.events = CONN_EVENTS;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        printl(LOG_ERR "[%d] epoll_ctl - %s\n", id, strerror(errno));
+        request_destroy(&c->req);
+        free(c);
+        close(fd);
+        return;
+    }
+
+    conn_list_push(&loop->conns, c);
+    loop->nconns++;
+
+    printl(LOG_DEBUG "[%d] Connection accepted on socket %d\n", id, fd);
+}
+
+
+/* Queue an error response and close the connection once it is sent. */
+static int conn_send_error(conn_t *c, int status)
+{
+    response_t res;
+
+    conn_release_response(c);
+    conn_clear_out(c);
+
+    response_init_from_request(&c->req, &res, status, NULL, 0);
+    response_serialize(&res, &c->out, &c->out_len);
+    printl("-> %s %s\n", c->req.ip, res.header.status_line);
+    response_destroy(&res);
+
+    c->out_owned = true;
+    c->close_after = true;
+    c->state = CONN_SEND_RESPONSE;
+
+    return 1;
+}
+
+
+/* Queue the header for the file cached as `key' and open it to follow. */
+static int conn_open_cache_file(conn_t *c, const char *key, const char *path)
+{
+    int fd = -1;
+    struct stat st;
+    off_t body_off;
+    size_t body_len;
+    char *msg;
+    request_t *req = &c->req;
+    int id = req->thread_id;
+
+    /* A hot object is served from RAM without touching the filesystem */
+    if ((c->mem = cache_object_get(key)) == NULL) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+            msg = LOG_DEBUG "[%d] Failed to open %s - %s\n";
+            printl(msg, id, path, strerror(errno));
+            return -1;
+        }
+
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return -1;
+        }
+
+        if ((c->mem = cache_object_load(key, fd, &st))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    c->file_len = c->mem ? c->mem->len : (size_t)st.st_size;
+
+    /* The origin's header was stored ahead of the body */
+    c->out = cache_response_header(req, fd, c->mem, c->file_len,
+                                   c->mem ? c->mem->mtime : st.st_mtime,
+                                   c->parts, &c->nparts, &body_off,
+                                   &body_len, &c->out_len);
+    if (c->out == NULL) {
+        printl(LOG_WARN "[%d] %s isn't a cache object\n", id, path);
+        if (c->mem)
+            memcache_release(&mem_cache, c->mem);
+        c->mem = NULL;
+        if (fd > -1)
+            close(fd);
+        return -1;
+    }
+
+    printl("-> %s %.3s %s (%lu)%s\n", req->ip, strchr(c->out, ' ') + 1, path,
+           (unsigned long)body_len, c->mem ? " from memory" : "");
+
+    /* Only the requested range of the body, if there was one */
+    c->out_owned = true;
+    c->mem_off = c->nparts ? (size_t)c->parts[0].off : (size_t)body_off;
+    c->file_fd = fd;
+    c->file_off = c->nparts ? c->parts[0].off : body_off;
+    c->file_len = body_off + body_len;
+    c->part = 0;
+    c->state = CONN_SEND_RESPONSE;
+
+    return 0;
+}
+
+
+/* Open (or take from the pool) the upstream socket for the request. */
+static int conn_connect(event_loop_t *loop, conn_t *c)
+{
+    struct sockaddr_in server_addr = { 0 };
+    struct epoll_event ev = { 0 };
+    char *msg;
+    int id = loop->id;
+
+    server_addr.sin_addr.s_addr = inet_addr(c->req.url->ip);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(c->req.url->port);
+
+    c->req_nsent = 0;
+
+    conn_close_upstream(loop, c);
+
+    c->sfd = connpool_checkout(&upstream_pool, &server_addr, true);
+    c->sfd_reused = c->sfd > -1;
+    if (!c->sfd_reused)
+        c->sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    c->req.server_fd = c->sfd;
+    if (c->sfd == -1) {
+        printl(LOG_ERR "[%d] socket - %s\n", id, strerror(errno));
+        c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    ev.events = CONN_EVENTS;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->sfd, &ev) < 0) {
+        printl(LOG_ERR "[%d] epoll_ctl - %s\n", id, strerror(errno));
+        conn_close_upstream(loop, c);
+        c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    memcpy(&c->server_addr, &server_addr, sizeof(struct sockaddr_in));
+
+    if (c->sfd_reused) {
+        msg = LOG_DEBUG "[%d] Reusing pooled socket %d for %s\n";
+        printl(msg, id, c->sfd, c->req.url->host);
+        c->state = CONN_SEND_REQUEST;
+        return 1;
+    }
+
+    msg = LOG_DEBUG "[%d] Socket %d opened for %s\n";
+    printl(msg, id, c->sfd, c->req.url->host);
+
+    if (connect(c->sfd, (struct sockaddr *)&server_addr,
+                sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS) {
+        printl(LOG_ERR "[%d] connect - %s\n", id, strerror(errno));
+        c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    c->state = CONN_CONNECT;
+
+    return 1;
+}
+
+
+/* Serve the request from the cache, a fetch already in flight, or upstream. */
+static int conn_lookup(event_loop_t *loop, conn_t *c)
+{
+    int rval;
+    char *path, *msg, key[CACHE_KEY_MAX];
+    request_t *req = &c->req;
+    int id = loop->id;
+
+    if ((path = cache_lookup(req, key)) != NULL) {
+        printl(LOG_DEBUG "[%d] Cache hit: %s\n", id, path);
+        rval = conn_open_cache_file(c, key, path);
+        /* A copy that can't be read is a miss */
+        if (rval < 0)
+            cache_drop(key, path);
+        free(path);
+        if (rval >= 0)
+            return 1;
+    }
+
+    /* A Range passed upstream gets a 206 that is no use to anyone else */
+    if (req->range && options.range_pass) {
+        cache_prepare_request(req);
+        return conn_connect(loop, c);
+    }
+
+    c->flight = inflight_join(&inflight_fetches, req->url->full,
+                              &c->flight_leader);
+    if (c->flight == NULL || c->flight_leader) {
+        cache_prepare_request(req);
+        return conn_connect(loop, c);
+    }
+
+    if (conn_follow(loop, c) == -1) {
+        inflight_release(&inflight_fetches, c->flight);
+        c->flight = NULL;
+        cache_prepare_request(req);
+        return conn_connect(loop, c);
+    }
+
+    msg = LOG_DEBUG "[%d] Attaching to the fetch in flight of %s\n";
+    printl(msg, id, req->url->full);
+    c->state = CONN_SEND_INFLIGHT;
+
+    return 1;
+}
+
+
+/* Route a completely read request to an error, the cache, or upstream. */
+static int conn_dispatch(event_loop_t *loop, conn_t *c)
+{
+    char *msg;
+    request_t *req = &c->req;
+    int id = loop->id;
+
+    c->keepalive = request_conn_is_keepalive(req);
+
+    /* Note: resolving an uncached hostname blocks this loop */
+    if (request_lookup_host(req) == -1)
+        return conn_send_error(c, 404);
+
+    if (blacklist_has_entry(req)) {
+        msg = LOG_WARN "[%d] Requested URL %s or IP %s is blacklisted\n";
+        printl(msg, id, req->url->host, req->url->ip);
+        return conn_send_error(c, 403);
+    }
+
+    printl("%s %s %s\n", req->ip, req->method, req->url->full);
+
+    /* Only GET required to implement at this time */
+    if (!request_method_is_get(req))
+        return conn_send_error(c, 405);
+
+    return conn_lookup(loop, c);
+}
+
+
+/* Finish the current request and wait for the next one if keep-alive. */
+static int conn_finish(event_loop_t *loop, conn_t *c)
+{
+    /* The upstream socket outlives this client if the origin allows it */
+    if (c->res_active && response_body_reusable(&c->body) &&
+        response_conn_is_keepalive(&c->res))
+        conn_release_upstream(loop, c);
+    else
+        conn_close_upstream(loop, c);
+
+    if (c->res_active) {
+        cache_writer_close(&c->writer, c->body.complete);
+        conn_release_response(c);
+    }
+
+    conn_release_flight(loop, c);
+
+    if (c->close_after || !c->keepalive) {
+        c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    request_destroy(&c->req);
+    request_init(&c->req, c->cfd, &c->client_addr);
+    c->req.thread_id = loop->id;
+    c->req_nunparsed = 0;
+    c->state = CONN_KEEPALIVE;
+
+    return 1;                   /* the next request may already be waiting */
+}
+
+
+static int conn_read_request(event_loop_t *loop, conn_t *c)
+{
+    ssize_t nrecvd;
+    int nunparsed;
+    char *msg;
+    int id = loop->id;
+
+    for (;;) {
+        if (c->req_nunparsed == REQ_BUFLEN)
+            return conn_send_error(c, 431); /* Header Fields Too Large */
+
+        nrecvd = read(c->cfd, c->reqbuf + c->req_nunparsed,
+                      REQ_BUFLEN - c->req_nunparsed);
+        if (nrecvd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            printl(LOG_WARN "[%d] request read - %s\n", id, strerror(errno));
+            c->state = CONN_CLOSED;
+            return 0;
+        } else if (nrecvd == 0) {
+            msg = LOG_DEBUG "[%d] Connection closed while reading request\n";
+            printl(msg, id);
+            c->state = CONN_CLOSED;
+            return 0;
+        }
+
+        if (c->state == CONN_KEEPALIVE) {
+            msg = LOG_DEBUG "[%d] Reusing keep-alive socket %d\n";
+            printl(msg, id, c->cfd);
+            c->state = CONN_READ_REQUEST;
+        }
+
+        c->reqbuf[c->req_nunparsed + nrecvd] = '\0';
+        nunparsed = request_deserialize(&c->req, c->reqbuf,
+                                        c->req_nunparsed + nrecvd);
+        if (nunparsed < 0)
+            return conn_send_error(c, 400); /* Bad Request Error */
+
+        c->req_nunparsed = nunparsed;
+
+        if (c->req.complete) {
+            c->req_nunparsed = 0;
+            return conn_dispatch(loop, c);
+        }
+    }
+}
+
+
+static int conn_finish_connect(event_loop_t *loop, conn_t *c)
+{
+    int err = 0;
+    struct sockaddr_in peer;
+    socklen_t err_sz = sizeof(err);
+    socklen_t addr_sz = sizeof(peer);
+    int id = loop->id;
+
+    if (getsockopt(c->sfd, SOL_SOCKET, SO_ERROR, &err, &err_sz) < 0)
+        err = errno;
+
+    if (err) {
+        printl(LOG_ERR "[%d] connect - %s\n", id, strerror(err));
+        c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    if (getpeername(c->sfd, (struct sockaddr *)&peer, &addr_sz) < 0)
+        return 0;               /* still connecting */
+
+    printl(LOG_DEBUG "[%d] Socket %d connected to %s\n", id, c->sfd,
+           c->req.url->host);
+    c->state = CONN_SEND_REQUEST;
+
+    return 1;
+}
+
+
+/* The origin closed a pooled socket while it sat idle - try another. */
+static int conn_retry_upstream(event_loop_t *loop, conn_t *c)
+{
+    printl(LOG_DEBUG "[%d] Pooled socket %d closed by origin\n", loop->id,
+           c->sfd);
+    conn_close_upstream(loop, c);
+    conn_release_response(c);
+
+    return conn_connect(loop, c);
+}
+
+
+static int conn_send_request(event_loop_t *loop, conn_t *c)
+{
+    ssize_t nsent;
+    char *msg;
+    int id = loop->id;
+
+    if (c->req_nsent == 0) {
+        msg = LOG_DEBUG "[%d] Forwarding request to %s on socket %d\n";
+        printl(msg, id, c->req.url->host, c->sfd);
+    }
+
+    while (c->req_nsent < c->req.raw_len) {
+        nsent = send(c->sfd, c->req.raw + c->req_nsent,
+                     c->req.raw_len - c->req_nsent, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            if (c->sfd_reused)
+                return conn_retry_upstream(loop, c);
+
+            printl(LOG_WARN "[%d] Socket write failed - %s\n", id,
+                   strerror(errno));
+            c->state = CONN_CLOSED;
+            return 0;
+        }
+        c->req_nsent += nsent;
+    }
+
+    response_init(&c->res);
+    c->res.thread_id = id;
+    c->res_active = true;
+    c->res_len = c->res_off = 0;
+    memset(&c->body, 0, sizeof(response_body_t));
+    c->writer.fill = NULL;
+    if ((c->resbuf = malloc(RELAY_BUFLEN + 1)) == NULL)
+        return conn_send_error(c, 500);
+
+    msg = LOG_DEBUG "[%d] Waiting for response from %s on socket %d\n";
+    printl(msg, id, c->req.url->host, c->sfd);
+    c->state = CONN_READ_RESPONSE;
+
+    return 1;
+}
+
+
+static int conn_read_response(event_loop_t *loop, conn_t *c)
+{
+    ssize_t nrecvd, nbody;
+    int rval;
+    char *msg;
+    int id = loop->id;
+
+    do {
+        if (c->res_len == RES_BUFLEN)
+            return conn_send_error(c, 431); /* Header Fields Too Large */
+
+        nrecvd = read(c->sfd, c->resbuf + c->res_len, RES_BUFLEN - c->res_len);
+        if (nrecvd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == ECONNRESET && c->sfd_reused && !c->res_len)
+                return conn_retry_upstream(loop, c);
+
+            printl(LOG_WARN "[%d] response read - %s\n", id, strerror(errno));
+            return conn_send_error(c, 500); /* Internal Server Error */
+        } else if (nrecvd == 0 && c->sfd_reused && !c->res_len) {
+            return conn_retry_upstream(loop, c);
+        } else if (nrecvd == 0) {
+            msg = LOG_DEBUG "[%d] Connection closed while reading response\n";
+            printl(msg, id);
+            c->state = CONN_CLOSED;
+            return 0;
+        }
+
+        c->res_len += nrecvd;
+    } while ((rval = response_parse_header(&c->res, c->resbuf,
+                                           &c->res_len)) == 0);
+
+    if (rval < 0)
+        return conn_send_error(c, 400); /* Bad Response Error */
+
+    response_body_init(&c->body, &c->res);
+    cache_writer_open(&c->writer, &c->req, &c->res, c->flight);
+
+    /* Nothing needs to see an uncached body unless it must be dechunked */
+    c->splice = c->writer.fill == NULL && c->body.framing != BODY_CHUNKED;
+
+    /* Body bytes that arrived with the header go out right after it */
+    nbody = response_body_feed(&c->body, c->resbuf, c->res_len,
+                               cache_writer_sink, &c->writer);
+    if (nbody < 0)
+        return conn_send_error(c, 400); /* Bad Response Error */
+
+    cache_writer_progress(&c->writer);
+    c->res_len = nbody;
+    c->res_off = 0;
+
+    /* A 304 to the proxy's own validators is answered from the cache */
+    if (c->req.revalidating && response_status(&c->res) == 304) {
+        if (!c->writer.revalidated)
+            return conn_send_error(c, 500);
+        if (conn_open_cache_file(c, c->req.url->full, c->writer.path) < 0)
+            return conn_send_error(c, 404);
+        return 1;
+    }
+
+    msg = LOG_DEBUG "[%d] Forwarding response from %s to %s on socket %d\n";
+    printl(msg, id, c->req.url->host, c->req.ip, c->cfd);
+
+    c->out = c->res.raw;
+    c->out_len = c->res.raw_len;
+    c->out_off = 0;
+    c->out_owned = false;
+    c->state = CONN_RELAY_RESPONSE;
+
+    return 1;
+}
+
+
+/*
+ * Send `len' bytes of `buf' from `*off' to the client with `flags'. Return 1
+ * once all of it is sent, 0 if the socket is full, or -1 on error.
+ */
+static int conn_send(event_loop_t *loop, conn_t *c, const char *buf,
+                     size_t len, size_t *off, int flags)
+{
+    ssize_t nsent;
+
+    while (*off < len) {
+        nsent = send(c->cfd, buf + *off, len - *off, flags | MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            printl(LOG_DEBUG "[%d] Socket write failed - %s\n", loop->id,
+                   strerror(errno));
+            return -1;
+        }
+        *off += nsent;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Send a multi-range hit: each part of the cached body goes out from the
+ * file (or RAM) after its part header in the out buffer, so only the headers
+ * are ever copied. The conn picks up again at part `part'.
+ */
+static int conn_send_parts(event_loop_t *loop, conn_t *c)
+{
+    cache_part_t *p;
+    int rval;
+
+    for (; c->part < c->nparts; c->part++) {
+        p = &c->parts[c->part];
+
+        rval = conn_send(loop, c, c->out, p->hdr_end, &c->out_off, MSG_MORE);
+        if (rval > 0 && c->mem)
+            rval = conn_send(loop, c, c->mem->data, p->off + p->len,
+                             &c->mem_off, MSG_MORE);
+        else if (rval > 0)
+            rval = send_file_range(c->cfd, c->file_fd, &c->file_off,
+                                   p->off + p->len);
+        if (rval <= 0)
+            goto blocked;
+
+        if (c->part + 1 < c->nparts) {
+            c->mem_off = p[1].off;
+            c->file_off = p[1].off;
+        }
+    }
+
+    /* The closing boundary */
+    rval = conn_send(loop, c, c->out, c->out_len, &c->out_off, 0);
+    if (rval <= 0)
+        goto blocked;
+
+    conn_clear_out(c);
+    c->nparts = c->part = 0;
+
+    if (c->mem) {
+        memcache_release(&mem_cache, c->mem);
+        c->mem = NULL;
+    }
+    if (c->file_fd > -1) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+
+    return conn_finish(loop, c);
+
+blocked:
+    if (rval < 0) {
+        printl(LOG_DEBUG "[%d] Failed to send cached file - %s\n", loop->id,
+               strerror(errno));
+        c->state = CONN_CLOSED;
+    }
+
+    return 0;
+}
+
+
+static int conn_send_response(event_loop_t *loop, conn_t *c)
+{
+    int rval, flags = 0;
+
+    if (c->nparts)
+        return conn_send_parts(loop, c);
+
+    /* Hold a cached object's header back to share a segment with the body */
+    if ((c->file_fd > -1 || c->mem) && (size_t)c->file_off < c->file_len)
+        flags = MSG_MORE;
+
+    rval = conn_send(loop, c, c->out, c->out_len, &c->out_off, flags);
+    if (rval <= 0) {
+        if (rval < 0)
+            c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    conn_clear_out(c);
+
+    if (c->mem) {
+        rval = conn_send(loop, c, c->mem->data, c->file_len, &c->mem_off, 0);
+        if (rval <= 0) {
+            if (rval < 0)
+                c->state = CONN_CLOSED;
+            return 0;
+        }
+        memcache_release(&mem_cache, c->mem);
+        c->mem = NULL;
+    }
+
+    if (c->file_fd > -1) {
+        c->state = CONN_SEND_FILE;
+        return 1;
+    }
+
+    return conn_finish(loop, c);
+}
+
+
+/*
+ * Move an uncached body from upstream to the client through the connection's
+ * pipe, so it never enters user space. Upstream isn't spliced from again
+ * until the client has taken everything in the pipe.
+ */
+static int conn_splice_response(event_loop_t *loop, conn_t *c)
+{
+    ssize_t n;
+    size_t len;
+    unsigned more;
+    char *msg;
+    int id = loop->id;
+
+    if (c->pipefd[0] < 0 && pipe2(c->pipefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        printl(LOG_WARN "[%d] pipe - %s\n", id, strerror(errno));
+        c->state = CONN_CLOSED;
+        return 0;
+    }
+
+    for (;;) {
+        if (c->pipe_len) {
+            /* Hold back partial segments until the last of the body */
+            more = c->body.complete ? 0 : SPLICE_F_MORE;
+            n = splice(c->pipefd[0], NULL, c->cfd, NULL, c->pipe_len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+
+                printl(LOG_DEBUG "[%d] Socket write failed - %s\n", id,
+                       strerror(errno));
+                c->state = CONN_CLOSED;
+                return 0;
+            }
+            c->pipe_len -= n;
+            continue;
+        }
+
+        if (c->body.complete)
+            return conn_finish(loop, c);
+
+        len = SPLICE_LEN;
+        if (c->body.framing == BODY_LENGTH && c->body.remaining < len)
+            len = c->body.remaining;
+
+        n = splice(c->sfd, NULL, c->pipefd[1], NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            printl(LOG_WARN "[%d] response read - %s\n", id, strerror(errno));
+            c->state = CONN_CLOSED;
+            return 0;
+        } else if (n == 0) {
+            response_body_feed(&c->body, NULL, 0, NULL, NULL);
+            if (!c->body.complete) {
+                msg = LOG_DEBUG "[%d] Response from %s cut off\n";
+                printl(msg, id, c->req.url->host);
+                c->state = CONN_CLOSED;
+                return 0;
+            }
+            continue;
+        }
+
+        c->pipe_len = n;
+        response_body_advance(&c->body, n);
+    }
+}
+
+
+/*
+ * Move the body from upstream to the client one buffer at a time. Upstream
+ * isn't read again until the client has taken everything in resbuf, so a
+ * slow client holds back the origin instead of growing memory.
+ */
+static int conn_relay_response(event_loop_t *loop, conn_t *c)
+{
+    ssize_t nrecvd, nbody;
+    int rval;
+    char *msg;
+    int id = loop->id;
+
+    if (c->out) {
+        rval = conn_send(loop, c, c->out, c->out_len, &c->out_off, 0);
+        if (rval <= 0)
+            goto blocked;
+        conn_clear_out(c);
+    }
+
+    for (;;) {
+        rval = conn_send(loop, c, c->resbuf, c->res_len, &c->res_off, 0);
+        if (rval <= 0)
+            goto blocked;
+
+        if (c->body.complete)
+            return conn_finish(loop, c);
+        if (c->splice)
+            return conn_splice_response(loop, c);
+
+        nrecvd = read(c->sfd, c->resbuf, RELAY_BUFLEN);
+        if (nrecvd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            printl(LOG_WARN "[%d] response read - %s\n", id, strerror(errno));
+            c->state = CONN_CLOSED;
+            return 0;
+        }
+
+        nbody = response_body_feed(&c->body, c->resbuf, nrecvd,
+                                   cache_writer_sink, &c->writer);
+        if (nbody < 0) {
+            printl(LOG_WARN "[%d] Malformed chunked response\n", id);
+            c->state = CONN_CLOSED;
+            return 0;
+        } else if (nrecvd == 0 && !c->body.complete) {
+            msg = LOG_DEBUG "[%d] Response from %s cut off\n";
+            printl(msg, id, c->req.url->host);
+            c->state = CONN_CLOSED;
+            return 0;
+        }
+
+        cache_writer_progress(&c->writer);
+        c->res_len = nbody;
+        c->res_off = 0;
+    }
+
+blocked:
+    if (rval < 0)
+        c->state = CONN_CLOSED;
+
+    return 0;
+}
+
+
+static int conn_send_file(event_loop_t *loop, conn_t *c)
+{
+    int rval;
+
+    rval = send_file_range(c->cfd, c->file_fd, &c->file_off, c->file_len);
+    if (rval <= 0) {
+        if (rval < 0) {
+            printl(LOG_DEBUG "[%d] Failed to send cached file - %s\n",
+                   loop->id, strerror(errno));
+            c->state = CONN_CLOSED;
+        }
+        return 0;
+    }
+
+    close(c->file_fd);
+    c->file_fd = -1;
+
+    return conn_finish(loop, c);
+}
+
+
+/*
+ * Follow the fetch of the same URL another conn is making, sending the
+ * cache file as it is written. The loop's wakefd brings the conn back here
+ * whenever the fetch moves on.
+ */
+static int conn_send_inflight(event_loop_t *loop, conn_t *c)
+{
+    int fd, rval;
+    size_t written, body_len;
+    char *msg;
+    inflight_t *f = c->flight;
+    inflight_state_t state = inflight_poll(&inflight_fetches, f, &written);
+    int id = loop->id;
+
+    if (c->file_fd < 0) {
+        /* Nothing is sent until the length the header needs is known */
+        if (state == INFLIGHT_PENDING ||
+            (state == INFLIGHT_STREAMING && !f->len_known))
+            return 0;
+
+        /* Done (so cached) or abandoned (so fetch it afresh) */
+        if (state != INFLIGHT_STREAMING ||
+            (fd = open(f->path, O_RDONLY | O_CLOEXEC)) < 0) {
+            conn_release_flight(loop, c);
+            return conn_lookup(loop, c);
+        }
+
+        /* The stored header is in place before readers are let in */
+        c->out = cache_response_header(&c->req, fd, NULL, f->len, time(NULL),
+                                       NULL, NULL, &c->file_off, &body_len,
+                                       &c->out_len);
+        if (c->out == NULL) {
+            close(fd);
+            conn_release_flight(loop, c);
+            return conn_lookup(loop, c);
+        }
+
+        printl("-> %s 200 %s (%lu) while fetching\n", c->req.ip, f->path,
+               (unsigned long)(f->len - c->file_off));
+
+        c->out_owned = true;
+        c->file_fd = fd;
+        c->file_len = f->len;
+    }
+
+    if (c->out) {
+        rval = conn_send(loop, c, c->out, c->out_len, &c->out_off,
+                         (size_t)c->file_off < c->file_len ? MSG_MORE : 0);
+        if (rval <= 0)
+            goto blocked;
+        conn_clear_out(c);
+    }
+
+    if ((size_t)c->file_off < written) {
+        rval = send_file_range(c->cfd, c->file_fd, &c->file_off, written);
+        if (rval <= 0)
+            goto blocked;
+    }
+
+    if ((size_t)c->file_off == c->file_len) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        conn_release_flight(loop, c);
+        return conn_finish(loop, c);
+    }
+
+    if (state == INFLIGHT_ABANDONED) {
+        msg = LOG_DEBUG "[%d] Fetch of %s cut off\n";
+        printl(msg, id, c->req.url->full);
+        c->state = CONN_CLOSED;
+    }
+
+    return 0;
+
+blocked:
+    if (rval < 0) {
+        printl(LOG_DEBUG "[%d] Failed to send cached file - %s\n", id,
+               strerror(errno));
+        c->state = CONN_CLOSED;
+    }
+
+    return 0;
+}
+
+
+static void conn_pump(event_loop_t *loop, conn_t *c)
+{
+    int progress;
+
+    if (c->state == CONN_CLOSED)
+        return;                 /* already queued for destruction */
+
+    c->last_active = time(NULL);
+
+    do {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+        case CONN_KEEPALIVE:
+            progress = conn_read_request(loop, c);
+            break;
+        case CONN_CONNECT:
+            progress = conn_finish_connect(loop, c);
+            break;
+        case CONN_SEND_REQUEST:
+            progress = conn_send_request(loop, c);
+            break;
+        case CONN_READ_RESPONSE:
+            progress = conn_read_response(loop, c);
+            break;
+        case CONN_RELAY_RESPONSE:
+            progress = conn_relay_response(loop, c);
+            break;
+        case CONN_SEND_RESPONSE:
+            progress = conn_send_response(loop, c);
+            break;
+        case CONN_SEND_FILE:
+            progress = conn_send_file(loop, c);
+            break;
+        case CONN_SEND_INFLIGHT:
+            progress = conn_send_inflight(loop, c);
+            break;
+        default:
+            progress = 0;
+        }
+    } while (progress && c->state != CONN_CLOSED);
+}
+
+
+/*
+ * Accept up to ACCEPT_BATCH pending connections. The listener is level
+ * triggered, so anything left in the backlog wakes the loop again.
+ */
+static void event_loop_accept(event_loop_t *loop)
+{
+    int fd;
+    struct sockaddr_in client_addr;
+    socklen_t addr_sz;
+    int id = loop->id;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        addr_sz = sizeof(struct sockaddr_in);
+        fd = accept4(loop->lfd, (struct sockaddr *)&client_addr, &addr_sz,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                printl(LOG_ERR "[%d] accept - %s\n", id, strerror(errno));
+            return;
+        }
+
+        conn_create(loop, fd, &client_addr);
+    }
+}
+
+
+/*
+ * Drain the loop's wakefd and move on conns following a fetch in flight. A
+ * pumped conn may leave the followers, or rejoin them at the head, so the
+ * next one is taken first.
+ */
+static void event_loop_wake(event_loop_t *loop)
+{
+    uint64_t n;
+    conn_t *c, *next;
+
+    while (read(loop->wakefd, &n, sizeof(n)) < 0 && errno == EINTR)
+        ;
+
+    for (c = loop->followers; c != NULL; c = next) {
+        next = c->fnext;
+        conn_pump(loop, c);
+    }
+}
+
+
+/* Time out a connection that has made no progress for too long. */
+static void conn_check_timeout(event_loop_t *loop, conn_t *c, time_t now)
+{
+    time_t idle = now - c->last_active;
+    int id = loop->id;
+
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+    case CONN_KEEPALIVE:
+        if (idle > KEEPALIVE_TIMEOUT_S) {
+            printl(LOG_DEBUG "[%d] Keep-alive timeout\n", id);
+            c->state = CONN_CLOSED;
+        }
+        break;
+    case CONN_CONNECT:
+    case CONN_SEND_REQUEST:
+    case CONN_READ_RESPONSE:
+        /* Nothing has been sent to the client yet, so it can get a 504 */
+        if (idle > (c->state == CONN_CONNECT ? CONNECT_TIMEOUT_S
+                                             : UPSTREAM_TIMEOUT_S)) {
+            printl(LOG_DEBUG "[%d] Upstream timeout\n", id);
+            conn_close_upstream(loop, c);
+            conn_send_error(c, 504);
+            conn_pump(loop, c);
+        }
+        break;
+    case CONN_RELAY_RESPONSE:
+        /* Part of the response is out, so all that's left is to close */
+        if (idle > UPSTREAM_TIMEOUT_S) {
+            printl(LOG_DEBUG "[%d] Relay timeout\n", id);
+            c->state = CONN_CLOSED;
+        }
+        break;
+    case CONN_SEND_INFLIGHT:
+        if (idle > INFLIGHT_TIMEOUT_S) {
+            printl(LOG_DEBUG "[%d] In-flight fetch timeout\n", id);
+            if (c->file_fd < 0) {
+                conn_release_flight(loop, c);
+                conn_send_error(c, 504);
+                conn_pump(loop, c);
+            } else {
+                c->state = CONN_CLOSED;
+            }
+        }
+        break;
+    case CONN_SEND_RESPONSE:
+    case CONN_SEND_FILE:
+        if (idle > SEND_TIMEOUT_S) {
+            printl(LOG_DEBUG "[%d] Client send timeout\n", id);
+            c->state = CONN_CLOSED;
+        }
+        break;
+    case CONN_CLOSED:
+        break;
+    }
+}
+
+
+/*
+ * Destroy connections that closed during the last batch of events and,
+ * once a second, time out idle keep-alive connections.
+ */
+static void event_loop_sweep(event_loop_t *loop, bool check_timeouts)
+{
+    conn_t *c, *next;
+    time_t now = time(NULL);
+
+    for (c = loop->conns; c != NULL; c = next) {
+        next = c->next;
+
+        if (check_timeouts)
+            conn_check_timeout(loop, c, now);
+
+        if (c->state == CONN_CLOSED) {
+            conn_list_remove(&loop->conns, c);
+            loop->nconns--;
+            conn_destroy(loop, c);
+        }
+    }
+}
+
+
+static int event_loop_serve(event_loop_t *loop)
+{
+    int nready, rval = 0;
+    bool any_closed;
+    conn_t *c;
+    time_t now;
+    struct epoll_event events[MAX_EVENTS];
+    int id = loop->id;
+
+    if (loop->cpu > -1)
+        pin_to_cpu(loop->cpu);
+
+    printl(LOG_DEBUG "[%d] Event loop running\n", id);
+
+    while (!exit_requested) {
+        nready = epoll_wait(loop->epfd, events, MAX_EVENTS, LOOP_TICK_MS);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+
+            printl(LOG_ERR "[%d] epoll_wait - %s\n", id, strerror(errno));
+            rval = errno;
+            break;
+        }
+
+        /* Destruction is deferred: both fds of a conn may be in `events' */
+        any_closed = false;
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.ptr == NULL) {
+                event_loop_accept(loop);
+                continue;
+            } else if (events[i].data.ptr == loop) {
+                event_loop_wake(loop);
+                any_closed = true;  /* sweep any conn the wakeup closed */
+                continue;
+            }
+
+            c = events[i].data.ptr;
+            conn_pump(loop, c);
+            any_closed |= c->state == CONN_CLOSED;
+        }
+
+        now = time(NULL);
+        if (any_closed || now != loop->last_sweep)
+            event_loop_sweep(loop, now != loop->last_sweep);
+        loop->last_sweep = now;
+    }
+
+    if (exit_requested)
+        printl(LOG_DEBUG "[%d] Caught SIGINT\n", id);
+
+    /* Tear down everything still open */
+    for (c = loop->conns; c != NULL; c = c->next)
+        c->state = CONN_CLOSED;
+    event_loop_sweep(loop, false);
+
+    printl(LOG_DEBUG "[%d] Event loop exiting\n", id);
+
+    return rval;
+}
+
+
+static void *event_loop_thread(void *loop_vptr)
+{
+    event_loop_t *loop = (event_loop_t *)loop_vptr;
+
+    loop->id = thread_id = global_thread_count++;
+    event_loop_serve(loop);
+
+    pthread_exit(NULL);
+}
+
+
+static int event_loop_init(event_loop_t *loop, int ssock, int cpu)
+{
+    struct epoll_event ev = { 0 };
+    int id = thread_id;
+
+    loop->lfd = ssock;
+    loop->cpu = cpu;
+    loop->last_sweep = time(NULL);
+
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        printl(LOG_ERR "[%d] epoll_create1 - %s\n", id, strerror(errno));
+        return errno;
+    }
+
+    /* A shared listener should wake only one loop per connection */
+    ev.events = cpu > -1 ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ssock, &ev) < 0) {
+        printl(LOG_ERR "[%d] epoll_ctl - %s\n", id, strerror(errno));
+        close(loop->epfd);
+        return errno;
+    }
+
+    /* Fetches in flight on other loops poke this to wake their followers */
+    if ((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        printl(LOG_ERR "[%d] eventfd - %s\n", id, strerror(errno));
+        close(loop->epfd);
+        return errno;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0) {
+        printl(LOG_ERR "[%d] epoll_ctl - %s\n", id, strerror(errno));
+        close(loop->wakefd);
+        close(loop->epfd);
+        return errno;
+    }
+
+    return 0;
+}
+
+
+int event_loop_run(int *ssocks, int nsocks, int nloops)
+{
+    int rval = 0, nstarted = 0;
+    bool sharded = nsocks > 1;
+    event_loop_t *loops;
+    int id = thread_id;
+
+    if (sharded)
+        nloops = nsocks;        /* one loop per SO_REUSEPORT listener */
+
+    if ((loops = calloc(nloops, sizeof(event_loop_t))) == NULL) {
+        printl(LOG_ERR "[%d] Out of memory allocating event loops\n", id);
+        return ENOMEM;
+    }
+
+    /*
+     * Pinned loops all get their own threads so the calling thread is never
+     * pinned. Otherwise the calling thread runs the first loop.
+     */
+    for (nstarted = 0; nstarted < nloops; nstarted++) {
+        rval = event_loop_init(&loops[nstarted],
+                               ssocks[sharded ? nstarted : 0],
+                               sharded ? nstarted : -1);
+        if (rval)
+            break;
+
+        if (nstarted == 0 && !sharded) {
+            loops[0].id = id;
+            continue;
+        }
+
+        rval = pthread_create(&loops[nstarted].thread, NULL,
+                              event_loop_thread, &loops[nstarted]);
+        if (rval) {
+            printl(LOG_ERR "[%d] pthread_create - %s\n", id, strerror(rval));
+            close(loops[nstarted].wakefd);
+            close(loops[nstarted].epfd);
+            break;
+        }
+    }
+
+    printl(LOG_DEBUG "[%d] Started %d event loops\n", id, nstarted);
+
+    if (nstarted < nloops) {
+        exit_requested = true;  /* startup failed - stop the loops started */
+    } else if (!sharded) {
+        rval = event_loop_serve(&loops[0]);
+        exit_requested = true;  /* stop the other loops if loop 0 failed */
+    }
+
+    for (int i = sharded ? 0 : 1; i < nstarted; i++)
+        pthread_join(loops[i].thread, NULL);
+
+    for (int i = 0; i < nstarted; i++) {
+        close(loops[i].wakefd);
+        close(loops[i].epfd);
+    }
+
+    free(loops);
+
+    return rval;
+}
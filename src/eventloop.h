@@ -0,0 +1,99 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <netinet/in.h>         /* struct sockaddr_in */
+#include <pthread.h>            /* pthread_t */
+#include <stdbool.h>            /* bool */
+#include <sys/types.h>          /* off_t */
+#include <time.h>               /* time_t */
+
+#include "request.h"
+#include "response.h"
+#include "toyproxy.h"
+
+
+/* Where a connection is in its request/response cycle. */
+typedef enum conn_state {
+    CONN_READ_REQUEST,          /* reading a request from the client */
+    CONN_CONNECT,               /* waiting on non-blocking upstream connect */
+    CONN_SEND_REQUEST,          /* forwarding the request upstream */
+    CONN_READ_RESPONSE,         /* reading the response header from upstream */
+    CONN_RELAY_RESPONSE,        /* streaming the response body to the client */
+    CONN_SEND_RESPONSE,         /* writing the out buffer to the client */
+    CONN_SEND_FILE,             /* writing a cached file to the client */
+    CONN_SEND_INFLIGHT,         /* following another conn's fetch of the URL */
+    CONN_KEEPALIVE,             /* idle between requests */
+    CONN_CLOSED                 /* ready to be torn down */
+} conn_state_t;
+
+/* A client connection driven by an event loop. */
+typedef struct conn {
+    struct conn *prev, *next;   /* owning loop's connection list */
+    struct conn *fprev, *fnext; /* owning loop's list of followers */
+    conn_state_t state;         /* current state machine state */
+    int cfd;                    /* client socket fd */
+    int sfd;                    /* server socket fd or -1 */
+    bool sfd_reused;            /* sfd came from the upstream pool */
+    bool keepalive;             /* client asked for a persistent connection */
+    bool close_after;           /* close once the out buffer is flushed */
+    time_t last_active;         /* last time any progress was made */
+    struct sockaddr_in client_addr;
+    struct sockaddr_in server_addr; /* address sfd is connected to */
+    request_t req;              /* request being read or served */
+    response_t res;             /* response being read from upstream */
+    bool res_active;            /* res was initialized and must be freed */
+    char reqbuf[REQ_BUFLEN + 1]; /* unparsed request bytes */
+    int req_nunparsed;          /* bytes held in reqbuf */
+    size_t req_nsent;           /* request bytes forwarded upstream */
+    response_body_t body;       /* decoder for the body being relayed */
+    cache_writer_t writer;      /* cache file the body is copied into */
+    char *resbuf;               /* RELAY_BUFLEN response bytes being relayed */
+    size_t res_len;             /* bytes held in resbuf */
+    size_t res_off;             /* bytes of resbuf already sent to the client */
+    bool splice;                /* relay the body through pipefd, uncopied */
+    int pipefd[2];              /* splice pipe or -1, kept across requests */
+    size_t pipe_len;            /* body bytes waiting in the pipe */
+    char *out;                  /* buffer being written to the client */
+    bool out_owned;             /* free out when done */
+    size_t out_len;             /* bytes in out */
+    size_t out_off;             /* bytes of out already written */
+    memcache_entry_t *mem;      /* borrowed RAM tier object being served */
+    size_t mem_off;             /* offset in mem of the next byte to write */
+    int file_fd;                /* cached file being served or -1 */
+    off_t file_off;             /* offset of the next file byte to write */
+    size_t file_len;            /* offset in the file (or mem) to stop at */
+    cache_part_t parts[REQ_RANGES_MAX]; /* parts of a multi-range body */
+    int nparts;                 /* size of the "parts" array used, or 0 */
+    int part;                   /* next part to send */
+    inflight_t *flight;         /* fetch this conn makes or follows, or NULL */
+    bool flight_leader;         /* this conn is making the fetch */
+} conn_t;
+
+/* A single epoll loop, run on its own thread. */
+typedef struct event_loop {
+    int id;                     /* thread id used in log messages */
+    int epfd;                   /* epoll instance */
+    int lfd;                    /* listener socket */
+    int wakefd;                 /* eventfd written when a followed fetch moves */
+    int cpu;                    /* CPU the loop is pinned to or -1 */
+    pthread_t thread;           /* thread running the loop */
+    conn_t *conns;              /* connections owned by this loop */
+    size_t nconns;              /* number of connections owned */
+    conn_t *followers;          /* conns in CONN_SEND_INFLIGHT */
+    time_t last_sweep;          /* last keep-alive timeout sweep */
+} event_loop_t;
+
+/*
+ * Serve connections from edge-triggered epoll loops until exit is requested.
+ * The calling thread runs the first loop.
+ *
+ * With a single listener, `nloops' loops share it. With `nsocks' > 1
+ * SO_REUSEPORT listeners, each listener gets its own loop pinned to a CPU and
+ * `nloops' is ignored.
+ *
+ * Return 0 on clean exit or an errno value.
+ */
+int event_loop_run(int *ssocks, int nsocks, int nloops);
+
+
+#endif  /* EVENTLOOP_H */
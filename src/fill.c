@@ -0,0 +1,104 @@
+#include <string.h>             /* memcpy */
+
+#include "fill.h"
+
+
+int fill_queue_init(fill_queue_t *q, size_t max_bytes)
+{
+    q->bytes = 0;
+    q->max_bytes = max_bytes;
+    q->dropped = 0;
+
+    if (workqueue_init(&q->jobs, 0) == -1)
+        return -1;
+
+    pthread_mutex_init(&q->lock, NULL);
+
+    return 0;
+}
+
+
+void fill_queue_destroy(fill_queue_t *q)
+{
+    fill_job_t *job;
+
+    workqueue_close(&q->jobs);
+    while ((job = workqueue_get(&q->jobs)) != NULL)
+        free(job);
+
+    workqueue_destroy(&q->jobs);
+    pthread_mutex_destroy(&q->lock);
+}
+
+
+fill_job_t *fill_job_new(void *fill, fill_op_t op, const char *data,
+                         size_t len)
+{
+    fill_job_t *job = malloc(sizeof(fill_job_t) + len);
+
+    if (job == NULL)
+        return NULL;
+
+    job->fill = fill;
+    job->op = op;
+    job->complete = false;
+    job->len = len;
+    if (len)
+        memcpy(job->data, data, len);
+
+    return job;
+}
+
+
+int fill_put(fill_queue_t *q, fill_job_t *job)
+{
+    size_t len = job->op == FILL_WRITE ? job->len : 0;
+
+    /* Room for the bytes is taken first, and given back if it isn't queued */
+    if (len) {
+        pthread_mutex_lock(&q->lock);
+        if (q->bytes + len > q->max_bytes) {
+            q->dropped++;
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        q->bytes += len;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    if (workqueue_put(&q->jobs, job) == 0)
+        return 0;
+
+    if (len) {
+        pthread_mutex_lock(&q->lock);
+        q->bytes -= len;
+        q->dropped++;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return -1;
+}
+
+
+fill_job_t *fill_get(fill_queue_t *q)
+{
+    return workqueue_get(&q->jobs);
+}
+
+
+void fill_done(fill_queue_t *q, fill_job_t *job)
+{
+    if (job->op == FILL_WRITE) {
+        pthread_mutex_lock(&q->lock);
+        q->bytes -= job->len;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    free(job);
+}
+
+
+void fill_close(fill_queue_t *q)
+{
+    workqueue_close(&q->jobs);
+}
@@ -0,0 +1,65 @@
+#ifndef FILL_H
+#define FILL_H
+
+#include <pthread.h>            /* pthread_* */
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+
+#include "workqueue.h"
+
+#define FILL_QUEUE_BYTES 8388608 /* body bytes waiting per fill thread */
+
+
+/* What a fill thread does with a job. */
+typedef enum fill_op {
+    FILL_OPEN,                  /* create the file and write `data' to it */
+    FILL_WRITE,                 /* append `data' */
+    FILL_CLOSE                  /* publish the file if `complete', else not */
+} fill_op_t;
+
+/* One step in writing a cache file, queued by the thread fetching it. */
+typedef struct fill_job {
+    void *fill;                 /* the file being written */
+    fill_op_t op;               /* what to do with it */
+    bool complete;              /* FILL_CLOSE: the body arrived whole */
+    size_t len;                 /* bytes at `data' */
+    char data[];                /* copy of the bytes to write */
+} fill_job_t;
+
+/*
+ * Cache file writes waiting for a fill thread, run in the order queued. Only
+ * FILL_WRITE bytes count towards the bound, so a file that was opened can
+ * always be closed.
+ */
+typedef struct fill_queue {
+    workqueue_t jobs;           /* jobs waiting, with no bound of its own */
+    size_t bytes;               /* FILL_WRITE bytes queued or being written */
+    size_t max_bytes;           /* bound on `bytes' */
+    unsigned long dropped;      /* writes not queued for lack of room */
+    pthread_mutex_t lock;       /* guards `bytes' and `dropped' */
+} fill_queue_t;
+
+/*
+ * Initialize an empty queue holding up to `max_bytes' of writes. Return -1
+ * for OOM.
+ */
+int fill_queue_init(fill_queue_t *q, size_t max_bytes);
+/* Free the queue and any jobs still on it. */
+void fill_queue_destroy(fill_queue_t *q);
+/* Return a job copying the `len' bytes at `data', or NULL for OOM. */
+fill_job_t *fill_job_new(void *fill, fill_op_t op, const char *data,
+                         size_t len);
+/*
+ * Queue `job' (it passes to the queue). Return 0, or -1 if the queue is
+ * closed or out of memory, or a FILL_WRITE would take it past `max_bytes'.
+ */
+int fill_put(fill_queue_t *q, fill_job_t *job);
+/* Take the oldest job, waiting for one. Return NULL once closed and empty. */
+fill_job_t *fill_get(fill_queue_t *q);
+/* Free a job from fill_get() once it's run, making room for its bytes. */
+void fill_done(fill_queue_t *q, fill_job_t *job);
+/* Stop accepting jobs and wake fill_get() callers. */
+void fill_close(fill_queue_t *q);
+
+
+#endif  /* FILL_H */
@@ -0,0 +1,110 @@
+#include <errno.h>              /* errno, E* */
+
+#include "gzip.h"
+
+#ifdef HAVE_ZLIB
+
+#include <unistd.h>             /* pread, write */
+#include <zlib.h>               /* deflate*, z_stream, Z_* */
+
+#define GZIP_WINDOW_BITS (15 + 16) /* largest window, with a gzip wrapper */
+#define GZIP_MEM_LEVEL 8        /* zlib's default */
+
+
+bool gzip_available()
+{
+    return true;
+}
+
+
+/* Write all `len' bytes of `buf' to `fd'. Return 0 or -1. */
+static int gzip_write(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t nwritten;
+
+    while (len) {
+        if ((nwritten = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += nwritten;
+        len -= nwritten;
+    }
+
+    return 0;
+}
+
+
+ssize_t gzip_file(int in, off_t off, size_t len, int out)
+{
+    unsigned char inbuf[GZIP_CHUNK], outbuf[GZIP_CHUNK];
+    z_stream zs = { 0 };
+    ssize_t nread, ntotal = 0;
+    size_t n;
+    int flush = Z_NO_FLUSH;
+
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS,
+                     GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (flush != Z_FINISH) {
+        nread = pread(in, inbuf, len < sizeof(inbuf) ? len : sizeof(inbuf),
+                      off);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0 || (nread == 0 && len)) {
+            if (nread == 0)
+                errno = EIO;    /* the file shrank under us */
+            goto fail;
+        }
+
+        off += nread;
+        len -= nread;
+        flush = len ? Z_NO_FLUSH : Z_FINISH;
+        zs.next_in = inbuf;
+        zs.avail_in = nread;
+
+        /* Drain the output until deflate has taken all the input */
+        do {
+            zs.next_out = outbuf;
+            zs.avail_out = sizeof(outbuf);
+            deflate(&zs, flush);
+            n = sizeof(outbuf) - zs.avail_out;
+            if (gzip_write(out, outbuf, n) == -1)
+                goto fail;
+            ntotal += n;
+        } while (zs.avail_out == 0);
+    }
+
+    deflateEnd(&zs);
+
+    return ntotal;
+
+fail:
+    deflateEnd(&zs);
+
+    return -1;
+}
+
+#else  /* HAVE_ZLIB */
+
+
+bool gzip_available()
+{
+    return false;
+}
+
+
+ssize_t gzip_file(int __attribute__((__unused__)) in,
+                  off_t __attribute__((__unused__)) off,
+                  size_t __attribute__((__unused__)) len,
+                  int __attribute__((__unused__)) out)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif  /* HAVE_ZLIB */
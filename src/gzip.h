@@ -0,0 +1,21 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+#include <sys/types.h>          /* off_t, ssize_t */
+
+#define GZIP_CHUNK 32768        /* bytes read or written per deflate call */
+#define GZIP_LEVEL 6            /* zlib's default speed/size trade-off */
+
+
+/* Return true if this build can compress (zlib was found). */
+bool gzip_available();
+/*
+ * Gzip `len' bytes of file `in' from `off', appending the compressed stream
+ * to file `out'. Return its length or -1 and set errno.
+ */
+ssize_t gzip_file(int in, off_t off, size_t len, int out);
+
+
+#endif  /* GZIP_H */
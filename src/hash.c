@@ -0,0 +1,230 @@
+#include <stdatomic.h>          /* atomic_* */
+#include <string.h>             /* memcpy */
+#include <sys/random.h>         /* getrandom */
+#include <time.h>               /* time */
+#include <unistd.h>             /* getpid */
+
+#include "hash.h"
+
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+/* Finalization mix - force all bits of a hash block to avalanche. */
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+
+hash128_t hash128(const void *key, size_t len, uint32_t seed)
+{
+    const uint8_t *data = key;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const size_t nblocks = len / 16;
+    const uint8_t *tail = data + nblocks * 16;
+    uint64_t h1 = seed, h2 = seed, k1, k2;
+    hash128_t h;
+
+    for (size_t i = 0; i < nblocks; i++) {
+        /* memcpy, as the key needn't be aligned */
+        memcpy(&k1, data + i * 16, sizeof(k1));
+        memcpy(&k2, data + i * 16 + 8, sizeof(k2));
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+
+    switch (len & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t)tail[9] << 8;   /* fall through */
+    case 9:
+        k2 ^= (uint64_t)tail[8];
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        /* fall through */
+    case 8: k1 ^= (uint64_t)tail[7] << 56;   /* fall through */
+    case 7: k1 ^= (uint64_t)tail[6] << 48;   /* fall through */
+    case 6: k1 ^= (uint64_t)tail[5] << 40;   /* fall through */
+    case 5: k1 ^= (uint64_t)tail[4] << 32;   /* fall through */
+    case 4: k1 ^= (uint64_t)tail[3] << 24;   /* fall through */
+    case 3: k1 ^= (uint64_t)tail[2] << 16;   /* fall through */
+    case 2: k1 ^= (uint64_t)tail[1] << 8;    /* fall through */
+    case 1:
+        k1 ^= (uint64_t)tail[0];
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    h.lo = h1;
+    h.hi = h2;
+
+    return h;
+}
+
+
+void hash128_hex(hash128_t h, char *buf)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    /* Most significant digit first, low half then high half */
+    for (int i = 0; i < 16; i++) {
+        buf[i] = digits[(h.lo >> (60 - 4 * i)) & 0xf];
+        buf[16 + i] = digits[(h.hi >> (60 - 4 * i)) & 0xf];
+    }
+
+    buf[HASH128_HEX_LEN] = '\0';
+}
+
+
+/* Multiply `a' by `b', leaving the low half in `a' and the high in `b'. */
+static inline void mum64(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a,
+        lb = (uint32_t)*b, rh = ha * hb, rm0 = ha * lb, rm1 = hb * la,
+        rl = la * lb, t = rl + (rm0 << 32), c = t < rl, lo;
+
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+
+static inline uint64_t mix64(uint64_t a, uint64_t b)
+{
+    mum64(&a, &b);
+
+    return a ^ b;
+}
+
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+
+uint64_t hash64(const void *key, size_t len, uint64_t seed)
+{
+    static const uint64_t s[4] = {
+        0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+        0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+    };
+    const uint8_t *p = key;
+    uint64_t a, b, seed1, seed2;
+    size_t i = len;
+
+    seed ^= mix64(seed ^ s[0], s[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            /* Two overlapping reads from each end cover 4 to 16 bytes */
+            a = read32(p) << 32 | read32(p + (len >> 3 << 2));
+            b = read32(p + len - 4) << 32 |
+                read32(p + len - 4 - (len >> 3 << 2));
+        } else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 |
+                p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            /* Three independent lanes, for instruction-level parallelism */
+            seed1 = seed2 = seed;
+            do {
+                seed = mix64(read64(p) ^ s[1], read64(p + 8) ^ seed);
+                seed1 = mix64(read64(p + 16) ^ s[2], read64(p + 24) ^ seed1);
+                seed2 = mix64(read64(p + 32) ^ s[3], read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        for (; i > 16; i -= 16, p += 16)
+            seed = mix64(read64(p) ^ s[1], read64(p + 8) ^ seed);
+
+        /* The last 16 bytes, overlapping what was mixed already */
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+    mum64(&a, &b);
+
+    return mix64(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+
+uint64_t hash_seed()
+{
+    static _Atomic uint64_t process_seed;
+    uint64_t seed = atomic_load(&process_seed), none = 0;
+
+    if (seed)
+        return seed;
+
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+        seed = (uint64_t)time(NULL) ^ (uint64_t)getpid() << 32 ^
+            (uintptr_t)&seed;
+    seed |= 1;                  /* 0 means not made yet */
+
+    /* Whichever thread gets here first picks it for everyone */
+    if (!atomic_compare_exchange_strong(&process_seed, &none, seed))
+        seed = none;
+
+    return seed;
+}
@@ -0,0 +1,33 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>             /* uint64_t */
+#include <stdlib.h>             /* size_t */
+
+#define HASH128_HEX_LEN 32      /* hex digits in a 128-bit hash */
+
+
+/* A 128-bit hash, as two 64-bit halves. */
+typedef struct hash128 {
+    uint64_t lo;
+    uint64_t hi;
+} hash128_t;
+
+/* Return the MurmurHash3 (x64, 128-bit) of `len' bytes at `key'. */
+hash128_t hash128(const void *key, size_t len, uint32_t seed);
+/* Write `h' as HASH128_HEX_LEN lowercase hex digits and a NUL to `buf'. */
+void hash128_hex(hash128_t h, char *buf);
+/*
+ * Return a 64-bit hash of `len' bytes at `key', for in-memory tables. It
+ * reads the key 8 bytes at a time (wyhash's construction), and outputs
+ * depend on the byte order, so they mustn't be stored.
+ */
+uint64_t hash64(const void *key, size_t len, uint64_t seed);
+/*
+ * Return this process's random seed for hash64(), so keys sent by clients
+ * can't be picked to collide.
+ */
+uint64_t hash_seed();
+
+
+#endif  /* HASH_H */
@@ -1,161 +1,714 @@
 #include <assert.h>             /* assert */
-#include <string.h>             /* str* */
-#include <time.h>               /* time */
+#include <string.h>             /* memcpy, memset, str* */
+#include <time.h>               /* clock_gettime, time */
+#ifdef __SSE2__
+#include <emmintrin.h>          /* _mm_* */
+#endif
 
+#include "hash.h"
 #include "hashmap.h"
 #include "printl.h"
 
+#define HASHMAP_EMPTY 0x80      /* control byte of a never used slot */
+#define HASHMAP_DELETED 0xfe    /* control byte of a deleted slot */
+#define HASHMAP_MAX_LOAD(n) ((n) - (n) / 8) /* full plus deleted slots */
 
-typedef unsigned long hash_t;
 
+typedef uint64_t hash_t;
 
-/* XOR DJB2 algorithm. */
-static inline hash_t hash(unsigned char *str)
+
+static inline hash_t hashmap_hash(const hashmap_t *map, const char *key)
 {
-    hash_t hash = 5381;
-    int c;
+    return hash64(key, strlen(key), map->seed);
+}
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) ^ c; /* hash(i - 1) * 33 ^ c */
 
-    return hash;
+/* Return the stripe of `map' for keys hashing to `h'. */
+static inline hashmap_stripe_t *hashmap_stripe(hashmap_t *map, hash_t h)
+{
+    /* The tables use the low 32 bits */
+    return &map->stripes[(h >> 32) & (map->nstripes - 1)];
 }
 
 
-static inline int hashmap_entry_init(hashmap_entry_t *entry,
-                                     const char *key, const char *value)
+/* Return a cheap millisecond clock for ordering entries by use. */
+static inline unsigned long hashmap_clock()
 {
-    entry->next = NULL;
-    entry->key = strdup(key);
-    entry->value = strdup(value);
-    entry->timestamp = time(NULL);
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+
+/* The 7 bits of `h' kept in a full slot's control byte. */
+static inline uint8_t hashmap_h2(hash_t h)
+{
+    return h & 0x7f;
+}
+
+
+/* Return a bit for each of the HASHMAP_GROUP bytes at `ctrl' equal to `c'. */
+static inline unsigned hashmap_match(const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    unsigned mask = 0;
+
+    for (int i = 0; i < HASHMAP_GROUP; i++)
+        mask |= (unsigned)(ctrl[i] == c) << i;
+
+    return mask;
+#endif
+}
+
+
+/* Return a bit for each empty or deleted slot of the group at `ctrl'. */
+static inline unsigned hashmap_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    unsigned mask = 0;
+
+    for (int i = 0; i < HASHMAP_GROUP; i++)
+        mask |= (unsigned)(ctrl[i] >> 7) << i;
+
+    return mask;
+#endif
+}
+
+
+/*
+ * Groups are probed in triangular steps from the one `h' picks, which
+ * visits every group of a power-of-two table once.
+ */
+static inline size_t hashmap_probe_start(const hashmap_table_t *t, hash_t h)
+{
+    return (h >> 7) & (t->nslots / HASHMAP_GROUP - 1);
+}
+
+
+static inline size_t hashmap_probe_next(const hashmap_table_t *t,
+                                        size_t group, size_t step)
+{
+    return (group + step) & (t->nslots / HASHMAP_GROUP - 1);
+}
+
+
+/* Return the slot of `t' holding `key' (which hashes to `h') or -1. */
+static long hashmap_find(const hashmap_table_t *t, const char *key, hash_t h)
+{
+    const uint8_t *ctrl;
+    size_t group = hashmap_probe_start(t, h);
+    unsigned match;
+    long slot;
+
+    for (size_t step = 1; step <= t->nslots / HASHMAP_GROUP; step++) {
+        ctrl = t->ctrl + group * HASHMAP_GROUP;
+
+        for (match = hashmap_match(ctrl, hashmap_h2(h)); match;
+             match &= match - 1) {
+            slot = group * HASHMAP_GROUP + __builtin_ctz(match);
+            if (t->slots[slot]->hash == h && !strcmp(t->slots[slot]->key, key))
+                return slot;
+        }
 
-    if (entry->key == NULL || entry->value == NULL) /* out of memory */
+        /* A probe stops at the first group with room, so `key' isn't on */
+        if (hashmap_match(ctrl, HASHMAP_EMPTY))
+            return -1;
+
+        group = hashmap_probe_next(t, group, step);
+    }
+
+    return -1;
+}
+
+
+/*
+ * Return the table of `s' holding `key' and set `slot', or return NULL.
+ * Keys are only ever in one of the two tables.
+ */
+static hashmap_table_t *hashmap_lookup(hashmap_stripe_t *s, const char *key,
+                                       hash_t h, long *slot)
+{
+    if ((*slot = hashmap_find(&s->table, key, h)) != -1)
+        return &s->table;
+
+    if (s->old.nslots && (*slot = hashmap_find(&s->old, key, h)) != -1)
+        return &s->old;
+
+    return NULL;
+}
+
+
+/* Put `entry' in `t'. Return its slot. */
+static size_t hashmap_place(hashmap_table_t *t, hashmap_entry_t *entry)
+{
+    size_t group = hashmap_probe_start(t, entry->hash);
+    size_t slot;
+    unsigned match;
+
+    /* The load limit leaves an empty slot, so this ends */
+    for (size_t step = 1; ; step++) {
+        match = hashmap_match_free(t->ctrl + group * HASHMAP_GROUP);
+        if (match)
+            break;
+        group = hashmap_probe_next(t, group, step);
+    }
+
+    slot = group * HASHMAP_GROUP + __builtin_ctz(match);
+    if (t->ctrl[slot] == HASHMAP_DELETED)
+        t->tombstones--;
+    t->ctrl[slot] = hashmap_h2(entry->hash);
+    t->slots[slot] = entry;
+    t->used++;
+
+    return slot;
+}
+
+
+/* Empty `slot'. An entry in a group with room never pushed a probe on. */
+static void hashmap_clear_slot(hashmap_table_t *t, size_t slot)
+{
+    const uint8_t *ctrl = t->ctrl + slot / HASHMAP_GROUP * HASHMAP_GROUP;
+
+    if (hashmap_match(ctrl, HASHMAP_EMPTY)) {
+        t->ctrl[slot] = HASHMAP_EMPTY;
+    } else {
+        t->ctrl[slot] = HASHMAP_DELETED;
+        t->tombstones++;
+    }
+    t->used--;
+}
+
+
+/* Point `t' at an empty table of `nslots' slots. Return -1 for OOM. */
+static int hashmap_alloc(hashmap_table_t *t, size_t nslots)
+{
+    /* The control bytes and slots share one allocation, aligned for SSE2 */
+    uint8_t *ctrl = aligned_alloc(HASHMAP_GROUP, nslots *
+                                  (1 + sizeof(hashmap_entry_t *)));
+
+    if (ctrl == NULL)
         return -1;
 
+    memset(ctrl, HASHMAP_EMPTY, nslots);
+    t->ctrl = ctrl;
+    t->slots = (hashmap_entry_t **)(ctrl + nslots);
+    t->nslots = nslots;
+    t->used = 0;
+    t->tombstones = 0;
+
     return 0;
 }
 
 
-static inline void hashmap_entry_destroy(hashmap_entry_t *entry)
+/* Move up to `groups' groups of the stripe's old table to the new one. */
+static void hashmap_migrate(hashmap_stripe_t *s, size_t groups)
 {
-    assert(entry->key != NULL);
-    free((char *)entry->key);
+    hashmap_table_t *old = &s->old;
+    hashmap_entry_t *entry;
+    size_t end;
+
+    if (!old->nslots)
+        return;
+
+    if (groups < (old->nslots - s->migrated) / HASHMAP_GROUP)
+        end = s->migrated + groups * HASHMAP_GROUP;
+    else
+        end = old->nslots;
 
-    assert(entry->value != NULL);
-    free((char *)entry->value);
+    for (; s->migrated < end; s->migrated++) {
+        if (old->ctrl[s->migrated] & HASHMAP_EMPTY)
+            continue;
+        entry = old->slots[s->migrated];
+        hashmap_place(&s->table, entry);
+        hashmap_clear_slot(old, s->migrated);
+    }
+
+    if (s->migrated == old->nslots) {
+        free(old->ctrl);
+        old->ctrl = NULL;
+        old->nslots = 0;
+    }
 }
 
 
-int hashmap_init(hashmap_t *map, size_t bucket_size)
+/*
+ * Start moving the stripe's entries to a new table of `nslots' slots,
+ * finishing any move already under way first. Return -1 for OOM.
+ */
+static int hashmap_resize(hashmap_stripe_t *s, size_t nslots)
 {
-    int rval = 0;
-    pthread_mutexattr_t mutexattr;
+    hashmap_table_t table;
+
+    hashmap_migrate(s, SIZE_MAX);
 
-    if (!bucket_size)
+    table = s->table;
+    if (hashmap_alloc(&s->table, nslots) == -1) {
+        s->table = table;
         return -1;
+    }
 
-    map->bucket = calloc(bucket_size, sizeof(hashmap_entry_t *));
-    map->bucket_size = bucket_size;
+    printl(LOG_DEBUG "Resizing hashmap stripe from %zu to %zu slots\n",
+           table.nslots, nslots);
+    s->old = table;
+    s->migrated = 0;
+    hashmap_migrate(s, HASHMAP_MIGRATE);
 
-    if (map->bucket == NULL)    /* out of memory */
-        return -1;
+    return 0;
+}
 
-    map->size = 0;
 
-    pthread_mutexattr_init(&mutexattr);
-    pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
-    if (pthread_mutex_init(&map->lock, &mutexattr))
-        rval = -1;
+/*
+ * Make room in the stripe's table for one more entry. Full plus deleted
+ * slots are kept under 7/8: past that the stripe moves to a table twice the
+ * size or, if deleted slots are what fill it, to a fresh one the same size.
+ * Return -1 for OOM.
+ *
+ * Each call moves at least one old group, and a table is only outgrown at
+ * 7/8 of twice the old one's slots, so a move always finishes first.
+ */
+static int hashmap_reserve(hashmap_stripe_t *s)
+{
+    hashmap_table_t *t = &s->table;
+    size_t nslots = t->nslots;
+
+    if (t->used + t->tombstones < HASHMAP_MAX_LOAD(nslots))
+        return 0;
 
-    pthread_mutexattr_destroy(&mutexattr);
+    if (t->used + s->old.used >= HASHMAP_MAX_LOAD(nslots) / 2)
+        nslots *= 2;
 
-    return rval;
+    return hashmap_resize(s, nslots);
 }
 
 
-void hashmap_destroy(hashmap_t *map)
+/*
+ * Start moving to a table half the size once under 1/4 of the 7/8 limit,
+ * which leaves the smaller table under 7/16 full, as a grown one is.
+ */
+static void hashmap_shrink(hashmap_stripe_t *s)
 {
-    hashmap_entry_t *current, *next;
+    size_t nslots = s->table.nslots;
 
-    if (map == NULL || map->bucket == NULL)
+    if (s->old.nslots || nslots <= s->min_nslots ||
+        s->table.used >= HASHMAP_MAX_LOAD(nslots) / 4)
         return;
 
-    /* Free entries */
-    for (size_t i = 0; i < map->bucket_size; i++) {
-        current = map->bucket[i];
-        if (current == NULL)
-            continue;
+    hashmap_resize(s, nslots / 2); /* on OOM, stay the size it is */
+}
+
+
+static hashmap_entry_t *hashmap_entry_new(const char *key, const char *value,
+                                          hash_t h)
+{
+    size_t key_len = strlen(key), value_len = strlen(value);
+    hashmap_entry_t *entry = malloc(sizeof(hashmap_entry_t) + key_len +
+                                    value_len + 2);
+
+    if (entry == NULL)          /* out of memory */
+        return NULL;
+
+    memcpy(entry->data, key, key_len + 1);
+    memcpy(entry->data + key_len + 1, value, value_len + 1);
+    entry->key = entry->data;
+    entry->value = entry->data + key_len + 1;
+    entry->value_max = value_len;
+    entry->hash = h;
+    entry->timestamp = time(NULL);
+    entry->expires = 0;
+    entry->bytes = 0;
+    entry->used = 0;
+    atomic_init(&entry->refs, 1);
+    entry->lru_prev = entry->lru_next = NULL;
+
+    return entry;
+}
+
+
+/* Drop a reference to `entry', freeing it with the last. */
+static inline void hashmap_entry_put(hashmap_entry_t *entry)
+{
+    if (atomic_fetch_sub(&entry->refs, 1) == 1)
+        free(entry);
+}
+
+
+static void hashmap_lru_remove(hashmap_stripe_t *s, hashmap_entry_t *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        s->lru_head = entry->lru_next;
+
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        s->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+
+static void hashmap_lru_push(hashmap_stripe_t *s, hashmap_entry_t *entry)
+{
+    entry->used = hashmap_clock();
+    entry->lru_prev = NULL;
+    entry->lru_next = s->lru_head;
+
+    if (s->lru_head)
+        s->lru_head->lru_prev = entry;
+    else
+        s->lru_tail = entry;
 
-        do {
-            next = current->next;
-            if (map->unlinker) {
-                printl(LOG_DEBUG "Unlinking %s\n", current->value);
-                map->unlinker(current->value);
+    s->lru_head = entry;
+}
+
+
+/*
+ * Take the entry in `slot' of `t' out of the stripe and push it on the
+ * `doomed' list for hashmap_reap(). The stripe must be locked.
+ */
+static void hashmap_remove(hashmap_t *map, hashmap_stripe_t *s,
+                           hashmap_table_t *t, size_t slot,
+                           hashmap_entry_t **doomed)
+{
+    hashmap_entry_t *entry = t->slots[slot];
+
+    hashmap_clear_slot(t, slot);
+    hashmap_lru_remove(s, entry);
+    atomic_fetch_sub(&map->bytes, entry->bytes);
+    atomic_fetch_sub(&map->size, 1);
+
+    entry->lru_next = *doomed;
+    *doomed = entry;
+}
+
+
+/*
+ * Unlink the values of the entries hashmap_remove() took out and drop the
+ * map's references, freeing those nobody borrowed.
+ */
+static void hashmap_reap(hashmap_t *map, hashmap_entry_t *doomed)
+{
+    hashmap_entry_t *next;
+
+    for (; doomed != NULL; doomed = next) {
+        next = doomed->lru_next;
+        if (map->unlinker) {
+            printl(LOG_DEBUG "Unlinking %s\n", doomed->value);
+            map->unlinker(doomed->value);
+        }
+        hashmap_entry_put(doomed);
+    }
+}
+
+
+/* Return the stripe's least recently used entry other than `keep'. */
+static inline hashmap_entry_t *hashmap_lru_victim(hashmap_stripe_t *s,
+                                                  hashmap_entry_t *keep)
+{
+    hashmap_entry_t *victim = s->lru_tail;
+
+    return victim == keep ? victim->lru_prev : victim;
+}
+
+
+/*
+ * Delete least recently used entries other than `keep' until within budget,
+ * taking each from the stripe whose oldest entry was used longest ago. No
+ * stripe may be locked.
+ */
+static void hashmap_evict(hashmap_t *map, hashmap_entry_t *keep)
+{
+    hashmap_stripe_t *s, *oldest;
+    hashmap_entry_t *victim, *doomed;
+    hashmap_table_t *t;
+    unsigned long used = 0;
+    long slot;
+
+    while ((map->max_bytes && map->bytes > map->max_bytes) ||
+           (map->max_entries && map->size > map->max_entries)) {
+        oldest = NULL;
+        for (size_t i = 0; i < map->nstripes; i++) {
+            s = &map->stripes[i];
+            pthread_mutex_lock(&s->lock);
+            victim = hashmap_lru_victim(s, keep);
+            if (victim && (oldest == NULL || victim->used < used)) {
+                oldest = s;
+                used = victim->used;
             }
-            hashmap_entry_destroy(current);
-            free(current);
-            current = next;
-        } while (next != NULL);
+            pthread_mutex_unlock(&s->lock);
+        }
+        if (oldest == NULL)
+            break;
+
+        /* The stripe may have changed since, but its oldest will do */
+        doomed = NULL;
+        pthread_mutex_lock(&oldest->lock);
+        if ((victim = hashmap_lru_victim(oldest, keep)) != NULL) {
+            printl(LOG_DEBUG "Evicting cache entry %s\n", victim->key);
+            t = hashmap_lookup(oldest, victim->key, victim->hash, &slot);
+            assert(t != NULL);
+            hashmap_remove(map, oldest, t, slot, &doomed);
+            oldest->evictions++;
+        }
+        pthread_mutex_unlock(&oldest->lock);
+        hashmap_reap(map, doomed);
     }
+}
+
+
+/* Free the entries in `t' and the table itself. */
+static void hashmap_destroy_table(hashmap_t *map, hashmap_table_t *t)
+{
+    for (size_t i = 0; i < t->nslots; i++) {
+        if (t->ctrl[i] & HASHMAP_EMPTY)
+            continue;
 
-    free(map->bucket);
-    pthread_mutex_destroy(&map->lock);
+        if (map->unlinker) {
+            printl(LOG_DEBUG "Unlinking %s\n", t->slots[i]->value);
+            map->unlinker(t->slots[i]->value);
+        }
+        hashmap_entry_put(t->slots[i]);
+    }
+
+    free(t->ctrl);
+    t->ctrl = NULL;
+    t->nslots = 0;
+}
+
+
+int hashmap_init(hashmap_t *map, size_t nslots)
+{
+    return hashmap_init_striped(map, nslots, 1);
+}
+
+
+int hashmap_init_striped(hashmap_t *map, size_t nslots, size_t nstripes)
+{
+    hashmap_stripe_t *s;
+    size_t n = HASHMAP_GROUP;
+
+    map->stripes = NULL;
+
+    if (!nslots)
+        return -1;
+
+    for (map->nstripes = 1; map->nstripes < nstripes; map->nstripes *= 2)
+        ;
+    map->stripes = calloc(map->nstripes, sizeof(hashmap_stripe_t));
+    if (map->stripes == NULL)   /* out of memory */
+        return -1;
+
+    nslots = (nslots + map->nstripes - 1) / map->nstripes;
+    while (HASHMAP_MAX_LOAD(n) < nslots)
+        n *= 2;
+
+    for (size_t i = 0; i < map->nstripes; i++) {
+        s = &map->stripes[i];
+        if (hashmap_alloc(&s->table, n) == -1 ||
+            pthread_mutex_init(&s->lock, NULL)) {
+            free(s->table.ctrl);
+            map->nstripes = i;
+            hashmap_destroy(map);
+            return -1;
+        }
+        s->min_nslots = n;
+    }
+
+    map->seed = hash_seed();
+    map->size = 0;
+    map->bytes = 0;
+    map->timeout = 0;
+    map->grace = 0;
+    map->unlinker = NULL;
+    map->max_bytes = 0;
+    map->max_entries = 0;
+
+    return 0;
+}
+
+
+void hashmap_destroy(hashmap_t *map)
+{
+    hashmap_stripe_t *s;
+
+    if (map == NULL || map->stripes == NULL)
+        return;
+
+    for (size_t i = 0; i < map->nstripes; i++) {
+        s = &map->stripes[i];
+        hashmap_destroy_table(map, &s->table);
+        if (s->old.nslots)
+            hashmap_destroy_table(map, &s->old);
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    free(map->stripes);
+    map->stripes = NULL;
 }
 
 
 int hashmap_add(hashmap_t *map, const char *key, const char *value)
+{
+    return hashmap_add_sized(map, key, value, 0);
+}
+
+
+int hashmap_add_sized(hashmap_t *map, const char *key, const char *value,
+                      size_t bytes)
+{
+    return hashmap_add_expiring(map, key, value, bytes, 0);
+}
+
+
+int hashmap_add_expiring(hashmap_t *map, const char *key, const char *value,
+                         size_t bytes, unsigned long expires)
 {
     assert(map != NULL);
-    assert(map->bucket_size > 0);
+    assert(map->stripes != NULL);
     assert(key != NULL);
     assert(value != NULL);
 
-    bool entry_exists = false;
-    hashmap_entry_t *last_entry, *entry;
-    hash_t key_hash = hash((unsigned char *)key);
-    int idx = key_hash % map->bucket_size;
+    hashmap_entry_t *entry, *old, *doomed = NULL;
+    hashmap_table_t *t;
+    hash_t key_hash = hashmap_hash(map, key);
+    hashmap_stripe_t *s = hashmap_stripe(map, key_hash);
+    long slot;
 
-    last_entry = entry = map->bucket[idx];
+    if (map->max_bytes && bytes > map->max_bytes)
+        return -1;
 
-    pthread_mutex_lock(&map->lock);
+    pthread_mutex_lock(&s->lock);
 
-    /* Look through existing entries to see if key is already added */
-    while (entry != NULL) {
-        if (!strcmp(key, entry->key)) {
-            entry_exists = true;
-            break;
-        }
-        last_entry = entry;
-        entry = entry->next;
-    }
+    hashmap_migrate(s, HASHMAP_MIGRATE);
 
-    if (entry_exists) {
-        /* Update existing entry */
+    if ((t = hashmap_lookup(s, key, key_hash, &slot)) != NULL) {
+        /* Update existing entry, in place if the new value fits and no one
+         * has it borrowed. Borrows are only taken under the lock. A value
+         * the unlinker has to drop keeps its entry until that's done. */
+        entry = old = t->slots[slot];
         if (strcmp(entry->value, value)) {
-            free((void *)entry->value);
-            entry->value = strdup(value);
+            if (map->unlinker == NULL &&
+                strlen(value) <= entry->value_max &&
+                atomic_load(&entry->refs) == 1) {
+                strcpy((char *)entry->value, value);
+            } else if ((entry = hashmap_entry_new(key, value, key_hash))) {
+                entry->timestamp = old->timestamp;
+                t->slots[slot] = entry;
+            } else {
+                pthread_mutex_unlock(&s->lock);
+                return -1;
+            }
         }
         if (map->timeout)
             entry->timestamp = time(NULL);
+        atomic_fetch_sub(&map->bytes, old->bytes);
+        hashmap_lru_remove(s, old);
+        if (entry != old && map->unlinker) {
+            old->lru_next = NULL;
+            doomed = old;
+        } else if (entry != old) {
+            hashmap_entry_put(old);
+        }
     } else {
         /* Add new entry */
-        entry = malloc(sizeof(hashmap_entry_t));
-        if (entry == NULL)
+        if (hashmap_reserve(s) == -1 ||
+            (entry = hashmap_entry_new(key, value, key_hash)) == NULL) {
+            pthread_mutex_unlock(&s->lock);
             return -1;
+        }
 
-        hashmap_entry_init(entry, key, value);
-        if (last_entry == NULL)
-            map->bucket[idx] = entry; /* add new entry at head of list */
-        else
-            last_entry->next = entry; /* add new entry at tail of list */
+        slot = hashmap_place(&s->table, entry);
+        atomic_fetch_add(&map->size, 1);
+    }
+
+    entry->expires = expires;
+    entry->bytes = bytes;
+    atomic_fetch_add(&map->bytes, bytes);
+    hashmap_lru_push(s, entry);
+
+    pthread_mutex_unlock(&s->lock);
+
+    hashmap_reap(map, doomed);
+    hashmap_evict(map, entry);
+
+    return slot;
+}
 
-        map->size++;
+
+/* Return true if `entry' has expired and its grace period is over too. */
+static inline bool hashmap_entry_dead(const hashmap_t *map,
+                                      const hashmap_entry_t *entry,
+                                      unsigned long now)
+{
+    return entry->expires && entry->expires + map->grace <= now;
+}
+
+
+/*
+ * Look `key' up like hashmap_get(), taking a reference to the entry for the
+ * caller if it's there. Return its slot or -1.
+ */
+static long hashmap_get_entry(hashmap_t *map, const char *key,
+                              hashmap_entry_t **entryp)
+{
+    hashmap_entry_t *entry = NULL, *doomed = NULL;
+    hashmap_table_t *t;
+    hash_t key_hash = hashmap_hash(map, key);
+    hashmap_stripe_t *s = hashmap_stripe(map, key_hash);
+    unsigned long now = time(NULL);
+    long slot;
+
+    pthread_mutex_lock(&s->lock);
+
+    hashmap_migrate(s, HASHMAP_MIGRATE);
+
+    if ((t = hashmap_lookup(s, key, key_hash, &slot)) != NULL)
+        entry = t->slots[slot];
+
+    /* An entry past its expiry and grace is gone, whether or not gc got to
+     * it yet; one within its grace is stale, so only hashmap_get_stale()
+     * returns it */
+    if (entry && hashmap_entry_dead(map, entry, now)) {
+        printl(LOG_DEBUG "Removing cache entry %s\n", entry->key);
+        hashmap_remove(map, s, t, slot, &doomed);
+        s->expirations++;
+        entry = NULL;
+    } else if (entry && entry->expires && entry->expires <= now) {
+        entry = NULL;
     }
 
-    pthread_mutex_unlock(&map->lock);
+    if (entry) {
+        atomic_fetch_add(&entry->refs, 1);
+        if (map->timeout)
+            entry->timestamp = now;
+        hashmap_lru_remove(s, entry);
+        hashmap_lru_push(s, entry);
+        s->hits++;
+    } else {
+        s->misses++;
+        slot = -1;
+    }
 
-    return idx;
+    pthread_mutex_unlock(&s->lock);
+
+    hashmap_reap(map, doomed);
+
+    *entryp = entry;
+
+    return slot;
 }
 
 
@@ -164,39 +717,67 @@ int hashmap_get(hashmap_t *map, const char *key, char **value)
     assert(map != NULL);
     assert(key != NULL);
 
-    int rval;
-    bool entry_exists = false;
     hashmap_entry_t *entry;
-    hash_t key_hash = hash((unsigned char *)key);
-    int idx = key_hash % map->bucket_size;
+    long slot = hashmap_get_entry(map, key, &entry);
 
-    entry = map->bucket[idx];
+    if (value != NULL)
+        *value = entry ? strdup(entry->value) : NULL;
 
-    pthread_mutex_lock(&map->lock);
+    if (entry)
+        hashmap_entry_put(entry);
 
-    while (entry != NULL) {
-        if (!strcmp(key, entry->key)) {
-            entry_exists = true;
-            break;
-        }
-        entry = entry->next;
-    }
+    return slot;
+}
 
-    if (entry_exists) {
-        rval = idx;
-        if (value != NULL)
-            *value = strdup(entry->value);
-        if (map->timeout)
-            entry->timestamp = time(NULL);
-    } else {
-        rval = -1;
-        if (value != NULL)
-            *value = NULL;
-    }
 
-    pthread_mutex_unlock(&map->lock);
+const hashmap_entry_t *hashmap_borrow(hashmap_t *map, const char *key)
+{
+    assert(map != NULL);
+    assert(key != NULL);
+
+    hashmap_entry_t *entry;
+
+    hashmap_get_entry(map, key, &entry);
 
-    return rval;
+    return entry;
+}
+
+
+void hashmap_release(const hashmap_entry_t *entry)
+{
+    if (entry != NULL)
+        hashmap_entry_put((hashmap_entry_t *)entry);
+}
+
+
+int hashmap_get_stale(hashmap_t *map, const char *key, char **value,
+                      unsigned long *expires)
+{
+    assert(map != NULL);
+    assert(key != NULL);
+
+    hashmap_entry_t *entry = NULL;
+    hashmap_table_t *t;
+    hash_t key_hash = hashmap_hash(map, key);
+    hashmap_stripe_t *s = hashmap_stripe(map, key_hash);
+    long slot;
+
+    pthread_mutex_lock(&s->lock);
+
+    hashmap_migrate(s, HASHMAP_MIGRATE);
+
+    t = hashmap_lookup(s, key, key_hash, &slot);
+    if (t && !hashmap_entry_dead(map, t->slots[slot], time(NULL)))
+        entry = t->slots[slot];
+
+    if (value != NULL)
+        *value = entry ? strdup(entry->value) : NULL;
+    if (expires != NULL)
+        *expires = entry ? entry->expires : 0;
+
+    pthread_mutex_unlock(&s->lock);
+
+    return entry ? slot : -1;
 }
 
 
@@ -205,47 +786,89 @@ int hashmap_del(hashmap_t *map, const char *key)
     assert(map != NULL);
     assert(key != NULL);
 
-    int rval = -1;
-    bool entry_exists = false;
-    hashmap_entry_t *last_entry, *entry;
-    hash_t key_hash = hash((unsigned char *)key);
-    int idx = key_hash % map->bucket_size;
+    hashmap_entry_t *doomed = NULL;
+    hashmap_table_t *t;
+    hash_t key_hash = hashmap_hash(map, key);
+    hashmap_stripe_t *s = hashmap_stripe(map, key_hash);
+    long slot;
 
-    last_entry = entry = map->bucket[idx];
+    pthread_mutex_lock(&s->lock);
 
-    pthread_mutex_lock(&map->lock);
+    hashmap_migrate(s, HASHMAP_MIGRATE);
 
-    while (entry != NULL) {
-        if (!strcmp(key, entry->key)) {
-            entry_exists = true;
-            break;
-        }
-        last_entry = entry;
-        entry = entry->next;
+    if ((t = hashmap_lookup(s, key, key_hash, &slot)) != NULL) {
+        hashmap_remove(map, s, t, slot, &doomed);
+        hashmap_shrink(s);
     }
 
-    if (entry_exists) {
-        if (entry == map->bucket[idx])
-            /* replace head of linked list */
-            map->bucket[idx] = entry->next;
-        else
-            /* replace non-head entry */
-            last_entry->next = entry->next;
+    pthread_mutex_unlock(&s->lock);
 
-        if (map->unlinker) {
-            printl(LOG_DEBUG "Unlinking %s\n", entry->value);
-            map->unlinker(entry->value);
-        }
+    hashmap_reap(map, doomed);
 
-        hashmap_entry_destroy(entry);
-        free(entry);
-        map->size--;
-        rval = idx;
+    return slot;
+}
+
+
+int hashmap_del_value(hashmap_t *map, const char *key, const char *value)
+{
+    assert(map != NULL);
+    assert(key != NULL);
+    assert(value != NULL);
+
+    hashmap_entry_t *doomed = NULL;
+    hashmap_table_t *t;
+    hash_t key_hash = hashmap_hash(map, key);
+    hashmap_stripe_t *s = hashmap_stripe(map, key_hash);
+    long slot;
+
+    pthread_mutex_lock(&s->lock);
+
+    hashmap_migrate(s, HASHMAP_MIGRATE);
+
+    if ((t = hashmap_lookup(s, key, key_hash, &slot)) != NULL &&
+        strcmp(t->slots[slot]->value, value) == 0) {
+        hashmap_remove(map, s, t, slot, &doomed);
+        hashmap_shrink(s);
+    } else {
+        slot = -1;
     }
 
-    pthread_mutex_unlock(&map->lock);
+    pthread_mutex_unlock(&s->lock);
 
-    return rval;
+    hashmap_reap(map, doomed);
+
+    return slot;
+}
+
+
+/*
+ * Take out the entries of `t' that expired or went unused too long, pushing
+ * them on `doomed'.
+ */
+static void hashmap_gc_table(hashmap_t *map, hashmap_stripe_t *s,
+                             hashmap_table_t *t, unsigned long now,
+                             hashmap_entry_t **doomed)
+{
+    hashmap_entry_t *entry;
+    const char msg[] = LOG_DEBUG "Removing cache entry %s\n";
+    bool expired;
+
+    /* Removing an entry only marks its slot, so the scan can go on */
+    for (size_t i = 0; i < t->nslots; i++) {
+        if (t->ctrl[i] & HASHMAP_EMPTY)
+            continue;
+
+        entry = t->slots[i];
+        if (entry->expires)
+            expired = hashmap_entry_dead(map, entry, now);
+        else
+            expired = map->timeout && now - entry->timestamp > map->timeout;
+        if (expired) {
+            printl(msg, entry->key);
+            hashmap_remove(map, s, t, i, doomed);
+            s->expirations++;
+        }
+    }
 }
 
 
@@ -253,28 +876,47 @@ void hashmap_gc(hashmap_t *map)
 {
     assert(map != NULL);
 
-    hashmap_entry_t *current, *next;
-    const char msg[] = LOG_DEBUG "Removing cache entry %s\n";
-    unsigned long timeout, now = time(NULL);
-
-    pthread_mutex_lock(&map->lock);
-
-    if (map->timeout) {
-        for (size_t i = 0; i < map->bucket_size; i++) {
-            current = map->bucket[i];
-            if (current == NULL)
-                continue;
-
-            do {
-                next = current->next;
-                if (now - current->timestamp > map->timeout) {
-                    printl(msg, current->key);
-                    hashmap_del(map, current->key);
-                }
-                current = next;
-            } while (next != NULL);
-        }
+    hashmap_entry_t *doomed;
+    hashmap_stripe_t *s;
+    unsigned long now = time(NULL);
+
+    for (size_t i = 0; i < map->nstripes; i++) {
+        s = &map->stripes[i];
+        doomed = NULL;
+
+        pthread_mutex_lock(&s->lock);
+
+        hashmap_migrate(s, HASHMAP_MIGRATE);
+
+        hashmap_gc_table(map, s, &s->table, now, &doomed);
+        if (s->old.nslots)
+            hashmap_gc_table(map, s, &s->old, now, &doomed);
+
+        hashmap_shrink(s);
+
+        pthread_mutex_unlock(&s->lock);
+
+        /* Only the stripe's own callers waited, and not for the unlinks */
+        hashmap_reap(map, doomed);
     }
+}
+
 
-    pthread_mutex_unlock(&map->lock);
+void hashmap_stats(hashmap_t *map, hashmap_stats_t *stats)
+{
+    hashmap_stripe_t *s;
+
+    stats->size = map->size;
+    stats->bytes = map->bytes;
+    stats->hits = stats->misses = stats->evictions = stats->expirations = 0;
+
+    for (size_t i = 0; i < map->nstripes; i++) {
+        s = &map->stripes[i];
+        pthread_mutex_lock(&s->lock);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->expirations += s->expirations;
+        pthread_mutex_unlock(&s->lock);
+    }
 }
@@ -2,41 +2,126 @@
 #define HASHMAP_H
 
 #include <pthread.h>            /* pthread_mutex_* */
+#include <stdatomic.h>          /* atomic_* */
 #include <stdbool.h>            /* bool */
+#include <stdint.h>             /* uint*_t */
 #include <stdlib.h>             /* size_t */
 
+#define HASHMAP_GROUP 16        /* control bytes compared per probe step */
+#define HASHMAP_MIGRATE 2       /* groups moved to a new table per call */
+#define HASHMAP_STRIPES 16      /* stripes of the shared caches */
+
 
 /* Change this function prototype to change unlinker function type. */
 typedef int (*hashmap_unlinker)(const char *);
 
-/* A string-string hash map entry. */
+/* A string-string hash map entry, allocated in one piece with its strings. */
 typedef struct hashmap_entry {
-    struct hashmap_entry *next; /* pointer to next entry in linked list */
-    const char *key;            /* the key that was hashed */
-    const char *value;          /* the mapped value */
+    const char *key;            /* the key that was hashed, in `data' */
+    const char *value;          /* the mapped value, in `data' */
+    size_t value_max;           /* longest value that fits in its place */
+    uint64_t hash;              /* the key's full hash */
     unsigned long timestamp;    /* timestamp for cache expiration */
+    unsigned long expires;      /* time the entry expires (0 = `timeout') */
+    size_t bytes;               /* size charged against map->max_bytes */
+    unsigned long used;         /* ms clock at last use, to order stripes */
+    atomic_uint refs;           /* the map's, while in it, plus borrows */
+    struct hashmap_entry *lru_prev, *lru_next; /* recency list */
+    char data[];                /* the key and value strings */
 } hashmap_entry_t;
 
+/*
+ * An open-addressed table of entries. Each slot has a control byte holding
+ * 7 bits of its key's hash, or marking it empty or deleted. A probe compares
+ * a whole group of HASHMAP_GROUP control bytes at once (with SSE2 where the
+ * target has it), so keys are only compared in slots whose hash bits match.
+ */
+typedef struct hashmap_table {
+    uint8_t *ctrl;              /* a control byte per slot */
+    hashmap_entry_t **slots;    /* the entry in each full slot */
+    size_t nslots;              /* a power of two, at least HASHMAP_GROUP */
+    size_t used;                /* full slots */
+    size_t tombstones;          /* deleted slots, which lengthen probes */
+} hashmap_table_t;
 
+/*
+ * One stripe of a hash map: the keys whose hash picks it, with their own
+ * lock and recency list. The tables resize with the stripe's load. A resize
+ * allocates the new table and each later call moves HASHMAP_MIGRATE groups
+ * of the old one into it, so no one call pays for rehashing them all. Until
+ * the old table is drained, lookups search both.
+ */
+typedef struct hashmap_stripe {
+    hashmap_table_t table;      /* where entries are added */
+    hashmap_table_t old;        /* being moved to `table' (nslots 0 = none) */
+    size_t migrated;            /* slots of `old' moved so far */
+    size_t min_nslots;          /* the init size, the least it shrinks to */
+    pthread_mutex_t lock;       /* stripe lock for multithreading support */
+    hashmap_entry_t *lru_head;  /* most recently added or got entry */
+    hashmap_entry_t *lru_tail;  /* least recently used, evicted first */
+    unsigned long hits, misses, evictions, expirations;
+} hashmap_stripe_t;
+
+/*
+ * A hash map split into stripes, so threads working on keys in different
+ * stripes don't wait for each other. The byte and entry budgets are for the
+ * whole map: eviction takes the least recently used of the stripes' oldest
+ * entries. Values are unlinked after the stripe lock is dropped.
+ */
 typedef struct hashmap {
-    hashmap_entry_t **bucket;   /* the hash map's array */
-    size_t bucket_size;         /* size of the "bucket" array */
-    size_t size;                /* number of entries in the map */
-    pthread_mutex_t lock;       /* map lock for multithreading support */
+    hashmap_stripe_t *stripes;  /* the stripes, a power of two of them */
+    size_t nstripes;            /* number of stripes */
+    uint64_t seed;              /* hash seed */
+    atomic_size_t size;         /* number of entries in the map */
+    atomic_size_t bytes;        /* sum of entry sizes */
     unsigned long timeout;      /* age in secs to delete entry (0 = never) */
-    hashmap_unlinker unlinker;  /* if non-NULL, call unlinker(value) on del */
+    unsigned long grace;        /* secs an expired entry is kept as stale */
+    hashmap_unlinker unlinker;  /* if non-NULL, call unlinker(value) on del
+                                 * and on a value replaced by hashmap_add */
+    size_t max_bytes;           /* evict LRU entries above this (0 = no cap) */
+    size_t max_entries;         /* evict LRU entries above this (0 = no cap) */
 } hashmap_t;
 
-/* Initialize a hash map with the requested bucket size. Return -1 for OOM. */
-int hashmap_init(hashmap_t *map, size_t bucket_size);
-/* Destroy a hash map and all  */
+/* Counts summed over a map's stripes. */
+typedef struct hashmap_stats {
+    size_t size, bytes;
+    unsigned long hits, misses, evictions, expirations;
+} hashmap_stats_t;
+
+/*
+ * Initialize a hash map with room for at least `nslots' entries. It grows
+ * past that as needed and shrinks back as entries are deleted. Return -1
+ * for OOM.
+ */
+int hashmap_init(hashmap_t *map, size_t nslots);
+/*
+ * Initialize a hash map like hashmap_init(), split into `nstripes' stripes
+ * (rounded up to a power of two) sharing the room for `nslots' entries.
+ */
+int hashmap_init_striped(hashmap_t *map, size_t nslots, size_t nstripes);
+/* Destroy a hash map and all its entries. */
 void hashmap_destroy(hashmap_t *map);
-/* Return the index where the key was added or -1 for out of memory. */
+/* Return the slot where the key was added or -1 for out of memory. */
 int hashmap_add(hashmap_t *map, const char *key, const char *value);
+/*
+ * Add `key' like hashmap_add(), charging `bytes' against `max_bytes'. Least
+ * recently used entries are deleted (and unlinked) until the map is within
+ * `max_bytes' and `max_entries' again. Return -1 if `bytes' alone is over
+ * budget.
+ */
+int hashmap_add_sized(hashmap_t *map, const char *key, const char *value,
+                      size_t bytes);
+/*
+ * Add `key' like hashmap_add_sized(), to expire at time `expires' instead
+ * of after `timeout' seconds unused. hashmap_get() never returns an expired
+ * entry, but it is kept for `grace' more seconds for hashmap_get_stale().
+ */
+int hashmap_add_expiring(hashmap_t *map, const char *key, const char *value,
+                         size_t bytes, unsigned long expires);
 /*
  * Get the `value` associated with `key`.
  *
- * If `key` exists in the map, return the index where it was found and set
+ * If `key` exists in the map, return the slot where it was found and set
  * `value` to point to a heap-allocated copy of the value in the map. The user
  * is responsible for freeing this string. If the hashmap has a non-zero
  * `timeout` value, update the entry's timestamp.
@@ -46,14 +131,40 @@ int hashmap_add(hashmap_t *map, const char *key, const char *value);
  * Touch timestamp if key already exists and map->timeout is non-zero.
  */
 int hashmap_get(hashmap_t *map, const char *key, char **value);
-/* Return the index where the deleted key was found or -1 for not found. */
+/*
+ * Look `key' up like hashmap_get(), but return its entry instead of a copy
+ * of the value, or NULL. The entry's `key' and `value' stay valid, even if
+ * it's deleted or replaced meanwhile, until it's given back with
+ * hashmap_release().
+ */
+const hashmap_entry_t *hashmap_borrow(hashmap_t *map, const char *key);
+/* Give back an entry from hashmap_borrow(). NULL is ignored. */
+void hashmap_release(const hashmap_entry_t *entry);
+/*
+ * Get `key' like hashmap_get(), but also if it has expired and is within
+ * `grace'. If `expires' isn't NULL, set it to the entry's expiry time. The
+ * entry's recency, timestamp and the hit counts are untouched.
+ */
+int hashmap_get_stale(hashmap_t *map, const char *key, char **value,
+                      unsigned long *expires);
+/* Return the slot where the deleted key was found or -1 for not found. */
 int hashmap_del(hashmap_t *map, const char *key);
-/* Garbage collect entries older then `timeout` seconds old. */
+/*
+ * Delete `key' like hashmap_del(), but only while it still maps to `value',
+ * so a caller acting on a value it looked up earlier can't drop a newer one.
+ */
+int hashmap_del_value(hashmap_t *map, const char *key, const char *value);
+/*
+ * Garbage collect expired entries and those unused for `timeout' seconds,
+ * locking one stripe at a time.
+ */
 void hashmap_gc(hashmap_t *map);
+/* Fill in `stats' for `map'. */
+void hashmap_stats(hashmap_t *map, hashmap_stats_t *stats);
 
 static inline bool hashmap_has_key(hashmap_t *map, const char *key)
 {
-    return hashmap_get(map, key, NULL) > 0;
+    return hashmap_get(map, key, NULL) != -1;
 }
 
 static inline bool hashmap_empty(hashmap_t *map)
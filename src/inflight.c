@@ -0,0 +1,286 @@
+#include <errno.h>              /* errno */
+#include <stdint.h>             /* uint64_t */
+#include <string.h>             /* strcmp, strdup, strlen */
+#include <time.h>               /* clock_gettime */
+#include <unistd.h>             /* write */
+
+#include "hash.h"
+#include "inflight.h"
+
+
+/* Keys are URLs clients pick, so the hash is seeded as in hashmap.c. */
+static inline size_t inflight_index(const inflight_map_t *map, const char *key)
+{
+    return hash64(key, strlen(key), hash_seed()) % map->bucket_size;
+}
+
+
+/* Take `f' out of the map so the next miss starts a new fetch. */
+static void inflight_unlink(inflight_map_t *map, inflight_t *f)
+{
+    inflight_t **link = &map->bucket[inflight_index(map, f->key)];
+
+    if (!f->in_map)
+        return;
+
+    while (*link != f)
+        link = &(*link)->next;
+    *link = f->next;
+
+    f->next = NULL;
+    f->in_map = false;
+}
+
+
+/* Wake blocked readers and poke every watching event loop. */
+static void inflight_notify(inflight_t *f)
+{
+    uint64_t one = 1;
+
+    pthread_cond_broadcast(&f->cond);
+
+    for (size_t i = 0; i < f->nwatchers; i++)
+        while (write(f->watchers[i].fd, &one, sizeof(one)) < 0 &&
+               errno == EINTR)
+            ;                   /* EAGAIN means a wakeup is already due */
+}
+
+
+int inflight_map_init(inflight_map_t *map, size_t bucket_size)
+{
+    map->bucket_size = bucket_size;
+    map->coalesced = 0;
+
+    if ((map->bucket = calloc(bucket_size, sizeof(inflight_t *))) == NULL)
+        return -1;
+
+    return pthread_mutex_init(&map->lock, NULL) ? -1 : 0;
+}
+
+
+void inflight_map_destroy(inflight_map_t *map)
+{
+    free(map->bucket);
+    pthread_mutex_destroy(&map->lock);
+}
+
+
+inflight_t *inflight_join(inflight_map_t *map, const char *key, bool *leader)
+{
+    inflight_t *f;
+    size_t index = inflight_index(map, key);
+
+    *leader = false;
+
+    pthread_mutex_lock(&map->lock);
+
+    f = map->bucket[index];
+    while (f != NULL && strcmp(f->key, key))
+        f = f->next;
+
+    if (f) {
+        f->refs++;
+        map->coalesced++;
+        pthread_mutex_unlock(&map->lock);
+        return f;
+    }
+
+    *leader = true;
+
+    if ((f = calloc(1, sizeof(inflight_t))) == NULL ||
+        (f->key = strdup(key)) == NULL) {
+        free(f);
+        pthread_mutex_unlock(&map->lock);
+        return NULL;
+    }
+
+    pthread_cond_init(&f->cond, NULL);
+    f->state = INFLIGHT_PENDING;
+    f->refs = 1;
+    f->in_map = true;
+    f->next = map->bucket[index];
+    map->bucket[index] = f;
+
+    pthread_mutex_unlock(&map->lock);
+
+    return f;
+}
+
+
+void inflight_start(inflight_map_t *map, inflight_t *f, const char *path,
+                    size_t len, bool len_known)
+{
+    pthread_mutex_lock(&map->lock);
+
+    if (f->state == INFLIGHT_PENDING) {
+        if ((f->path = strdup(path)) == NULL) {
+            f->state = INFLIGHT_ABANDONED;
+            inflight_unlink(map, f);
+        } else {
+            f->state = INFLIGHT_STREAMING;
+            f->len = len;
+            f->len_known = len_known;
+        }
+        inflight_notify(f);
+    }
+
+    pthread_mutex_unlock(&map->lock);
+}
+
+
+void inflight_progress(inflight_map_t *map, inflight_t *f, size_t written)
+{
+    pthread_mutex_lock(&map->lock);
+
+    if (f->state == INFLIGHT_STREAMING && written != f->written) {
+        f->written = written;
+        inflight_notify(f);
+    }
+
+    pthread_mutex_unlock(&map->lock);
+}
+
+
+/* End `f' if it's still going. The map lock must be held. */
+static void inflight_finish(inflight_map_t *map, inflight_t *f, bool complete)
+{
+    if (f->state == INFLIGHT_PENDING || f->state == INFLIGHT_STREAMING) {
+        complete = complete && f->state == INFLIGHT_STREAMING;
+        f->state = complete ? INFLIGHT_DONE : INFLIGHT_ABANDONED;
+        inflight_unlink(map, f);
+        inflight_notify(f);
+    }
+}
+
+
+void inflight_end(inflight_map_t *map, inflight_t *f, bool complete)
+{
+    pthread_mutex_lock(&map->lock);
+
+    if (!f->deferred)
+        inflight_finish(map, f, complete);
+
+    pthread_mutex_unlock(&map->lock);
+}
+
+
+void inflight_defer(inflight_map_t *map, inflight_t *f)
+{
+    pthread_mutex_lock(&map->lock);
+    f->deferred = true;
+    f->refs++;
+    pthread_mutex_unlock(&map->lock);
+}
+
+
+void inflight_end_deferred(inflight_map_t *map, inflight_t *f,
+                           bool complete)
+{
+    pthread_mutex_lock(&map->lock);
+    inflight_finish(map, f, complete);
+    pthread_mutex_unlock(&map->lock);
+}
+
+
+void inflight_release(inflight_map_t *map, inflight_t *f)
+{
+    pthread_mutex_lock(&map->lock);
+
+    if (--f->refs) {
+        pthread_mutex_unlock(&map->lock);
+        return;
+    }
+
+    inflight_unlink(map, f);
+
+    pthread_mutex_unlock(&map->lock);
+
+    pthread_cond_destroy(&f->cond);
+    free(f->watchers);
+    free(f->path);
+    free(f->key);
+    free(f);
+}
+
+
+inflight_state_t inflight_poll(inflight_map_t *map, inflight_t *f,
+                               size_t *written)
+{
+    inflight_state_t state;
+
+    pthread_mutex_lock(&map->lock);
+    state = f->state;
+    *written = f->written;
+    pthread_mutex_unlock(&map->lock);
+
+    return state;
+}
+
+
+inflight_state_t inflight_wait(inflight_map_t *map, inflight_t *f,
+                               inflight_state_t state, size_t *written,
+                               unsigned timeout_s)
+{
+    struct timespec deadline;
+    int rval = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_s;
+
+    pthread_mutex_lock(&map->lock);
+
+    while (f->state == state && f->written == *written && rval != ETIMEDOUT)
+        rval = pthread_cond_timedwait(&f->cond, &map->lock, &deadline);
+
+    state = f->state;
+    *written = f->written;
+
+    pthread_mutex_unlock(&map->lock);
+
+    return state;
+}
+
+
+int inflight_watch(inflight_map_t *map, inflight_t *f, int fd)
+{
+    inflight_watcher_t *watchers;
+    int rval = 0;
+    size_t i;
+
+    pthread_mutex_lock(&map->lock);
+
+    for (i = 0; i < f->nwatchers && f->watchers[i].fd != fd; i++)
+        ;
+
+    if (i < f->nwatchers) {
+        f->watchers[i].count++;
+    } else if ((watchers = realloc(f->watchers, (i + 1) *
+                                   sizeof(inflight_watcher_t))) != NULL) {
+        f->watchers = watchers;
+        f->watchers[i].fd = fd;
+        f->watchers[i].count = 1;
+        f->nwatchers++;
+    } else {
+        rval = -1;
+    }
+
+    pthread_mutex_unlock(&map->lock);
+
+    return rval;
+}
+
+
+void inflight_unwatch(inflight_map_t *map, inflight_t *f, int fd)
+{
+    pthread_mutex_lock(&map->lock);
+
+    for (size_t i = 0; i < f->nwatchers; i++) {
+        if (f->watchers[i].fd != fd)
+            continue;
+        if (--f->watchers[i].count == 0)
+            f->watchers[i] = f->watchers[--f->nwatchers];
+        break;
+    }
+
+    pthread_mutex_unlock(&map->lock);
+}
@@ -0,0 +1,106 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <pthread.h>            /* pthread_* */
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+
+#define INFLIGHT_BUCKETS 256    /* key hash buckets */
+
+
+/* How far a fetch that other requests attach to has got. */
+typedef enum inflight_state {
+    INFLIGHT_PENDING,           /* waiting on the origin's header */
+    INFLIGHT_STREAMING,         /* body being written to `path' */
+    INFLIGHT_DONE,              /* body complete and in the cache */
+    INFLIGHT_ABANDONED          /* not cacheable or cut off */
+} inflight_state_t;
+
+/* An fd (an event loop's eventfd) written to whenever a fetch progresses. */
+typedef struct inflight_watcher {
+    int fd;                     /* eventfd to write to */
+    unsigned count;             /* readers watching through it */
+} inflight_watcher_t;
+
+/*
+ * One upstream fetch of a URL. The first request to miss the cache becomes
+ * its leader and fetches; later requests for the URL attach as readers and
+ * stream the cache file as the leader writes it.
+ */
+typedef struct inflight {
+    struct inflight *next;      /* next fetch in the bucket */
+    char *key;                  /* heap-allocated key */
+    inflight_state_t state;     /* how far the fetch has got */
+    char *path;                 /* cache file being written, once streaming */
+    size_t len;                 /* cache file length, if len_known */
+    bool len_known;             /* the origin sent a Content-Length */
+    size_t written;             /* cache file bytes written so far */
+    unsigned refs;              /* leader and readers holding the fetch */
+    bool in_map;                /* still findable by inflight_join() */
+    bool deferred;              /* ended by a cache fill, not the leader */
+    pthread_cond_t cond;        /* broadcast on every change */
+    inflight_watcher_t *watchers; /* fds written on every change */
+    size_t nwatchers;           /* size of the "watchers" array */
+} inflight_t;
+
+/* Fetches in flight, keyed by URL. */
+typedef struct inflight_map {
+    inflight_t **bucket;        /* fetches hashed by key */
+    size_t bucket_size;         /* size of the "bucket" array */
+    unsigned long coalesced;    /* requests that attached to another fetch */
+    pthread_mutex_t lock;       /* map lock for multithreading support */
+} inflight_map_t;
+
+/* Initialize an empty map. Return -1 for OOM. */
+int inflight_map_init(inflight_map_t *map, size_t bucket_size);
+/* Free the map. Every fetch must have been released. */
+void inflight_map_destroy(inflight_map_t *map);
+/*
+ * Return the fetch in flight for `key' with a reference the caller must drop
+ * with inflight_release(), starting one if there is none. `leader' is set if
+ * the caller started it and so must fetch the URL and end the fetch.
+ *
+ * Return NULL (with `leader' set) for OOM.
+ */
+inflight_t *inflight_join(inflight_map_t *map, const char *key, bool *leader);
+/*
+ * Leader: the body is being written to `path', which will be `len' bytes
+ * long if `len_known'. Readers can start sending it.
+ */
+void inflight_start(inflight_map_t *map, inflight_t *f, const char *path,
+                    size_t len, bool len_known);
+/* Leader: `written' bytes are now in the cache file. */
+void inflight_progress(inflight_map_t *map, inflight_t *f, size_t written);
+/*
+ * Leader: the body is complete and in the cache, or the fetch is abandoned.
+ * The key is free for a new fetch either way. Does nothing if already ended.
+ */
+void inflight_end(inflight_map_t *map, inflight_t *f, bool complete);
+/*
+ * Leader: the cache file is written behind the leader, by a thread that
+ * will end `f' with inflight_end_deferred(). Take a reference for it, and
+ * make the leader's own inflight_end() calls do nothing.
+ */
+void inflight_defer(inflight_map_t *map, inflight_t *f);
+/* End `f' as inflight_end() does, once it's been deferred. */
+void inflight_end_deferred(inflight_map_t *map, inflight_t *f,
+                           bool complete);
+/* Drop a reference from inflight_join() or inflight_defer(). */
+void inflight_release(inflight_map_t *map, inflight_t *f);
+/* Return the state of `f' and set `written' to the bytes written so far. */
+inflight_state_t inflight_poll(inflight_map_t *map, inflight_t *f,
+                               size_t *written);
+/*
+ * Wait up to `timeout_s' seconds for `f' to move on from `state' and
+ * `written'. Return the state it is in and update `written'.
+ */
+inflight_state_t inflight_wait(inflight_map_t *map, inflight_t *f,
+                               inflight_state_t state, size_t *written,
+                               unsigned timeout_s);
+/* Write to eventfd `fd' whenever `f' changes. Return 0 or -1 for OOM. */
+int inflight_watch(inflight_map_t *map, inflight_t *f, int fd);
+/* Undo one inflight_watch() of `fd'. */
+void inflight_unwatch(inflight_map_t *map, inflight_t *f, int fd);
+
+
+#endif  /* INFLIGHT_H */
@@ -0,0 +1,362 @@
+#include <string.h>             /* memset, strcmp, strdup, strlen */
+
+#include "hash.h"
+#include "memcache.h"
+#include "printl.h"
+
+
+/* Keys are URLs clients pick, so the hash is seeded as in hashmap.c. */
+static inline size_t memcache_index(const memcache_t *mc, const char *key)
+{
+    return hash64(key, strlen(key), hash_seed()) % mc->bucket_size;
+}
+
+
+/* Return the smallest slab class with chunks of at least `len' bytes. */
+static unsigned memcache_class_for(const memcache_t *mc, size_t len)
+{
+    unsigned cls = 0;
+
+    while (cls < mc->nclasses && mc->cls[cls].chunk_size < len)
+        cls++;
+
+    return cls;
+}
+
+
+/* Return the index of the page holding `chunk'. */
+static unsigned memcache_page_of(const memcache_t *mc, const char *chunk)
+{
+    unsigned p = 0;
+
+    while (chunk < mc->pages[p].base ||
+           chunk >= mc->pages[p].base + MEMCACHE_PAGE_SIZE)
+        p++;
+
+    return p;
+}
+
+
+static void memcache_ring_insert(memcache_t *mc, memcache_entry_t *e)
+{
+    if (mc->hand == NULL) {
+        e->clock_prev = e->clock_next = e;
+        mc->hand = e;
+        return;
+    }
+
+    /* Just behind the hand, so a new object gets a full lap */
+    e->clock_next = mc->hand;
+    e->clock_prev = mc->hand->clock_prev;
+    e->clock_prev->clock_next = e;
+    mc->hand->clock_prev = e;
+}
+
+
+static void memcache_ring_remove(memcache_t *mc, memcache_entry_t *e)
+{
+    if (e->clock_next == e) {
+        mc->hand = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (mc->hand == e)
+            mc->hand = e->clock_next;
+    }
+
+    e->clock_prev = e->clock_next = NULL;
+}
+
+
+/* Return an entry's chunk to its class and free it. */
+static void memcache_entry_free(memcache_t *mc, memcache_entry_t *e)
+{
+    memcache_class_t *cls = &mc->cls[e->cls];
+
+    *(char **)e->data = cls->free;
+    cls->free = e->data;
+    mc->pages[e->page].nused--;
+
+    free(e->key);
+    free(e);
+}
+
+
+/* Remove an entry from the map and drop the map's reference. */
+static void memcache_unlink(memcache_t *mc, memcache_entry_t *e)
+{
+    memcache_entry_t **link = &mc->bucket[memcache_index(mc, e->key)];
+
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+    e->next = NULL;
+
+    memcache_ring_remove(mc, e);
+    mc->size--;
+    mc->bytes -= e->len;
+
+    if (--e->refs == 0)
+        memcache_entry_free(mc, e);
+}
+
+
+/* Carve empty page `p' into chunks for `cls', taking it from its old class. */
+static void memcache_page_carve(memcache_t *mc, size_t p, unsigned cls)
+{
+    memcache_page_t *page = &mc->pages[p];
+    size_t size = mc->cls[cls].chunk_size;
+    char **link;
+
+    if (page->cls != cls) {
+        /* Every chunk of an empty page is on its old class's free list */
+        link = &mc->cls[page->cls].free;
+        while (*link != NULL) {
+            if (*link >= page->base && *link < page->base + MEMCACHE_PAGE_SIZE)
+                *link = *(char **)*link;
+            else
+                link = (char **)*link;
+        }
+    } else if (mc->cls[cls].free != NULL) {
+        return;                 /* its chunks are already free for `cls' */
+    }
+
+    page->cls = cls;
+    for (size_t off = 0; off + size <= MEMCACHE_PAGE_SIZE; off += size) {
+        *(char **)(page->base + off) = mc->cls[cls].free;
+        mc->cls[cls].free = page->base + off;
+    }
+}
+
+
+/* Allocate a new page for `cls'. Return -1 if over budget or OOM. */
+static int memcache_grow(memcache_t *mc, unsigned cls)
+{
+    memcache_page_t *page = &mc->pages[mc->npages];
+
+    if (mc->npages == mc->max_pages)
+        return -1;
+
+    if ((page->base = malloc(MEMCACHE_PAGE_SIZE)) == NULL)
+        return -1;
+
+    page->cls = cls;
+    page->nused = 0;
+    memcache_page_carve(mc, mc->npages++, cls);
+
+    return 0;
+}
+
+
+/*
+ * Advance the CLOCK hand, evicting cold objects until one frees a chunk of
+ * `cls' or empties a page that can be recarved for it. Return 0 or -1.
+ */
+static int memcache_evict(memcache_t *mc, unsigned cls)
+{
+    memcache_entry_t *e;
+    unsigned page;
+
+    /* Two laps clear every CLOCK bit, so only borrowed objects survive */
+    for (size_t n = 2 * mc->size; n && (e = mc->hand); n--) {
+        mc->hand = e->clock_next;
+
+        if (e->referenced) {
+            e->referenced = false;
+            continue;
+        } else if (e->refs > 1) {
+            continue;           /* being sent, so it can't be freed */
+        }
+
+        printl(LOG_DEBUG "Memory cache evicting %s\n", e->key);
+        page = e->page;
+        memcache_unlink(mc, e);
+        mc->evictions++;
+
+        if (mc->pages[page].nused == 0)
+            memcache_page_carve(mc, page, cls);
+        if (mc->cls[cls].free != NULL)
+            return 0;
+    }
+
+    return -1;
+}
+
+
+int memcache_init(memcache_t *mc, size_t max_bytes, size_t max_object)
+{
+    size_t size = MEMCACHE_MIN_CHUNK;
+
+    memset(mc, 0, sizeof(memcache_t));
+
+    if (max_object > MEMCACHE_PAGE_SIZE)
+        max_object = MEMCACHE_PAGE_SIZE;
+
+    mc->max_object = max_object;
+    mc->max_pages = max_bytes / MEMCACHE_PAGE_SIZE;
+    mc->bucket_size = MEMCACHE_BUCKETS;
+    mc->bucket = calloc(mc->bucket_size, sizeof(memcache_entry_t *));
+    mc->pages = calloc(mc->max_pages + 1, sizeof(memcache_page_t));
+    if (mc->bucket == NULL || mc->pages == NULL) {
+        free(mc->bucket);
+        free(mc->pages);
+        return -1;
+    }
+
+    /* Chunk sizes grow by 1.25x (8 byte aligned), ending at max_object */
+    while (mc->nclasses < MEMCACHE_MAX_CLASSES - 1 && size < max_object) {
+        mc->cls[mc->nclasses++].chunk_size = size;
+        size = ((size * 5 / 4) + 7) & ~(size_t)7;
+    }
+
+    /* Free chunks link through their first bytes, so none is smaller */
+    if (max_object < MEMCACHE_MIN_CHUNK)
+        max_object = MEMCACHE_MIN_CHUNK;
+    mc->cls[mc->nclasses++].chunk_size = max_object;
+
+    return pthread_mutex_init(&mc->lock, NULL) ? -1 : 0;
+}
+
+
+void memcache_destroy(memcache_t *mc)
+{
+    memcache_entry_t *e, *next;
+
+    for (size_t i = 0; i < mc->bucket_size; i++) {
+        for (e = mc->bucket[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->key);
+            free(e);
+        }
+    }
+
+    for (size_t i = 0; i < mc->npages; i++)
+        free(mc->pages[i].base);
+
+    free(mc->pages);
+    free(mc->bucket);
+    pthread_mutex_destroy(&mc->lock);
+}
+
+
+memcache_entry_t *memcache_get(memcache_t *mc, const char *key)
+{
+    memcache_entry_t *e;
+
+    pthread_mutex_lock(&mc->lock);
+
+    e = mc->bucket[memcache_index(mc, key)];
+    while (e != NULL && strcmp(e->key, key))
+        e = e->next;
+
+    if (e) {
+        e->referenced = true;
+        e->refs++;
+        mc->hits++;
+    } else {
+        mc->misses++;
+    }
+
+    pthread_mutex_unlock(&mc->lock);
+
+    return e;
+}
+
+
+void memcache_release(memcache_t *mc, memcache_entry_t *entry)
+{
+    pthread_mutex_lock(&mc->lock);
+
+    if (--entry->refs == 0)
+        memcache_entry_free(mc, entry);
+
+    pthread_mutex_unlock(&mc->lock);
+}
+
+
+memcache_entry_t *memcache_reserve(memcache_t *mc, const char *key,
+                                   size_t len)
+{
+    memcache_entry_t *e;
+    unsigned cls;
+
+    if (len > mc->max_object || mc->max_pages == 0)
+        return NULL;
+
+    if ((e = calloc(1, sizeof(memcache_entry_t))) == NULL)
+        return NULL;
+
+    if ((e->key = strdup(key)) == NULL) {
+        free(e);
+        return NULL;
+    }
+
+    cls = memcache_class_for(mc, len);
+
+    pthread_mutex_lock(&mc->lock);
+
+    if (mc->cls[cls].free == NULL && memcache_grow(mc, cls) == -1)
+        memcache_evict(mc, cls);
+
+    if ((e->data = mc->cls[cls].free) != NULL) {
+        mc->cls[cls].free = *(char **)e->data;
+        e->page = memcache_page_of(mc, e->data);
+        mc->pages[e->page].nused++;
+    }
+
+    pthread_mutex_unlock(&mc->lock);
+
+    if (e->data == NULL) {
+        free(e->key);
+        free(e);
+        return NULL;
+    }
+
+    e->len = len;
+    e->cls = cls;
+    e->refs = 1;
+
+    return e;
+}
+
+
+void memcache_publish(memcache_t *mc, memcache_entry_t *entry)
+{
+    memcache_entry_t *old;
+    size_t index = memcache_index(mc, entry->key);
+
+    pthread_mutex_lock(&mc->lock);
+
+    old = mc->bucket[index];
+    while (old != NULL && strcmp(old->key, entry->key))
+        old = old->next;
+
+    if (old)
+        memcache_unlink(mc, old);
+
+    entry->next = mc->bucket[index];
+    mc->bucket[index] = entry;
+    memcache_ring_insert(mc, entry);
+    entry->refs++;
+    mc->size++;
+    mc->bytes += entry->len;
+
+    pthread_mutex_unlock(&mc->lock);
+}
+
+
+void memcache_del(memcache_t *mc, const char *key)
+{
+    memcache_entry_t *e;
+
+    pthread_mutex_lock(&mc->lock);
+
+    e = mc->bucket[memcache_index(mc, key)];
+    while (e != NULL && strcmp(e->key, key))
+        e = e->next;
+
+    if (e)
+        memcache_unlink(mc, e);
+
+    pthread_mutex_unlock(&mc->lock);
+}
@@ -0,0 +1,95 @@
+#ifndef MEMCACHE_H
+#define MEMCACHE_H
+
+#include <pthread.h>            /* pthread_mutex_* */
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+#include <time.h>               /* time_t */
+
+#define MEMCACHE_BUCKETS 1024   /* key hash buckets */
+#define MEMCACHE_PAGE_SIZE (1024 * 1024) /* slab page, carved into chunks */
+#define MEMCACHE_MIN_CHUNK 64   /* chunk size of the smallest slab class */
+#define MEMCACHE_MAX_CLASSES 64 /* chunk sizes grow by 1.25x up to a page */
+
+
+/* A cached object. Its bytes stay valid while the caller holds a reference. */
+typedef struct memcache_entry {
+    struct memcache_entry *next; /* next entry in the bucket */
+    struct memcache_entry *clock_prev, *clock_next; /* CLOCK ring */
+    char *key;                  /* heap-allocated key */
+    char *data;                 /* slab chunk holding the object */
+    size_t len;                 /* object size */
+    time_t mtime;               /* caller's timestamp, set before publishing */
+    unsigned cls;               /* slab class data was carved from */
+    unsigned page;              /* slab page data was carved from */
+    unsigned refs;              /* borrowers, plus one while in the map */
+    bool referenced;            /* CLOCK bit - hit since the hand passed */
+} memcache_entry_t;
+
+/* Chunks of one size. */
+typedef struct memcache_class {
+    size_t chunk_size;          /* bytes per chunk */
+    char *free;                 /* free chunks, linked through their start */
+} memcache_class_t;
+
+/* A slab page, carved into chunks of one class. */
+typedef struct memcache_page {
+    char *base;                 /* MEMCACHE_PAGE_SIZE bytes */
+    unsigned cls;               /* class the page is carved for */
+    size_t nused;               /* chunks holding objects */
+} memcache_page_t;
+
+/*
+ * A byte-budgeted RAM tier of small objects in front of the disk cache.
+ *
+ * Objects live in slab pages carved into size classes. When a class has no
+ * free chunk and the budget allows no new page, the CLOCK hand evicts
+ * objects that haven't been hit since it last passed them, until one frees
+ * a chunk of the class or empties a whole page to recarve for it.
+ */
+typedef struct memcache {
+    memcache_entry_t **bucket;  /* entries hashed by key */
+    size_t bucket_size;         /* size of the "bucket" array */
+    memcache_class_t cls[MEMCACHE_MAX_CLASSES];
+    unsigned nclasses;          /* slab classes in use */
+    memcache_page_t *pages;     /* slab pages allocated so far */
+    size_t npages;              /* number of pages allocated */
+    memcache_entry_t *hand;     /* CLOCK hand or NULL if the cache is empty */
+    size_t max_pages;           /* pages the byte budget allows */
+    size_t max_object;          /* largest object kept */
+    size_t size;                /* number of objects held */
+    size_t bytes;               /* object bytes held */
+    unsigned long hits, misses, evictions;
+    pthread_mutex_t lock;       /* cache lock for multithreading support */
+} memcache_t;
+
+/*
+ * Initialize a cache of up to `max_bytes' of slab pages holding objects of up
+ * to `max_object' bytes (at most a page). Pages are allocated as they fill.
+ * Return -1 for OOM.
+ */
+int memcache_init(memcache_t *mc, size_t max_bytes, size_t max_object);
+/* Free every object and page. Nothing may still be borrowed. */
+void memcache_destroy(memcache_t *mc);
+/*
+ * Return the object stored under `key' with a reference the caller must drop
+ * with memcache_release(), or NULL if there is none.
+ */
+memcache_entry_t *memcache_get(memcache_t *mc, const char *key);
+/* Drop a reference from memcache_get() or memcache_reserve(). */
+void memcache_release(memcache_t *mc, memcache_entry_t *entry);
+/*
+ * Return space for a `len' byte object for `key', evicting cold objects if
+ * needed, or NULL if it is too large or nothing can be evicted. The caller
+ * fills in `data' and holds a reference to the entry, which isn't visible
+ * to memcache_get() until memcache_publish().
+ */
+memcache_entry_t *memcache_reserve(memcache_t *mc, const char *key,
+                                   size_t len);
+/* Make a reserved entry visible, replacing any older object for its key. */
+void memcache_publish(memcache_t *mc, memcache_entry_t *entry);
+/* Drop the object stored under `key', if any. */
+void memcache_del(memcache_t *mc, const char *key);
+
+
+#endif  /* MEMCACHE_H */
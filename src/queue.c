@@ -3,16 +3,45 @@
 #include "queue.h"
 
 
-void queue_put(queue_t *q, queue_type_t item)
+/* Store `item' in a slot already reserved on the `full' semaphore. */
+static inline void queue_insert(queue_t *q, queue_type_t item)
 {
-    queue_wait_if_full(q);
     pthread_mutex_lock(&q->lock);
     q->buffer[q->in_idx] = item;
     q->in_idx = (q->in_idx + 1) % q->buffer_size;
     q->size++;
+    assert(q->size <= q->buffer_size);
     pthread_mutex_unlock(&q->lock);
     queue_signal_available(q);
-    assert(q->size <= q->buffer_size);
+}
+
+
+void queue_put(queue_t *q, queue_type_t item)
+{
+    queue_wait_if_full(q);
+    queue_insert(q, item);
+}
+
+
+int queue_timed_put(queue_t *q, queue_type_t item, unsigned int secs)
+{
+    if (queue_timed_wait_if_full(q, secs) == -1)
+        return -1;
+
+    queue_insert(q, item);
+
+    return 0;
+}
+
+
+int queue_try_put(queue_t *q, queue_type_t item)
+{
+    if (queue_reserve_if_not_full(q) == -1)
+        return -1;
+
+    queue_insert(q, item);
+
+    return 0;
 }
 
 
@@ -20,8 +49,9 @@ queue_type_t queue_get(queue_t *q)
 {
     queue_type_t item;
 
-    assert(q->size > 0);
+    queue_wait_if_empty(q);
     pthread_mutex_lock(&q->lock);
+    assert(q->size > 0);
     item = q->buffer[q->out_idx];
     q->out_idx = (q->out_idx + 1) % q->buffer_size;
     q->size--;
@@ -32,20 +62,27 @@ queue_type_t queue_get(queue_t *q)
 }
 
 
-void queue_init(queue_t *q, size_t qsize)
+int queue_init(queue_t *q, size_t qsize)
 {
     q->buffer_size = qsize;
     q->size = 0;
     q->in_idx = 0;
     q->out_idx = 0;
 
+    if (!qsize)
+        return -1;
+
+    q->buffer = malloc(qsize * sizeof(queue_type_t));
+    if (q->buffer == NULL)      /* out of memory */
+        return -1;
+
     int pshared = 0;            /* share between threads, but not processes */
     sem_init(&q->full, pshared, qsize);
     sem_init(&q->empty, pshared, 0);
 
     pthread_mutex_init(&q->lock, NULL);
 
-    q->buffer = malloc(qsize * sizeof(int));
+    return 0;
 }
 
 
@@ -1,14 +1,14 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <errno.h>              /* errno, EINTR */
 #include <pthread.h>            /* pthread_* */
 #include <semaphore.h>          /* sem_* */
 #include <stdlib.h>             /* size_t */
+#include <time.h>               /* clock_gettime, struct timespec */
 
-#include "request.h"
 
-
-typedef request_t queue_type_t;
+typedef int queue_type_t;       /* accepted client socket fds */
 
 typedef struct queue {
     size_t buffer_size;         /* max number elements buffer can hold */
@@ -20,21 +20,52 @@ typedef struct queue {
     queue_type_t *buffer;       /* internal storage */
 } queue_t;
 
+/* Add `item' to the queue, blocking while the queue is full. */
 void queue_put(queue_t *q, queue_type_t item);
+/*
+ * Add `item' to the queue, blocking at most `secs' seconds while the queue is
+ * full. Return 0, or -1 if the wait timed out or was interrupted by a signal.
+ */
+int queue_timed_put(queue_t *q, queue_type_t item, unsigned int secs);
+/* Add `item' to the queue if there is room. Return 0 or -1 if full. */
+int queue_try_put(queue_t *q, queue_type_t item);
+/* Remove and return the oldest item, blocking while the queue is empty. */
 queue_type_t queue_get(queue_t *q);
-void queue_init(queue_t *q, size_t qsize);
+/* Initialize a queue holding at most `qsize' items. Return -1 for OOM. */
+int queue_init(queue_t *q, size_t qsize);
 void queue_destroy(queue_t *q);
 
 
 static inline void queue_wait_if_empty(queue_t* q)
 {
-    sem_wait(&q->empty);
+    while (sem_wait(&q->empty) == -1 && errno == EINTR)
+        ;
 }
 
 
 static inline void queue_wait_if_full(queue_t *q)
 {
-    sem_wait(&q->full);
+    while (sem_wait(&q->full) == -1 && errno == EINTR)
+        ;
+}
+
+
+/* Return 0 if a slot was reserved or -1 on timeout or signal. */
+static inline int queue_timed_wait_if_full(queue_t *q, unsigned int secs)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += secs;
+
+    return sem_timedwait(&q->full, &deadline);
+}
+
+
+/* Return 0 if a slot was reserved or -1 if the queue is full. */
+static inline int queue_reserve_if_not_full(queue_t *q)
+{
+    return sem_trywait(&q->full);
 }
 
 
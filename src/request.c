@@ -1,7 +1,10 @@
 #include <arpa/inet.h>          /* inet_addr */
 #include <assert.h>             /* assert */
+#include <ctype.h>              /* isdigit */
 #include <errno.h>              /* errno */
-#include <netdb.h>              /* gethostbyname */
+#include <limits.h>             /* ULLONG_MAX */
+#include <netdb.h>              /* getaddrinfo */
+#include <stdio.h>              /* sprintf */
 #include <string.h>             /* str* */
 #include <sys/socket.h>         /* struct sockaddr */
 #include <unistd.h>             /* read */
@@ -10,6 +13,9 @@
 #include "request.h"
 
 
+hashmap_t hostname_cache;
+
+
 int request_read(request_t *req)
 {
     int nrecv, nrecvd, nunparsed;
@@ -33,6 +39,8 @@ int request_read(request_t *req)
         printl(LOG_DEBUG "[%d] Connection closed while reading request\n", id);
         if (nrecvd == 0 && nunparsed == REQ_BUFLEN) {
             return 431;         /* Request Header Fields Too Large Error */
+        } else if (nrecvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            printl(LOG_DEBUG "[%d] Timed out reading request\n", id);
         } else if (nrecvd == -1) {
             printl(LOG_WARN "[%d] request read - %s\n", id, strerror(errno));
             return 500;         /* Internal Server Error */
@@ -117,6 +125,21 @@ int request_deserialize_line(request_t *req, const char *cline)
             req->connection = strdup(value);
         else if (!strcasecmp(key, "content-length:"))
             req->content_length = strdup(value);
+        else if (!strcasecmp(key, "accept-encoding:")) {
+            free(req->accept_encoding);
+            req->accept_encoding = strdup(value);
+        }
+        else if (!strcasecmp(key, "range:")) {
+            free(req->range);
+            req->range = strdup(value);
+        }
+        else if (!strcasecmp(key, "if-range:")) {
+            free(req->if_range);
+            req->if_range = strdup(value);
+        }
+        else if (!strcasecmp(key, "if-none-match:") ||
+                 !strcasecmp(key, "if-modified-since:"))
+            req->conditional = true;
     }
 
     free(line);
@@ -124,11 +147,158 @@ int request_deserialize_line(request_t *req, const char *cline)
 }
 
 
+int request_add_field(request_t *req, const char *name, const char *value)
+{
+    size_t len = strlen(name) + strlen(value) + 4; /* ": " and "\r\n" */
+    char *raw;
+
+    assert(req->complete && req->raw_len >= 4);
+
+    if ((raw = realloc(req->raw, req->raw_len + len + 1)) == NULL)
+        return -1;
+
+    /* Insert before the blank line that ends the header */
+    sprintf(raw + req->raw_len - 2, "%s: %s\r\n\r\n", name, value);
+    req->raw = raw;
+    req->raw_len += len;
+    req->raw_buffer_sz = req->raw_len + 1;
+
+    return 0;
+}
+
+
+int request_del_field(request_t *req, const char *name)
+{
+    size_t len = strlen(name);
+    char *line, *end;
+    int ndel = 0;
+
+    assert(req->complete);
+
+    /* Step over the request line - the header ends at the blank line */
+    line = strstr(req->raw, "\r\n") + 2;
+    while ((end = strstr(line, "\r\n")) != NULL && end != line) {
+        if (!strncasecmp(line, name, len) && line[len] == ':') {
+            memmove(line, end + 2, req->raw + req->raw_len + 1 - (end + 2));
+            req->raw_len -= end + 2 - line;
+            ndel++;
+        } else {
+            line = end + 2;
+        }
+    }
+
+    return ndel;
+}
+
+
+bool request_accepts(const request_t *req, const char *coding)
+{
+    const char *p = req->accept_encoding, *end, *param;
+    size_t len, coding_len = strlen(coding);
+    double q, star = 0;
+
+    while (p && *p) {
+        p += strspn(p, ", \t");
+        len = strcspn(p, ",; \t");
+        end = p + strcspn(p, ",");
+
+        q = 1;
+        if ((param = memchr(p, ';', end - p)) != NULL) {
+            param += 1 + strspn(param + 1, " \t");
+            if (!strncasecmp(param, "q=", 2))
+                q = strtod(param + 2, NULL);
+        }
+
+        /* The coding's own entry beats a "*" one */
+        if (len == coding_len && !strncasecmp(p, coding, len))
+            return q > 0;
+        if (len == 1 && *p == '*')
+            star = q;
+
+        p = end;
+    }
+
+    return star > 0;
+}
+
+
+int request_ranges(const request_t *req, size_t len, byte_range_t *ranges)
+{
+    const char *p = req->range;
+    char *end;
+    unsigned long long first, last;
+    size_t total = 0;
+    int n = 0, nspecs = 0;
+
+    /* Range units other than bytes are ignored (RFC 7233 3.1) */
+    if (p == NULL || strncasecmp(p, "bytes=", 6))
+        return 0;
+
+    for (p += 6; *p; nspecs++) {
+        p += strspn(p, ", \t");
+        if (*p == '\0')
+            break;
+
+        if (*p == '-') {
+            /* A suffix: the last N bytes */
+            if (!isdigit((unsigned char)*++p))
+                return 0;
+            last = strtoull(p, &end, 10);
+            if (last == 0 || len == 0) {
+                first = 1;      /* unsatisfiable */
+                last = 0;
+            } else {
+                first = last < len ? len - last : 0;
+                last = len - 1;
+            }
+        } else {
+            if (!isdigit((unsigned char)*p))
+                return 0;
+            first = strtoull(p, &end, 10);
+            if (*end++ != '-')
+                return 0;
+            last = ULLONG_MAX;
+            if (isdigit((unsigned char)*end))
+                last = strtoull(end, &end, 10);
+            if (last < first)
+                return 0;
+            if (last >= len)
+                last = len - 1;
+        }
+
+        p = end + strspn(end, " \t");
+        if (*p != ',' && *p != '\0')
+            return 0;
+
+        if (first > last || first >= len)
+            continue;           /* unsatisfiable, but others may be */
+
+        /* Overlapping or many small ranges could cost more than the body */
+        total += last - first + 1;
+        if (n == REQ_RANGES_MAX || total > len)
+            return 0;
+
+        ranges[n].first = first;
+        ranges[n].last = last;
+        n++;
+    }
+
+    if (nspecs == 0)
+        return 0;
+
+    return n ? n : -1;
+}
+
+
 int request_lookup_host(request_t *req)
 {
     char *ip, *msg;
-    struct hostent *hostinfo;
+    char ipbuf[INET_ADDRSTRLEN];
+    const hashmap_entry_t *cached;
+    struct addrinfo *info;
+    struct addrinfo hints = { 0 };
     struct in_addr ip_addr;
+    int rval;
     int id = req->thread_id;
 
     if (inet_aton(req->url->host, &ip_addr) == 1) {
@@ -137,22 +307,27 @@ int request_lookup_host(request_t *req)
         return 1;
     }
 
-    if (hashmap_get(&hostname_cache, req->url->host, &ip) != -1) {
+    if ((cached = hashmap_borrow(&hostname_cache, req->url->host))) {
         /* Cache hit */
         msg = LOG_DEBUG "[%d] Host %s -> %s - cache hit\n";
-        printl(msg, id, req->url->host, ip);
-        req->url->ip = strdup(ip);
-        free(ip);
+        printl(msg, id, req->url->host, cached->value);
+        req->url->ip = strdup(cached->value);
+        hashmap_release(cached);
         return 1;
     }
 
-    if ((hostinfo = gethostbyname(req->url->host)) == NULL) {
+    /* getaddrinfo is reentrant, so threads and event loops can share it */
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rval = getaddrinfo(req->url->host, NULL, &hints, &info)) != 0) {
         msg = LOG_DEBUG "[%d] Couldn't resolve %s - %s\n";
-        printl(msg, id, req->url->host, hstrerror(h_errno));
+        printl(msg, id, req->url->host, gai_strerror(rval));
         return -1;
     }
 
-    ip = inet_ntoa(*(struct in_addr *)hostinfo->h_addr);
+    ip_addr = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
+    ip = (char *)inet_ntop(AF_INET, &ip_addr, ipbuf, sizeof(ipbuf));
+    freeaddrinfo(info);
     msg = LOG_DEBUG "[%d] Host lookup %s -> %s - cache miss\n";
     printl(msg, id, req->url->host, ip);
     hashmap_add(&hostname_cache, req->url->host, ip);
@@ -183,6 +358,9 @@ void request_destroy(request_t *req)
         free(req->connection);
     if (req->content_length)
         free(req->content_length);
+    free(req->accept_encoding);
+    free(req->range);
+    free(req->if_range);
     if (req->url) {
         if (req->url->full)     /* verify url initialized */
             url_destroy(req->url);
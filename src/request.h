@@ -10,6 +10,7 @@
 #include "url.h"
 
 #define REQ_BUFLEN 1000
+#define REQ_RANGES_MAX 16       /* byte ranges honored in one Range */
 
 
 typedef struct request {
@@ -26,9 +27,20 @@ typedef struct request {
     char *http_version;         /* status line HTTP version (e.g., HTTP/1.1) */
     char *content_length;       /* HTTP Content-Length value */
     char *connection;           /* HTTP Connection value (e.g., keep-alive) */
+    char *accept_encoding;      /* HTTP Accept-Encoding value or NULL */
+    char *range;                /* HTTP Range value or NULL */
+    char *if_range;             /* HTTP If-Range value or NULL */
+    bool conditional;           /* client sent If-None-Match/-Modified-Since */
+    bool revalidating;          /* proxy added validators of a stale copy */
 } request_t;
 
-hashmap_t hostname_cache;
+/* Bytes `first' through `last' (inclusive) of a representation. */
+typedef struct byte_range {
+    size_t first;
+    size_t last;
+} byte_range_t;
+
+extern hashmap_t hostname_cache;
 
 void request_init(request_t *req, int fd, const struct sockaddr_in *addr);
 void request_destroy(request_t *req);
@@ -38,6 +50,25 @@ int request_read(request_t *req);
 int request_deserialize(request_t *req, char *buf, size_t buflen);
 /* Return -1 for parse error or 0 for success. */
 int request_deserialize_line(request_t *req, const char *line);
+/*
+ * Append the header field `name: value' to a complete request's raw buffer.
+ * Return 0 or -1 for OOM.
+ */
+int request_add_field(request_t *req, const char *name, const char *value);
+/*
+ * Remove every `name' field from a complete request's raw buffer. Return how
+ * many were removed.
+ */
+int request_del_field(request_t *req, const char *name);
+/* Return true if the request's Accept-Encoding takes `coding'. */
+bool request_accepts(const request_t *req, const char *coding);
+/*
+ * Resolve the request's Range against a representation `len' bytes long
+ * into `ranges' (REQ_RANGES_MAX of them). Return how many, 0 if the whole
+ * representation should be sent (no Range, a malformed one, or one asking
+ * for more ranges or bytes than that), or -1 if no range is satisfiable.
+ */
+int request_ranges(const request_t *req, size_t len, byte_range_t *ranges);
 /*
  * Return -1 for invalid host, 0 for cache miss, and 1 for cache hit.
  *
@@ -1,9 +1,13 @@
+#define _GNU_SOURCE             /* strptime, timegm */
+
 #include <assert.h>             /* assert */
+#include <ctype.h>              /* isspace */
 #include <errno.h>              /* errno */
+#include <stdint.h>             /* SIZE_MAX */
 #include <stdio.h>              /* sprintf */
 #include <stdlib.h>             /* size_t */
 #include <string.h>             /* memset, str* */
-#include <time.h>               /* gmtime */
+#include <time.h>               /* gmtime, strptime, timegm */
 #include <unistd.h>             /* read */
 
 #include "printl.h"
@@ -12,16 +16,56 @@
 
 
 const char response_date_fmt[] = "%a, %d %b %Y %H:%M:%S %Z";
+const char response_date_parse_fmt[] = "%a, %d %b %Y %H:%M:%S GMT";
 const char response_server[] = "toyproxy";
+/* Fields serialized after the fixed ones when a response has them. */
+const char *response_optional_fields[RESPONSE_OPTIONAL_FIELDS] = {
+    "Content-Type",
+    "Content-Length",
+    "Age"
+};
+/*
+ * Fields a cache doesn't store with an object: hop-by-hop fields, which only
+ * concern the connection they came over, and those a hit sets afresh.
+ */
+const char *response_unstored_fields[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "Proxy-Connection",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+    "Date",
+    "Age",
+    "Content-Length",
+    NULL
+};
+/* Content types worth gzipping: text formats, which compress well. */
+const char *response_compressible_types[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/xhtml+xml",
+    "image/svg+xml",
+    NULL
+};
 const char response_version_1_0[] = "HTTP/1.0";
 const char response_version_1_1[] = "HTTP/1.1";
 const char response_success_200[] = "200 Success";
+const char response_success_206[] = "206 Partial Content";
 const char response_client_error_400[] = "400 Bad Request";
 const char response_client_error_403[] = "403 Forbidden";
 const char response_client_error_404[] = "404 Not Found";
 const char response_client_error_405[] = "405 Method Not Allowed";
+const char response_client_error_416[] = "416 Range Not Satisfiable";
 const char response_client_error_431[] = "431 Request Header Fields Too Large";
 const char response_server_error_500[] = "500 Internal Server Error";
+const char response_server_error_503[] = "503 Service Unavailable";
+const char response_server_error_504[] = "504 Gateway Timeout";
 const char error_500[] = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
 
 
@@ -67,31 +111,33 @@ int response_read(response_t *res, int fd)
 int response_serialize(response_t *res, char **buf, size_t *buflen)
 {
     int rval;
-    char *status, *server, *date, *conn, *content_type, *content_length;
-    char *msg, *fmt;
+    char *status, *msg, *fmt;
+    const char *conn;
+    const hashmap_entry_t *server, *date, *connection;
+    const hashmap_entry_t *optional[RESPONSE_OPTIONAL_FIELDS];
     size_t nbytes = 0;
     int id = res->thread_id;
 
+    /* The fields are borrowed, not copied, until the response is built */
     status = res->header.status_line;
-    hashmap_get(&res->header.fields, "Date", &date);
-    hashmap_get(&res->header.fields, "Server", &server);
-    hashmap_get(&res->header.fields, "Connection", &conn);
-    hashmap_get(&res->header.fields, "Content-Type", &content_type);
-    hashmap_get(&res->header.fields, "Content-Length", &content_length);
+    date = hashmap_borrow(&res->header.fields, "Date");
+    server = hashmap_borrow(&res->header.fields, "Server");
+    connection = hashmap_borrow(&res->header.fields, "Connection");
+    for (int i = 0; i < RESPONSE_OPTIONAL_FIELDS; i++)
+        optional[i] = hashmap_borrow(&res->header.fields,
+                                     response_optional_fields[i]);
 
-    if (conn == NULL)
-        conn = strdup("close");
+    conn = connection ? connection->value : "close";
 
     /* Precalculate size of response header (line + 2 for \r\n) */
     nbytes += strlen(status) + 2;
-    nbytes += 8 + strlen(server) + 2;
-    nbytes += 6 + strlen(date) + 2;
+    nbytes += 8 + strlen(server->value) + 2;
+    nbytes += 6 + strlen(date->value) + 2;
     nbytes += 12 + strlen(conn) + 2;
-    if (content_type)
-        nbytes += 14 + strlen(content_type) + 2;
-    if (content_length) {
-        nbytes += 16 + strlen(content_length) + 2;
-    }
+    for (int i = 0; i < RESPONSE_OPTIONAL_FIELDS; i++)
+        if (optional[i])
+            nbytes += strlen(response_optional_fields[i]) + 2 +
+                strlen(optional[i]->value) + 2;
     nbytes += 2;                /* end of header \r\n */
 
     /* Try to allocate enough memory to serialize this response */
@@ -99,15 +145,13 @@ int response_serialize(response_t *res, char **buf, size_t *buflen)
     if (*buf) {
         /* Build response buffer */
         fmt = "%s\r\nServer: %s\r\nDate: %s\r\nConnection: %s\r\n";
-        sprintf(*buf, fmt, status, server, date, conn);
-        if (content_type) {
-            strcat(*buf, "Content-Type: ");
-            strcat(*buf, content_type);
-            strcat(*buf, "\r\n");
-        }
-        if (content_length) {
-            strcat(*buf, "Content-Length: ");
-            strcat(*buf, content_length);
+        sprintf(*buf, fmt, status, server->value, date->value, conn);
+        for (int i = 0; i < RESPONSE_OPTIONAL_FIELDS; i++) {
+            if (optional[i] == NULL)
+                continue;
+            strcat(*buf, response_optional_fields[i]);
+            strcat(*buf, ": ");
+            strcat(*buf, optional[i]->value);
             strcat(*buf, "\r\n");
         }
         strcat(*buf, "\r\n");       /* end of header */
@@ -124,11 +168,11 @@ int response_serialize(response_t *res, char **buf, size_t *buflen)
     }
 
     /* Clean up */
-    free(date);
-    free(server);
-    free(conn);
-    free(content_type);
-    free(content_length);
+    hashmap_release(date);
+    hashmap_release(server);
+    hashmap_release(connection);
+    for (int i = 0; i < RESPONSE_OPTIONAL_FIELDS; i++)
+        hashmap_release(optional[i]);
 
     return nbytes;
 }
@@ -137,7 +181,7 @@ int response_serialize(response_t *res, char **buf, size_t *buflen)
 int response_deserialize(response_t* res, char* buf, size_t buflen)
 {
     const char *bufcur = buf;     /* work on a const str until the end */
-    char *line, *key, *value, *clen, *header_end, *line_end;
+    char *line, *key, *value, *header_end, *line_end;
     size_t nunparsed, line_len, line_buffer_sz;
     size_t header_len, expected_content_len, actual_content_len;
     int id = res->thread_id;
@@ -224,12 +268,7 @@ int response_deserialize(response_t* res, char* buf, size_t buflen)
                 res->complete = true;
         } else {
             /* Non-chunked content */
-            expected_content_len = 0;
-            hashmap_get(&res->header.fields, "Content-Length", &clen);
-            if (clen != NULL) {
-                expected_content_len = atoi(clen);
-                free(clen);
-            }
+            expected_content_len = response_content_length(res);
 
             header_len = res->content - res->raw;
             actual_content_len = res->raw_len - header_len;
@@ -242,6 +281,196 @@ int response_deserialize(response_t* res, char* buf, size_t buflen)
 }
 
 
+int response_parse_header(response_t *res, char *buf, size_t *buflen)
+{
+    char *header_end;
+    char saved;
+    size_t header_len, nbody;
+    int nunparsed;
+
+    buf[*buflen] = '\0';
+    if ((header_end = strstr(buf, "\r\n\r\n")) == NULL)
+        return 0;
+
+    header_len = header_end + 4 - buf;
+    nbody = *buflen - header_len;
+
+    /* Parse only the header - the body is streamed, not kept in raw */
+    saved = buf[header_len];
+    buf[header_len] = '\0';
+    nunparsed = response_deserialize(res, buf, header_len);
+    buf[header_len] = saved;
+
+    if (nunparsed != 0 || !res->header.complete)
+        return -1;
+
+    memmove(buf, buf + header_len, nbody);
+    buf[nbody] = '\0';
+    *buflen = nbody;
+
+    return 1;
+}
+
+
+void response_body_init(response_body_t *body, response_t *res)
+{
+    int status = response_status(res);
+
+    memset(body, 0, sizeof(response_body_t));
+
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        body->framing = BODY_LENGTH;    /* never has a body */
+    } else if (response_chunked(res)) {
+        body->framing = BODY_CHUNKED;
+        body->state = CHUNK_SIZE;
+    } else if (hashmap_get(&res->header.fields, "Content-Length", NULL) != -1) {
+        body->framing = BODY_LENGTH;
+        body->remaining = response_content_length(res);
+    } else {
+        body->framing = BODY_UNTIL_CLOSE;
+    }
+
+    body->complete = body->framing == BODY_LENGTH && body->remaining == 0;
+}
+
+
+/* Return the value of hex digit `c' or -1. */
+static inline int hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+
+static ssize_t response_chunked_feed(response_body_t *body, const char *buf,
+                                     size_t len, response_body_sink sink,
+                                     void *arg)
+{
+    size_t i = 0, n;
+    int digit;
+    char c;
+
+    while (i < len && !body->complete) {
+        c = buf[i];
+
+        switch (body->state) {
+        case CHUNK_SIZE:
+            if ((digit = hexval(c)) != -1) {
+                if (body->remaining > (SIZE_MAX >> 4))
+                    return -1;  /* chunk size overflow */
+                body->remaining = (body->remaining << 4) | digit;
+            } else if (c == ';') {
+                body->state = CHUNK_EXT;
+            } else if (c == '\r') {
+                body->state = CHUNK_SIZE_LF;
+            } else {
+                return -1;
+            }
+            i++;
+            break;
+        case CHUNK_EXT:
+            if (c == '\r')
+                body->state = CHUNK_SIZE_LF;
+            i++;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            body->state = body->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_DATA:
+            n = len - i < body->remaining ? len - i : body->remaining;
+            if (sink)
+                sink(arg, buf + i, n);
+            body->remaining -= n;
+            if (!body->remaining)
+                body->state = CHUNK_DATA_CR;
+            i += n;
+            break;
+        case CHUNK_DATA_CR:
+            if (c != '\r')
+                return -1;
+            body->state = CHUNK_DATA_LF;
+            i++;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            body->state = CHUNK_SIZE;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            body->state = c == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n')
+                body->state = CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n')
+                return -1;
+            body->complete = true;
+            i++;
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+ssize_t response_body_feed(response_body_t *body, const char *buf, size_t len,
+                           response_body_sink sink, void *arg)
+{
+    ssize_t nbody;
+
+    if (len == 0) {
+        /* The origin closed - only a close-delimited body ends that way */
+        if (body->framing == BODY_UNTIL_CLOSE)
+            body->complete = true;
+        return 0;
+    }
+
+    if (body->complete) {
+        body->excess = true;
+        return 0;
+    }
+
+    switch (body->framing) {
+    case BODY_LENGTH:
+        nbody = len < body->remaining ? len : body->remaining;
+        if (sink && nbody)
+            sink(arg, buf, nbody);
+        body->remaining -= nbody;
+        body->complete = body->remaining == 0;
+        break;
+    case BODY_CHUNKED:
+        if ((nbody = response_chunked_feed(body, buf, len, sink, arg)) < 0)
+            return -1;
+        break;
+    case BODY_UNTIL_CLOSE:
+    default:
+        nbody = len;
+        if (sink)
+            sink(arg, buf, nbody);
+        break;
+    }
+
+    body->excess = (size_t)nbody < len;
+
+    return nbody;
+}
+
+
 void response_init(response_t *res)
 {
     memset(res, 0, sizeof(response_t));
@@ -284,6 +513,243 @@ void response_init_from_request(const request_t *req, response_t *res,
 }
 
 
+void response_body_advance(response_body_t *body, size_t len)
+{
+    if (body->framing != BODY_LENGTH)
+        return;                 /* a close-delimited body ends at EOF */
+
+    body->remaining -= len < body->remaining ? len : body->remaining;
+    body->complete = body->remaining == 0;
+}
+
+
+time_t response_parse_date(const char *date)
+{
+    struct tm gmt = { 0 };
+    const char *end;
+
+    if (date == NULL ||
+        (end = strptime(date, response_date_parse_fmt, &gmt)) == NULL ||
+        *end != '\0')
+        return -1;
+
+    return timegm(&gmt);
+}
+
+
+bool cache_control_has(const char *cc, const char *directive, long *value)
+{
+    size_t len = strlen(directive);
+    const char *p = cc;
+    char *end;
+
+    while (p && *p) {
+        while (*p == ',' || isspace((unsigned char)*p))
+            p++;
+
+        if (!strncasecmp(p, directive, len) &&
+            (p[len] == '\0' || p[len] == ',' || p[len] == '=' ||
+             isspace((unsigned char)p[len]))) {
+            if (value == NULL)
+                return true;
+            p += len;
+            if (*p++ != '=')
+                return false;   /* a delta-seconds directive with no value */
+            if (*p == '"')
+                p++;
+            *value = strtol(p, &end, 10);
+            return end != p && *value >= 0;
+        }
+
+        p = strchr(p, ',');
+    }
+
+    return false;
+}
+
+
+/* Return true if field `name' is stored, given the response's Connection. */
+static bool response_field_stored(const char *name, const char *conn)
+{
+    for (int i = 0; response_unstored_fields[i]; i++)
+        if (!strcasecmp(name, response_unstored_fields[i]))
+            return false;
+
+    /* Connection names more fields that go no further than this hop */
+    return !cache_control_has(conn, name, NULL);
+}
+
+
+/* Return the value of the field `name' in `res' borrowed as `e', or NULL. */
+static inline const char *response_field(response_t *res, const char *name,
+                                         const hashmap_entry_t **e)
+{
+    *e = hashmap_borrow(&res->header.fields, name);
+
+    return *e ? (*e)->value : NULL;
+}
+
+
+ssize_t response_stored_fields(response_t *res, char *buf, size_t buflen)
+{
+    char name[RESPONSE_FIELD_NAME_MAX];
+    const char *line, *end, *colon, *connection;
+    const hashmap_entry_t *conn;
+    size_t len, nbytes = 0;
+    bool keep = false;
+
+    if (res->raw == NULL || (line = strstr(res->raw, "\r\n")) == NULL)
+        return -1;
+
+    connection = response_field(res, "Connection", &conn);
+
+    /* Step over the Status-Line - the header ends at the empty line */
+    for (line += 2; (end = strstr(line, "\r\n")) && end != line;
+         line = end + 2) {
+        /* A folded line continues the field before it */
+        if (*line != ' ' && *line != '\t') {
+            colon = memchr(line, ':', end - line);
+            keep = colon && (size_t)(colon - line) < sizeof(name);
+            if (keep) {
+                memcpy(name, line, colon - line);
+                name[colon - line] = '\0';
+                keep = response_field_stored(name, connection);
+            }
+        }
+
+        if (!keep)
+            continue;
+
+        len = end + 2 - line;
+        if (nbytes + len > buflen) {
+            hashmap_release(conn);
+            return -1;
+        }
+        memcpy(buf + nbytes, line, len);
+        nbytes += len;
+    }
+
+    hashmap_release(conn);
+
+    return nbytes;
+}
+
+
+/*
+ * Return true if `res' depends on request fields a cache keyed by URL alone
+ * can't tell apart: Vary names any but Accept-Encoding, or it does and `res'
+ * was encoded for the client that asked.
+ */
+static bool response_varies(response_t *res)
+{
+    char *vary, *name, *saveptr;
+    const char *value;
+    const hashmap_entry_t *encoding;
+    bool varies = false, on_encoding = false;
+
+    if (hashmap_get(&res->header.fields, "Vary", &vary) == -1)
+        return false;
+
+    for (name = strtok_r(vary, ", \t", &saveptr); name != NULL;
+         name = strtok_r(NULL, ", \t", &saveptr)) {
+        if (!strcasecmp(name, "Accept-Encoding"))
+            on_encoding = true;
+        else
+            varies = true;      /* including "*" */
+    }
+
+    free(vary);
+
+    if (on_encoding &&
+        (value = response_field(res, "Content-Encoding", &encoding))) {
+        varies = varies || strcasecmp(value, "identity");
+        hashmap_release(encoding);
+    }
+
+    return varies;
+}
+
+
+bool response_compressible(response_t *res)
+{
+    const hashmap_entry_t *content_type, *cache_control;
+    const char *type, *ctype, *cc;
+    bool compressible = false;
+    size_t len;
+
+    if (hashmap_get(&res->header.fields, "Content-Encoding", NULL) != -1)
+        return false;           /* the origin encoded it already */
+
+    ctype = response_field(res, "Content-Type", &content_type);
+    cc = response_field(res, "Cache-Control", &cache_control);
+
+    /* no-transform forbids a proxy to change the content coding */
+    if (ctype && !cache_control_has(cc, "no-transform", NULL)) {
+        for (int i = 0; !compressible && response_compressible_types[i]; i++) {
+            type = response_compressible_types[i];
+            len = strlen(type);
+            compressible = !strncasecmp(ctype, type, len) &&
+                (type[len - 1] == '/' || ctype[len] == '\0' ||
+                 ctype[len] == ';' || isspace((unsigned char)ctype[len]));
+        }
+    }
+
+    hashmap_release(content_type);
+    hashmap_release(cache_control);
+
+    return compressible;
+}
+
+
+long response_ttl(response_t *res, time_t now, long default_ttl, long *age)
+{
+    const hashmap_entry_t *cache_control, *field;
+    const char *cc, *value;
+    time_t date, expires;
+    long lifetime, age_value = 0;
+
+    *age = 0;
+
+    cc = response_field(res, "Cache-Control", &cache_control);
+
+    /* A shared cache may store neither of these, and can't revalidate */
+    if (cache_control_has(cc, "no-store", NULL) ||
+        cache_control_has(cc, "private", NULL) ||
+        cache_control_has(cc, "no-cache", NULL) ||
+        response_varies(res)) {
+        hashmap_release(cache_control);
+        return 0;
+    }
+
+    value = response_field(res, "Date", &field);
+    if ((date = response_parse_date(value)) == -1 || date > now)
+        date = now;
+    hashmap_release(field);
+
+    /* Age is the larger of what upstream caches report and the clock says */
+    if ((value = response_field(res, "Age", &field)) != NULL)
+        age_value = strtol(value, NULL, 10);
+    hashmap_release(field);
+    *age = now - date > age_value ? now - date : age_value;
+
+    if (cache_control_has(cc, "s-maxage", &lifetime) ||
+        cache_control_has(cc, "max-age", &lifetime)) {
+        ;
+    } else if ((value = response_field(res, "Expires", &field)) != NULL) {
+        /* An invalid date, like "0", means already expired */
+        expires = response_parse_date(value);
+        lifetime = expires > date ? expires - date : 0;
+        hashmap_release(field);
+    } else {
+        lifetime = default_ttl;
+    }
+
+    hashmap_release(cache_control);
+
+    return lifetime > *age ? lifetime - *age : 0;
+}
+
+
 void response_destroy(response_t *res)
 {
     if (res->header.status_line)
@@ -303,6 +769,9 @@ char *status_string(int status, char *buf, size_t buflen)
     case 200:
         status_str = response_success_200;
         break;
+    case 206:
+        status_str = response_success_206;
+        break;
     case 400:
         status_str = response_client_error_400;
         break;
@@ -315,15 +784,24 @@ char *status_string(int status, char *buf, size_t buflen)
     case 405:
         status_str = response_client_error_405;
         break;
+    case 416:
+        status_str = response_client_error_416;
+        break;
     case 431:
         status_str = response_client_error_431;
         break;
+    case 503:
+        status_str = response_server_error_503;
+        break;
+    case 504:
+        status_str = response_server_error_504;
+        break;
     default:
         status_str = response_server_error_500;
     }
 
     strncpy(buf, status_str, buflen);
-    buf[buflen] = '\0';
+    buf[buflen - 1] = '\0';
 
     return buf;
 }
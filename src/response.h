@@ -2,12 +2,18 @@
 #define RESPONSE_H
 
 #include <stdio.h>              /* sscanf */
-#include <stdlib.h>             /* size_t */
+#include <stdlib.h>             /* size_t, strtoull */
+#include <sys/types.h>          /* ssize_t */
+#include <time.h>               /* time_t */
 
 #include "hashmap.h"
 #include "request.h"
 
 #define RES_BUFLEN 8000
+#define RESPONSE_OPTIONAL_FIELDS 3 /* see response_optional_fields */
+#define RESPONSE_FIELD_NAME_MAX 64 /* longer field names aren't stored */
+
+extern const char response_date_fmt[]; /* strftime format of an HTTP date */
 
 
 typedef struct response_header {
@@ -28,6 +34,38 @@ typedef struct response {
     size_t content_offset;      /* used to reset content ptr if raw moved */
 } response_t;
 
+/* How the end of a response body is found. */
+typedef enum body_framing {
+    BODY_LENGTH,                /* Content-Length bytes (possibly none) */
+    BODY_CHUNKED,               /* Transfer-Encoding: chunked */
+    BODY_UNTIL_CLOSE            /* everything until the origin closes */
+} body_framing_t;
+
+/* Where a chunked body decoder is within the chunk framing. */
+typedef enum chunk_state {
+    CHUNK_SIZE,                 /* reading hex chunk size */
+    CHUNK_EXT,                  /* skipping a chunk extension */
+    CHUNK_SIZE_LF,              /* expecting \n after the size line */
+    CHUNK_DATA,                 /* inside chunk data */
+    CHUNK_DATA_CR,              /* expecting \r after chunk data */
+    CHUNK_DATA_LF,              /* expecting \n after chunk data */
+    CHUNK_TRAILER,              /* at the start of a trailer line */
+    CHUNK_TRAILER_LINE,         /* skipping a trailer field */
+    CHUNK_TRAILER_LF            /* expecting the final \n */
+} chunk_state_t;
+
+/* Called with each run of decoded body content. */
+typedef void (*response_body_sink)(void *arg, const char *buf, size_t len);
+
+/* Incremental decoder for a response body streamed after its header. */
+typedef struct response_body {
+    body_framing_t framing;     /* how the end of the body is found */
+    chunk_state_t state;        /* chunked decoder state */
+    size_t remaining;           /* bytes left in the body or current chunk */
+    bool complete;              /* the whole body has been seen */
+    bool excess;                /* bytes followed the end of the body */
+} response_body_t;
+
 /* Basic response initialization. */
 void response_init(response_t *res);
 /* Initialize a response directly from webproxy to a given request. */
@@ -35,8 +73,61 @@ void response_init_from_request(const request_t *req, response_t *res,
                                 int status, const char *ctype, size_t clen);
 /* Read socket and build response. */
 int response_read(response_t *res, int fd);
+/*
+ * Parse the header at the start of the `*buflen' bytes read into `buf'.
+ *
+ * Return 0 if the header isn't complete yet and -1 if it's malformed. Once
+ * the header is complete, return 1, leave only the body bytes that followed
+ * it at the start of `buf' and set `*buflen' to their count.
+ */
+int response_parse_header(response_t *res, char *buf, size_t *buflen);
+/* Set up a decoder for the body of `res' from its parsed header. */
+void response_body_init(response_body_t *body, response_t *res);
+/*
+ * Feed `len' raw body bytes to the decoder, calling `sink' with the decoded
+ * content. Pass `len' 0 when the origin closes the connection.
+ *
+ * Return how many bytes belong to the body (any after its end are left
+ * alone), or -1 if the chunk framing is malformed.
+ */
+ssize_t response_body_feed(response_body_t *body, const char *buf, size_t len,
+                           response_body_sink sink, void *arg);
+/*
+ * Account for `len' body bytes that were moved without passing through the
+ * decoder. Only for bodies that aren't chunked.
+ */
+void response_body_advance(response_body_t *body, size_t len);
 /* Free response memory. */
 void response_destroy(response_t *res);
+/* Return the time in an HTTP date (IMF-fixdate) or -1 if it isn't one. */
+time_t response_parse_date(const char *date);
+/*
+ * Return true if Cache-Control value `cc' (may be NULL) has `directive'. If
+ * `value' isn't NULL, the directive must also carry a delta-seconds value,
+ * which is stored there.
+ */
+bool cache_control_has(const char *cc, const char *directive, long *value);
+/*
+ * Return how many more seconds a shared cache may serve `res' received at
+ * `now', going by its Cache-Control, Expires, Date and Age fields, or 0 if
+ * it mustn't be cached, which includes varying on more than Accept-Encoding
+ * or on that and being encoded for the client that asked. `default_ttl' is
+ * the freshness lifetime of a response that gives none. Set `age' to how old
+ * the response already is.
+ */
+long response_ttl(response_t *res, time_t now, long default_ttl, long *age);
+/*
+ * Return true if a cache may gzip `res': it has a text-like Content-Type, no
+ * Content-Encoding and no Cache-Control: no-transform.
+ */
+bool response_compressible(response_t *res);
+/*
+ * Copy the "Name: value\r\n" lines of the header of `res' that a cache
+ * stores with the object to `buf', leaving out hop-by-hop fields, any the
+ * Connection field names, and Date, Age and Content-Length. Return the bytes
+ * copied or -1 if they don't fit in `buflen'.
+ */
+ssize_t response_stored_fields(response_t *res, char *buf, size_t buflen);
 /* Return number of bytes not consumed if successful or -1 for error. */
 int response_deserialize(response_t *res, char *buf, size_t buflen);
 /*
@@ -75,18 +166,28 @@ static inline bool response_ok(const response_t *res)
     return strncmp(expected_code, actual_code, 3) == 0;
 }
 
+/* Return the response's status code or 0 if the Status-Line has none. */
+static inline int response_status(const response_t *res)
+{
+    int status = 0;
+
+    sscanf(res->header.status_line, "%*s %d", &status);
+
+    return status;
+}
+
 /* Return value of Content-Length header field or 0. */
 static inline size_t response_content_length(response_t *res)
 {
-    int len = 0;
-    char *clen;
+    size_t len = 0;
+    const hashmap_entry_t *clen;
 
-    hashmap_get(&res->header.fields, "Content-Length", &clen);
+    clen = hashmap_borrow(&res->header.fields, "Content-Length");
 
     if (clen)
-        len = atoi(clen);
+        len = strtoull(clen->value, NULL, 10);
 
-    free(clen);
+    hashmap_release(clen);
 
     return len;
 }
@@ -95,16 +196,44 @@ static inline size_t response_content_length(response_t *res)
 static inline bool response_chunked(response_t *res)
 {
     bool is_chunked;
-    char *tenc;
+    const hashmap_entry_t *tenc;
 
-    if (hashmap_get(&res->header.fields, "Transfer-Encoding", &tenc) == -1)
+    tenc = hashmap_borrow(&res->header.fields, "Transfer-Encoding");
+    if (tenc == NULL)
         return false;
 
-    is_chunked = strcmp(tenc, "chunked") == 0;
+    is_chunked = strcmp(tenc->value, "chunked") == 0;
 
-    free(tenc);
+    hashmap_release(tenc);
 
     return is_chunked;
 }
 
+/* Return true if the upstream connection can be reused for another request. */
+static inline bool response_conn_is_keepalive(response_t *res)
+{
+    bool keepalive = !strncmp(res->header.status_line, "HTTP/1.1", 8);
+    const hashmap_entry_t *conn;
+
+    conn = hashmap_borrow(&res->header.fields, "Connection");
+    if (conn == NULL)
+        return keepalive;
+
+    if (!strcasecmp(conn->value, "close"))
+        keepalive = false;
+    else if (!strcasecmp(conn->value, "keep-alive"))
+        keepalive = true;
+
+    hashmap_release(conn);
+
+    return keepalive;
+}
+
+/* Return true if the connection a body was read from can carry another. */
+static inline bool response_body_reusable(const response_body_t *body)
+{
+    return (body->complete && !body->excess &&
+            body->framing != BODY_UNTIL_CLOSE);
+}
+
 #endif  /* RESPONSE_H */
@@ -1,87 +1,335 @@
+#define _GNU_SOURCE             /* accept4, CPU_SET, pthread_*_np, splice */
+
 #include <arpa/inet.h>          /* inet_ntoa */
 #include <assert.h>             /* assert */
+#include <ctype.h>              /* isspace */
 #include <errno.h>              /* errno */
+#include <fcntl.h>              /* open, splice, O_* */
 #include <getopt.h>             /* getopt_long, struct option, no_argument */
 #include <netdb.h>              /* gethostbyname */
 #include <netinet/tcp.h>        /* TCP_NODELAY */
 #include <pthread.h>            /* pthread_* */
+#include <sched.h>              /* cpu_set_t, CPU_* */
 #include <signal.h>             /* sigset_t, sigaction */
 #include <stdatomic.h>          /* atomic_ */
-#include <stdlib.h>             /* size_t, strtoul */
+#include <stdlib.h>             /* mkostemp, size_t, strtoul */
 #include <string.h>             /* memset */
 #include <stdio.h>              /* printf, fprintf */
+#include <sys/sendfile.h>       /* sendfile */
 #include <sys/socket.h>         /* setsockopt */
 #include <sys/stat.h>           /* stat, struct st */
-#include <unistd.h>             /* close, read, write */
+#include <unistd.h>             /* close, pipe2, pread, read, write */
 
+#include "connpool.h"
+#include "eventloop.h"
+#include "fill.h"
+#include "gzip.h"
 #include "hashmap.h"
 #include "printl.h"
+#include "queue.h"
 #include "request.h"
 #include "response.h"
-
-#define CACHE_ROOT ".cache"
-#define BLACKLIST_FILE "blacklist.txt"
-#define DIR_PERMS 0700
-#define MAX_BACKLOG 100         /* Max connections before ECONNREFUSED error */
-#define KEEPALIVE_TIMEOUT_S 10
-#define DEFAULT_CACHE_TIMEOUT_S 60
+#include "toyproxy.h"
+#include "uring.h"
+#include "workqueue.h"
 
 
 /* Command line options */
-const char usage[] = "USAGE: %s [-h] port [cache timeout (secs)]\n";
-const char shortopts[] = "hd";
+const char usage[] =
+    "USAGE: %s [-h] [-d] [-e] [-l loops] [-w workers] [-q depth] [-r]"
+    " [-s listeners] [-b backlog] [-u] [-c bytes] [-o objects]"
+    " [-m bytes] [-M bytes] [-t secs] [-S secs] [-j percent] [-z bytes]"
+    " [-R fetch|pass] [-F threads]"
+    " port [cache timeout (secs)]\n"
+    "  -h, --help         show this message and exit\n"
+    "  -d, --debug        enable debug output\n"
+    "  -e, --epoll        serve connections from epoll event loops\n"
+    "  -l, --loops N      number of event loops (default: one per core)\n"
+    "  -w, --workers N    serve connections from a pool of N threads\n"
+    "  -q, --queue-depth N  sockets waiting for a worker (default: 128)\n"
+    "  -r, --reject-when-full  send 503 instead of blocking accept when\n"
+    "                     the worker queue is full\n"
+    "                     (worker options can't be combined with --epoll)\n"
+    "  -s, --listeners N  open N SO_REUSEPORT listeners, each with its own\n"
+    "                     accept loop pinned to a CPU\n"
+    "  -b, --backlog N    listen backlog per listener (default: 100)\n"
+    "  -u, --io-uring     batch socket sends, cache file I/O and accepts\n"
+    "                     through io_uring (not with --epoll)\n"
+    "  -c, --cache-size N disk cache budget in bytes, K/M/G suffixes\n"
+    "                     allowed (default: 1G, 0 for no limit)\n"
+    "  -o, --cache-objects N  most objects kept on disk (default: no limit)\n"
+    "                     (least recently used objects are evicted first)\n"
+    "  -m, --mem-cache N  RAM tier budget in bytes, K/M/G suffixes allowed\n"
+    "                     (default: 64M, 0 to serve hits from disk only)\n"
+    "  -M, --mem-object-max N  largest object kept in RAM (default: 256K)\n"
+    "  -t, --max-ttl N    longest an origin's Cache-Control or Expires can\n"
+    "                     keep an object fresh (default: 86400 secs)\n"
+    "  -S, --stale-while-revalidate N  serve an object up to N secs after\n"
+    "                     it expires while it's refreshed in the background\n"
+    "                     (default: 0, always wait for the origin)\n"
+    "  -j, --ttl-jitter N cut up to N%% off each object's lifetime at random\n"
+    "                     so objects cached together expire apart\n"
+    "                     (default: 10)\n"
+    "  -z, --gzip-min N   keep a gzip copy of cached text bodies of at\n"
+    "                     least N bytes for clients that accept gzip\n"
+    "                     (default: 256, 0 to turn off)\n"
+    "  -R, --range-miss P what to do with a Range request for an object\n"
+    "                     that isn't cached: fetch the whole object into\n"
+    "                     the cache (default), or pass the Range upstream\n"
+    "  -F, --fill-threads N  write cache files from N threads behind the\n"
+    "                     requests that fetch them (default: 2, 0 to\n"
+    "                     write them on the request thread)\n"
+    "The cache timeout is how long an object stays fresh if the origin\n"
+    "doesn't say (default: 60 secs).\n"
+    "Send SIGUSR1 to log cache utilization.\n";
+const char shortopts[] = "hdel:w:q:rs:b:uc:o:m:M:t:S:j:z:R:F:";
 const struct option longopts[] = {
     {"help", no_argument, 0, 'h'},
-    {"debug", no_argument, 0, 'd'}
+    {"debug", no_argument, 0, 'd'},
+    {"epoll", no_argument, 0, 'e'},
+    {"loops", required_argument, 0, 'l'},
+    {"workers", required_argument, 0, 'w'},
+    {"queue-depth", required_argument, 0, 'q'},
+    {"reject-when-full", no_argument, 0, 'r'},
+    {"listeners", required_argument, 0, 's'},
+    {"backlog", required_argument, 0, 'b'},
+    {"io-uring", no_argument, 0, 'u'},
+    {"cache-size", required_argument, 0, 'c'},
+    {"cache-objects", required_argument, 0, 'o'},
+    {"mem-cache", required_argument, 0, 'm'},
+    {"mem-object-max", required_argument, 0, 'M'},
+    {"max-ttl", required_argument, 0, 't'},
+    {"stale-while-revalidate", required_argument, 0, 'S'},
+    {"ttl-jitter", required_argument, 0, 'j'},
+    {"gzip-min", required_argument, 0, 'z'},
+    {"range-miss", required_argument, 0, 'R'},
+    {"fill-threads", required_argument, 0, 'F'},
+    {0, 0, 0, 0}
 };
 
+options_t options;
 atomic_bool exit_requested = false;
 atomic_int global_thread_count = 0;
 __thread int thread_id;
+__thread uring_t *thread_ring;
+__thread int thread_pipe[2] = { -1, -1 }; /* splice pipe, opened on first use */
+__thread unsigned int thread_seed; /* rand_r state, seeded on first use */
 
 hashmap_t file_cache;
+memcache_t mem_cache;
+cache_index_t cache_index;
+inflight_map_t inflight_fetches;
+connpool_t upstream_pool;
+
+/* Accepted client sockets waiting for a worker thread. */
+queue_t connection_queue;
+
+/*
+ * Fetches of stale objects waiting for the refresh thread. Each was started
+ * by the request that served its object stale, so others attach to it.
+ */
+workqueue_t refresh_queue;
+
+/* Cached objects waiting for the gzip thread to make their gzip variant. */
+workqueue_t gzip_queue;
+atomic_ulong gzip_variants;     /* gzip variants made */
+atomic_ulong gzip_saved;        /* bytes they are smaller than the originals */
+
+/* Cache file writes waiting for each fill thread. */
+fill_queue_t *fill_queues;
+atomic_uint fill_next;          /* fill thread the next cache file goes to */
+
+/* An accept loop on one SO_REUSEPORT listener. */
+typedef struct acceptor {
+    int ssock;                  /* listener socket */
+    int cpu;                    /* CPU to pin the accept loop to */
+    pthread_t thread;           /* thread running the accept loop */
+} acceptor_t;
 
 /* If a requested URL or IP is in the blacklist, return 403 Forbidden. */
 char **blacklist;
 
+/* Set by SIGUSR1 for cache_gc to log cache utilization. */
+atomic_bool stats_requested;
+
 static void signal_handler(int __attribute__((__unused__)) sig)
 {
     exit_requested = true;
 }
 
 
+static void stats_handler(int __attribute__((__unused__)) sig)
+{
+    stats_requested = true;
+}
+
+
 /* Parse command line options. */
-void parse_options(int argc, char *argv[], int *port, int *cache_timeout);
-/* Setup the listener socket. */
-int initialize_listener(struct sockaddr_in *saddr, int *fd);
+void parse_options(int argc, char *argv[], options_t *opts);
+/* Parse a byte count with an optional K, M or G suffix. Return 0 or -1. */
+int parse_size(const char *str, size_t *size);
+/* Setup a non-blocking listener socket. */
+int initialize_listener(struct sockaddr_in *saddr, int backlog, bool reuseport,
+                        int *fd);
+/* Run one accept loop per listener, each pinned to a CPU if more than one. */
+int proxy_listeners(int *ssocks, int nsocks);
+/* Accept loop thread entry point for proxy_listeners. */
+void *acceptor_thread(void *acceptor_vptr);
 /* Watch for incoming socket connections and spawn connection handler. */
 int proxy(int ssock);
-/* Handle a single connection until connection close or keep-alive timeout. */
+/* Accept loop using a multishot io_uring accept. Return -1 if unavailable. */
+int proxy_uring(int ssock);
+/* Accept up to ACCEPT_BATCH connections. Return 0, -1 to stop, or errno. */
+int accept_connections(int ssock);
+/* Hand an accepted socket to a worker or a new thread. Return 0 or errno. */
+int dispatch_connection(int cfd);
+/* Answer a connection the worker pool has no room for with 503. */
+void reject_connection(int cfd);
+/* Thread entry point - serve one connection and exit. */
 void *handle_connection(void *fd_vptr);
-/* Send an HTTP error response (no body). */
-int send_error(request_t *req, int status);
-/* Save a response's content in at `path`. */
-void save_cache_file(response_t *res, char *path);
-/* Send an HTTP response including the file at `path'. */
-int send_cache_file(request_t *req, char *path);
+/* Worker pool entry point - serve connections from connection_queue. */
+void *connection_worker(void *queue_vptr);
+/* Serve a single connection until connection close or keep-alive timeout. */
+void serve_connection(int cfd);
+/*
+ * Return a socket connected to `addr' for `req', from the upstream pool if
+ * one is idle (setting `reused'), or -1.
+ */
+int upstream_connect(request_t *req, struct sockaddr_in *addr, bool *reused);
+/* Send all of `buf' on blocking socket `sock' with `flags'. Return 0 or -1. */
+int send_all(int sock, const char *buf, size_t len, int flags);
+/* Send all of `buf' to the client, or queue it on thread_ring. Return 0/-1. */
+int relay_send(int cfd, const char *buf, size_t len);
+/*
+ * Stream the response to `req' from `sfd' to the client through a fixed
+ * buffer, caching it on the way if it is cacheable (and telling requests
+ * attached to `flight' how it's going). Set `reusable' if `sfd' can carry
+ * another request.
+ *
+ * Return 0 once the whole response is relayed, 1 if the origin closed
+ * before sending anything, an HTTP status to send the client if the header
+ * couldn't be read, or -1 if the body was cut off midway.
+ */
+int relay_response(request_t *req, response_t *res, int sfd,
+                   inflight_t *flight, bool *reusable);
+/*
+ * Move the rest of an uncached `body' from `sfd' to `cfd' through the
+ * thread's pipe, so it never enters user space. Return 0 or -1.
+ */
+int relay_splice(int sfd, int cfd, response_body_t *body);
+/* Close the thread's splice pipe. */
+void relay_pipe_close();
+/*
+ * Serve `req' from the fetch `f' another request is making of the same URL,
+ * streaming the cache file as it is written. Return 0 once the response is
+ * sent, 1 to fetch the URL afresh, an HTTP status to send the client if
+ * nothing was sent, or -1 if the response was cut off.
+ */
+int send_inflight(request_t *req, inflight_t *f);
+/*
+ * Send `buf', the `len' byte header of a multi-range hit, with the `nparts'
+ * `parts' of cache file `fd' (or `mem') after their part headers in it.
+ * Return the body bytes sent or -1.
+ */
+ssize_t send_cache_parts(int sock, const char *buf, size_t len, int fd,
+                         const memcache_entry_t *mem,
+                         const cache_part_t *parts, int nparts);
+/* Wait for another request on `cfd'. Return false to close the connection. */
+bool keepalive_wait(int cfd);
+/* Spawn the worker pool. Return the number of workers started. */
+int workers_start(pthread_t *workers, int nworkers);
+/* Wake and join the worker pool. */
+void workers_stop(pthread_t *workers, int nworkers);
+/* Route this thread's I/O through `ring' if --io-uring was given. */
+void thread_ring_start(uring_t *ring, unsigned timeout_s);
+void thread_ring_stop();
+/* Write `len' bytes at `*off' in a cache file, or queue it on thread_ring. */
+int cache_write(int fd, const char *buf, size_t len, off_t *off);
+/* Start `nfills' fill threads, each with its own queue. Return -1 on error. */
+int fills_start(pthread_t *fills, int nfills);
+/* Close the fill queues and wait for what's on them to be written. */
+void fills_stop(pthread_t *fills, int nfills);
+/* Fill thread entry point - run the jobs on a queue in fill_queues. */
+void *cache_filler(void *queue_vptr);
+/*
+ * Create the temporary file of `fill' and write the `len' byte `header' to
+ * it, then let readers follow it. Return 0, or -1 and set `failed'.
+ */
+int cache_fill_open(cache_fill_t *fill, const char *header, size_t len);
+/* Append `len' bytes of body to the file of `fill'. */
+void cache_fill_write(cache_fill_t *fill, const char *buf, size_t len);
+/*
+ * Rename the file of `fill' into place and publish it if `complete' and all
+ * of it was written, else discard it. End its fetch and free it.
+ */
+void cache_fill_close(cache_fill_t *fill, bool complete);
+/*
+ * Refresh the stale copy of `req' that 304 response `res' validated: its
+ * freshness, validators and age. Return 0, or -1 if there's none to refresh.
+ */
+int cache_writer_refresh(cache_writer_t *w, request_t *req, response_t *res,
+                         time_t now);
+/*
+ * Return how long to keep an object the origin says stays fresh for `ttl'
+ * secs: capped at --max-ttl and cut short by up to --ttl-jitter percent.
+ */
+long cache_lifetime(long ttl);
+/* Refresh thread entry point - refetch the stale objects on refresh_queue. */
+void *cache_refresher(void *queue_vptr);
+/* Return rand_r() of this thread's state, seeding it on first use. */
+unsigned thread_rand();
+/*
+ * Return true if `req' has a Range to answer from the cached copy whose
+ * stored fields are the `len' bytes at `fields': one with no If-Range, or
+ * whose If-Range is the copy's strong ETag or its Last-Modified.
+ */
+bool cache_range_applies(const request_t *req, const char *fields,
+                         size_t len);
+/*
+ * Write the part headers and closing boundary of the multipart/byteranges
+ * body of `ranges' of the `clen' byte body at `body_off' in a cache file to
+ * `buf', or only measure them if `buf' is NULL, and describe each part in
+ * `parts' (with `hdr_end' counted from `buf'). Return the bytes of headers,
+ * or -1 if a part header is too long.
+ */
+ssize_t cache_byteranges(char *buf, off_t body_off, size_t clen,
+                         const byte_range_t *ranges, int nranges,
+                         const char *boundary, const char *ctype,
+                         cache_part_t *parts);
+/* Fetch the URL of `f', a refresh of a stale object, into the cache. */
+void cache_refresh(inflight_t *f);
+/* Copy the key of the gzip variant of `url' to `key' (CACHE_KEY_MAX bytes). */
+void cache_gzip_key(const char *url, char *key);
+/* Have the gzip thread make a gzip variant of the cached copy of `url'. */
+void cache_queue_gzip(const char *url);
+/* Gzip thread entry point - make the variants queued on gzip_queue. */
+void *cache_gzipper(void *queue_vptr);
+/* Make the gzip variant `f' is keyed by from the fresh copy of its URL. */
+void cache_gzip(inflight_t *f);
+/* Give the gzip variant of `url', if any, the age and expiry of a 304. */
+void cache_gzip_renew(const char *url, time_t born, time_t expires);
+/* Map the cache index and put the objects it lists back in file_cache. */
+void cache_restore();
+/* Put a cached object listed in the index back - a cache_index_visitor. */
+bool cache_restore_entry(void *count_vptr, const cache_index_entry_t *e);
+/* Unlink a cache file and drop it from the index - file_cache's unlinker. */
+int cache_unlink(const char *path);
+/* Free the caches, leaving cache files and the index for the next run. */
+void cache_destroy();
 /* Handle cache timeout. */
 void *cache_gc(void *cache_vptr);
-/* Return heap-allocated string that the user must free. */
-char *url_to_cache_path(const url_t *url);
-/* Return true if a and b have the same IP and port. */
-bool addrs_equal(struct sockaddr_in *a, struct sockaddr_in *b);
 /* Load blacklist.txt into blacklist character array. */
 int blacklist_init();
 /* Free blacklist memory. */
 void blacklist_destroy();
-/* Return true if the requested URL or IP is on the blacklist. */
-bool blacklist_has_entry(request_t *req);
 
 
 int main(int argc, char *argv[])
 {
-    int rval, ssock, port, cache_timeout;
-    pthread_t cache_gc_thread;
+    int rval, nworkers = 0;
+    int *ssocks;
+    pthread_t cache_gc_thread, refresh_thread, gzip_thread;
+    pthread_t *workers = NULL, *fills = NULL;
     sigset_t set;
     struct stat st;
     struct sockaddr_in addr;
@@ -90,72 +338,233 @@ int main(int argc, char *argv[])
 
     printl_setlevel(INFO);
 
-    parse_options(argc, argv, &port, &cache_timeout);
+    parse_options(argc, argv, &options);
 
     signal(SIGINT, signal_handler);
+    signal(SIGUSR1, stats_handler);
+    signal(SIGPIPE, SIG_IGN);   /* peer resets are handled at write */
     sigemptyset(&set);
     sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);   /* only cache_gc takes it */
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-    hashmap_init(&hostname_cache, 100);
-    hashmap_init(&file_cache, 100);
-    file_cache.timeout = cache_timeout;
-    file_cache.unlinker = unlink;       /* unlink cached files on timeout */
+    hashmap_init_striped(&hostname_cache, 100, HASHMAP_STRIPES);
+    hashmap_init_striped(&file_cache, 100, HASHMAP_STRIPES);
+    file_cache.timeout = options.cache_timeout;
+    file_cache.grace = CACHE_STALE_KEEP_S;
+    file_cache.unlinker = cache_unlink; /* unlink cached files on timeout */
+    file_cache.max_bytes = options.cache_bytes;
+    file_cache.max_entries = options.cache_objects;
+    if (connpool_init(&upstream_pool, CONNPOOL_MAX_IDLE,
+                      CONNPOOL_IDLE_TIMEOUT_S) == -1) {
+        printl(LOG_FATAL "Failed to allocate upstream pool\n");
+        exit(EXIT_FAILURE);
+    }
+    if (memcache_init(&mem_cache, options.mem_cache_bytes,
+                      options.mem_object_max) == -1) {
+        printl(LOG_FATAL "Failed to allocate memory cache\n");
+        exit(EXIT_FAILURE);
+    }
+    if (inflight_map_init(&inflight_fetches, INFLIGHT_BUCKETS) == -1) {
+        printl(LOG_FATAL "Failed to allocate in-flight fetch map\n");
+        exit(EXIT_FAILURE);
+    }
 
     if (stat(CACHE_ROOT, &st) == -1)
         mkdir(CACHE_ROOT, DIR_PERMS);
 
+    cache_restore();
+
     /* Spawn cache timeout handler */
     if (pthread_create(&cache_gc_thread, NULL, cache_gc, &file_cache) < 0) {
         printl(LOG_ERR "pthread_create - %s\n", strerror(errno));
         hashmap_destroy(&hostname_cache);
-        hashmap_destroy(&file_cache);
+        cache_destroy();
+        connpool_destroy(&upstream_pool);
         return errno;
     }
 
+    /* Spawn the refresh thread if stale objects may be served */
+    if (options.stale_while_revalidate &&
+        (workqueue_init(&refresh_queue, REFRESH_QUEUE_DEPTH) == -1 ||
+         pthread_create(&refresh_thread, NULL, cache_refresher,
+                        &refresh_queue))) {
+        printl(LOG_FATAL "Failed to start the refresh thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Spawn the gzip thread if cached text gets gzip variants */
+    if (options.gzip_min &&
+        (workqueue_init(&gzip_queue, GZIP_QUEUE_DEPTH) == -1 ||
+         pthread_create(&gzip_thread, NULL, cache_gzipper, &gzip_queue))) {
+        printl(LOG_FATAL "Failed to start the gzip thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Spawn the fill threads that write cache files behind requests */
+    if (options.fill_threads &&
+        ((fills = calloc(options.fill_threads, sizeof(pthread_t))) == NULL ||
+         fills_start(fills, options.fill_threads) == -1)) {
+        printl(LOG_FATAL "Failed to start the fill threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Spawn connection workers (with SIGINT blocked, like cache_gc) */
+    if (options.nworkers && !options.epoll) {
+        if (queue_init(&connection_queue, options.queue_depth) == 0)
+            workers = calloc(options.nworkers, sizeof(pthread_t));
+
+        if (workers == NULL) {
+            printl(LOG_FATAL "Failed to allocate worker pool\n");
+            exit(EXIT_FAILURE);
+        }
+
+        nworkers = workers_start(workers, options.nworkers);
+        if (nworkers == 0)
+            exit(EXIT_FAILURE);
+    }
+
+    sigdelset(&set, SIGUSR1);   /* threads spawned from here inherit it */
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    addr.sin_port = htons(options.port);
     addr.sin_addr.s_addr = INADDR_ANY;
 
-    if ((rval = initialize_listener(&addr, &ssock) < 0)) {
-        hashmap_destroy(&hostname_cache);
-        hashmap_destroy(&file_cache);
-        return rval;
+    if ((ssocks = calloc(options.nlisteners, sizeof(int))) == NULL) {
+        printl(LOG_FATAL "Failed to allocate listeners\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < options.nlisteners; i++) {
+        rval = initialize_listener(&addr, options.backlog,
+                                   options.nlisteners > 1, &ssocks[i]);
+        if (rval) {
+            while (i--)
+                close(ssocks[i]);
+            free(ssocks);
+            hashmap_destroy(&hostname_cache);
+            cache_destroy();
+            connpool_destroy(&upstream_pool);
+            return rval;
+        }
     }
 
     if (blacklist_init() == -1)
         printl(LOG_ERR "Failed to load blacklist from %s\n", BLACKLIST_FILE);
 
     /* Serve until terminated */
-    printl(LOG_INFO "Toyproxy started on port %d\n", port);
-    rval = proxy(ssock);
+    printl(LOG_INFO "Toyproxy started on port %d\n", options.port);
+    if (options.epoll)
+        rval = event_loop_run(ssocks, options.nlisteners, options.nloops);
+    else
+        rval = proxy_listeners(ssocks, options.nlisteners);
 
     printl(LOG_INFO "Exiting...\n");
     pthread_join(cache_gc_thread, NULL);
+    cache_log_stats();
+
+    if (workers) {
+        workers_stop(workers, nworkers);
+        queue_destroy(&connection_queue);
+        free(workers);
+    }
+
+    if (options.stale_while_revalidate) {
+        workqueue_close(&refresh_queue);
+        pthread_join(refresh_thread, NULL);
+        workqueue_destroy(&refresh_queue);
+    }
+
+    /* Fills queue gzip jobs as they finish, so they stop first */
+    if (fills) {
+        fills_stop(fills, options.fill_threads);
+        free(fills);
+    }
+
+    if (options.gzip_min) {
+        workqueue_close(&gzip_queue);
+        pthread_join(gzip_thread, NULL);
+        workqueue_destroy(&gzip_queue);
+    }
 
-    close(ssock);
+    for (int i = 0; i < options.nlisteners; i++)
+        close(ssocks[i]);
+    free(ssocks);
     hashmap_destroy(&hostname_cache);
-    hashmap_destroy(&file_cache);
+    cache_destroy();
+    connpool_destroy(&upstream_pool);
     blacklist_destroy();
 
     return rval;
 }
 
 
+int proxy_listeners(int *ssocks, int nsocks)
+{
+    int rval = 0, nstarted;
+    acceptor_t *acceptors;
+    int id = thread_id;
+
+    if (nsocks == 1)
+        return proxy(ssocks[0]);
+
+    if ((acceptors = calloc(nsocks, sizeof(acceptor_t))) == NULL) {
+        printl(LOG_ERR "[%d] Out of memory allocating acceptors\n", id);
+        return ENOMEM;
+    }
+
+    /*
+     * Every accept loop gets its own pinned thread so this one stays
+     * unpinned. Connection threads spawned by a loop inherit its CPU.
+     */
+    for (nstarted = 0; nstarted < nsocks; nstarted++) {
+        acceptors[nstarted].ssock = ssocks[nstarted];
+        acceptors[nstarted].cpu = nstarted;
+        rval = pthread_create(&acceptors[nstarted].thread, NULL,
+                              acceptor_thread, &acceptors[nstarted]);
+        if (rval) {
+            printl(LOG_ERR "[%d] pthread_create - %s\n", id, strerror(rval));
+            exit_requested = true;      /* stop the loops already started */
+            break;
+        }
+    }
+
+    printl(LOG_DEBUG "[%d] Started %d accept loops\n", id, nstarted);
+
+    for (int i = 0; i < nstarted; i++)
+        pthread_join(acceptors[i].thread, NULL);
+
+    free(acceptors);
+
+    return rval;
+}
+
+
+void *acceptor_thread(void *acceptor_vptr)
+{
+    acceptor_t *acceptor = (acceptor_t *)acceptor_vptr;
+
+    thread_id = global_thread_count++;
+    pin_to_cpu(acceptor->cpu);
+    proxy(acceptor->ssock);
+    exit_requested = true;      /* stop the other loops if this one failed */
+
+    pthread_exit(NULL);
+}
+
+
 int proxy(int ssock)
 {
     int rval, ready;
-    int *fd;
-    pthread_t thread;
-    struct sockaddr_in client_addr;
-    socklen_t addr_sz = sizeof(struct sockaddr_in);
     fd_set readfds_master, readfds;
-    char *msg;
+    const struct timespec one_second = { .tv_sec = 1, .tv_nsec = 0 };
     int id = thread_id;
 
+    if (options.io_uring && (rval = proxy_uring(ssock)) != -1)
+        return rval;
+
     FD_ZERO(&readfds_master);
     FD_SET(ssock, &readfds_master);
 
@@ -163,34 +572,16 @@ int proxy(int ssock)
     while (!exit_requested) {
         readfds = readfds_master;
 
-        ready = pselect(ssock + 1, &readfds, NULL, NULL, NULL, NULL);
+        /* Time out so loops that don't catch SIGINT still see the exit */
+        ready = pselect(ssock + 1, &readfds, NULL, NULL, &one_second, NULL);
         if (ready < 0 && errno != EINTR) {
             printl(LOG_ERR "[%d] pselect - %s\n", id, strerror(errno));
             break;
         } else if (exit_requested) {
             printl(LOG_DEBUG "[%d] Caught SIGINT\n", id);
-        } else if (ready) {
-            fd = malloc(sizeof(int *));
-            *fd = accept(ssock, (struct sockaddr *)&client_addr, &addr_sz);
-            if (*fd < 0) {
-                printl(LOG_ERR "[%d] accept - %s\n", id, strerror(errno));
-                break;
-            }
-
-            msg = LOG_DEBUG "[%d] Connection accepted on socket %d\n";
-            printl(msg, id, *fd);
-
-            /* Spawn connection handler */
-            rval = pthread_create(&thread, NULL, handle_connection, fd);
-            if (rval < 0) {
-                msg = LOG_ERR "[%d] pthread_create - %s\n";
-                printl(msg, id, strerror(errno));
-                return errno;
-            }
-            pthread_detach(thread);
-        } else {
-            msg = LOG_WARN "[%d] pselect returned 0 on listener socket\n";
-            printl(msg, id);
+        } else if (ready > 0) {
+            if ((rval = accept_connections(ssock)))
+                return rval < 0 ? 0 : rval;
         }
     }
 
@@ -198,270 +589,2179 @@ int proxy(int ssock)
 }
 
 
-void *handle_connection(void *cfd_vptr)
+int proxy_uring(int ssock)
 {
-    int cfd = *(int *)cfd_vptr; /* client socket fd */
-    int sfd = -1;               /* server socket fd */
-    int rval, timer, ready;
-    char *path, *msg;
-    char cache_dir[REQ_BUFLEN] = "";
-    fd_set readfds_master, readfds;
-    bool keepalive;
-    request_t req = { 0 };
-    response_t res = { 0 };
-    struct stat st = { 0 };
-    struct sockaddr_in client_addr;
-    struct sockaddr_in server_addr;
-    struct sockaddr_in current_server_addr = { 0 }; /* open sock addr */
-    const struct timespec one_second = { .tv_sec = 1, .tv_nsec = 0 };
-    socklen_t addr_sz = sizeof(struct sockaddr_in);
-    int id = thread_id = global_thread_count++;
+    int fd, rval;
+    uring_t ring;
+    char *msg;
+    int id = thread_id;
 
-    free(cfd_vptr);
+    /* The ring's timeout is the tick for checking exit_requested */
+    if (uring_init(&ring, 1) == -1) {
+        msg = LOG_WARN "[%d] io_uring unavailable, using accept - %s\n";
+        printl(msg, id, strerror(errno));
+        return -1;
+    }
 
-    if ((getpeername(cfd, (struct sockaddr *)&client_addr, &addr_sz)) < 0) {
-        printl(LOG_WARN "[%d] getpeername failed - %s\n", id, strerror(errno));
-        pthread_exit(NULL);
+    while (!exit_requested) {
+        if ((fd = uring_accept(&ring, ssock)) < 0) {
+            if (errno == ETIME || errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* EINVAL: kernel too old for multishot accept */
+            msg = LOG_WARN "[%d] io_uring accept - %s\n";
+            printl(msg, id, strerror(errno));
+            uring_destroy(&ring);
+            return errno == EINVAL ? -1 : 0;
+        }
+
+        msg = LOG_DEBUG "[%d] Connection accepted on socket %d\n";
+        printl(msg, id, fd);
+
+        if ((rval = dispatch_connection(fd))) {
+            uring_destroy(&ring);
+            return rval;
+        }
     }
 
-    FD_ZERO(&readfds_master);
-    FD_SET(cfd, &readfds_master);
+    printl(LOG_DEBUG "[%d] Caught SIGINT\n", id);
+    uring_destroy(&ring);
 
-    printl(LOG_DEBUG "[%d] Handling connection on socket %d\n", id, cfd);
+    return 0;
+}
 
-    /* If keep-alive requested, watch fd for KEEPALIVE_TIMEOUT_S seconds */
-    do {
-        timer = 1;
-        request_destroy(&req);  /* safe to call on uninit'd req struct */
-        request_init(&req, cfd, &client_addr);
-        req.thread_id = id;
 
-        if ((rval = request_read(&req) != 0)) {
-            if (rval >= 100 && rval <= 599)
-                send_error(&req, rval);
+int accept_connections(int ssock)
+{
+    int fd, rval;
+    struct sockaddr_in client_addr;
+    socklen_t addr_sz;
+    char *msg;
+    int id = thread_id;
 
-            break;
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        /* Only the listener is non-blocking - handlers use blocking I/O */
+        addr_sz = sizeof(struct sockaddr_in);
+        fd = accept4(ssock, (struct sockaddr *)&client_addr, &addr_sz,
+                     SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;       /* backlog drained */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            printl(LOG_ERR "[%d] accept - %s\n", id, strerror(errno));
+            return -1;
         }
 
-        keepalive = request_conn_is_keepalive(&req);
+        msg = LOG_DEBUG "[%d] Connection accepted on socket %d\n";
+        printl(msg, id, fd);
 
-        rval = request_lookup_host(&req);
-        if (rval == -1) {
-            send_error(&req, 404);
-            break;
-        }
+        if ((rval = dispatch_connection(fd)))
+            return rval;
+    }
 
-        if (blacklist_has_entry(&req)) {
-            msg = LOG_WARN "[%d] Requested URL %s or IP %s is blacklisted\n";
-            printl(msg, id, req.url->host, req.url->ip);
-            send_error(&req, 403);
-            break;
-        }
+    return 0;
+}
 
-        printl("%s %s %s\n", req.ip, req.method, req.url->full);
 
-        /* Only GET required to implement at this time */
-        if (!request_method_is_get(&req)) {
-            send_error(&req, 405);
-            break;
+int dispatch_connection(int cfd)
+{
+    int rval;
+    int *fd;
+    pthread_t thread;
+    char *msg;
+    int id = thread_id;
+
+    if (options.nworkers) {
+        if (options.reject_when_full) {
+            if (queue_try_put(&connection_queue, cfd) == -1) {
+                msg = LOG_WARN "[%d] Worker queue full, rejecting socket %d\n";
+                printl(msg, id, cfd);
+                reject_connection(cfd);
+            }
+            return 0;
         }
 
-        if (hashmap_get(&file_cache, req.url->full, (char **)&path) != -1) {
-            printl(LOG_DEBUG "[%d] Cache hit: %s\n", id, path);
-            rval = send_cache_file(&req, path);
-            free(path);
-            if (rval < 0) {
-                send_error(&req, 404);
-                break;
+        /* Stop accepting while full, but keep checking for exit */
+        while (queue_timed_put(&connection_queue, cfd, 1) == -1) {
+            if (exit_requested) {
+                close(cfd);
+                return 0;
             }
-            continue;
         }
+        return 0;
+    }
 
-        server_addr.sin_addr.s_addr = inet_addr(req.url->ip);
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(req.url->port);
+    /* Spawn connection handler */
+    fd = malloc(sizeof(int));
+    *fd = cfd;
+    rval = pthread_create(&thread, NULL, handle_connection, fd);
+    if (rval) {
+        msg = LOG_ERR "[%d] pthread_create - %s\n";
+        printl(msg, id, strerror(rval));
+        free(fd);
+        close(cfd);
+        return rval;
+    }
+    pthread_detach(thread);
 
-        /* Open socket to req.url->host:req.url->port if not already open */
-        if (!addrs_equal(&current_server_addr, &server_addr)) {
-            if (sfd > -1) {
-                /* close the open socket */
-                printl(LOG_DEBUG "[%d] Closing socket %d\n", id, sfd);
-                close(sfd);
-            }
+    return 0;
+}
 
-            sfd = socket(AF_INET, SOCK_STREAM, 0);
-            req.server_fd = sfd;
-            if (sfd == -1) {
-                printl(LOG_ERR "[%d] socket - %s", id, strerror(errno));
-                break;
-            }
-            msg = LOG_DEBUG "[%d] Socket %d opened for %s\n";
-            printl(msg, id, sfd, req.url->host);
 
-            /* Connect to remote server */
-            rval = connect(sfd, (struct sockaddr *)&server_addr , addr_sz);
-            if (rval < 0) {
-                printl(LOG_ERR "[%d] connect - %s", id, strerror(errno));
-                break;
-            }
-            msg = LOG_DEBUG "[%d] Socket %d connected to %s\n";
-            printl(msg, id, sfd, req.url->host);
+void reject_connection(int cfd)
+{
+    request_t req;
+    struct sockaddr_in client_addr = { 0 };
+    socklen_t addr_sz = sizeof(struct sockaddr_in);
 
-            memcpy(&current_server_addr, &server_addr, addr_sz);
-        }
+    getpeername(cfd, (struct sockaddr *)&client_addr, &addr_sz);
 
-        /* Send full request to above */
-        msg = LOG_DEBUG "[%d] Forwarding request to %s on socket %d\n";
-        printl(msg, id, req.url->host, sfd);
-        write(sfd, req.raw, req.raw_len);
+    /* The request is never read, so answer as HTTP/1.1 and close */
+    request_init(&req, cfd, &client_addr);
+    req.thread_id = thread_id;
+    req.http_version = strdup("HTTP/1.1");
+    req.connection = strdup("close");
+    send_error(&req, 503);
+    request_destroy(&req);
 
-        response_init(&res);
-        res.thread_id = id;
+    close(cfd);
+}
 
-        /* Read response from remote */
-        msg = LOG_DEBUG "[%d] Waiting for response from %s on socket %d\n";
-        printl(msg, id, req.url->host, sfd);
-        if ((rval = response_read(&res, sfd) != 0)) {
-            if (rval >= 100 && rval <= 599)
-                send_error(&req, rval); /* send error back to requester */
 
-            response_destroy(&res);
-            break;
-        }
+void thread_ring_start(uring_t *ring, unsigned timeout_s)
+{
+    char *msg;
+    int id = thread_id;
 
-        /* Write response to requester */
-        msg = LOG_DEBUG "[%d] Forwarding response from %s to %s on socket %d\n";
-        printl(msg, id, req.url->host, req.ip, cfd);
-        write(cfd, res.raw, res.raw_len);
+    thread_ring = NULL;
+    if (!options.io_uring)
+        return;
 
-        /* If response is 200, cache file */
-        if (response_ok(&res)) {
-            /* Ensure a cache directory exists for this host */
-            sprintf(cache_dir, "%s/%s", CACHE_ROOT, req.url->host);
-            if (stat(cache_dir, &st) == -1) {
-                mkdir(cache_dir, DIR_PERMS);
-            }
+    if (uring_init(ring, timeout_s) == -1) {
+        msg = LOG_WARN "[%d] io_uring unavailable, using syscalls - %s\n";
+        printl(msg, id, strerror(errno));
+        return;
+    }
 
-            path = url_to_cache_path(req.url);
-            save_cache_file(&res, path);
-            hashmap_add(&file_cache, req.url->full, path);
-            printl(LOG_DEBUG "[%d] Cache entry created: %s\n", id, path);
-            free(path);
-        }
+    thread_ring = ring;
+}
 
-        response_destroy(&res);
 
-        while (keepalive) {
-            readfds = readfds_master;
-            ready = pselect(cfd + 1, &readfds, NULL, NULL, &one_second, NULL);
-            if (exit_requested) {
-                keepalive = false;
-            } else if (ready == -1) {
-                printl(LOG_WARN "[%d] pselect - %s\n", id, strerror(errno));
-                keepalive = false;
-            } else if (ready) {
-                msg = LOG_DEBUG "[%d] Reusing keep-alive socket %d\n";
-                printl(msg, id, cfd);
-                break;
-            } else {
-                if (++timer > KEEPALIVE_TIMEOUT_S) {
-                    printl(LOG_DEBUG "[%d] Keep-alive timeout\n", id);
-                    keepalive = false;
-                }
-            }
-        }
+void thread_ring_stop()
+{
+    if (thread_ring)
+        uring_destroy(thread_ring);
 
-    } while (keepalive);
+    thread_ring = NULL;
+}
 
-    printl(LOG_DEBUG "[%d] Closing socket %d\n", id, cfd);
-    close(cfd);
 
-    if (sfd > 0) {
-        printl(LOG_DEBUG "[%d] Closing socket %d\n", id, sfd);
-        close(sfd);
-    }
+void *handle_connection(void *cfd_vptr)
+{
+    int cfd = *(int *)cfd_vptr;
+    uring_t ring;
+
+    free(cfd_vptr);
+    thread_id = global_thread_count++;
+    thread_ring_start(&ring, 0);
+    serve_connection(cfd);
+    thread_ring_stop();
+    relay_pipe_close();
 
-    request_destroy(&req);
     pthread_exit(NULL);
 }
 
 
-/* Return total bytes sent or -1. */
-int send_cache_file(request_t *req, char *path)
+void *connection_worker(void *queue_vptr)
 {
-    response_t res;
-    char *msg, *resbuf;
-    size_t resbuflen, clen;
-    FILE *file;
-    struct stat st;
-    char *fileext;
-    char filebuf[RES_BUFLEN] = "";
-    const char *ctype;
-    int ntotal = 0, nsend, nsent;
-    int id = thread_id;
+    queue_t *queue = (queue_t *)queue_vptr;
+    int cfd;
+    const struct timeval timeout = { .tv_sec = CLIENT_IO_TIMEOUT_S };
+    uring_t ring;
+    int id = thread_id = global_thread_count++;
 
-    if ((file = fopen(path, "r")) == NULL) {
-        msg = LOG_DEBUG "[%d] Failed to open %s - %s\n";
-        printl(msg, id, path, strerror(errno));
-        return -1;
+    printl(LOG_DEBUG "[%d] Worker running\n", id);
+    thread_ring_start(&ring, CLIENT_IO_TIMEOUT_S);
+
+    /* A negative fd is the signal to exit */
+    while ((cfd = queue_get(queue)) > -1) {
+        if (exit_requested) {
+            close(cfd);         /* drain sockets queued before shutdown */
+            continue;
+        }
+        /* A client that stalls mid-request can't hold a worker forever */
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_connection(cfd);
     }
 
-    /* Set Content-Length */
-    stat(path, &st);
-    clen = st.st_size;
-
-    /* Set Content-Type */
-    fileext = strrchr(req->url->path, '.');
-    if (fileext && !strcmp(fileext, ".png"))
-        ctype = "image/png";
-    else if (fileext && !strcmp(fileext, ".txt"))
-        ctype = "text/plain";
-    else if (fileext && !strcmp(fileext, ".gif"))
-        ctype = "image/gif";
-    else if (fileext && !strcmp(fileext, ".jpg"))
-        ctype = "image/jpg";
-    else if (fileext && !strcmp(fileext, ".css"))
-        ctype = "text/css";
-    else if (fileext && !strcmp(fileext, ".js"))
-        ctype = "application/javascript";
-    else
-        ctype = "text/html";
+    thread_ring_stop();
+    relay_pipe_close();
+    printl(LOG_DEBUG "[%d] Worker exiting\n", id);
+
+    pthread_exit(NULL);
+}
 
-    /* Send header */
-    response_init_from_request(req, &res, 200, ctype, clen);
-    response_serialize(&res, &resbuf, &resbuflen);
-    ntotal += write(req->client_fd, resbuf, resbuflen);
-    free(resbuf);
 
-    printl("-> %s 200 %s %s (%lu)\n", req->ip, path, ctype, clen);
+int workers_start(pthread_t *workers, int nworkers)
+{
+    int rval, nstarted;
+    int id = thread_id;
 
-    /* Send body */
-    while ((nsend = fread(filebuf, 1, RES_BUFLEN, file))) {
-        nsent = write(req->client_fd, filebuf, nsend);
-        ntotal+= nsent;
+    for (nstarted = 0; nstarted < nworkers; nstarted++) {
+        rval = pthread_create(&workers[nstarted], NULL, connection_worker,
+                              &connection_queue);
+        if (rval) {
+            printl(LOG_ERR "[%d] pthread_create - %s\n", id, strerror(rval));
+            break;
+        }
     }
 
-    response_destroy(&res);
-    fclose(file);
+    printl(LOG_DEBUG "[%d] Started %d workers\n", id, nstarted);
 
-    return ntotal;
+    return nstarted;
 }
 
 
-int send_error(request_t *req, int status)
+void workers_stop(pthread_t *workers, int nworkers)
 {
-    response_t res;
-    char *msg, *resbuf;
-    size_t resbuflen;
-    int nsent;
-    int id = thread_id;
+    for (int i = 0; i < nworkers; i++)
+        queue_put(&connection_queue, -1);
 
-    response_init_from_request(req, &res, status, NULL, 0);
-    response_serialize(&res, &resbuf, &resbuflen);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+}
 
-    printl("-> %s %s\n", req->ip, res.header.status_line);
 
-    if ((nsent = write(req->client_fd, resbuf, resbuflen)) < 0) {
+int fills_start(pthread_t *fills, int nfills)
+{
+    int rval;
+    int id = thread_id;
+
+    if ((fill_queues = calloc(nfills, sizeof(fill_queue_t))) == NULL)
+        return -1;
+
+    for (int i = 0; i < nfills; i++) {
+        if (fill_queue_init(&fill_queues[i], FILL_QUEUE_BYTES) == -1)
+            return -1;
+        rval = pthread_create(&fills[i], NULL, cache_filler, &fill_queues[i]);
+        if (rval) {
+            printl(LOG_ERR "[%d] pthread_create - %s\n", id, strerror(rval));
+            return -1;
+        }
+    }
+
+    printl(LOG_DEBUG "[%d] Started %d fill threads\n", id, nfills);
+
+    return 0;
+}
+
+
+void fills_stop(pthread_t *fills, int nfills)
+{
+    for (int i = 0; i < nfills; i++)
+        fill_close(&fill_queues[i]);
+
+    for (int i = 0; i < nfills; i++) {
+        pthread_join(fills[i], NULL);
+        fill_queue_destroy(&fill_queues[i]);
+    }
+
+    free(fill_queues);
+    fill_queues = NULL;
+}
+
+
+int upstream_connect(request_t *req, struct sockaddr_in *addr, bool *reused)
+{
+    int sfd;
+    char *msg;
+    int id = thread_id;
+
+    if ((sfd = connpool_checkout(&upstream_pool, addr, false)) > -1) {
+        msg = LOG_DEBUG "[%d] Reusing pooled socket %d for %s\n";
+        printl(msg, id, sfd, req->url->host);
+        *reused = true;
+        req->server_fd = sfd;
+        return sfd;
+    }
+
+    *reused = false;
+
+    sfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    req->server_fd = sfd;
+    if (sfd == -1) {
+        printl(LOG_ERR "[%d] socket - %s", id, strerror(errno));
+        return -1;
+    }
+    msg = LOG_DEBUG "[%d] Socket %d opened for %s\n";
+    printl(msg, id, sfd, req->url->host);
+
+    /* Connect to remote server */
+    if (connect(sfd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        printl(LOG_ERR "[%d] connect - %s", id, strerror(errno));
+        close(sfd);
+        return -1;
+    }
+    msg = LOG_DEBUG "[%d] Socket %d connected to %s\n";
+    printl(msg, id, sfd, req->url->host);
+
+    return sfd;
+}
+
+
+int send_all(int sock, const char *buf, size_t len, int flags)
+{
+    ssize_t nsent;
+
+    while (len) {
+        if ((nsent = send(sock, buf, len, flags | MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += nsent;
+        len -= nsent;
+    }
+
+    return 0;
+}
+
+
+int relay_send(int cfd, const char *buf, size_t len)
+{
+    if (cfd < 0)
+        return 0;               /* a background refresh has no client */
+
+    if (thread_ring)
+        return uring_queue_send(thread_ring, cfd, buf, len);
+
+    return send_all(cfd, buf, len, 0);
+}
+
+
+int relay_response(request_t *req, response_t *res, int sfd,
+                   inflight_t *flight, bool *reusable)
+{
+    char buf[RELAY_BUFLEN + 1];
+    size_t n = 0;
+    ssize_t nrecvd, nbody;
+    response_body_t body;
+    cache_writer_t writer;
+    char *msg;
+    bool splice_body;
+    int rval, cfd = req->client_fd;
+    int id = thread_id;
+
+    *reusable = false;
+
+    /* Read until the header is complete */
+    do {
+        if (n == RES_BUFLEN)
+            return 431;         /* Response Header Fields Too Large Error */
+
+        nrecvd = read(sfd, buf + n, RES_BUFLEN - n);
+        if (nrecvd == 0) {
+            msg = LOG_DEBUG "[%d] Connection closed while reading response\n";
+            printl(msg, id);
+            return 1;
+        } else if (nrecvd < 0) {
+            if (errno == EINTR)
+                continue;
+            printl(LOG_WARN "[%d] response read - %s\n", id, strerror(errno));
+            return 500;         /* Internal Server Error */
+        }
+        n += nrecvd;
+    } while ((rval = response_parse_header(res, buf, &n)) == 0);
+
+    if (rval < 0)
+        return 400;             /* Bad Response Error */
+
+    response_body_init(&body, res);
+    cache_writer_open(&writer, req, res, flight);
+
+    /* A 304 to the proxy's own validators is answered from the cache */
+    if (req->revalidating && response_status(res) == 304) {
+        response_body_feed(&body, buf, n, NULL, NULL);
+        rval = 0;
+        if (!writer.revalidated)
+            rval = 500;
+        else if (cfd > -1 &&
+                 send_cache_file(req, req->url->full, writer.path) < 0)
+            rval = 404;
+        cache_writer_close(&writer, body.complete);
+        *reusable = response_body_reusable(&body) &&
+            response_conn_is_keepalive(res);
+        return rval;
+    }
+
+    /* Nothing needs to see an uncached body unless it must be dechunked */
+    splice_body = writer.fill == NULL && body.framing != BODY_CHUNKED;
+
+    /* Nor, without a client, an uncached body at all */
+    if (cfd < 0 && writer.fill == NULL) {
+        cache_writer_close(&writer, false);
+        return 0;
+    }
+
+    msg = LOG_DEBUG "[%d] Forwarding response from %s to %s on socket %d\n";
+    printl(msg, id, req->url->host, req->ip, cfd);
+
+    /*
+     * Forward each run of the body as it arrives and tee the decoded
+     * content into the cache. With a ring, the header and every run go out
+     * in one submission with their cache writes.
+     */
+    if (relay_send(cfd, res->raw, res->raw_len) == -1)
+        goto done;
+
+    while (true) {
+        nbody = response_body_feed(&body, buf, n, cache_writer_sink, &writer);
+        if (nbody < 0) {
+            printl(LOG_WARN "[%d] Malformed chunked response\n", id);
+            break;
+        }
+
+        if (nbody && relay_send(cfd, buf, nbody) == -1)
+            break;
+        if (thread_ring && uring_run(thread_ring) == -1)
+            break;
+        cache_writer_progress(&writer);
+        if (body.complete)
+            break;
+        if (splice_body) {
+            relay_splice(sfd, cfd, &body);
+            break;
+        }
+
+        while ((nrecvd = read(sfd, buf, RELAY_BUFLEN)) < 0 && errno == EINTR)
+            ;
+        if (nrecvd <= 0) {
+            if (nrecvd == 0)
+                response_body_feed(&body, NULL, 0, NULL, NULL);
+            break;
+        }
+        n = nrecvd;
+    }
+
+done:
+    if (!body.complete) {
+        msg = LOG_DEBUG "[%d] Response from %s cut off - %s\n";
+        printl(msg, id, req->url->host, strerror(errno));
+    }
+
+    cache_writer_close(&writer, body.complete);
+    *reusable = response_body_reusable(&body) && response_conn_is_keepalive(res);
+
+    return body.complete ? 0 : -1;
+}
+
+
+int relay_splice(int sfd, int cfd, response_body_t *body)
+{
+    ssize_t nrecvd, nsent;
+    size_t len;
+    unsigned more;
+
+    if (thread_pipe[0] < 0 && pipe2(thread_pipe, O_CLOEXEC) == -1)
+        return -1;
+
+    while (!body->complete) {
+        len = SPLICE_LEN;
+        if (body->framing == BODY_LENGTH && body->remaining < len)
+            len = body->remaining;
+
+        nrecvd = splice(sfd, NULL, thread_pipe[1], NULL, len, SPLICE_F_MOVE);
+        if (nrecvd < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (nrecvd == 0) {
+            response_body_feed(body, NULL, 0, NULL, NULL);
+            break;
+        }
+        response_body_advance(body, nrecvd);
+
+        /* Hold back partial segments until the last of the body */
+        more = body->complete ? 0 : SPLICE_F_MORE;
+        while (nrecvd > 0) {
+            nsent = splice(thread_pipe[0], NULL, cfd, NULL, nrecvd,
+                           SPLICE_F_MOVE | more);
+            if (nsent < 0) {
+                if (errno == EINTR)
+                    continue;
+                relay_pipe_close(); /* don't leave bytes for the next body */
+                return -1;
+            }
+            nrecvd -= nsent;
+        }
+    }
+
+    return body->complete ? 0 : -1;
+}
+
+
+void relay_pipe_close()
+{
+    if (thread_pipe[0] < 0)
+        return;
+
+    close(thread_pipe[0]);
+    close(thread_pipe[1]);
+    thread_pipe[0] = thread_pipe[1] = -1;
+}
+
+
+bool keepalive_wait(int cfd)
+{
+    int ready, timer = 1;
+    char *msg;
+    fd_set readfds;
+    const struct timespec one_second = { .tv_sec = 1, .tv_nsec = 0 };
+    int id = thread_id;
+
+    while (true) {
+        FD_ZERO(&readfds);
+        FD_SET(cfd, &readfds);
+        ready = pselect(cfd + 1, &readfds, NULL, NULL, &one_second, NULL);
+        if (exit_requested) {
+            return false;
+        } else if (!ready && options.nworkers && connection_queue.size) {
+            /* Give an idle worker back to connections waiting for one */
+            msg = LOG_DEBUG "[%d] Closing idle keep-alive socket %d\n";
+            printl(msg, id, cfd);
+            return false;
+        } else if (ready == -1) {
+            printl(LOG_WARN "[%d] pselect - %s\n", id, strerror(errno));
+            return false;
+        } else if (ready) {
+            msg = LOG_DEBUG "[%d] Reusing keep-alive socket %d\n";
+            printl(msg, id, cfd);
+            return true;
+        } else if (++timer > KEEPALIVE_TIMEOUT_S) {
+            printl(LOG_DEBUG "[%d] Keep-alive timeout\n", id);
+            return false;
+        }
+    }
+}
+
+
+void serve_connection(int cfd)
+{
+    int sfd = -1;               /* server socket fd */
+    int rval;
+    char *path, *msg, key[CACHE_KEY_MAX];
+    bool keepalive, reused, reusable, leader;
+    inflight_t *flight;
+    request_t req = { 0 };
+    response_t res = { 0 };
+    struct sockaddr_in client_addr;
+    struct sockaddr_in server_addr;
+    socklen_t addr_sz = sizeof(struct sockaddr_in);
+    int id = thread_id;
+
+    if ((getpeername(cfd, (struct sockaddr *)&client_addr, &addr_sz)) < 0) {
+        printl(LOG_WARN "[%d] getpeername failed - %s\n", id, strerror(errno));
+        close(cfd);
+        return;
+    }
+
+    printl(LOG_DEBUG "[%d] Handling connection on socket %d\n", id, cfd);
+
+    /* If keep-alive requested, watch fd for KEEPALIVE_TIMEOUT_S seconds */
+    do {
+        request_destroy(&req);  /* safe to call on uninit'd req struct */
+        request_init(&req, cfd, &client_addr);
+        req.thread_id = id;
+
+        if ((rval = request_read(&req) != 0)) {
+            if (rval >= 100 && rval <= 599)
+                send_error(&req, rval);
+
+            break;
+        }
+
+        keepalive = request_conn_is_keepalive(&req);
+
+        rval = request_lookup_host(&req);
+        if (rval == -1) {
+            send_error(&req, 404);
+            break;
+        }
+
+        if (blacklist_has_entry(&req)) {
+            msg = LOG_WARN "[%d] Requested URL %s or IP %s is blacklisted\n";
+            printl(msg, id, req.url->host, req.url->ip);
+            send_error(&req, 403);
+            break;
+        }
+
+        printl("%s %s %s\n", req.ip, req.method, req.url->full);
+
+        /* Only GET required to implement at this time */
+        if (!request_method_is_get(&req)) {
+            send_error(&req, 405);
+            break;
+        }
+
+        if ((path = cache_lookup(&req, key)) != NULL) {
+            printl(LOG_DEBUG "[%d] Cache hit: %s\n", id, path);
+            rval = send_cache_file(&req, key, path);
+            /* A copy that can't be read is a miss */
+            if (rval < 0)
+                cache_drop(key, path);
+            free(path);
+            if (rval >= 0) {
+                if (keepalive)
+                    keepalive = keepalive_wait(cfd);
+                continue;
+            }
+        }
+
+        /* A miss already being fetched is streamed from that fetch */
+        if (req.range && options.range_pass) {
+            flight = NULL;      /* its 206 is no use to anyone else */
+            leader = true;
+        } else {
+            while ((flight = inflight_join(&inflight_fetches, req.url->full,
+                                           &leader)) && !leader) {
+                rval = send_inflight(&req, flight);
+                inflight_release(&inflight_fetches, flight);
+                if (rval != 1)
+                    break;
+            }
+        }
+
+        if (!leader) {
+            if (rval != 0) {
+                if (rval >= 100 && rval <= 599)
+                    send_error(&req, rval);
+                break;
+            }
+            if (keepalive)
+                keepalive = keepalive_wait(cfd);
+            continue;
+        }
+
+        cache_prepare_request(&req);
+
+        server_addr.sin_addr.s_addr = inet_addr(req.url->ip);
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(req.url->port);
+
+        /* Retry if the origin closed a pooled socket while it sat idle */
+        do {
+            if ((sfd = upstream_connect(&req, &server_addr, &reused)) == -1)
+                break;
+
+            /* Send full request to above */
+            msg = LOG_DEBUG "[%d] Forwarding request to %s on socket %d\n";
+            printl(msg, id, req.url->host, sfd);
+            write(sfd, req.raw, req.raw_len);
+
+            response_init(&res);
+            res.thread_id = id;
+
+            /* Stream response from remote */
+            msg = LOG_DEBUG "[%d] Waiting for response from %s on socket %d\n";
+            printl(msg, id, req.url->host, sfd);
+            rval = relay_response(&req, &res, sfd, flight, &reusable);
+            if (rval != 1 || !reused)
+                break;
+
+            msg = LOG_DEBUG "[%d] Pooled socket %d closed by origin\n";
+            printl(msg, id, sfd);
+            response_destroy(&res);
+            close(sfd);
+            sfd = -1;
+        } while (true);
+
+        /* Requests still waiting on a fetch that failed go fetch themselves */
+        if (flight) {
+            inflight_end(&inflight_fetches, flight, false);
+            inflight_release(&inflight_fetches, flight);
+        }
+
+        if (sfd == -1)
+            break;
+
+        /* The origin socket outlives this client if the origin allows it */
+        if (rval == 0 && reusable)
+            connpool_checkin(&upstream_pool, &server_addr, sfd, false);
+        else
+            close(sfd);
+        sfd = -1;
+
+        response_destroy(&res);
+
+        if (rval != 0) {
+            if (rval >= 100 && rval <= 599)
+                send_error(&req, rval); /* send error back to requester */
+
+            break;              /* includes a body cut off midway */
+        }
+
+        if (keepalive)
+            keepalive = keepalive_wait(cfd);
+
+    } while (keepalive);
+
+    printl(LOG_DEBUG "[%d] Closing socket %d\n", id, cfd);
+    close(cfd);
+
+    if (sfd > -1) {
+        printl(LOG_DEBUG "[%d] Closing socket %d\n", id, sfd);
+        close(sfd);
+    }
+
+    request_destroy(&req);
+}
+
+
+int send_inflight(request_t *req, inflight_t *f)
+{
+    char *msg, *path, *resbuf;
+    size_t resbuflen, clen, written;
+    inflight_state_t state;
+    off_t off = 0;
+    int fd, rval;
+    time_t last_progress = time(NULL);
+    int cfd = req->client_fd;
+    int id = thread_id;
+
+    msg = LOG_DEBUG "[%d] Attaching to the fetch in flight of %s\n";
+    printl(msg, id, req->url->full);
+
+    /* Wait for the header, or the whole body if its length isn't known */
+    state = inflight_poll(&inflight_fetches, f, &written);
+    while (state == INFLIGHT_PENDING ||
+           (state == INFLIGHT_STREAMING && !f->len_known)) {
+        size_t seen = written;
+
+        if (exit_requested)
+            return -1;
+        if (time(NULL) - last_progress > INFLIGHT_TIMEOUT_S)
+            return 504;         /* Gateway Timeout */
+        state = inflight_wait(&inflight_fetches, f, state, &written, 1);
+        if (written != seen)
+            last_progress = time(NULL);
+    }
+
+    if (state == INFLIGHT_ABANDONED)
+        return 1;
+
+    if (state == INFLIGHT_DONE) {
+        if (hashmap_get(&file_cache, req->url->full, &path) == -1)
+            return 1;           /* already evicted */
+        printl(LOG_DEBUG "[%d] Cache hit: %s\n", id, path);
+        rval = send_cache_file(req, req->url->full, path);
+        free(path);
+        return rval < 0 ? 1 : 0;
+    }
+
+    /* The leader is still writing the file, so follow it */
+    if ((fd = open(f->path, O_RDONLY | O_CLOEXEC)) == -1)
+        return 1;
+
+    /* The stored header is in place before readers are let in */
+    resbuf = cache_response_header(req, fd, NULL, f->len, time(NULL), NULL,
+                                   NULL, &off, &clen, &resbuflen);
+    if (resbuf == NULL) {
+        close(fd);
+        return 1;
+    }
+
+    printl("-> %s 200 %s (%lu) while fetching\n", req->ip, f->path,
+           (unsigned long)(f->len - off));
+
+    rval = send_all(cfd, resbuf, resbuflen,
+                    (size_t)off < f->len ? MSG_MORE : 0);
+    free(resbuf);
+
+    while (rval == 0 && (size_t)off < f->len) {
+        if ((size_t)off < written) {
+            if (send_file_range(cfd, fd, &off, written) != 1)
+                rval = -1;
+            last_progress = time(NULL);
+        } else if (state == INFLIGHT_ABANDONED || exit_requested ||
+                   time(NULL) - last_progress > INFLIGHT_TIMEOUT_S) {
+            msg = LOG_DEBUG "[%d] Fetch of %s cut off\n";
+            printl(msg, id, req->url->full);
+            rval = -1;
+        } else {
+            state = inflight_wait(&inflight_fetches, f, state, &written, 1);
+        }
+    }
+
+    close(fd);
+
+    return rval;
+}
+
+
+/* Return total bytes sent or -1. */
+int send_cache_file(request_t *req, const char *key, char *path)
+{
+    char *msg, *resbuf;
+    size_t resbuflen, size, clen;
+    int fd = -1;
+    struct stat st;
+    memcache_entry_t *mem;
+    cache_part_t parts[REQ_RANGES_MAX];
+    time_t born;
+    off_t off;
+    int ntotal = 0, nsent, nparts;
+    int cfd = req->client_fd;
+    int id = thread_id;
+
+    /* A hot object is served from RAM without touching the filesystem */
+    if ((mem = cache_object_get(key)) == NULL) {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            msg = LOG_DEBUG "[%d] Failed to open %s - %s\n";
+            printl(msg, id, path, strerror(errno));
+            return -1;
+        }
+
+        fstat(fd, &st);
+        mem = cache_object_load(key, fd, &st);
+    }
+
+    size = mem ? mem->len : (size_t)st.st_size;
+    born = mem ? mem->mtime : st.st_mtime;
+
+    /* The origin's header was stored ahead of the body */
+    resbuf = cache_response_header(req, fd, mem, size, born, parts, &nparts,
+                                   &off, &clen, &resbuflen);
+    if (resbuf == NULL) {
+        printl(LOG_WARN "[%d] %s isn't a cache object\n", id, path);
+        if (mem)
+            memcache_release(&mem_cache, mem);
+        if (fd > -1)
+            close(fd);
+        return -1;
+    }
+
+    printl("-> %s %.3s %s (%lu)%s\n", req->ip, strchr(resbuf, ' ') + 1, path,
+           clen, mem ? " from memory" : "");
+
+    if (nparts) {
+        nsent = send_cache_parts(cfd, resbuf, resbuflen, fd, mem, parts,
+                                 nparts);
+        if (nsent >= 0) {
+            ntotal = resbuflen + nsent;
+        } else {
+            msg = LOG_DEBUG "[%d] Failed to send %s - %s\n";
+            printl(msg, id, path, strerror(errno));
+        }
+        if (mem)
+            memcache_release(&mem_cache, mem);
+    } else if (mem) {
+        if (thread_ring) {
+            uring_queue_send(thread_ring, cfd, resbuf, resbuflen);
+            uring_queue_send(thread_ring, cfd, mem->data + off, clen);
+            nsent = uring_run(thread_ring);
+        } else {
+            nsent = send_all(cfd, resbuf, resbuflen, clen ? MSG_MORE : 0);
+            if (nsent == 0)
+                nsent = send_all(cfd, mem->data + off, clen, 0);
+        }
+
+        if (nsent == 0) {
+            ntotal = resbuflen + clen;
+        } else {
+            msg = LOG_DEBUG "[%d] Failed to send %s - %s\n";
+            printl(msg, id, path, strerror(errno));
+        }
+        memcache_release(&mem_cache, mem);
+    } else if (thread_ring) {
+        /* Header, file reads and sends go out in a single submission */
+        uring_queue_send(thread_ring, cfd, resbuf, resbuflen);
+        nsent = uring_send_file(thread_ring, cfd, fd, off, clen);
+        if (nsent < 0) {
+            msg = LOG_WARN "[%d] Failed to send %s - %s\n";
+            printl(msg, id, path, strerror(errno));
+        } else {
+            ntotal = resbuflen + nsent;
+        }
+    } else {
+        /* MSG_MORE holds the header back to share a segment with the body */
+        if (send_all(cfd, resbuf, resbuflen, clen ? MSG_MORE : 0) == 0 &&
+            send_file_range(cfd, fd, &off, off + clen) == 1) {
+            ntotal = resbuflen + clen;
+        } else {
+            msg = LOG_DEBUG "[%d] Failed to send %s - %s\n";
+            printl(msg, id, path, strerror(errno));
+        }
+    }
+
+    free(resbuf);
+    if (fd > -1)
+        close(fd);
+
+    return ntotal;
+}
+
+
+ssize_t send_cache_parts(int sock, const char *buf, size_t len, int fd,
+                         const memcache_entry_t *mem,
+                         const cache_part_t *parts, int nparts)
+{
+    size_t hdr_off = 0, ntotal = 0;
+    ssize_t nsent;
+    off_t off;
+    int rval = 0;
+
+    /* Each part is sent from where it lies, after its header */
+    for (int i = 0; i < nparts && rval == 0; i++) {
+        if (thread_ring) {
+            rval = uring_queue_send(thread_ring, sock, buf + hdr_off,
+                                    parts[i].hdr_end - hdr_off);
+            if (rval == 0 && mem) {
+                rval = uring_queue_send(thread_ring, sock,
+                                        mem->data + parts[i].off,
+                                        parts[i].len);
+            } else if (rval == 0) {
+                nsent = uring_send_file(thread_ring, sock, fd, parts[i].off,
+                                        parts[i].len);
+                rval = nsent == (ssize_t)parts[i].len ? 0 : -1;
+            }
+        } else {
+            rval = send_all(sock, buf + hdr_off, parts[i].hdr_end - hdr_off,
+                            MSG_MORE);
+            if (rval == 0 && mem) {
+                rval = send_all(sock, mem->data + parts[i].off,
+                                parts[i].len, MSG_MORE);
+            } else if (rval == 0) {
+                off = parts[i].off;
+                if (send_file_range(sock, fd, &off,
+                                    off + parts[i].len) != 1)
+                    rval = -1;
+            }
+        }
+
+        hdr_off = parts[i].hdr_end;
+        ntotal += parts[i].len;
+    }
+
+    /* Then the closing boundary */
+    if (rval == 0 && thread_ring) {
+        rval = uring_queue_send(thread_ring, sock, buf + hdr_off,
+                                len - hdr_off);
+        if (rval == 0)
+            rval = uring_run(thread_ring);
+    } else if (rval == 0) {
+        rval = send_all(sock, buf + hdr_off, len - hdr_off, 0);
+    }
+
+    return rval == 0 ? (ssize_t)ntotal : -1;
+}
+
+
+memcache_entry_t *cache_object_get(const char *key)
+{
+    if (options.mem_cache_bytes == 0)
+        return NULL;
+
+    return memcache_get(&mem_cache, key);
+}
+
+
+memcache_entry_t *cache_object_load(const char *key, int fd,
+                                    const struct stat *st)
+{
+    memcache_entry_t *mem;
+    ssize_t nread;
+    size_t off = 0, len = st->st_size;
+
+    if (options.mem_cache_bytes == 0 ||
+        (mem = memcache_reserve(&mem_cache, key, len)) == NULL)
+        return NULL;
+
+    while (off < len) {
+        nread = pread(fd, mem->data + off, len - off, off);
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR)
+                continue;
+            memcache_release(&mem_cache, mem); /* never published */
+            return NULL;
+        }
+        off += nread;
+    }
+
+    mem->mtime = st->st_mtime;
+    memcache_publish(&mem_cache, mem);
+
+    return mem;
+}
+
+
+char *cache_response_header(const request_t *req, int fd,
+                            const memcache_entry_t *mem, size_t size,
+                            time_t born, cache_part_t *parts, int *nparts,
+                            off_t *body_off, size_t *body_len,
+                            size_t *hdrlen)
+{
+    cache_file_prefix_t prefix;
+    byte_range_t ranges[REQ_RANGES_MAX];
+    char filebuf[CACHE_FILE_HEADER_MAX], status[32], date[64];
+    char boundary[24], *ctype = NULL;
+    const char *data = mem ? mem->data : filebuf;
+    const char *fields, *conn, *fmt, *line = NULL, *value;
+    char *buf;
+    ssize_t nread = mem ? (ssize_t)mem->len : 0, partslen = 0;
+    size_t nbytes, clen, multilen = 0, fields_len, linelen = 0, vlen;
+    int nranges = 0;
+    struct tm gmt;
+    time_t now = time(NULL);
+
+    if (mem == NULL && (nread = pread(fd, filebuf, sizeof(filebuf), 0)) < 0)
+        return NULL;
+
+    if ((size_t)nread < sizeof(prefix))
+        return NULL;
+    memcpy(&prefix, data, sizeof(prefix));
+    if (memcmp(prefix.magic, CACHE_FILE_MAGIC, sizeof(prefix.magic)) ||
+        sizeof(prefix) + prefix.fields_len > (size_t)nread ||
+        sizeof(prefix) + prefix.fields_len > size)
+        return NULL;
+
+    *body_off = sizeof(prefix) + prefix.fields_len;
+    *body_len = clen = size - *body_off;
+    fields = data + sizeof(prefix);
+    fields_len = prefix.fields_len;
+
+    if (parts && cache_range_applies(req, fields, fields_len))
+        nranges = request_ranges(req, clen, ranges);
+
+    if (nranges == -1) {
+        *body_len = 0;
+        fields_len = 0;         /* none of them describe an empty 416 */
+    } else if (nranges == 1) {
+        *body_off += ranges[0].first;
+        *body_len = ranges[0].last - ranges[0].first + 1;
+    } else if (nranges > 1) {
+        /* Each part has the Content-Type the whole body had */
+        line = cache_stored_field(fields, fields_len, "Content-Type",
+                                  &linelen, &value, &vlen);
+        if (line && (ctype = strndup(value, vlen)) == NULL)
+            return NULL;
+        snprintf(boundary, sizeof(boundary), "%08x%08x", thread_rand(),
+                 thread_rand());
+        partslen = cache_byteranges(NULL, *body_off, clen, ranges, nranges,
+                                    boundary, ctype, parts);
+        *body_len = 0;
+        if (partslen == -1) {
+            free(ctype);
+            return NULL;
+        }
+        multilen = partslen;
+        for (int i = 0; i < nranges; i++)
+            multilen += parts[i].len;
+    }
+
+    if (req->connection)
+        conn = req->connection;
+    else
+        conn = request_version_is_1_1(req) ? "keep-alive" : "close";
+
+    status_string(nranges ? (nranges > 0 ? 206 : 416) : 200, status,
+                  sizeof(status));
+    gmtime_r(&now, &gmt);
+    strftime(date, sizeof(date), response_date_fmt, &gmt);
+
+    /* The stored fields go out as they came, with what changes per hit */
+    if ((buf = malloc(strlen(req->http_version) + fields_len +
+                      strlen(conn) + 512 + partslen)) == NULL) {
+        free(ctype);
+        return NULL;
+    }
+
+    nbytes = sprintf(buf, "%s %s\r\n", req->http_version, status);
+
+    if (line) {
+        /* A multipart body's own Content-Type replaces the stored one */
+        memcpy(buf + nbytes, fields, line - fields);
+        nbytes += line - fields;
+        memcpy(buf + nbytes, line + linelen,
+               fields + fields_len - (line + linelen));
+        nbytes += fields + fields_len - (line + linelen);
+    } else {
+        memcpy(buf + nbytes, fields, fields_len);
+        nbytes += fields_len;
+    }
+
+    if (nranges == -1) {
+        nbytes += sprintf(buf + nbytes, "Content-Range: bytes */%zu\r\n",
+                          clen);
+    } else if (nranges == 1) {
+        fmt = "Content-Range: bytes %zu-%zu/%zu\r\n";
+        nbytes += sprintf(buf + nbytes, fmt, ranges[0].first, ranges[0].last,
+                          clen);
+    } else if (nranges > 1) {
+        fmt = "Content-Type: multipart/byteranges; boundary=%s\r\n";
+        nbytes += sprintf(buf + nbytes, fmt, boundary);
+    }
+
+    fmt = "Date: %s\r\nAge: %ld\r\nContent-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n";
+    nbytes += sprintf(buf + nbytes, fmt, date,
+                      (long)(now > born ? now - born : 0),
+                      nranges > 1 ? multilen : *body_len, conn);
+
+    if (nranges > 1) {
+        if (cache_byteranges(buf + nbytes, *body_off, clen, ranges, nranges,
+                             boundary, ctype, parts) != partslen) {
+            free(ctype);
+            free(buf);
+            return NULL;
+        }
+        for (int i = 0; i < nranges; i++)
+            parts[i].hdr_end += nbytes;
+        nbytes += partslen;
+    }
+
+    if (nparts)
+        *nparts = nranges > 1 ? nranges : 0;
+
+    free(ctype);
+
+    *hdrlen = nbytes;
+
+    return buf;
+}
+
+
+const char *cache_stored_field(const char *fields, size_t len,
+                               const char *name, size_t *linelen,
+                               const char **value, size_t *vlen)
+{
+    const char *line, *next, *end = fields + len;
+    size_t name_len = strlen(name);
+
+    for (line = fields; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+
+        if ((size_t)(next - line) <= name_len ||
+            strncasecmp(line, name, name_len) || line[name_len] != ':')
+            continue;
+
+        *value = line + name_len + 1;
+        while (*value < next && (**value == ' ' || **value == '\t'))
+            (*value)++;
+        *vlen = next - *value;
+        while (*vlen && isspace((unsigned char)(*value)[*vlen - 1]))
+            (*vlen)--;
+        *linelen = next - line;
+
+        return line;
+    }
+
+    return NULL;
+}
+
+
+bool cache_range_applies(const request_t *req, const char *fields,
+                         size_t len)
+{
+    const char *name, *value;
+    size_t linelen, vlen;
+    const char *if_range = req->if_range;
+
+    if (req->range == NULL)
+        return false;
+    if (if_range == NULL)
+        return true;
+
+    /* A weak ETag never validates a range (RFC 7233 3.2) */
+    if (!strncmp(if_range, "W/", 2))
+        return false;
+    name = *if_range == '"' ? "ETag" : "Last-Modified";
+
+    return cache_stored_field(fields, len, name, &linelen, &value,
+                              &vlen) != NULL &&
+        strlen(if_range) == vlen && !memcmp(if_range, value, vlen);
+}
+
+
+ssize_t cache_byteranges(char *buf, off_t body_off, size_t clen,
+                         const byte_range_t *ranges, int nranges,
+                         const char *boundary, const char *ctype,
+                         cache_part_t *parts)
+{
+    const char *fmt = "\r\n--%s\r\n%s%s%sContent-Range: bytes %zu-%zu/%zu"
+        "\r\n\r\n";
+    char part[RES_BUFLEN + 128];
+    size_t len, n = 0;
+
+    /* The CRLF before each boundary belongs to it, not to the part */
+    for (int i = 0; i < nranges; i++) {
+        len = snprintf(part, sizeof(part), fmt, boundary,
+                       ctype ? "Content-Type: " : "", ctype ? ctype : "",
+                       ctype ? "\r\n" : "", ranges[i].first, ranges[i].last,
+                       clen);
+        if (len >= sizeof(part))
+            return -1;
+        if (buf)
+            memcpy(buf + n, part + (i ? 0 : 2), len - (i ? 0 : 2));
+        n += len - (i ? 0 : 2);
+
+        parts[i].hdr_end = n;
+        parts[i].off = body_off + ranges[i].first;
+        parts[i].len = ranges[i].last - ranges[i].first + 1;
+    }
+
+    len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+    if (buf)
+        memcpy(buf + n, part, len);
+
+    return n + len;
+}
+
+
+int send_file_range(int sock, int fd, off_t *off, size_t len)
+{
+    ssize_t nsent;
+
+    while ((size_t)*off < len) {
+        nsent = sendfile(sock, fd, off, len - *off);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        } else if (nsent == 0) {
+            errno = EIO;        /* the file shrank under us */
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+
+char *cache_lookup(const request_t *req, char *key)
+{
+    char *path;
+
+    /* Peeked at first, so objects with no variant don't count as misses */
+    if (options.gzip_min && request_accepts(req, "gzip")) {
+        cache_gzip_key(req->url->full, key);
+        if (hashmap_get_stale(&file_cache, key, NULL, NULL) != -1 &&
+            hashmap_get(&file_cache, key, &path) != -1)
+            return path;
+    }
+
+    snprintf(key, CACHE_KEY_MAX, "%s", req->url->full);
+
+    /* A stale copy may be served while it's refreshed */
+    if (hashmap_get(&file_cache, key, &path) != -1)
+        return path;
+
+    return cache_serve_stale(key);
+}
+
+
+void cache_drop(const char *key, const char *path)
+{
+    int id = thread_id;
+
+    printl(LOG_DEBUG "[%d] Dropping unreadable %s\n", id, path);
+
+    if (hashmap_del_value(&file_cache, key, path) != -1)
+        memcache_del(&mem_cache, key);
+}
+
+
+char *cache_serve_stale(const char *url)
+{
+    char *path, *msg;
+    unsigned long expires;
+    inflight_t *f;
+    bool leader;
+    int id = thread_id;
+
+    if (options.stale_while_revalidate == 0 ||
+        hashmap_get_stale(&file_cache, url, &path, &expires) == -1)
+        return NULL;
+
+    if (expires == 0 ||
+        time(NULL) >= (time_t)expires + options.stale_while_revalidate) {
+        free(path);
+        return NULL;
+    }
+
+    /* The first request to find it stale starts the refresh */
+    if ((f = inflight_join(&inflight_fetches, url, &leader)) && leader) {
+        if (workqueue_put(&refresh_queue, f) == -1) {
+            msg = LOG_DEBUG "[%d] Refresh queue full - %s stays stale\n";
+            printl(msg, id, url);
+            inflight_end(&inflight_fetches, f, false);
+            inflight_release(&inflight_fetches, f);
+        }
+    } else if (f) {
+        inflight_release(&inflight_fetches, f);
+    }
+
+    printl(LOG_DEBUG "[%d] Serving stale %s while it's refreshed\n", id, path);
+
+    return path;
+}
+
+
+long cache_lifetime(long ttl)
+{
+    if (ttl > options.max_ttl)
+        ttl = options.max_ttl;
+
+    if (options.ttl_jitter == 0)
+        return ttl;
+
+    /* Shortened, never lengthened, so it's no fresher than the origin says */
+    return ttl - thread_rand() % (ttl * options.ttl_jitter / 100 + 1);
+}
+
+
+unsigned thread_rand()
+{
+    if (thread_seed == 0)
+        thread_seed = time(NULL) ^ (thread_id + 1) * 2654435761u;
+
+    return rand_r(&thread_seed);
+}
+
+
+void *cache_refresher(void *queue_vptr)
+{
+    workqueue_t *queue = (workqueue_t *)queue_vptr;
+    inflight_t *f;
+    int id = thread_id = global_thread_count++;
+
+    printl(LOG_DEBUG "[%d] Refresh thread running\n", id);
+
+    /* Whatever is still queued at exit is dropped, not fetched */
+    while ((f = workqueue_get(queue)) != NULL) {
+        if (!exit_requested)
+            cache_refresh(f);
+        inflight_end(&inflight_fetches, f, false); /* if not done already */
+        inflight_release(&inflight_fetches, f);
+    }
+
+    printl(LOG_DEBUG "[%d] Refresh thread exiting\n", id);
+
+    pthread_exit(NULL);
+}
+
+
+void cache_refresh(inflight_t *f)
+{
+    request_t req;
+    response_t res;
+    struct sockaddr_in addr = { 0 };
+    const struct timeval timeout = { .tv_sec = INFLIGHT_TIMEOUT_S };
+    char *reqbuf, host[REQ_BUFLEN];
+    size_t len = strlen(f->key) + sizeof("GET  HTTP/1.1\r\n\r\n");
+    bool reused, reusable;
+    int sfd, rval = -1;
+    int id = thread_id;
+
+    printl(LOG_DEBUG "[%d] Refreshing %s\n", id, f->key);
+
+    request_init(&req, -1, &addr);
+    req.thread_id = id;
+
+    if ((reqbuf = malloc(len)) == NULL)
+        goto done;
+
+    len = snprintf(reqbuf, len, "GET %s HTTP/1.1\r\n\r\n", f->key);
+    if (request_deserialize(&req, reqbuf, len) != 0 || !req.complete)
+        goto done;
+
+    if (req.url->port == 80)
+        snprintf(host, sizeof(host), "%s", req.url->host);
+    else
+        snprintf(host, sizeof(host), "%s:%u", req.url->host, req.url->port);
+
+    if (request_add_field(&req, "Host", host) == -1 ||
+        request_lookup_host(&req) == -1)
+        goto done;
+
+    cache_prepare_request(&req);
+
+    addr.sin_addr.s_addr = inet_addr(req.url->ip);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(req.url->port);
+
+    /* Retry if the origin closed a pooled socket while it sat idle */
+    do {
+        if ((sfd = upstream_connect(&req, &addr, &reused)) == -1)
+            break;
+
+        /* A stalled origin can't hold up the refreshes queued behind it */
+        setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        write(sfd, req.raw, req.raw_len);
+
+        response_init(&res);
+        res.thread_id = id;
+        rval = relay_response(&req, &res, sfd, f, &reusable);
+        response_destroy(&res);
+
+        if (rval == 0 && reusable) {
+            connpool_checkin(&upstream_pool, &addr, sfd, false);
+            break;
+        }
+        close(sfd);
+    } while (rval == 1 && reused);
+
+done:
+    free(reqbuf);
+    request_destroy(&req);
+}
+
+
+void cache_prepare_request(request_t *req)
+{
+    cache_record_t rec;
+    cache_index_entry_t e;
+    char *path;
+
+    /* The cache holds the identity copy and makes the gzip one itself */
+    if (options.gzip_min)
+        request_del_field(req, "Accept-Encoding");
+
+    /* The range is served from the cache once the whole object is in it */
+    if (req->range && !options.range_pass) {
+        request_del_field(req, "Range");
+        request_del_field(req, "If-Range");
+    }
+
+    /* A client revalidating its own copy gets the origin's answer */
+    if (req->conditional || req->revalidating ||
+        hashmap_get_stale(&file_cache, req->url->full, &path, NULL) == -1)
+        return;
+
+    if (cache_index_get(&cache_index, path, &rec, &e) == 0) {
+        if (*e.etag &&
+            request_add_field(req, "If-None-Match", e.etag) == 0)
+            req->revalidating = true;
+        if (*e.last_modified &&
+            request_add_field(req, "If-Modified-Since", e.last_modified) == 0)
+            req->revalidating = true;
+    }
+
+    free(path);
+}
+
+
+void cache_gzip_key(const char *url, char *key)
+{
+    snprintf(key, CACHE_KEY_MAX, "%s%s", url, CACHE_GZIP_SUFFIX);
+}
+
+
+void cache_queue_gzip(const char *url)
+{
+    char key[CACHE_KEY_MAX], *msg;
+    inflight_t *f;
+    bool leader;
+    int id = thread_id;
+
+    cache_gzip_key(url, key);
+
+    /* A variant already queued will be made from the newest copy anyway */
+    if ((f = inflight_join(&inflight_fetches, key, &leader)) && leader) {
+        if (workqueue_put(&gzip_queue, f) == -1) {
+            msg = LOG_DEBUG "[%d] Gzip queue full - %s stays uncompressed\n";
+            printl(msg, id, url);
+            inflight_end(&inflight_fetches, f, false);
+            inflight_release(&inflight_fetches, f);
+        }
+    } else if (f) {
+        inflight_release(&inflight_fetches, f);
+    }
+}
+
+
+void *cache_gzipper(void *queue_vptr)
+{
+    workqueue_t *queue = (workqueue_t *)queue_vptr;
+    inflight_t *f;
+    int id = thread_id = global_thread_count++;
+
+    printl(LOG_DEBUG "[%d] Gzip thread running\n", id);
+
+    /* Whatever is still queued at exit is dropped, not compressed */
+    while ((f = workqueue_get(queue)) != NULL) {
+        if (!exit_requested)
+            cache_gzip(f);
+        inflight_end(&inflight_fetches, f, false);
+        inflight_release(&inflight_fetches, f);
+    }
+
+    printl(LOG_DEBUG "[%d] Gzip thread exiting\n", id);
+
+    pthread_exit(NULL);
+}
+
+
+void cache_gzip(inflight_t *f)
+{
+    cache_file_prefix_t prefix;
+    cache_index_entry_t e = { .key = f->key };
+    char header[CACHE_FILE_HEADER_MAX], fields[CACHE_FILE_HEADER_MAX];
+    char *url, *path = NULL, *gzpath = NULL, *msg;
+    const char *line, *next, *end;
+    unsigned long expires;
+    size_t nfields = 0, body_len;
+    ssize_t nread, gzlen = -1;
+    off_t body_off;
+    struct stat st, now_st;
+    int in = -1, out = -1;
+    int id = thread_id;
+
+    url = strndup(f->key, strlen(f->key) - strlen(CACHE_GZIP_SUFFIX));
+
+    /* Made only from a fresh copy, and given the same expiry */
+    if (url == NULL ||
+        hashmap_get_stale(&file_cache, url, &path, &expires) == -1 ||
+        (expires && (time_t)expires <= time(NULL)))
+        goto done;
+
+    if ((in = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(in, &st) == -1)
+        goto done;
+
+    nread = pread(in, header, sizeof(header), 0);
+    if (nread < (ssize_t)sizeof(prefix))
+        goto done;
+
+    memcpy(&prefix, header, sizeof(prefix));
+    body_off = sizeof(prefix) + prefix.fields_len;
+    if (memcmp(prefix.magic, CACHE_FILE_MAGIC, sizeof(prefix.magic)) ||
+        body_off > nread)
+        goto done;
+    body_len = st.st_size - body_off;
+
+    /*
+     * The stored fields carry over, but the variant's bytes differ from the
+     * original's, so its ETag is weakened (RFC 7232 2.1)
+     */
+    line = header + sizeof(prefix);
+    end = header + body_off;
+    for (; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (next - line > 5 && !strncasecmp(line, "ETag:", 5)) {
+            for (line += 5; line < next && (*line == ' ' || *line == '\t');
+                 line++)
+                ;
+            if (next - line < 2 || strncmp(line, "W/", 2))
+                nfields += snprintf(fields + nfields, sizeof(fields) - nfields,
+                                    "ETag: W/");
+            else
+                nfields += snprintf(fields + nfields, sizeof(fields) - nfields,
+                                    "ETag: ");
+        }
+        if (nfields + (next - line) > sizeof(fields))
+            goto done;
+        memcpy(fields + nfields, line, next - line);
+        nfields += next - line;
+    }
+    nfields += snprintf(fields + nfields, sizeof(fields) - nfields,
+                        "Content-Encoding: gzip\r\n");
+    if (sizeof(prefix) + nfields > sizeof(header))
+        goto done;              /* no room for what cache hits read back */
+    prefix.fields_len = nfields;
+
+    if ((gzpath = malloc(strlen(path) + sizeof(".XXXXXX.gz"))) == NULL)
+        goto done;
+    sprintf(gzpath, "%s.XXXXXX.gz", path);
+
+    /* Named uniquely, like the copy it's made from, and only published
+     * once done, so it's never seen half done */
+    out = mkostemps(gzpath, strlen(".gz"), O_CLOEXEC);
+    if (out == -1 ||
+        write(out, &prefix, sizeof(prefix)) != sizeof(prefix) ||
+        write(out, fields, nfields) != (ssize_t)nfields ||
+        (gzlen = gzip_file(in, body_off, body_len, out)) == -1) {
+        msg = LOG_WARN "[%d] Failed to write to %s - %s\n";
+        printl(msg, id, gzpath, strerror(errno));
+        goto done;
+    }
+
+    if ((size_t)gzlen >= body_len) {
+        msg = LOG_DEBUG "[%d] Not gzipping %s - it doesn't shrink\n";
+        printl(msg, id, url);
+        gzlen = -1;
+        goto done;
+    }
+
+    futimens(out, (struct timespec[2]){ { st.st_mtime, 0 },
+                                        { st.st_mtime, 0 } });
+
+    /* The copy it was made from may have been replaced meanwhile */
+    if (stat(path, &now_st) == -1 || now_st.st_ino != st.st_ino) {
+        gzlen = -1;
+        goto done;
+    }
+
+    e.path = gzpath;
+    e.size = sizeof(prefix) + nfields + gzlen;
+    e.stored = st.st_mtime;
+    e.expires = expires;
+
+    if (hashmap_add_expiring(&file_cache, f->key, gzpath, e.size,
+                             expires) == -1) {
+        gzlen = -1;
+        goto done;
+    }
+    cache_index_put(&cache_index, &e);
+    memcache_del(&mem_cache, f->key); /* reload the new copy */
+
+    gzip_variants++;
+    gzip_saved += body_len - gzlen;
+
+    msg = LOG_DEBUG "[%d] Gzip variant created: %s (%zu -> %zd bytes)\n";
+    printl(msg, id, gzpath, body_len, gzlen);
+
+done:
+    if (out > -1) {
+        close(out);
+        if (gzlen == -1)
+            unlink(gzpath);
+    }
+    if (in > -1)
+        close(in);
+    free(gzpath);
+    free(path);
+    free(url);
+}
+
+
+void cache_gzip_renew(const char *url, time_t born, time_t expires)
+{
+    cache_index_entry_t e = { 0 };
+    struct stat st;
+    char key[CACHE_KEY_MAX], *path;
+
+    if (options.gzip_min == 0)
+        return;
+
+    cache_gzip_key(url, key);
+    if (hashmap_get_stale(&file_cache, key, &path, NULL) == -1)
+        return;
+
+    /* The 304 validated the original, so its variant is as fresh */
+    if (stat(path, &st) != -1 &&
+        hashmap_add_expiring(&file_cache, key, path, st.st_size,
+                             expires) != -1) {
+        e.key = key;
+        e.path = path;
+        e.size = st.st_size;
+        e.stored = born;
+        e.expires = expires;
+        cache_index_put(&cache_index, &e);
+        utimensat(AT_FDCWD, path,
+                  (struct timespec[2]){ { born, 0 }, { born, 0 } }, 0);
+        memcache_del(&mem_cache, key); /* Age changed */
+    }
+
+    free(path);
+}
+
+
+void cache_writer_open(cache_writer_t *w, request_t *req, response_t *res,
+                       inflight_t *flight)
+{
+    char header[CACHE_FILE_HEADER_MAX];
+    cache_file_prefix_t prefix = { .magic = CACHE_FILE_MAGIC };
+    const char vary[] = "Vary: Accept-Encoding\r\n";
+    char key[CACHE_KEY_MAX];
+    cache_fill_t *fill;
+    fill_job_t *job;
+    ssize_t nfields;
+    const hashmap_entry_t *origin_vary;
+    char *msg;
+    bool compress;
+    long ttl, age;
+    time_t now = time(NULL);
+    int status = response_status(res);
+    int id = thread_id;
+
+    memset(w, 0, sizeof(cache_writer_t));
+    w->flight = flight;
+
+    if (req->revalidating && status == 304) {
+        w->revalidated = cache_writer_refresh(w, req, res, now) == 0;
+        goto attach;
+    }
+
+    /*
+     * A new response supersedes a stale copy, unlike an error (it may be
+     * passing), a 304 to the client's own validators or an answer to a
+     * Range passed upstream.
+     */
+    if (status < 500 && status != 304 && status != 206 && status != 416) {
+        hashmap_del(&file_cache, req->url->full);
+        cache_gzip_key(req->url->full, key);
+        hashmap_del(&file_cache, key);
+    }
+
+    /* If response is 200, cache file */
+    if (status != 200)
+        goto attach;
+
+    if (response_content_length(res) > CACHE_MAX_OBJECT_BYTES) {
+        msg = LOG_DEBUG "[%d] Not caching %s - larger than %d bytes\n";
+        printl(msg, id, req->url->full, CACHE_MAX_OBJECT_BYTES);
+        goto attach;
+    }
+
+    if (options.cache_bytes &&
+        response_content_length(res) > options.cache_bytes) {
+        msg = LOG_DEBUG "[%d] Not caching %s - larger than the cache\n";
+        printl(msg, id, req->url->full);
+        goto attach;
+    }
+
+    if ((ttl = response_ttl(res, now, options.cache_timeout, &age)) == 0) {
+        msg = LOG_DEBUG "[%d] Not caching %s - not cacheable or stale\n";
+        printl(msg, id, req->url->full);
+        goto attach;
+    }
+
+    /* Hits replay the origin's header, stored ahead of the body */
+    nfields = response_stored_fields(res, header + sizeof(prefix),
+                                     sizeof(header) - sizeof(prefix));
+    if (nfields == -1) {
+        msg = LOG_DEBUG "[%d] Not caching %s - header too large\n";
+        printl(msg, id, req->url->full);
+        goto attach;
+    }
+
+    /* Either copy may be served, so caches downstream must key on both */
+    compress = options.gzip_min && response_compressible(res);
+    origin_vary = hashmap_borrow(&res->header.fields, "Vary");
+    if (compress && !cache_control_has(origin_vary ? origin_vary->value :
+                                       NULL, "Accept-Encoding", NULL)) {
+        if (sizeof(prefix) + nfields + strlen(vary) > sizeof(header)) {
+            msg = LOG_DEBUG "[%d] Not caching %s - header too large\n";
+            printl(msg, id, req->url->full);
+            hashmap_release(origin_vary);
+            goto attach;
+        }
+        memcpy(header + sizeof(prefix) + nfields, vary, strlen(vary));
+        nfields += strlen(vary);
+    }
+    hashmap_release(origin_vary);
+    prefix.fields_len = nfields;
+    memcpy(header, &prefix, sizeof(prefix));
+
+    if ((fill = calloc(1, sizeof(cache_fill_t))) == NULL)
+        goto attach;
+
+    fill->fd = -1;
+    fill->body_off = sizeof(prefix) + nfields;
+    fill->born = now - age;
+    fill->expires = now + cache_lifetime(ttl);
+    fill->compress = compress;
+
+    /* Attached readers can only stream a body whose length they know */
+    fill->len_known = !response_chunked(res) &&
+        hashmap_get(&res->header.fields, "Content-Length", NULL) != -1;
+    fill->len = fill->body_off + response_content_length(res);
+
+    /* Kept to revalidate the copy once it's stale */
+    hashmap_get(&res->header.fields, "ETag", &fill->etag);
+    hashmap_get(&res->header.fields, "Last-Modified", &fill->last_modified);
+
+    /* Made now so closing the fill can't fail for lack of memory */
+    if (options.fill_threads)
+        w->close_job = fill_job_new(fill, FILL_CLOSE, NULL, 0);
+
+    if ((fill->key = strdup(req->url->full)) == NULL ||
+        (fill->path = url_to_cache_path(req->url)) == NULL ||
+        (options.fill_threads && w->close_job == NULL)) {
+        free(w->close_job);
+        w->close_job = NULL;
+        cache_fill_close(fill, false);
+        goto attach;
+    }
+
+    /* Whichever thread writes the file tells attached readers how it went */
+    if (flight) {
+        inflight_defer(&inflight_fetches, flight);
+        fill->flight = flight;
+    }
+
+    if (options.fill_threads) {
+        w->queue = &fill_queues[fill_next++ % options.fill_threads];
+        job = fill_job_new(fill, FILL_OPEN, header, fill->body_off);
+        if (job == NULL || fill_put(w->queue, job) == -1) {
+            free(job);
+            free(w->close_job);
+            w->close_job = NULL;
+            w->queue = NULL;
+            cache_fill_close(fill, false);
+            return;
+        }
+    } else if (cache_fill_open(fill, header, fill->body_off) == -1) {
+        cache_fill_close(fill, false);
+        return;
+    }
+
+    w->fill = fill;
+
+    return;
+
+attach:
+    if (flight == NULL)
+        return;
+
+    /* A refreshed copy (one given a new expiry) is whole in the cache */
+    if (w->revalidated && w->expires) {
+        inflight_start(&inflight_fetches, flight, w->path, w->off, true);
+        inflight_progress(&inflight_fetches, flight, w->off);
+        inflight_end(&inflight_fetches, flight, true);
+    } else {
+        inflight_end(&inflight_fetches, flight, false);
+    }
+}
+
+
+int cache_writer_refresh(cache_writer_t *w, request_t *req, response_t *res,
+                         time_t now)
+{
+    cache_record_t rec;
+    cache_index_entry_t e = { .key = req->url->full };
+    struct timespec born[2];
+    struct stat st;
+    long ttl, age, lifetime = options.cache_timeout;
+    const hashmap_entry_t *etag = NULL, *last_modified = NULL;
+    char *msg;
+    int id = thread_id;
+
+    if (hashmap_get_stale(&file_cache, req->url->full, &w->path,
+                          NULL) == -1 ||
+        stat(w->path, &st) == -1) {
+        msg = LOG_DEBUG "[%d] Stale copy of %s gone before its 304\n";
+        printl(msg, id, req->url->full);
+        free(w->path);
+        w->path = NULL;
+        return -1;
+    }
+
+    w->off = st.st_size;
+
+    /* What the 304 leaves out still holds from the stored response */
+    if (cache_index_get(&cache_index, w->path, &rec, &e) == 0 && e.expires)
+        lifetime = e.expires - e.stored;
+    etag = hashmap_borrow(&res->header.fields, "ETag");
+    last_modified = hashmap_borrow(&res->header.fields, "Last-Modified");
+    if (etag)
+        e.etag = etag->value;
+    if (last_modified)
+        e.last_modified = last_modified->value;
+
+    /* If the origin now forbids caching, this copy is still valid once */
+    if ((ttl = response_ttl(res, now, lifetime, &age)) > 0) {
+        w->born = now - age;
+        w->expires = now + cache_lifetime(ttl);
+
+        if (hashmap_add_expiring(&file_cache, req->url->full, w->path,
+                                 w->off, w->expires) != -1) {
+            e.path = w->path;
+            e.size = w->off;
+            e.stored = w->born;
+            e.expires = w->expires;
+            cache_index_put(&cache_index, &e);
+
+            born[0].tv_sec = born[1].tv_sec = w->born;
+            born[0].tv_nsec = born[1].tv_nsec = 0;
+            utimensat(AT_FDCWD, w->path, born, 0);
+            memcache_del(&mem_cache, req->url->full); /* Age changed */
+            cache_gzip_renew(req->url->full, w->born, w->expires);
+
+            printl(LOG_DEBUG "[%d] Cache entry revalidated: %s\n", id,
+                   w->path);
+        } else {
+            w->expires = 0;
+        }
+    }
+
+    hashmap_release(etag);
+    hashmap_release(last_modified);
+
+    return 0;
+}
+
+
+void cache_writer_sink(void *writer_vptr, const char *buf, size_t len)
+{
+    cache_writer_t *w = (cache_writer_t *)writer_vptr;
+    fill_job_t *job;
+    char *msg;
+    int id = thread_id;
+
+    if (w->fill == NULL || w->failed)
+        return;
+
+    /* A chunked or close-delimited body only shows its size as it arrives */
+    if (w->body_len + len > CACHE_MAX_OBJECT_BYTES) {
+        msg = LOG_DEBUG "[%d] Not caching %s - larger than %d bytes\n";
+        printl(msg, id, w->fill->key, CACHE_MAX_OBJECT_BYTES);
+        w->failed = true;
+        return;
+    }
+    w->body_len += len;
+
+    if (w->queue == NULL) {
+        cache_fill_write(w->fill, buf, len);
+        return;
+    }
+
+    /* A fill thread that falls behind loses the copy, not the client time */
+    if ((job = fill_job_new(w->fill, FILL_WRITE, buf, len)) == NULL ||
+        fill_put(w->queue, job) == -1) {
+        msg = LOG_DEBUG "[%d] Not caching %s - fill queue full\n";
+        printl(msg, id, w->fill->key);
+        free(job);
+        w->failed = true;
+    }
+}
+
+
+void cache_writer_progress(cache_writer_t *w)
+{
+    /* A fill thread tells readers itself as its writes land */
+    if (w->fill && w->queue == NULL && w->fill->flight && !w->fill->failed)
+        inflight_progress(&inflight_fetches, w->fill->flight, w->fill->off);
+}
+
+
+void cache_writer_close(cache_writer_t *w, bool complete)
+{
+    char *msg;
+    int id = thread_id;
+
+    if (w->fill && w->queue) {
+        w->close_job->complete = complete && !w->failed;
+        if (fill_put(w->queue, w->close_job) == -1) {
+            /* Only once the fill threads are gone, at exit */
+            msg = LOG_DEBUG "[%d] Fill of %s left unfinished at exit\n";
+            printl(msg, id, w->fill->key);
+            free(w->close_job);
+        }
+    } else if (w->fill) {
+        cache_fill_close(w->fill, complete && !w->failed);
+    }
+
+    free(w->path);
+    w->fill = NULL;
+    w->queue = NULL;
+    w->close_job = NULL;
+    w->path = NULL;
+}
+
+
+void *cache_filler(void *queue_vptr)
+{
+    fill_queue_t *queue = (fill_queue_t *)queue_vptr;
+    fill_job_t *job;
+    cache_fill_t *fill;
+    int id = thread_id = global_thread_count++;
+
+    printl(LOG_DEBUG "[%d] Fill thread running\n", id);
+
+    /* Everything queued is run, even at exit, so no fill is left open */
+    while ((job = fill_get(queue)) != NULL) {
+        fill = (cache_fill_t *)job->fill;
+
+        switch (job->op) {
+        case FILL_OPEN:
+            if (cache_fill_open(fill, job->data, job->len) == -1 &&
+                fill->flight)
+                inflight_end_deferred(&inflight_fetches, fill->flight, false);
+            break;
+        case FILL_WRITE:
+            cache_fill_write(fill, job->data, job->len);
+            if (fill->flight && !fill->failed)
+                inflight_progress(&inflight_fetches, fill->flight, fill->off);
+            break;
+        case FILL_CLOSE:
+            cache_fill_close(fill, job->complete);
+            break;
+        }
+
+        fill_done(queue, job);
+    }
+
+    printl(LOG_DEBUG "[%d] Fill thread exiting\n", id);
+
+    pthread_exit(NULL);
+}
+
+
+int cache_fill_open(cache_fill_t *fill, const char *header, size_t len)
+{
+    char cache_dir[REQ_BUFLEN] = "";
+    char *path, *msg;
+    size_t len0 = strlen(fill->path);
+    int id = thread_id;
+
+    if ((path = realloc(fill->path, len0 + sizeof(".XXXXXX"))) == NULL) {
+        fill->failed = true;
+        return -1;
+    }
+    fill->path = path;
+
+    /* Each copy is named uniquely, so the unlink of a copy it replaces, or
+     * of one a fetch that wasn't coalesced wrote, can't hit this one */
+    strcpy(fill->path + len0, ".XXXXXX");
+    fill->fd = mkostemp(fill->path, O_CLOEXEC);
+
+    /* Fan-out directories are made the first time an object lands in them */
+    if (fill->fd == -1 && errno == ENOENT) {
+        snprintf(cache_dir, REQ_BUFLEN, "%.*s", CACHE_FANOUT_LEN(1),
+                 fill->path);
+        mkdir(cache_dir, DIR_PERMS);
+        snprintf(cache_dir, REQ_BUFLEN, "%.*s", CACHE_FANOUT_LEN(2),
+                 fill->path);
+        mkdir(cache_dir, DIR_PERMS);
+        strcpy(fill->path + len0, ".XXXXXX");
+        fill->fd = mkostemp(fill->path, O_CLOEXEC);
+    }
+
+    if (fill->fd == -1) {
+        msg = LOG_WARN "[%d] Failed to open %s - %s\n";
+        printl(msg, id, fill->path, strerror(errno));
+        fill->failed = true;
+        return -1;
+    }
+
+    /* Written now, not queued, so attached readers can read it at once */
+    if (write(fill->fd, header, len) != (ssize_t)len) {
+        msg = LOG_WARN "[%d] Failed to write to %s - %s\n";
+        printl(msg, id, fill->path, strerror(errno));
+        fill->failed = true;
+        return -1;
+    }
+    fill->off = len;
+
+    if (fill->flight)
+        inflight_start(&inflight_fetches, fill->flight, fill->path,
+                       fill->len, fill->len_known);
+
+    return 0;
+}
+
+
+void cache_fill_write(cache_fill_t *fill, const char *buf, size_t len)
+{
+    char *msg;
+    int id = thread_id;
+
+    if (fill->fd < 0 || fill->failed)
+        return;
+
+    if (cache_write(fill->fd, buf, len, &fill->off) == -1) {
+        msg = LOG_WARN "[%d] Failed to write to %s - %s\n";
+        printl(msg, id, fill->path, strerror(errno));
+        fill->failed = true;
+    }
+}
+
+
+void cache_fill_close(cache_fill_t *fill, bool complete)
+{
+    cache_index_entry_t e;
+    char *msg;
+    int id = thread_id;
+
+    if (fill->fd < 0) {
+        complete = false;
+        goto done;
+    }
+
+    /* Queued writes must land before the file is closed */
+    if (thread_ring && uring_run(thread_ring) == -1) {
+        msg = LOG_WARN "[%d] Failed to write to %s - %s\n";
+        printl(msg, id, fill->path, strerror(errno));
+        fill->failed = true;
+    }
+
+    /* The file's mtime carries the response's age across restarts */
+    futimens(fill->fd, (struct timespec[2]){ { fill->born, 0 },
+                                             { fill->born, 0 } });
+    close(fill->fd);
+
+    complete = complete && !fill->failed;
+    if (!complete) {
+        unlink(fill->path);     /* never serve a truncated body */
+        goto done;
+    }
+
+    /* Only a copy that's whole at its path is published */
+    memcache_del(&mem_cache, fill->key); /* reload the new copy */
+    /* Colder entries are evicted to make room */
+    if (hashmap_add_expiring(&file_cache, fill->key, fill->path, fill->off,
+                             fill->expires) == -1) {
+        msg = LOG_DEBUG "[%d] Not caching %s - larger than the cache\n";
+        printl(msg, id, fill->path);
+        unlink(fill->path);
+        complete = false;
+        goto done;
+    }
+
+    printl(LOG_DEBUG "[%d] Cache entry created: %s\n", id, fill->path);
+    e.key = fill->key;
+    e.path = fill->path;
+    e.size = fill->off;
+    e.stored = fill->born;
+    e.expires = fill->expires;
+    e.etag = fill->etag;
+    e.last_modified = fill->last_modified;
+    if (cache_index_put(&cache_index, &e) == -1) {
+        msg = LOG_DEBUG "[%d] %s not indexed - lost at exit\n";
+        printl(msg, id, fill->path);
+    }
+    if (fill->compress &&
+        (size_t)(fill->off - fill->body_off) >= options.gzip_min)
+        cache_queue_gzip(fill->key);
+
+done:
+    /* Readers see the last bytes before they're told the body is whole */
+    if (fill->flight) {
+        if (complete)
+            inflight_progress(&inflight_fetches, fill->flight, fill->off);
+        inflight_end_deferred(&inflight_fetches, fill->flight, complete);
+        inflight_release(&inflight_fetches, fill->flight);
+    }
+
+    free(fill->key);
+    free(fill->path);
+    free(fill->etag);
+    free(fill->last_modified);
+    free(fill);
+}
+
+
+int send_error(request_t *req, int status)
+{
+    response_t res;
+    char *msg, *resbuf;
+    size_t resbuflen;
+    int nsent;
+    int id = thread_id;
+
+    response_init_from_request(req, &res, status, NULL, 0);
+    response_serialize(&res, &resbuf, &resbuflen);
+
+    printl("-> %s %s\n", req->ip, res.header.status_line);
+
+    if ((nsent = write(req->client_fd, resbuf, resbuflen)) < 0) {
         msg = LOG_WARN "[%d] Socket write failed - %s\n";
         printl(msg, id, strerror(errno));
     }
@@ -472,14 +2772,48 @@ int send_error(request_t *req, int status)
 }
 
 
-int initialize_listener(struct sockaddr_in *saddr, int *fd)
+int parse_size(const char *str, size_t *size)
+{
+    char *end;
+    unsigned long long n;
+
+    errno = 0;
+    n = strtoull(str, &end, 10);
+    if (errno || end == str || *str == '-')
+        return -1;
+
+    switch (*end) {
+    case 'G': case 'g':
+        n *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        n *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        n *= 1024;
+        end++;
+        break;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    *size = n;
+
+    return 0;
+}
+
+
+int initialize_listener(struct sockaddr_in *saddr, int backlog, bool reuseport,
+                        int *fd)
 {
     const int on = 1;
     socklen_t addr_sz = sizeof(struct sockaddr_in);
+    int rval;
     int id = thread_id;
 
     /* Setup listener socket */
-    *fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, IPPROTO_TCP);
+    *fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, IPPROTO_TCP);
     if (*fd == -1) {
         printl(LOG_ERR "[%d] socket - %s\n", id, strerror(errno));
         return errno;
@@ -487,30 +2821,88 @@ int initialize_listener(struct sockaddr_in *saddr, int *fd)
 
     if ((setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) < 0) {
         printl(LOG_ERR "[%d] setsockopt - %s\n", id, strerror(errno));
-        return errno;
+        goto error;
+    }
+
+    /* Let the kernel spread connections across all listeners on the port */
+    if (reuseport &&
+        (setsockopt(*fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) < 0) {
+        printl(LOG_ERR "[%d] setsockopt - %s\n", id, strerror(errno));
+        goto error;
     }
     printl(LOG_DEBUG "[%d] Created listener socket %d\n", id, *fd);
 
     if (bind(*fd, (struct sockaddr *)saddr, addr_sz) < 0) {
         printl(LOG_ERR "[%d] bind - %s\n", id, strerror(errno));
-        return errno;
+        goto error;
     }
     printl(LOG_DEBUG "[%d] Bind succeeded\n", id);
 
-    if (listen(*fd, MAX_BACKLOG) < 0) {
+    if (listen(*fd, backlog) < 0) {
         printl(LOG_ERR "[%d] listen - %s\n", id, strerror(errno));
-        return errno;
+        goto error;
     };
 
     return 0;
+
+error:
+    rval = errno;
+    close(*fd);
+    *fd = -1;
+    return rval;
+}
+
+
+int pin_to_cpu(int cpu)
+{
+    int rval;
+    cpu_set_t set;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int id = thread_id;
+
+    if (ncpus < 1)
+        ncpus = 1;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+
+    rval = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (rval)
+        printl(LOG_WARN "[%d] pthread_setaffinity_np - %s\n", id,
+               strerror(rval));
+    else
+        printl(LOG_DEBUG "[%d] Pinned to CPU %ld\n", id, cpu % ncpus);
+
+    return rval;
 }
 
 
-void parse_options(int argc, char *argv[], int *port, int *cache_timeout)
+void parse_options(int argc, char *argv[], options_t *opts)
 {
     int c, id = thread_id;
     char *msg, *portstr, *timeoutstr;
 
+    opts->epoll = false;
+    opts->nworkers = 0;
+    opts->queue_depth = DEFAULT_QUEUE_DEPTH;
+    opts->reject_when_full = false;
+    opts->nlisteners = 1;
+    opts->backlog = DEFAULT_BACKLOG;
+    opts->io_uring = false;
+    opts->cache_bytes = DEFAULT_CACHE_BYTES;
+    opts->cache_objects = 0;
+    opts->mem_cache_bytes = DEFAULT_MEM_CACHE_BYTES;
+    opts->mem_object_max = DEFAULT_MEM_OBJECT_MAX;
+    opts->max_ttl = DEFAULT_MAX_TTL_S;
+    opts->stale_while_revalidate = 0;
+    opts->ttl_jitter = DEFAULT_TTL_JITTER_PCT;
+    opts->gzip_min = gzip_available() ? DEFAULT_GZIP_MIN : 0;
+    opts->range_pass = false;
+    opts->fill_threads = DEFAULT_FILL_THREADS;
+    opts->nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts->nloops < 1)
+        opts->nloops = 1;
+
     /* Parse cmdline options */
     while ((c = getopt_long(argc, argv, shortopts, longopts, 0)) != -1) {
         switch (c) {
@@ -521,6 +2913,141 @@ void parse_options(int argc, char *argv[], int *port, int *cache_timeout)
         case 'd':
             printl_setlevel(DEBUG);
             break;
+        case 'e':
+            opts->epoll = true;
+            break;
+        case 'l':
+            opts->nloops = atoi(optarg);
+            if (opts->nloops < 1) {
+                printl(LOG_FATAL "Invalid number of loops `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            opts->nworkers = atoi(optarg);
+            if (opts->nworkers < 1) {
+                printl(LOG_FATAL "Invalid number of workers `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            opts->queue_depth = atoi(optarg);
+            if (opts->queue_depth < 1) {
+                printl(LOG_FATAL "Invalid queue depth `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            opts->reject_when_full = true;
+            break;
+        case 's':
+            opts->nlisteners = atoi(optarg);
+            if (opts->nlisteners < 1) {
+                printl(LOG_FATAL "Invalid number of listeners `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            opts->io_uring = true;
+            break;
+        case 'c':
+            if (parse_size(optarg, &opts->cache_bytes) == -1) {
+                printl(LOG_FATAL "Invalid cache size `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            if (parse_size(optarg, &opts->cache_objects) == -1) {
+                printl(LOG_FATAL "Invalid cache object count `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            if (parse_size(optarg, &opts->mem_cache_bytes) == -1) {
+                printl(LOG_FATAL "Invalid memory cache size `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            if (parse_size(optarg, &opts->mem_object_max) == -1 ||
+                opts->mem_object_max > MEMCACHE_PAGE_SIZE) {
+                printl(LOG_FATAL "Invalid memory object size `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            opts->max_ttl = atol(optarg);
+            if (opts->max_ttl < 1) {
+                printl(LOG_FATAL "Invalid max TTL `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            opts->stale_while_revalidate = atol(optarg);
+            if (opts->stale_while_revalidate < 0 ||
+                opts->stale_while_revalidate > CACHE_STALE_KEEP_S) {
+                msg = LOG_FATAL "Invalid stale-while-revalidate `%s'\n";
+                printl(msg, optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            opts->ttl_jitter = atoi(optarg);
+            if (opts->ttl_jitter < 0 || opts->ttl_jitter > 100) {
+                printl(LOG_FATAL "Invalid TTL jitter `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            if (parse_size(optarg, &opts->gzip_min) == -1) {
+                printl(LOG_FATAL "Invalid gzip minimum `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            if (opts->gzip_min && !gzip_available()) {
+                printl(LOG_FATAL "toyproxy was built without zlib support\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            if (!strcmp(optarg, "pass")) {
+                opts->range_pass = true;
+            } else if (!strcmp(optarg, "fetch")) {
+                opts->range_pass = false;
+            } else {
+                printl(LOG_FATAL "Invalid range miss policy `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            opts->fill_threads = atoi(optarg);
+            if (opts->fill_threads < 0) {
+                msg = LOG_FATAL "Invalid number of fill threads `%s'\n";
+                printl(msg, optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            opts->backlog = atoi(optarg);
+            if (opts->backlog < 1) {
+                printl(LOG_FATAL "Invalid backlog `%s'\n", optarg);
+                printf(usage, argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case '?':
             /* handled by getopt */
             break;
@@ -538,20 +3065,20 @@ void parse_options(int argc, char *argv[], int *port, int *cache_timeout)
 
     /* Check port */
     portstr = argv[optind++];
-    *port = atoi(portstr);
-    if (*port < 1) {
+    opts->port = atoi(portstr);
+    if (opts->port < 1) {
         printl(LOG_FATAL "Invalid port `%s'\n", portstr);
         printf(usage, argv[0]);
         exit(EXIT_FAILURE);
     }
 
     if (n_posargs == 1) {
-        *cache_timeout = DEFAULT_CACHE_TIMEOUT_S;
+        opts->cache_timeout = DEFAULT_CACHE_TIMEOUT_S;
     } else {
         /* Check timeout */
         timeoutstr = argv[optind++];
-        *cache_timeout = atoi(timeoutstr);
-        if (*cache_timeout < 1) {
+        opts->cache_timeout = atoi(timeoutstr);
+        if (opts->cache_timeout < 1) {
             printl(LOG_FATAL "Invalid cache timeout `%s'\n", timeoutstr);
             printf(usage, argv[0]);
             exit(EXIT_FAILURE);
@@ -559,7 +3086,104 @@ void parse_options(int argc, char *argv[], int *port, int *cache_timeout)
     }
 
     msg = LOG_DEBUG "[%d] Cache timeout set to %d seconds\n";
-    printl(msg, id, *cache_timeout);
+    printl(msg, id, opts->cache_timeout);
+
+    if (opts->epoll && (opts->nworkers || opts->reject_when_full ||
+                        opts->queue_depth != DEFAULT_QUEUE_DEPTH)) {
+        printl(LOG_FATAL "Worker pool options can't be used with --epoll\n");
+        printf(usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->io_uring && opts->epoll) {
+        printl(LOG_FATAL "--io-uring can't be used with --epoll\n");
+        printf(usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts->io_uring && !uring_available()) {
+        printl(LOG_FATAL "toyproxy was built without io_uring support\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void cache_restore()
+{
+    size_t restored = 0;
+    size_t nslots = CACHE_INDEX_SLOTS;
+    int id = thread_id;
+
+    /* Half full at most, so probes stay short */
+    if (options.cache_objects)
+        nslots = 2 * options.cache_objects;
+
+    if (cache_index_open(&cache_index, CACHE_INDEX_FILE, nslots) == -1) {
+        printl(LOG_WARN "[%d] Failed to open cache index %s - %s\n", id,
+               CACHE_INDEX_FILE, strerror(errno));
+        return;
+    }
+
+    cache_index_load(&cache_index, cache_restore_entry, &restored);
+
+    printl(LOG_INFO "Restored %zu cached objects (%zu bytes) from %s\n",
+           restored, file_cache.bytes, CACHE_INDEX_FILE);
+}
+
+
+bool cache_restore_entry(void *count_vptr, const cache_index_entry_t *e)
+{
+    struct stat st;
+    char *msg;
+    time_t expires = e->expires;
+    int id = thread_id;
+
+    /* The file must still be the one the index describes */
+    if (stat(e->path, &st) == -1 || (size_t)st.st_size != e->size) {
+        msg = LOG_DEBUG "[%d] Cache file %s is missing or changed\n";
+        printl(msg, id, e->path);
+        unlink(e->path);
+        return false;
+    }
+
+    if (!expires)
+        expires = e->stored + options.cache_timeout;
+
+    /* A stale object is kept a while longer, to be revalidated */
+    if (time(NULL) >= expires + CACHE_STALE_KEEP_S) {
+        printl(LOG_DEBUG "[%d] Removing cache entry %s\n", id, e->key);
+        unlink(e->path);
+        return false;
+    }
+
+    /* Over a smaller budget than last run, the excess is evicted here */
+    if (hashmap_add_expiring(&file_cache, e->key, e->path, e->size,
+                             expires) == -1) {
+        unlink(e->path);
+        return false;
+    }
+
+    (*(size_t *)count_vptr)++;
+
+    return true;
+}
+
+
+int cache_unlink(const char *path)
+{
+    cache_index_del(&cache_index, path);
+
+    return unlink(path);
+}
+
+
+void cache_destroy()
+{
+    file_cache.unlinker = NULL;
+    hashmap_destroy(&file_cache);
+    memcache_destroy(&mem_cache);
+    inflight_map_destroy(&inflight_fetches);
+    cache_index_close(&cache_index);
 }
 
 
@@ -567,14 +3191,25 @@ void *cache_gc(void *cache_vptr)
 {
     hashmap_t *cache = (hashmap_t *)cache_vptr;
     unsigned int clk = 0;
+    sigset_t set;
     int id = thread_id = global_thread_count++;
 
     printl(LOG_DEBUG "[%d] Cache GC running\n", id);
 
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
     while (!exit_requested) {
         usleep(100000);         /* check exit_requested 10 times a second */
-        if (!(clk++ % 10))
+        if (stats_requested) {
+            stats_requested = false;
+            cache_log_stats();
+        }
+        if (!(clk++ % 10)) {
             hashmap_gc(cache);  /* run gc only once a second */
+            connpool_expire(&upstream_pool);
+        }
     }
 
     printl(LOG_DEBUG "[%d] Cache GC exiting\n", id);
@@ -583,63 +3218,119 @@ void *cache_gc(void *cache_vptr)
 }
 
 
-char *url_to_cache_path(const url_t *url)
+void cache_log_stats()
 {
-    char *p = strdup(url->path);
-    char *cache_path = malloc(strlen(CACHE_ROOT) + strlen(url->host) +
-                              strlen(url->path) + 3);
+    char *msg;
+    size_t size, bytes, npages;
+    unsigned long hits, misses, evictions;
+    hashmap_stats_t disk;
+
+    hashmap_stats(&file_cache, &disk);
+
+    msg = LOG_INFO "Disk cache: %zu objects, %zu of %zu bytes (%.1f%%), "
+        "%lu hits, %lu misses, %lu evicted, %lu expired\n";
+    printl(msg, disk.size, disk.bytes, options.cache_bytes,
+           options.cache_bytes ?
+           100.0 * disk.bytes / options.cache_bytes : 0.0,
+           disk.hits, disk.misses, disk.evictions, disk.expirations);
+
+    pthread_mutex_lock(&mem_cache.lock);
+    size = mem_cache.size;
+    bytes = mem_cache.bytes;
+    npages = mem_cache.npages;
+    hits = mem_cache.hits;
+    misses = mem_cache.misses;
+    evictions = mem_cache.evictions;
+    pthread_mutex_unlock(&mem_cache.lock);
+
+    msg = LOG_INFO "Memory cache: %zu objects, %zu bytes in %zu of %zu "
+        "pages, %lu hits, %lu misses, %lu evicted\n";
+    printl(msg, size, bytes, npages, mem_cache.max_pages, hits, misses,
+           evictions);
+
+    pthread_mutex_lock(&inflight_fetches.lock);
+    hits = inflight_fetches.coalesced;
+    pthread_mutex_unlock(&inflight_fetches.lock);
+
+    printl(LOG_INFO "Misses coalesced onto a fetch in flight: %lu\n", hits);
+
+    if (fill_queues) {
+        hits = misses = 0;
+        for (int i = 0; i < options.fill_threads; i++) {
+            pthread_mutex_lock(&fill_queues[i].jobs.lock);
+            hits += fill_queues[i].jobs.queued;
+            pthread_mutex_unlock(&fill_queues[i].jobs.lock);
+            pthread_mutex_lock(&fill_queues[i].lock);
+            misses += fill_queues[i].dropped;
+            pthread_mutex_unlock(&fill_queues[i].lock);
+        }
 
-    /* Replace illegal path characters */
-    for (int i = 0; p[i] != '\0'; i++)
-        if (p[i] == '/')
-            p[i] = '_';
+        msg = LOG_INFO "Cache fills written behind: %lu jobs queued, "
+            "%lu fills dropped with the queue full\n";
+        printl(msg, hits, misses);
+    }
 
-    sprintf(cache_path, "%s/%s/%s", CACHE_ROOT, url->host, p);
-    free(p);
+    if (options.stale_while_revalidate) {
+        pthread_mutex_lock(&refresh_queue.lock);
+        hits = refresh_queue.queued;
+        misses = refresh_queue.dropped;
+        pthread_mutex_unlock(&refresh_queue.lock);
 
-    return cache_path;
+        msg = LOG_INFO "Stale objects served: %lu refreshes queued, "
+            "%lu dropped\n";
+        printl(msg, hits, misses);
+    }
+
+    if (options.gzip_min) {
+        pthread_mutex_lock(&gzip_queue.lock);
+        misses = gzip_queue.dropped;
+        pthread_mutex_unlock(&gzip_queue.lock);
+
+        msg = LOG_INFO "Gzip variants: %lu made, %lu bytes saved, "
+            "%lu dropped\n";
+        printl(msg, (unsigned long)gzip_variants,
+               (unsigned long)gzip_saved, misses);
+    }
 }
 
 
-void save_cache_file(response_t *res, char *path)
+char *url_to_cache_path(const url_t *url)
 {
-    size_t content_length, chunk_length;
-    char *msg, *chunk_end;
-    const char *chunk_start;
-    FILE *file;
-    int id = thread_id;
+    char hex[HASH128_HEX_LEN + 1];
+    char *cache_path = malloc(CACHE_FANOUT_LEN(2) + HASH128_HEX_LEN + 2);
 
-    if ((file = fopen(path, "w")) == NULL) {
-        msg = LOG_WARN "[%d] Failed to open %s - %s\n";
-        printl(msg, id, path, strerror(errno));
-        return;
-    }
+    if (cache_path == NULL)
+        return NULL;
 
-    if (response_chunked(res)) {
-        /* Response specified Transfer-Encoding: chunked */
-        chunk_start = res->content;
-        while ((chunk_length = strtoul(chunk_start, &chunk_end, 16))) {
-            if (chunk_length == 0)
-                break;
+    hash128_hex(hash128(url->full, strlen(url->full), 0), hex);
 
-            chunk_start = chunk_end + 2; /* step over length and \r\n */
+    /* e.g., .cache/3f/a9/3fa9... */
+    sprintf(cache_path, "%s/%.2s/%.2s/%s", CACHE_ROOT, hex, hex + 2, hex);
 
-            if (fwrite(chunk_start, 1, chunk_length, file) != chunk_length) {
-                msg = LOG_WARN "[%d] Failed to write to %s - %s";
-                printl(msg, id, path, strerror(errno));
-            }
-        }
-    } else {
-        /* Response specified Content-Length: xxx */
-        content_length = response_content_length(res);
+    return cache_path;
+}
 
-        if (fwrite(res->content, 1, content_length, file) != content_length) {
-            msg = LOG_WARN "[%d] Failed to write to %s - %s";
-            printl(msg, id, path, strerror(errno));
-        }
+
+int cache_write(int fd, const char *buf, size_t len, off_t *off)
+{
+    ssize_t nwritten;
+
+    if (thread_ring) {
+        if (uring_queue_write(thread_ring, fd, buf, len, *off) == -1)
+            return -1;
+        *off += len;
+        return 0;
     }
 
-    fclose(file);
+    while (len) {
+        if ((nwritten = write(fd, buf, len)) < 0)
+            return -1;
+        buf += nwritten;
+        len -= nwritten;
+        *off += nwritten;
+    }
+
+    return 0;
 }
 
 
@@ -0,0 +1,261 @@
+#ifndef TOYPROXY_H
+#define TOYPROXY_H
+
+#include <netinet/in.h>         /* struct sockaddr_in */
+#include <stdatomic.h>          /* atomic_* */
+#include <stdbool.h>            /* bool */
+#include <stdint.h>             /* uint32_t */
+#include <sys/stat.h>           /* struct stat */
+
+#include "cacheindex.h"
+#include "connpool.h"
+#include "fill.h"
+#include "hash.h"
+#include "hashmap.h"
+#include "inflight.h"
+#include "memcache.h"
+#include "request.h"
+#include "response.h"
+#include "url.h"
+#include "uring.h"
+
+#define CACHE_ROOT ".cache"
+/* Length of a cache path's first `n' two-hex-digit fan-out directories */
+#define CACHE_FANOUT_LEN(n) ((int)sizeof(CACHE_ROOT) - 1 + 3 * (n))
+#define CACHE_INDEX_FILE CACHE_ROOT "/.index" /* persistent cache index */
+#define CACHE_INDEX_SLOTS 16384 /* index slots unless --cache-objects is set */
+#define CACHE_FILE_MAGIC "TOYOBJ1" /* starts every cache file */
+#define CACHE_GZIP_SUFFIX " gzip" /* a URL plus this keys its gzip variant */
+#define CACHE_KEY_MAX (REQ_BUFLEN + sizeof(CACHE_GZIP_SUFFIX))
+/* Most a cache file holds ahead of the body */
+#define CACHE_FILE_HEADER_MAX (sizeof(cache_file_prefix_t) + RES_BUFLEN)
+#define BLACKLIST_FILE "blacklist.txt"
+#define DIR_PERMS 0700
+#define DEFAULT_BACKLOG 100     /* Max connections before ECONNREFUSED error */
+#define ACCEPT_BATCH 64         /* Max connections accepted per wakeup */
+#define KEEPALIVE_TIMEOUT_S 10
+#define DEFAULT_CACHE_TIMEOUT_S 60
+#define DEFAULT_MAX_TTL_S 86400 /* Longest an origin can keep objects fresh */
+#define CACHE_STALE_KEEP_S 86400 /* Expired objects kept for revalidation */
+#define DEFAULT_TTL_JITTER_PCT 10 /* Most an object's lifetime is cut short */
+#define DEFAULT_QUEUE_DEPTH 128  /* Accepted sockets waiting for a worker */
+#define CLIENT_IO_TIMEOUT_S 10  /* Max stall on a worker's client socket */
+#define RELAY_BUFLEN 16384      /* Response bytes buffered per connection */
+#define SPLICE_LEN 65536        /* Bytes spliced per call (default pipe size) */
+#define CACHE_MAX_OBJECT_BYTES 67108864 /* Larger bodies aren't cached */
+#define DEFAULT_CACHE_BYTES 1073741824 /* disk cache budget */
+#define DEFAULT_MEM_CACHE_BYTES 67108864 /* RAM tier budget */
+#define DEFAULT_MEM_OBJECT_MAX 262144 /* Largest object held in RAM */
+#define INFLIGHT_TIMEOUT_S 30   /* max stall waiting on another's fetch */
+#define DEFAULT_GZIP_MIN 256    /* smallest body given a gzip variant */
+#define GZIP_QUEUE_DEPTH 64     /* objects waiting to be compressed */
+#define REFRESH_QUEUE_DEPTH 64  /* stale objects waiting to be refreshed */
+#define DEFAULT_FILL_THREADS 2  /* threads writing cache files */
+
+
+/* Runtime options set from the command line. */
+typedef struct options {
+    int port;                   /* listener port */
+    int cache_timeout;          /* secs fresh if the origin doesn't say */
+    long max_ttl;               /* cap on the origin's freshness lifetime */
+    long stale_while_revalidate; /* secs stale objects are served (0 = off) */
+    int ttl_jitter;             /* % of lifetimes randomly cut off */
+    bool epoll;                 /* use event loops instead of thread per conn */
+    int nloops;                 /* number of event loop threads */
+    int nworkers;               /* worker pool size (0 = thread per conn) */
+    int queue_depth;            /* accepted sockets waiting for a worker */
+    bool reject_when_full;      /* 503 instead of blocking accept when full */
+    int nlisteners;             /* SO_REUSEPORT listeners (1 = not sharded) */
+    int backlog;                /* listen() backlog per listener */
+    bool io_uring;              /* batch blocking-mode I/O through io_uring */
+    size_t cache_bytes;         /* disk cache budget (0 = unlimited) */
+    size_t cache_objects;       /* disk cache object cap (0 = unlimited) */
+    size_t mem_cache_bytes;     /* RAM tier budget (0 = disk only) */
+    size_t mem_object_max;      /* largest object kept in the RAM tier */
+    size_t gzip_min;            /* smallest body gzipped (0 = no gzip) */
+    bool range_pass;            /* send Range misses upstream as they are */
+    int fill_threads;           /* cache file writers (0 = request thread) */
+} options_t;
+
+/*
+ * What a cache file starts with. The origin's header fields replayed on a
+ * hit follow it, then the body.
+ */
+typedef struct cache_file_prefix {
+    char magic[8];              /* CACHE_FILE_MAGIC */
+    uint32_t fields_len;        /* bytes of stored header fields */
+    uint32_t reserved;
+} cache_file_prefix_t;
+
+/*
+ * A cache file being written, by the thread fetching it or by a fill thread
+ * behind it. Opening it gives `path' a unique suffix, and it's only added
+ * to the cache once whole, so a hit never finds it half written.
+ */
+typedef struct cache_fill {
+    char *key;                  /* heap-allocated cache key */
+    char *path;                 /* heap-allocated cache file path */
+    int fd;                     /* `path' or -1 if not open */
+    off_t off;                  /* bytes written so far */
+    off_t body_off;             /* where the body starts in the file */
+    size_t len;                 /* file length, if len_known */
+    bool len_known;             /* the origin sent a Content-Length */
+    time_t born;                /* when the origin generated the response */
+    time_t expires;             /* when the cached copy goes stale */
+    char *etag;                 /* heap-allocated ETag or NULL */
+    char *last_modified;        /* heap-allocated Last-Modified or NULL */
+    bool compress;              /* give the cached copy a gzip variant */
+    bool failed;                /* a write failed, so don't publish */
+    inflight_t *flight;         /* deferred fetch readers follow, or NULL */
+} cache_fill_t;
+
+/* A response's body being cached as it streams through. */
+typedef struct cache_writer {
+    cache_fill_t *fill;         /* file being filled or NULL if not caching */
+    fill_queue_t *queue;        /* fill thread's queue or NULL to write here */
+    fill_job_t *close_job;      /* made up front to end the fill with */
+    size_t body_len;            /* body bytes passed to the fill so far */
+    bool failed;                /* some weren't, so don't publish */
+    char *path;                 /* heap-allocated path of a revalidated copy */
+    off_t off;                  /* its size */
+    time_t born;                /* when the origin generated the response */
+    time_t expires;             /* when the revalidated copy goes stale */
+    bool revalidated;           /* a 304 validated the stale copy at `path' */
+    inflight_t *flight;         /* fetch other requests are attached to */
+} cache_writer_t;
+
+/*
+ * One part of a multi-range 206. Once the header buffer has been sent up to
+ * `hdr_end', which takes in the part's own header, `len' bytes of the cache
+ * file (or its RAM copy) from `off' follow.
+ */
+typedef struct cache_part {
+    size_t hdr_end;             /* header bytes to send before the part */
+    off_t off;                  /* where the part starts in the file */
+    size_t len;                 /* bytes in the part */
+} cache_part_t;
+
+extern options_t options;
+extern atomic_bool exit_requested;
+extern atomic_int global_thread_count;
+extern __thread int thread_id;
+extern __thread uring_t *thread_ring; /* NULL to use plain syscalls */
+extern hashmap_t file_cache;
+extern memcache_t mem_cache; /* hot objects held in RAM, keyed by URL */
+extern cache_index_t cache_index; /* file_cache as it's kept on disk */
+extern inflight_map_t inflight_fetches; /* cache misses being fetched */
+extern connpool_t upstream_pool; /* idle upstream sockets by origin */
+
+/* Pin the calling thread to CPU `cpu' modulo the online CPU count. */
+int pin_to_cpu(int cpu);
+/* Send an HTTP error response (no body). */
+int send_error(request_t *req, int status);
+/*
+ * Send an HTTP response including the file at `path', cached as `key'.
+ * Return -1, with nothing sent, if it can't be opened or isn't a cache
+ * object.
+ */
+int send_cache_file(request_t *req, const char *key, char *path);
+/*
+ * Send file `fd' from `*off' up to `len' on socket `sock' with sendfile,
+ * advancing `*off'. Return 1 once it's all sent, 0 if a non-blocking socket
+ * is full (or a blocking one timed out), or -1 on error.
+ */
+int send_file_range(int sock, int fd, off_t *off, size_t len);
+/*
+ * Borrow the RAM tier's copy of the object cached as `key', or return NULL.
+ * Drop it with memcache_release(&mem_cache, ...).
+ */
+memcache_entry_t *cache_object_get(const char *key);
+/*
+ * Copy cache file `fd' for `key', as described by `st', into the RAM tier
+ * and borrow it, or return NULL if it isn't kept in RAM.
+ */
+memcache_entry_t *cache_object_load(const char *key, int fd,
+                                    const struct stat *st);
+/*
+ * Build the header of a hit on the `size' byte cache file open as `fd' (or
+ * held by `mem' if it isn't NULL) for `req': the stored fields plus Date,
+ * Age (the origin generated it at `born') and Content-Length. Set `body_off'
+ * and `body_len' to the part of the file to send after it. Return the
+ * heap-allocated header, `hdrlen' bytes long, or NULL if the file isn't a
+ * cache object or for OOM.
+ *
+ * If `parts' isn't NULL (the file is whole), a Range is answered with a
+ * 206, or a 416 with no body if none of it is satisfiable. A multi-range 206
+ * is sent in `nparts' parts (0 for any other response), described in
+ * `parts' (REQ_RANGES_MAX of them), whose headers end the returned buffer.
+ * `body_len' is left 0.
+ */
+char *cache_response_header(const request_t *req, int fd,
+                            const memcache_entry_t *mem, size_t size,
+                            time_t born, cache_part_t *parts, int *nparts,
+                            off_t *body_off, size_t *body_len,
+                            size_t *hdrlen);
+/*
+ * Find the `name' field among the `len' bytes of stored "Name: value\r\n"
+ * lines at `fields'. Return the start of its line, `linelen' bytes long,
+ * and point `value' at its `vlen' byte value, or return NULL.
+ */
+const char *cache_stored_field(const char *fields, size_t len,
+                               const char *name, size_t *linelen,
+                               const char **value, size_t *vlen);
+/*
+ * Return the heap-allocated path of a stale copy of `url' that may still be
+ * served under --stale-while-revalidate, making sure a background refresh
+ * of it is under way, or NULL.
+ */
+char *cache_serve_stale(const char *url);
+/*
+ * Return the heap-allocated path of the cached copy to answer `req' with, or
+ * NULL on a miss, copying the key it's cached under to `key' (at least
+ * CACHE_KEY_MAX bytes). A client that takes gzip gets the gzip variant if
+ * there is a fresh one; a stale copy is returned as cache_serve_stale() does.
+ */
+char *cache_lookup(const request_t *req, char *key);
+/*
+ * Drop the copy at `path' cached as `key', which turned out to be missing or
+ * not a cache object, unless a newer copy replaced it meanwhile.
+ */
+void cache_drop(const char *key, const char *path);
+/*
+ * Ready `req' to be fetched for the cache. Drop its Accept-Encoding if gzip
+ * variants are made here, so the origin sends a copy every client can take,
+ * and its Range unless --range-miss is pass, so the whole object is cached.
+ * Add If-None-Match/If-Modified-Since from the validators of its stale
+ * cached copy, if it has one and the client sent neither itself.
+ */
+void cache_prepare_request(request_t *req);
+/*
+ * Start caching the body of `res' if it is cacheable (fill stays NULL if
+ * not), on a fill thread unless --fill-threads is 0.
+ * If `res' is a 304 to validators from cache_prepare_request(), refresh the
+ * stale copy instead and set `revalidated' with `path' naming it. If
+ * `flight' isn't NULL, readers attached to it are told whether to stream
+ * the cache file or fetch the URL themselves.
+ */
+void cache_writer_open(cache_writer_t *w, request_t *req, response_t *res,
+                       inflight_t *flight);
+/* Append decoded body content - a response_body_sink for a cache_writer_t. */
+void cache_writer_sink(void *writer_vptr, const char *buf, size_t len);
+/* Let attached readers see what has been written so far. */
+void cache_writer_progress(cache_writer_t *w);
+/*
+ * Publish the cache file if `complete', else discard it. A file
+ * written on a fill thread is closed there once its writes have landed.
+ */
+void cache_writer_close(cache_writer_t *w, bool complete);
+/* Log disk and RAM tier utilization. */
+void cache_log_stats();
+/*
+ * Return the cache file path for `url', CACHE_ROOT/xx/yy/<128-bit hash of
+ * the URL in hex>, as a heap-allocated string that the user must free.
+ */
+char *url_to_cache_path(const url_t *url);
+/* Return true if a and b have the same IP and port. */
+bool addrs_equal(struct sockaddr_in *a, struct sockaddr_in *b);
+/* Return true if the requested URL or IP is on the blacklist. */
+bool blacklist_has_entry(request_t *req);
+
+
+#endif  /* TOYPROXY_H */
@@ -0,0 +1,476 @@
+#include <errno.h>              /* errno, E* */
+#include <stdint.h>             /* uintptr_t */
+#include <string.h>             /* memset */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>     /* struct io_uring_*, IORING_* */
+#include <sys/mman.h>           /* mmap, munmap */
+#include <sys/socket.h>         /* MSG_*, SOCK_CLOEXEC */
+#include <sys/syscall.h>        /* __NR_io_uring_* */
+#include <sys/uio.h>            /* struct iovec */
+#include <unistd.h>             /* close, syscall */
+
+/* user_data tags that aren't result pointers */
+#define TAG_IGNORE 1            /* linked timeouts - result not interesting */
+#define TAG_ACCEPT 2            /* multishot accept */
+#define TAG_TIMER 3             /* accept tick */
+
+
+bool uring_available()
+{
+    return true;
+}
+
+
+static int uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int rval;
+
+    /* Publish queued sqes to the kernel */
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    rval = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                   flags, NULL, 0);
+    if (rval > 0) {
+        ring->nqueued -= rval;
+        ring->ninflight += rval;
+    }
+
+    return rval;
+}
+
+
+/* Return a zeroed sqe, or NULL if the queue is full of unsubmitted sqes. */
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, idx;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    idx = ring->sq_local_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->nqueued++;
+
+    return sqe;
+}
+
+
+/* Copy out the next completion if there is one. Return true if copied. */
+static bool uring_peek_cqe(uring_t *ring, struct io_uring_cqe *cqe)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/* Record the completions of batched operations. */
+static void uring_reap(uring_t *ring)
+{
+    struct io_uring_cqe cqe;
+
+    while (uring_peek_cqe(ring, &cqe)) {
+        ring->ninflight--;
+
+        if (cqe.user_data == TAG_IGNORE)
+            continue;
+        else if (cqe.user_data)
+            *(int *)(uintptr_t)cqe.user_data = cqe.res;
+        else if (cqe.res < 0 && !ring->error)
+            ring->error = -cqe.res;
+    }
+}
+
+
+int uring_init(uring_t *ring, unsigned timeout_s)
+{
+    struct io_uring_params params;
+    struct iovec iov[URING_NBUFS];
+    char *sq, *cq;
+    int rval;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+    ring->sq_ring = ring->cq_ring = ring->bufs = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_sz = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings with a single mmap */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz)
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        ring->cq_ring_sz = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto error;
+
+    if (ring->cq_ring_sz) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto error;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring_sz ? ring->cq_ring : ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    /* Register the file read buffers so the kernel maps them only once */
+    ring->bufs = mmap(NULL, URING_NBUFS * URING_BUFLEN, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED)
+        goto error;
+
+    for (int i = 0; i < URING_NBUFS; i++) {
+        iov[i].iov_base = ring->bufs + i * URING_BUFLEN;
+        iov[i].iov_len = URING_BUFLEN;
+    }
+
+    rval = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                   iov, URING_NBUFS);
+    if (rval < 0)
+        goto error;
+
+    ring->timeout[0] = timeout_s;   /* tv_sec */
+    ring->timeout[1] = 0;           /* tv_nsec */
+
+    return 0;
+
+error:
+    rval = errno;
+    uring_destroy(ring);
+    errno = rval;
+    return -1;
+}
+
+
+void uring_destroy(uring_t *ring)
+{
+    if (ring->bufs != MAP_FAILED)
+        munmap(ring->bufs, URING_NBUFS * URING_BUFLEN);
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    if (ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+    if (ring->fd > -1)
+        close(ring->fd);        /* cancels anything still in flight */
+
+    ring->fd = -1;
+}
+
+
+/* Queue a send, bounded by the ring's timeout. */
+static int uring_prep_send(uring_t *ring, int fd, const void *buf, size_t len,
+                           int *result, bool link)
+{
+    struct io_uring_sqe *sqe, *tsqe;
+    bool timed = ring->timeout[0] > 0;
+
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t)result;
+    if (link || timed)
+        sqe->flags |= IOSQE_IO_LINK;
+
+    if (!timed)
+        return 0;
+
+    if ((tsqe = uring_get_sqe(ring)) == NULL)
+        return -1;
+
+    /* Cancels the send if it doesn't complete in time */
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->addr = (uintptr_t)ring->timeout;
+    tsqe->len = 1;
+    tsqe->user_data = TAG_IGNORE;
+    if (link)
+        tsqe->flags |= IOSQE_IO_LINK;
+
+    return 0;
+}
+
+
+int uring_queue_send(uring_t *ring, int fd, const void *buf, size_t len)
+{
+    /* Make room rather than split a later batch */
+    if (ring->sq_entries - ring->nqueued < 2 && uring_run(ring) == -1)
+        return -1;
+
+    return uring_prep_send(ring, fd, buf, len, NULL, false);
+}
+
+
+int uring_queue_write(uring_t *ring, int fd, const void *buf, size_t len,
+                      off_t off)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring->sq_entries - ring->nqueued < 1 && uring_run(ring) == -1)
+        return -1;
+
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+
+    return 0;
+}
+
+
+int uring_run(uring_t *ring)
+{
+    int rval;
+
+    while (ring->nqueued || ring->ninflight) {
+        rval = uring_enter(ring, ring->nqueued, 1);
+        if (rval < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+
+        uring_reap(ring);
+    }
+
+    if (ring->error) {
+        errno = ring->error;
+        ring->error = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+ssize_t uring_send_file(uring_t *ring, int sock, int fd, off_t off,
+                        size_t len)
+{
+    struct io_uring_sqe *sqe;
+    int nread[URING_NBUFS], nsent[URING_NBUFS];
+    size_t n[URING_NBUFS];
+    size_t pos = off, end = off + len;
+    ssize_t ntotal = 0;
+    int nchunks;
+    char *buf;
+
+    /* Each chunk is a read linked to a send (and its timeout) */
+    if (ring->sq_entries - ring->nqueued < 3 * URING_NBUFS &&
+        uring_run(ring) == -1)
+        return -1;
+
+    do {
+        for (nchunks = 0; nchunks < URING_NBUFS && pos < end; nchunks++) {
+            n[nchunks] = end - pos < URING_BUFLEN ? end - pos : URING_BUFLEN;
+            buf = ring->bufs + nchunks * URING_BUFLEN;
+
+            if ((sqe = uring_get_sqe(ring)) == NULL)
+                return -1;
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)buf;
+            sqe->len = n[nchunks];
+            sqe->off = pos;
+            sqe->buf_index = nchunks;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = (uintptr_t)&nread[nchunks];
+
+            pos += n[nchunks];
+
+            /* Keep the whole batch in one chain so chunks go out in order */
+            if (uring_prep_send(ring, sock, buf, n[nchunks], &nsent[nchunks],
+                                nchunks + 1 < URING_NBUFS && pos < end) == -1)
+                return -1;
+        }
+
+        if (uring_run(ring) == -1)
+            return -1;
+
+        for (int i = 0; i < nchunks; i++) {
+            if (nread[i] < 0 || nsent[i] < 0) {
+                errno = nsent[i] < 0 ? -nsent[i] : -nread[i];
+                return -1;
+            } else if ((size_t)nread[i] != n[i] || nsent[i] != nread[i]) {
+                errno = EIO;    /* file shrank or the send was cut short */
+                return -1;
+            }
+            ntotal += nsent[i];
+        }
+    } while (pos < end);
+
+    return ntotal;
+}
+
+
+int uring_accept(uring_t *ring, int ssock)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+
+    if (!ring->accept_armed) {
+        if ((sqe = uring_get_sqe(ring)) == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = ssock;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = TAG_ACCEPT;
+        ring->accept_armed = true;
+    }
+
+    if (!ring->timer_armed) {
+        if ((sqe = uring_get_sqe(ring)) == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uintptr_t)ring->timeout;
+        sqe->len = 1;
+        sqe->user_data = TAG_TIMER;
+        ring->timer_armed = true;
+    }
+
+    while (!uring_peek_cqe(ring, &cqe)) {
+        if (uring_enter(ring, ring->nqueued, 1) < 0 && errno != EAGAIN)
+            return -1;          /* including EINTR */
+    }
+
+    if (cqe.user_data == TAG_TIMER) {
+        ring->timer_armed = false;
+        errno = ETIME;
+        return -1;
+    }
+
+    /* The kernel drops a multishot accept on error */
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        ring->accept_armed = false;
+
+    if (cqe.res < 0) {
+        errno = -cqe.res;
+        return -1;
+    }
+
+    return cqe.res;
+}
+
+#else  /* HAVE_IO_URING */
+
+bool uring_available()
+{
+    return false;
+}
+
+
+int uring_init(uring_t *ring, unsigned __attribute__((__unused__)) timeout_s)
+{
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+
+void uring_destroy(uring_t __attribute__((__unused__)) *ring)
+{
+}
+
+
+int uring_queue_send(uring_t __attribute__((__unused__)) *ring,
+                     int __attribute__((__unused__)) fd,
+                     const void __attribute__((__unused__)) *buf,
+                     size_t __attribute__((__unused__)) len)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int uring_queue_write(uring_t __attribute__((__unused__)) *ring,
+                      int __attribute__((__unused__)) fd,
+                      const void __attribute__((__unused__)) *buf,
+                      size_t __attribute__((__unused__)) len,
+                      off_t __attribute__((__unused__)) off)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int uring_run(uring_t __attribute__((__unused__)) *ring)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+ssize_t uring_send_file(uring_t __attribute__((__unused__)) *ring,
+                        int __attribute__((__unused__)) sock,
+                        int __attribute__((__unused__)) fd,
+                        off_t __attribute__((__unused__)) off,
+                        size_t __attribute__((__unused__)) len)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+
+int uring_accept(uring_t __attribute__((__unused__)) *ring,
+                 int __attribute__((__unused__)) ssock)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif  /* HAVE_IO_URING */
@@ -0,0 +1,74 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+#include <sys/types.h>          /* off_t, ssize_t */
+
+#define URING_ENTRIES 64        /* submission queue slots per ring */
+#define URING_NBUFS 4           /* registered buffers per ring */
+#define URING_BUFLEN 16384      /* size of each registered buffer */
+
+
+/*
+ * A minimal io_uring instance driven through the raw syscalls.
+ *
+ * Operations are queued with the uring_queue_* functions and submitted
+ * together by uring_run(), so a batch costs a single io_uring_enter(). Each
+ * ring is owned by one thread.
+ */
+typedef struct uring {
+    int fd;                     /* io_uring instance or -1 */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;  /* submission queue entries */
+    struct io_uring_cqe *cqes;  /* completion queue entries */
+    unsigned sq_entries;        /* submission queue size */
+    unsigned sq_local_tail;     /* tail including queued, unsubmitted sqes */
+    unsigned nqueued;           /* sqes queued but not yet submitted */
+    unsigned ninflight;         /* sqes submitted but not yet reaped */
+    void *sq_ring, *cq_ring;    /* mmapped ring memory */
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    char *bufs;                 /* URING_NBUFS registered buffers */
+    int error;                  /* first error in the current batch */
+    long long timeout[2];       /* send timeout or accept tick (timespec) */
+    bool accept_armed;          /* multishot accept is pending */
+    bool timer_armed;           /* accept tick timeout is pending */
+} uring_t;
+
+/* Return true if this build includes the io_uring backend. */
+bool uring_available();
+/*
+ * Set up a ring and register its buffers. Socket sends give up after
+ * `timeout_s' seconds (0 = never), which is also the uring_accept() tick.
+ * Return 0 or -1 and set errno.
+ */
+int uring_init(uring_t *ring, unsigned timeout_s);
+void uring_destroy(uring_t *ring);
+/* Queue a send of `len' bytes of `buf' on socket `fd'. Return 0 or -1. */
+int uring_queue_send(uring_t *ring, int fd, const void *buf, size_t len);
+/* Queue a write of `len' bytes of `buf' to file `fd' at `off'. Return 0/-1. */
+int uring_queue_write(uring_t *ring, int fd, const void *buf, size_t len,
+                      off_t off);
+/*
+ * Submit everything queued and wait for it to complete. `buf' passed to the
+ * queued operations must stay valid until this returns. Return 0, or -1 and
+ * set errno from the first operation that failed.
+ */
+int uring_run(uring_t *ring);
+/*
+ * Send `len' bytes of file `fd' from `off' on socket `sock' through the
+ * registered buffers, submitting anything already queued with the first
+ * batch. Return bytes of the file sent or -1.
+ */
+ssize_t uring_send_file(uring_t *ring, int sock, int fd, off_t off,
+                        size_t len);
+/*
+ * Return the next connection accepted on listener `ssock' with a multishot
+ * accept. Return -1 and set errno to ETIME if none arrived within the ring's
+ * timeout, EINTR on a signal, or to the accept error.
+ */
+int uring_accept(uring_t *ring, int ssock);
+
+
+#endif  /* URING_H */
@@ -0,0 +1,101 @@
+#include <string.h>             /* memcpy */
+
+#include "workqueue.h"
+
+
+int workqueue_init(workqueue_t *q, size_t depth)
+{
+    q->nslots = depth ? depth : WORKQUEUE_INIT_SLOTS;
+    q->head = q->len = 0;
+    q->depth = depth;
+    q->closed = false;
+    q->queued = q->dropped = 0;
+
+    if ((q->ring = calloc(q->nslots, sizeof(void *))) == NULL)
+        return -1;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+    return 0;
+}
+
+
+void workqueue_destroy(workqueue_t *q)
+{
+    free(q->ring);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+
+/* Double the ring of an unbounded queue, unwrapping it. Return -1 for OOM. */
+static int workqueue_grow(workqueue_t *q)
+{
+    void **ring;
+    size_t first = q->nslots - q->head; /* items up to the end of the ring */
+
+    if ((ring = malloc(2 * q->nslots * sizeof(void *))) == NULL)
+        return -1;
+
+    memcpy(ring, q->ring + q->head, first * sizeof(void *));
+    memcpy(ring + first, q->ring, q->head * sizeof(void *));
+
+    free(q->ring);
+    q->ring = ring;
+    q->head = 0;
+    q->nslots *= 2;
+
+    return 0;
+}
+
+
+int workqueue_put(workqueue_t *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+
+    if (q->closed || (q->len == q->nslots &&
+                      (q->depth || workqueue_grow(q) == -1))) {
+        q->dropped++;
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    q->ring[(q->head + q->len++) % q->nslots] = item;
+    q->queued++;
+    pthread_cond_signal(&q->cond);
+
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+
+void *workqueue_get(workqueue_t *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (q->len == 0 && !q->closed)
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    if (q->len) {
+        item = q->ring[q->head];
+        q->head = (q->head + 1) % q->nslots;
+        q->len--;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+
+void workqueue_close(workqueue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
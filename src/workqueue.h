@@ -0,0 +1,47 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <pthread.h>            /* pthread_* */
+#include <stdbool.h>            /* bool */
+#include <stdlib.h>             /* size_t */
+
+#define WORKQUEUE_INIT_SLOTS 16 /* first ring size of an unbounded queue */
+
+
+/*
+ * Items waiting for a background thread, run in the order queued: stale
+ * objects to refresh, objects to gzip, cache file writes. A queue can be
+ * closed, after which puts are refused and gets drain what's left.
+ */
+typedef struct workqueue {
+    void **ring;                /* queued items, oldest at `head' */
+    size_t nslots;              /* size of the "ring" array */
+    size_t head;                /* index of the oldest item */
+    size_t len;                 /* number of items queued */
+    size_t depth;               /* bound on `len' (0 = grow as needed) */
+    bool closed;                /* no more puts, gets drain what's left */
+    unsigned long queued;       /* items queued */
+    unsigned long dropped;      /* items refused, full or closed */
+    pthread_mutex_t lock;       /* queue lock for multithreading support */
+    pthread_cond_t cond;        /* signalled on put and close */
+} workqueue_t;
+
+/*
+ * Initialize an empty queue of up to `depth' items, or of any number if
+ * `depth' is 0. Return -1 for OOM.
+ */
+int workqueue_init(workqueue_t *q, size_t depth);
+/* Free the queue. Anything still on it is the caller's to free first. */
+void workqueue_destroy(workqueue_t *q);
+/*
+ * Queue `item' (not NULL). Return 0, or -1 if the queue is full, closed or
+ * couldn't grow.
+ */
+int workqueue_put(workqueue_t *q, void *item);
+/* Take the oldest item, waiting for one. Return NULL once closed and empty. */
+void *workqueue_get(workqueue_t *q);
+/* Stop accepting items and wake workqueue_get() callers. */
+void workqueue_close(workqueue_t *q);
+
+
+#endif  /* WORKQUEUE_H */
@@ -0,0 +1,78 @@
+/*
+ * Compare hash64() with the XOR DJB2 hash the hashmap used before it, on
+ * URL-like keys of a few lengths. Not run by ctest: build bench_hash and run
+ * it on an otherwise idle machine.
+ */
+#include <stdio.h>              /* printf, snprintf */
+#include <string.h>             /* memset, strlen */
+#include <time.h>               /* clock_gettime */
+
+#include "../src/hash.h"
+
+#define BENCH_KEYS 1024         /* distinct keys per length */
+#define BENCH_ROUNDS 2000       /* passes over the keys */
+
+
+/* XOR DJB2 algorithm, as hashmap.c had it. */
+static uint64_t djb2(const char *str)
+{
+    unsigned long hash = 5381;
+    int c;
+
+    while ((c = (unsigned char)*str++))
+        hash = ((hash << 5) + hash) ^ c;
+
+    return hash;
+}
+
+
+static uint64_t seeded(const char *str)
+{
+    return hash64(str, strlen(str), hash_seed());
+}
+
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Return nanoseconds per key for `hash' over `keys'. */
+static double bench(uint64_t (*hash)(const char *), char keys[][300])
+{
+    volatile uint64_t sink = 0;
+    double start = now();
+
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        for (int i = 0; i < BENCH_KEYS; i++)
+            sink += hash(keys[i]);
+
+    return (now() - start) * 1e9 / ((double)BENCH_ROUNDS * BENCH_KEYS);
+}
+
+
+int main()
+{
+    static char keys[BENCH_KEYS][300];
+    const size_t lengths[] = { 16, 48, 100, 250 };
+    char path[256];
+
+    printf("%8s %12s %12s\n", "key len", "djb2 ns", "hash64 ns");
+
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        memset(path, 'p', lengths[l]);
+        path[lengths[l]] = '\0';
+        for (int i = 0; i < BENCH_KEYS; i++)
+            snprintf(keys[i], sizeof(keys[i]), "http://h/%s?%d", path, i);
+
+        printf("%8zu %12.1f %12.1f\n", strlen(keys[0]), bench(djb2, keys),
+               bench(seeded, keys));
+    }
+
+    return 0;
+}
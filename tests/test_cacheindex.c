@@ -0,0 +1,232 @@
+#include "../vendor/unity/unity.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/cacheindex.h"
+
+#define INDEX_FILE "test_cacheindex.idx"
+#define NSLOTS 8
+
+
+cache_index_t idx;
+
+/* What load() saw, and which path to reject. */
+typedef struct seen {
+    size_t count;
+    char key[64];
+    char path[64];
+    size_t size;
+    time_t stored;
+    time_t expires;
+    char etag[64];
+    char last_modified[64];
+    const char *reject;
+} seen_t;
+
+
+void setUp()
+{
+    unlink(INDEX_FILE);
+    TEST_ASSERT_EQUAL_INT(0, cache_index_open(&idx, INDEX_FILE, NSLOTS));
+}
+
+
+void tearDown()
+{
+    cache_index_close(&idx);
+    unlink(INDEX_FILE);
+}
+
+
+/* Record `size' bytes at `path' for `key', with no validators. */
+int put(const char *key, const char *path, size_t size)
+{
+    cache_index_entry_t e = { .key = key, .path = path, .size = size };
+
+    return cache_index_put(&idx, &e);
+}
+
+
+bool visit(void *seen_vptr, const cache_index_entry_t *e)
+{
+    seen_t *seen = seen_vptr;
+
+    seen->count++;
+    snprintf(seen->key, sizeof(seen->key), "%s", e->key);
+    snprintf(seen->path, sizeof(seen->path), "%s", e->path);
+    snprintf(seen->etag, sizeof(seen->etag), "%s", e->etag);
+    snprintf(seen->last_modified, sizeof(seen->last_modified), "%s",
+             e->last_modified);
+    seen->size = e->size;
+    seen->stored = e->stored;
+    seen->expires = e->expires;
+
+    return seen->reject == NULL || strcmp(seen->reject, e->path);
+}
+
+
+/* Close and reopen the index, returning what load() saw. */
+seen_t reload(const char *reject)
+{
+    seen_t seen = { .reject = reject };
+
+    cache_index_close(&idx);
+    TEST_ASSERT_EQUAL_INT(0, cache_index_open(&idx, INDEX_FILE, NSLOTS));
+    cache_index_load(&idx, visit, &seen);
+
+    return seen;
+}
+
+
+void test_cacheindex_survives_reopen()
+{
+    seen_t seen;
+    cache_index_entry_t e = {
+        .key = "http://a/", .path = ".cache/a", .size = 100,
+        .stored = 1234, .expires = 5678,
+        .etag = "\"v1\"", .last_modified = "Tue, 13 Nov 2018 05:01:00 GMT"
+    };
+
+    TEST_ASSERT_EQUAL_INT(0, cache_index_put(&idx, &e));
+
+    seen = reload(NULL);
+    TEST_ASSERT_EQUAL_INT(1, seen.count);
+    TEST_ASSERT_EQUAL_STRING("http://a/", seen.key);
+    TEST_ASSERT_EQUAL_STRING(".cache/a", seen.path);
+    TEST_ASSERT_EQUAL_INT(100, seen.size);
+    TEST_ASSERT_EQUAL_INT(1234, seen.stored);
+    TEST_ASSERT_EQUAL_INT(5678, seen.expires);
+    TEST_ASSERT_EQUAL_STRING("\"v1\"", seen.etag);
+    TEST_ASSERT_EQUAL_STRING("Tue, 13 Nov 2018 05:01:00 GMT",
+                             seen.last_modified);
+    TEST_ASSERT_EQUAL_INT(1, idx.used);
+}
+
+
+void test_cacheindex_get()
+{
+    cache_record_t rec;
+    cache_index_entry_t e;
+    cache_index_entry_t in = {
+        .key = "http://a/", .path = ".cache/a", .size = 5, .etag = "\"x\""
+    };
+
+    TEST_ASSERT_EQUAL_INT(-1, cache_index_get(&idx, ".cache/a", &rec, &e));
+
+    cache_index_put(&idx, &in);
+    TEST_ASSERT_EQUAL_INT(0, cache_index_get(&idx, ".cache/a", &rec, &e));
+    TEST_ASSERT_EQUAL_STRING("http://a/", e.key);
+    TEST_ASSERT_EQUAL_STRING(".cache/a", e.path);
+    TEST_ASSERT_EQUAL_INT(5, e.size);
+    TEST_ASSERT_EQUAL_STRING("\"x\"", e.etag);
+    TEST_ASSERT_EQUAL_STRING("", e.last_modified);
+}
+
+
+void test_cacheindex_put_replaces()
+{
+    put("http://a/", ".cache/a", 100);
+    put("http://a/", ".cache/a", 200);
+
+    TEST_ASSERT_EQUAL_INT(1, idx.used);
+    TEST_ASSERT_EQUAL_INT(200, reload(NULL).size);
+}
+
+
+void test_cacheindex_del()
+{
+    put("http://a/", ".cache/a", 100);
+    put("http://b/", ".cache/b", 100);
+    cache_index_del(&idx, ".cache/a");
+
+    TEST_ASSERT_EQUAL_INT(1, idx.used);
+    TEST_ASSERT_EQUAL_STRING(".cache/b", reload(NULL).path);
+}
+
+
+/* Records the visitor rejects are gone on the next load. */
+void test_cacheindex_load_drops_rejected()
+{
+    put("http://a/", ".cache/a", 100);
+
+    TEST_ASSERT_EQUAL_INT(1, reload(".cache/a").count);
+    TEST_ASSERT_EQUAL_INT(0, idx.used);
+    TEST_ASSERT_EQUAL_INT(0, reload(NULL).count);
+}
+
+
+/* A record torn by a crash mid-write is dropped at load. */
+void test_cacheindex_load_drops_torn()
+{
+    put("http://a/", ".cache/a", 100);
+    put("http://b/", ".cache/b", 100);
+
+    for (size_t i = 0; i < idx.nslots; i++)
+        if (idx.records[i].state == CACHE_RECORD_USED &&
+            !strcmp(idx.records[i].data, "http://a/"))
+            idx.records[i].size = 999;
+
+    TEST_ASSERT_EQUAL_INT(1, reload(NULL).count);
+    TEST_ASSERT_EQUAL_STRING("http://b/", reload(NULL).key);
+}
+
+
+void test_cacheindex_full()
+{
+    char path[32];
+
+    for (int i = 0; i < NSLOTS; i++) {
+        snprintf(path, sizeof(path), ".cache/%d", i);
+        TEST_ASSERT_EQUAL_INT(0, put("k", path, 1));
+    }
+
+    TEST_ASSERT_EQUAL_INT(-1, put("k", ".cache/x", 1));
+    cache_index_del(&idx, ".cache/3");
+    TEST_ASSERT_EQUAL_INT(0, put("k", ".cache/x", 1));
+}
+
+
+void test_cacheindex_key_too_long()
+{
+    char key[CACHE_RECORD_DATA];
+
+    memset(key, 'k', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+
+    TEST_ASSERT_EQUAL_INT(-1, put(key, ".cache/a", 1));
+    TEST_ASSERT_EQUAL_INT(0, idx.used);
+}
+
+
+/* A file that isn't an index is replaced by an empty one. */
+void test_cacheindex_invalid_file()
+{
+    FILE *f;
+
+    cache_index_close(&idx);
+    f = fopen(INDEX_FILE, "w");
+    fputs("not an index", f);
+    fclose(f);
+
+    TEST_ASSERT_EQUAL_INT(0, cache_index_open(&idx, INDEX_FILE, NSLOTS));
+    TEST_ASSERT_EQUAL_INT(NSLOTS, idx.nslots);
+    TEST_ASSERT_EQUAL_INT(0, put("k", ".cache/a", 1));
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_cacheindex_survives_reopen);
+    RUN_TEST(test_cacheindex_get);
+    RUN_TEST(test_cacheindex_put_replaces);
+    RUN_TEST(test_cacheindex_del);
+    RUN_TEST(test_cacheindex_load_drops_rejected);
+    RUN_TEST(test_cacheindex_load_drops_torn);
+    RUN_TEST(test_cacheindex_full);
+    RUN_TEST(test_cacheindex_key_too_long);
+    RUN_TEST(test_cacheindex_invalid_file);
+    return UNITY_END();
+}
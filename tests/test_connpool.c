@@ -0,0 +1,166 @@
+#include "../vendor/unity/unity.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/connpool.h"
+
+
+connpool_t pool;
+struct sockaddr_in origin_a, origin_b;
+
+
+void setUp()
+{
+    TEST_ASSERT_EQUAL_INT(0, connpool_init(&pool, 2, 30));
+
+    origin_a.sin_family = origin_b.sin_family = AF_INET;
+    origin_a.sin_addr.s_addr = origin_b.sin_addr.s_addr = inet_addr("10.0.0.1");
+    origin_a.sin_port = htons(80);
+    origin_b.sin_port = htons(8080);
+}
+
+
+void tearDown()
+{
+    connpool_destroy(&pool);
+}
+
+
+/* Return the local end of a connected socket pair and its peer. */
+int connected_pair(int *peer)
+{
+    int sv[2];
+
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    *peer = sv[1];
+
+    return sv[0];
+}
+
+
+bool fd_is_open(int fd)
+{
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+
+void test_connpool_checkout_empty()
+{
+    TEST_ASSERT_EQUAL_INT(-1, connpool_checkout(&pool, &origin_a, false));
+}
+
+
+/* A checked in socket is only handed out for its own origin. */
+void test_connpool_checkout_by_origin()
+{
+    int peer, fd = connected_pair(&peer);
+
+    connpool_checkin(&pool, &origin_a, fd, false);
+    TEST_ASSERT_EQUAL_INT(1, pool.size);
+    TEST_ASSERT_EQUAL_INT(-1, connpool_checkout(&pool, &origin_b, false));
+    TEST_ASSERT_EQUAL_INT(fd, connpool_checkout(&pool, &origin_a, false));
+    TEST_ASSERT_EQUAL_INT(0, pool.size);
+
+    close(fd);
+    close(peer);
+}
+
+
+/* The most recently checked in socket should be reused first. */
+void test_connpool_checkout_newest_first()
+{
+    int peer1, fd1 = connected_pair(&peer1);
+    int peer2, fd2 = connected_pair(&peer2);
+
+    connpool_checkin(&pool, &origin_a, fd1, false);
+    connpool_checkin(&pool, &origin_a, fd2, false);
+    TEST_ASSERT_EQUAL_INT(fd2, connpool_checkout(&pool, &origin_a, false));
+    TEST_ASSERT_EQUAL_INT(fd1, connpool_checkout(&pool, &origin_a, false));
+
+    close(fd1);
+    close(fd2);
+    close(peer1);
+    close(peer2);
+}
+
+
+/* A socket the peer closed while idle should be discarded on checkout. */
+void test_connpool_checkout_skips_closed()
+{
+    int peer, fd = connected_pair(&peer);
+
+    connpool_checkin(&pool, &origin_a, fd, false);
+    close(peer);
+
+    TEST_ASSERT_EQUAL_INT(-1, connpool_checkout(&pool, &origin_a, false));
+    TEST_ASSERT_FALSE(fd_is_open(fd));
+    TEST_ASSERT_EQUAL_INT(0, pool.size);
+}
+
+
+/* Checkout should switch the socket to the mode the caller asked for. */
+void test_connpool_checkout_sets_nonblock()
+{
+    int peer, fd = connected_pair(&peer);
+
+    connpool_checkin(&pool, &origin_a, fd, false);
+    TEST_ASSERT_EQUAL_INT(fd, connpool_checkout(&pool, &origin_a, true));
+    TEST_ASSERT_TRUE(fcntl(fd, F_GETFL) & O_NONBLOCK);
+
+    close(fd);
+    close(peer);
+}
+
+
+/* Sockets beyond max_idle for an origin should be closed, not pooled. */
+void test_connpool_checkin_max_idle()
+{
+    int peers[3], fds[3];
+
+    for (int i = 0; i < 3; i++) {
+        fds[i] = connected_pair(&peers[i]);
+        connpool_checkin(&pool, &origin_a, fds[i], false);
+    }
+
+    TEST_ASSERT_EQUAL_INT(2, pool.size);
+    TEST_ASSERT_FALSE(fd_is_open(fds[2]));
+
+    for (int i = 0; i < 3; i++)
+        close(peers[i]);
+}
+
+
+void test_connpool_expire()
+{
+    int peer, fd = connected_pair(&peer);
+
+    connpool_checkin(&pool, &origin_a, fd, false);
+    TEST_ASSERT_EQUAL_INT(0, connpool_expire(&pool));
+
+    for (size_t i = 0; i < pool.bucket_size; i++)
+        if (pool.bucket[i])
+            pool.bucket[i]->idle_since -= 31;
+
+    TEST_ASSERT_EQUAL_INT(1, connpool_expire(&pool));
+    TEST_ASSERT_FALSE(fd_is_open(fd));
+    TEST_ASSERT_EQUAL_INT(0, pool.size);
+
+    close(peer);
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_connpool_checkout_empty);
+    RUN_TEST(test_connpool_checkout_by_origin);
+    RUN_TEST(test_connpool_checkout_newest_first);
+    RUN_TEST(test_connpool_checkout_skips_closed);
+    RUN_TEST(test_connpool_checkout_sets_nonblock);
+    RUN_TEST(test_connpool_checkin_max_idle);
+    RUN_TEST(test_connpool_expire);
+    return UNITY_END();
+}
@@ -0,0 +1,123 @@
+#include "../vendor/unity/unity.h"
+
+#include <string.h>
+
+#include "../src/fill.h"
+
+
+fill_queue_t q;
+int files[2];                   /* only their addresses are queued */
+
+
+void setUp()
+{
+    TEST_ASSERT_EQUAL_INT(0, fill_queue_init(&q, 8));
+}
+
+
+void tearDown()
+{
+    fill_queue_destroy(&q);
+}
+
+
+/* Queue a job for `fill'. Return 0 or -1 if it was refused. */
+int put(void *fill, fill_op_t op, const char *data)
+{
+    fill_job_t *job = fill_job_new(fill, op, data, strlen(data));
+
+    TEST_ASSERT_NOT_NULL(job);
+    if (fill_put(&q, job) == 0)
+        return 0;
+
+    free(job);
+    return -1;
+}
+
+
+void test_fill_fifo_order()
+{
+    fill_job_t *job;
+
+    put(&files[0], FILL_OPEN, "hdr");
+    put(&files[1], FILL_OPEN, "");
+    put(&files[0], FILL_WRITE, "body");
+    put(&files[0], FILL_CLOSE, "");
+
+    job = fill_get(&q);
+    TEST_ASSERT_EQUAL_PTR(&files[0], job->fill);
+    TEST_ASSERT_EQUAL_INT(FILL_OPEN, job->op);
+    TEST_ASSERT_EQUAL_MEMORY("hdr", job->data, 3);
+    fill_done(&q, job);
+
+    job = fill_get(&q);
+    TEST_ASSERT_EQUAL_PTR(&files[1], job->fill);
+    fill_done(&q, job);
+
+    job = fill_get(&q);
+    TEST_ASSERT_EQUAL_INT(FILL_WRITE, job->op);
+    TEST_ASSERT_EQUAL_INT(4, job->len);
+    TEST_ASSERT_EQUAL_MEMORY("body", job->data, 4);
+    fill_done(&q, job);
+
+    job = fill_get(&q);
+    TEST_ASSERT_EQUAL_INT(FILL_CLOSE, job->op);
+    fill_done(&q, job);
+    TEST_ASSERT_EQUAL_INT(0, q.bytes);
+}
+
+
+/* Writes are refused past the bound until written ones are done. */
+void test_fill_bound_drops_writes()
+{
+    fill_job_t *job;
+
+    TEST_ASSERT_EQUAL_INT(0, put(&files[0], FILL_WRITE, "12345"));
+    TEST_ASSERT_EQUAL_INT(-1, put(&files[0], FILL_WRITE, "6789"));
+    TEST_ASSERT_EQUAL_INT(1, q.dropped);
+    TEST_ASSERT_EQUAL_INT(5, q.bytes);
+
+    /* A file can still be opened and closed */
+    TEST_ASSERT_EQUAL_INT(0, put(&files[1], FILL_OPEN, "header bytes"));
+    TEST_ASSERT_EQUAL_INT(0, put(&files[0], FILL_CLOSE, ""));
+
+    job = fill_get(&q);
+    TEST_ASSERT_EQUAL_INT(0, put(&files[0], FILL_WRITE, "678"));
+    fill_done(&q, job);
+    TEST_ASSERT_EQUAL_INT(0, put(&files[0], FILL_WRITE, "6789"));
+}
+
+
+/* A closed queue still hands out what was queued before it was closed. */
+void test_fill_close_drains()
+{
+    fill_job_t *job;
+
+    put(&files[0], FILL_OPEN, "");
+    fill_close(&q);
+
+    TEST_ASSERT_EQUAL_INT(-1, put(&files[0], FILL_CLOSE, ""));
+    job = fill_get(&q);
+    TEST_ASSERT_EQUAL_PTR(&files[0], job->fill);
+    fill_done(&q, job);
+    TEST_ASSERT_NULL(fill_get(&q));
+}
+
+
+/* Jobs still queued are freed with the queue. */
+void test_fill_destroy_frees_jobs()
+{
+    put(&files[0], FILL_OPEN, "hdr");
+    put(&files[0], FILL_WRITE, "body");
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fill_fifo_order);
+    RUN_TEST(test_fill_bound_drops_writes);
+    RUN_TEST(test_fill_close_drains);
+    RUN_TEST(test_fill_destroy_frees_jobs);
+    return UNITY_END();
+}
@@ -0,0 +1,100 @@
+#include "../vendor/unity/unity.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../src/gzip.h"
+
+
+char in_path[32], out_path[32];
+int in = -1, out = -1;
+
+
+void setUp()
+{
+    strcpy(in_path, "/tmp/test_gzip_in_XXXXXX");
+    strcpy(out_path, "/tmp/test_gzip_out_XXXXXX");
+    in = mkstemp(in_path);
+    out = mkstemp(out_path);
+    TEST_ASSERT_TRUE(in > -1 && out > -1);
+}
+
+
+void tearDown()
+{
+    close(in);
+    close(out);
+    unlink(in_path);
+    unlink(out_path);
+}
+
+
+/* Inflate the `len' byte gzip stream in `out' into `buf'. Return its size. */
+size_t gunzip_out(size_t len, unsigned char *buf, size_t buflen)
+{
+    unsigned char *gz = malloc(len);
+    z_stream zs = { 0 };
+
+    TEST_ASSERT_EQUAL_INT(len, pread(out, gz, len, 0));
+    TEST_ASSERT_EQUAL_INT(Z_OK, inflateInit2(&zs, 15 + 16));
+    zs.next_in = gz;
+    zs.avail_in = len;
+    zs.next_out = buf;
+    zs.avail_out = buflen;
+    TEST_ASSERT_EQUAL_INT(Z_STREAM_END, inflate(&zs, Z_FINISH));
+    inflateEnd(&zs);
+    free(gz);
+
+    return buflen - zs.avail_out;
+}
+
+
+/* Only the range asked for is compressed, across several chunks. */
+void test_gzip_file_range()
+{
+    size_t len = GZIP_CHUNK * 3 + 17;
+    unsigned char *data = malloc(len + 100), *back = malloc(len + 1);
+    ssize_t zlen;
+
+    memset(data, 'h', 100);     /* a header the body follows */
+    for (size_t i = 100; i < len + 100; i++)
+        data[i] = 'a' + i % 7;
+    TEST_ASSERT_EQUAL_INT(len + 100, write(in, data, len + 100));
+
+    zlen = gzip_file(in, 100, len, out);
+    TEST_ASSERT_TRUE(zlen > 0 && (size_t)zlen < len);
+    TEST_ASSERT_EQUAL_INT(len, gunzip_out(zlen, back, len + 1));
+    TEST_ASSERT_EQUAL_MEMORY(data + 100, back, len);
+
+    free(data);
+    free(back);
+}
+
+
+void test_gzip_file_empty()
+{
+    unsigned char back[1];
+    ssize_t zlen = gzip_file(in, 0, 0, out);
+
+    TEST_ASSERT_TRUE(zlen > 0); /* still a whole gzip stream */
+    TEST_ASSERT_EQUAL_INT(0, gunzip_out(zlen, back, sizeof(back)));
+}
+
+
+void test_gzip_file_short()
+{
+    TEST_ASSERT_EQUAL_INT(5, write(in, "hello", 5));
+    TEST_ASSERT_EQUAL_INT(-1, gzip_file(in, 0, 10, out));
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_gzip_file_range);
+    RUN_TEST(test_gzip_file_empty);
+    RUN_TEST(test_gzip_file_short);
+    return UNITY_END();
+}
@@ -0,0 +1,121 @@
+#include "../vendor/unity/unity.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/hash.h"
+
+#define FOX "The quick brown fox jumps over the lazy dog"
+
+
+void setUp()
+{
+}
+
+
+void tearDown()
+{
+}
+
+
+/* Reference values from the MurmurHash3 x64 128-bit implementation. */
+void test_hash128_known_values()
+{
+    hash128_t h = hash128("", 0, 0);
+
+    TEST_ASSERT_EQUAL_HEX64(0, h.lo);
+    TEST_ASSERT_EQUAL_HEX64(0, h.hi);
+
+    h = hash128("hello", 5, 0);
+    TEST_ASSERT_EQUAL_HEX64(0xcbd8a7b341bd9b02ULL, h.lo);
+    TEST_ASSERT_EQUAL_HEX64(0x5b1e906a48ae1d19ULL, h.hi);
+
+    h = hash128(FOX, strlen(FOX), 0);
+    TEST_ASSERT_EQUAL_HEX64(0xe34bbc7bbc071b6cULL, h.lo);
+    TEST_ASSERT_EQUAL_HEX64(0x7a433ca9c49a9347ULL, h.hi);
+}
+
+
+void test_hash128_seed()
+{
+    hash128_t a = hash128(FOX, strlen(FOX), 0);
+    hash128_t b = hash128(FOX, strlen(FOX), 1);
+
+    TEST_ASSERT_TRUE(a.lo != b.lo || a.hi != b.hi);
+}
+
+
+/* Paths the old flattened layout mapped to the same file. */
+void test_hash128_distinct()
+{
+    hash128_t a = hash128("http://h/a_b", 12, 0);
+    hash128_t b = hash128("http://h/a/b", 12, 0);
+
+    TEST_ASSERT_TRUE(a.lo != b.lo || a.hi != b.hi);
+}
+
+
+void test_hash128_hex()
+{
+    char hex[HASH128_HEX_LEN + 1];
+    hash128_t h = { 0x0123456789abcdefULL, 0xfedcba9876543210ULL };
+
+    hash128_hex(h, hex);
+    TEST_ASSERT_EQUAL_STRING("0123456789abcdeffedcba9876543210", hex);
+}
+
+
+/* Every length takes one of several paths; each byte must count in all. */
+void test_hash64_lengths()
+{
+    char buf[128], url[128];
+    uint64_t h, prev = 0;
+
+    memset(buf, 'a', sizeof(buf));
+
+    for (size_t len = 0; len < sizeof(buf); len++) {
+        h = hash64(buf, len, 0);
+        TEST_ASSERT_TRUE(h != prev);
+        TEST_ASSERT_EQUAL_HEX64(h, hash64(buf, len, 0));
+        prev = h;
+
+        /* Flip each byte in turn */
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = 'b';
+            TEST_ASSERT_TRUE(hash64(buf, len, 0) != h);
+            buf[i] = 'a';
+        }
+    }
+
+    /* Keys alike but for one character, as URLs often are */
+    for (int i = 0; i < 1000; i++) {
+        snprintf(url, sizeof(url), "http://example.com/a/b/c?id=%d", i);
+        snprintf(buf, sizeof(buf), "http://example.com/a/b/c?id=%d", i + 1);
+        TEST_ASSERT_TRUE(hash64(url, strlen(url), 0) !=
+                         hash64(buf, strlen(buf), 0));
+    }
+}
+
+
+void test_hash64_seed()
+{
+    uint64_t seed = hash_seed();
+
+    TEST_ASSERT_TRUE(seed != 0);
+    TEST_ASSERT_EQUAL_HEX64(seed, hash_seed());
+    TEST_ASSERT_TRUE(hash64(FOX, strlen(FOX), 0) !=
+                     hash64(FOX, strlen(FOX), 1));
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_hash128_known_values);
+    RUN_TEST(test_hash128_seed);
+    RUN_TEST(test_hash128_distinct);
+    RUN_TEST(test_hash128_hex);
+    RUN_TEST(test_hash64_lengths);
+    RUN_TEST(test_hash64_seed);
+    return UNITY_END();
+}
@@ -1,5 +1,9 @@
 #include <errno.h>              /* errno */
+#include <pthread.h>            /* pthread_* */
+#include <stdio.h>              /* snprintf */
+#include <stdlib.h>             /* free */
 #include <string.h>             /* strerror */
+#include <time.h>               /* time */
 #include <unistd.h>             /* unlink */
 
 #include "../vendor/unity/unity.h"
@@ -74,6 +78,31 @@ void test_hashmap_get_null()
 }
 
 
+void test_hashmap_borrow()
+{
+    const hashmap_entry_t *entry;
+
+    hashmap_init(&map, 10);
+
+    TEST_ASSERT_NULL(hashmap_borrow(&map, "a"));
+    hashmap_add(&map, "a", "12345");
+
+    entry = hashmap_borrow(&map, "a");
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING("12345", entry->value);
+
+    /* A borrowed value isn't overwritten, and outlives its deletion */
+    hashmap_add(&map, "a", "123");
+    TEST_ASSERT_EQUAL_STRING("12345", entry->value);
+    hashmap_del(&map, "a");
+    TEST_ASSERT_EQUAL_STRING("a", entry->key);
+    TEST_ASSERT_EQUAL_STRING("12345", entry->value);
+    hashmap_release(entry);
+
+    hashmap_release(NULL);
+}
+
+
 void test_hashmap_has_key()
 {
     hashmap_init(&map, 10);
@@ -83,27 +112,160 @@ void test_hashmap_has_key()
 }
 
 
-void test_hashmap_add_get_force_hash_collision()
+void test_hashmap_add_get_grows()
 {
     int addidx, getidx;
     char *value;
-    char *keys[] = {"a", "b", "c"};
-    char *values[] = {"1", "2", "3"};
+    char key[16];
 
-    hashmap_init(&map, 1);      /* bucket size 1 will force hash collision */
+    hashmap_init(&map, 1);      /* one group, so adding 100 keys must grow */
+    TEST_ASSERT_EQUAL_INT(HASHMAP_GROUP, map.stripes[0].table.nslots);
 
-    for (int i = 0; i < 3; i++) {
-        addidx = hashmap_add(&map, keys[i], values[i]);
-        getidx = hashmap_get(&map, keys[i], &value);
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        addidx = hashmap_add(&map, key, key);
+        getidx = hashmap_get(&map, key, NULL);
 
-        TEST_ASSERT_EQUAL(0, addidx);
-        TEST_ASSERT_EQUAL(0, getidx);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, addidx);
         TEST_ASSERT_EQUAL(addidx, getidx);
-        TEST_ASSERT_EQUAL_STRING(values[i], value);
+    }
 
+    TEST_ASSERT_EQUAL_INT(100, map.size);
+    TEST_ASSERT_GREATER_THAN(100, map.stripes[0].table.nslots);
+
+    /* Entries moved by growing are all still found */
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, key, &value));
+        TEST_ASSERT_EQUAL_STRING(key, value);
         free(value);
     }
+}
+
+
+/* Deleting from a full group leaves a tombstone later probes pass over. */
+void test_hashmap_del_reuses_slots()
+{
+    hashmap_table_t *table;
+    char *value;
+    char key[16];
+
+    hashmap_init(&map, 1);
+
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 8; i++) {
+            snprintf(key, sizeof(key), "r%dk%d", round, i);
+            hashmap_add(&map, key, "v");
+        }
+        for (int i = 0; i < 8; i += 2) {
+            snprintf(key, sizeof(key), "r%dk%d", round, i);
+            TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_del(&map, key));
+        }
+    }
+
+    TEST_ASSERT_EQUAL_INT(200, map.size);
+    table = &map.stripes[0].table;
+    TEST_ASSERT_LESS_THAN(table->nslots - table->nslots / 8,
+                          table->used + table->tombstones);
+
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 8; i++) {
+            snprintf(key, sizeof(key), "r%dk%d", round, i);
+            if (i % 2) {
+                TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, key,
+                                                            &value));
+                TEST_ASSERT_EQUAL_STRING("v", value);
+                free(value);
+            } else {
+                TEST_ASSERT_EQUAL_INT(-1, hashmap_get(&map, key, NULL));
+            }
+        }
+    }
+}
+
+
+/* Lookups find every key while a resize is moving them between tables. */
+void test_hashmap_incremental_resize()
+{
+    char key[16];
+    bool moving = false;
+
+    hashmap_init(&map, 1);
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        hashmap_add(&map, key, key);
+        moving |= map.stripes[0].old.nslots != 0;
+
+        for (int j = 0; j <= i; j += 37) {
+            snprintf(key, sizeof(key), "key%d", j);
+            TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, key, NULL));
+        }
+    }
+
+    TEST_ASSERT_TRUE(moving);
+    TEST_ASSERT_EQUAL_INT(1000, map.size);
+    TEST_ASSERT_EQUAL_INT(1000, map.stripes[0].table.used +
+                          map.stripes[0].old.used);
+}
+
+
+/* Deleting shrinks the map back to its initial size, but no further. */
+void test_hashmap_shrink()
+{
+    char key[16];
+
+    hashmap_init(&map, 100);
+    TEST_ASSERT_EQUAL_INT(128, map.stripes[0].table.nslots);
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        hashmap_add(&map, key, key);
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(1024, map.stripes[0].table.nslots);
+
+    for (int i = 0; i < 1000; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_del(&map, key));
+    }
+    for (int i = 1; i < 990; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_del(&map, key));
+    }
+
+    /* Each call moves a little more of the old table */
+    for (int i = 0; i < 100 && (map.stripes[0].old.nslots ||
+                                map.stripes[0].table.nslots > 128); i++)
+        hashmap_gc(&map);
+
+    TEST_ASSERT_EQUAL_INT(128, map.stripes[0].table.nslots);
+    TEST_ASSERT_EQUAL_INT(0, map.stripes[0].old.nslots);
+    TEST_ASSERT_EQUAL_INT(5, map.size);
+    for (int i = 991; i < 1000; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, key, NULL));
+    }
+}
 
+
+/* A longer value replaces the entry, a shorter one is copied over it. */
+void test_hashmap_update_value()
+{
+    char *value;
+
+    hashmap_init(&map, 10);
+
+    hashmap_add(&map, "a", "12345");
+    hashmap_add(&map, "a", "123");
+    hashmap_get(&map, "a", &value);
+    TEST_ASSERT_EQUAL_STRING("123", value);
+    free(value);
+
+    hashmap_add(&map, "a", "1234567890");
+    hashmap_get(&map, "a", &value);
+    TEST_ASSERT_EQUAL_STRING("1234567890", value);
+    free(value);
+    TEST_ASSERT_EQUAL_INT(1, map.size);
 }
 
 
@@ -199,20 +361,292 @@ void test_hashmap_unlinker()
 }
 
 
+static char unlinked[64];
+
+
+static int unlink_note(const char *path)
+{
+    snprintf(unlinked, sizeof(unlinked), "%s", path);
+    return 0;
+}
+
+
+void test_hashmap_unlinker_replaced()
+{
+    hashmap_init(&map, 10);
+    map.unlinker = unlink_note;
+    unlinked[0] = '\0';
+
+    /* The same value isn't unlinked, a value replaced by a new one is */
+    hashmap_add(&map, "key", "file.1");
+    hashmap_add(&map, "key", "file.1");
+    TEST_ASSERT_EQUAL_STRING("", unlinked);
+    hashmap_add(&map, "key", "file.2");
+    TEST_ASSERT_EQUAL_STRING("file.1", unlinked);
+    TEST_ASSERT_EQUAL_INT(1, map.size);
+}
+
+
+void test_hashmap_del_value()
+{
+    char *value;
+
+    hashmap_init(&map, 10);
+    map.unlinker = unlink_note;
+    unlinked[0] = '\0';
+
+    /* A key that maps to a newer value is kept */
+    hashmap_add(&map, "key", "file.2");
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_del_value(&map, "key", "file.1"));
+    TEST_ASSERT_EQUAL_STRING("", unlinked);
+    TEST_ASSERT_NOT_EQUAL(-1, hashmap_get(&map, "key", &value));
+    TEST_ASSERT_EQUAL_STRING("file.2", value);
+    free(value);
+
+    TEST_ASSERT_NOT_EQUAL(-1, hashmap_del_value(&map, "key", "file.2"));
+    TEST_ASSERT_EQUAL_STRING("file.2", unlinked);
+    TEST_ASSERT_FALSE(hashmap_has_key(&map, "key"));
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_del_value(&map, "none", "file.2"));
+}
+
+
+void test_hashmap_add_sized_bytes()
+{
+    hashmap_init(&map, 10);
+
+    hashmap_add_sized(&map, "a", "1", 100);
+    hashmap_add_sized(&map, "b", "2", 50);
+    TEST_ASSERT_EQUAL_INT(150, map.bytes);
+
+    hashmap_add_sized(&map, "a", "1", 10); /* replacing recharges */
+    TEST_ASSERT_EQUAL_INT(60, map.bytes);
+
+    hashmap_del(&map, "b");
+    TEST_ASSERT_EQUAL_INT(10, map.bytes);
+}
+
+
+void test_hashmap_max_bytes_evicts_lru()
+{
+    hashmap_init(&map, 10);
+    map.max_bytes = 300;
+
+    hashmap_add_sized(&map, "a", "1", 100);
+    hashmap_add_sized(&map, "b", "2", 100);
+    hashmap_add_sized(&map, "c", "3", 100);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, "a", NULL));
+
+    /* b is now least recently used */
+    hashmap_add_sized(&map, "d", "4", 100);
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_get(&map, "b", NULL));
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, "a", NULL));
+    TEST_ASSERT_EQUAL_INT(3, map.size);
+    TEST_ASSERT_EQUAL_INT(300, map.bytes);
+    TEST_ASSERT_EQUAL_INT(1, map.stripes[0].evictions);
+
+    /* One large entry evicts several */
+    hashmap_add_sized(&map, "e", "5", 250);
+    TEST_ASSERT_EQUAL_INT(1, map.size);
+    TEST_ASSERT_EQUAL_INT(250, map.bytes);
+
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_add_sized(&map, "f", "6", 301));
+    TEST_ASSERT_EQUAL_INT(1, map.size);
+}
+
+
+void test_hashmap_max_entries_evicts_lru()
+{
+    hashmap_init(&map, 10);
+    map.max_entries = 2;
+
+    hashmap_add(&map, "a", "1");
+    hashmap_add(&map, "b", "2");
+    hashmap_add(&map, "a", "1"); /* re-adding counts as use */
+    hashmap_add(&map, "c", "3");
+
+    TEST_ASSERT_EQUAL_INT(2, map.size);
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_get(&map, "b", NULL));
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, "a", NULL));
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, "c", NULL));
+}
+
+
+void test_hashmap_hits_misses()
+{
+    hashmap_stats_t stats;
+
+    hashmap_init_striped(&map, 10, 4);
+
+    hashmap_add(&map, "a", "1");
+    hashmap_get(&map, "a", NULL);
+    hashmap_get(&map, "b", NULL);
+    hashmap_get(&map, "a", NULL);
+
+    hashmap_stats(&map, &stats);
+    TEST_ASSERT_EQUAL_INT(2, stats.hits);
+    TEST_ASSERT_EQUAL_INT(1, stats.misses);
+    TEST_ASSERT_EQUAL_INT(1, stats.size);
+}
+
+
+/* The budgets are for the whole map, whichever stripes the keys are in. */
+void test_hashmap_striped_budget()
+{
+    char key[16];
+    size_t used = 0;
+
+    hashmap_init_striped(&map, 100, 3);
+    TEST_ASSERT_EQUAL_INT(4, map.nstripes);
+    map.max_entries = 10;
+
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        hashmap_add(&map, key, key);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, key, NULL));
+    }
+
+    TEST_ASSERT_EQUAL_INT(10, map.size);
+    for (size_t i = 0; i < map.nstripes; i++)
+        used += map.stripes[i].table.used;
+    TEST_ASSERT_EQUAL_INT(10, used);
+}
+
+
+#define STRIPED_THREADS 4
+#define STRIPED_KEYS 2000
+
+atomic_int striped_failures;
+
+void *striped_worker(void *arg)
+{
+    char key[16], *value;
+    long id = (long)arg;
+
+    for (int i = 0; i < STRIPED_KEYS; i++) {
+        snprintf(key, sizeof(key), "t%ldk%d", id, i);
+        hashmap_add(&map, key, key);
+        hashmap_get(&map, key, &value);
+        if (value == NULL || strcmp(key, value))
+            striped_failures++; /* Unity can't assert off the main thread */
+        free(value);
+        if (i % 2)
+            hashmap_del(&map, key);
+        if (!(i % 500))
+            hashmap_gc(&map);
+    }
+
+    return NULL;
+}
+
+
+/* Threads adding, getting and deleting keys leave the map consistent. */
+void test_hashmap_striped_threads()
+{
+    pthread_t threads[STRIPED_THREADS];
+    char key[16];
+
+    hashmap_init_striped(&map, 10, HASHMAP_STRIPES);
+
+    for (long i = 0; i < STRIPED_THREADS; i++)
+        pthread_create(&threads[i], NULL, striped_worker, (void *)i);
+    for (int i = 0; i < STRIPED_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    TEST_ASSERT_EQUAL_INT(0, striped_failures);
+    TEST_ASSERT_EQUAL_INT(STRIPED_THREADS * STRIPED_KEYS / 2, map.size);
+    for (int i = 0; i < STRIPED_KEYS; i++) {
+        snprintf(key, sizeof(key), "t%dk%d", STRIPED_THREADS - 1, i);
+        if (i % 2)
+            TEST_ASSERT_EQUAL_INT(-1, hashmap_get(&map, key, NULL));
+        else
+            TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, key, NULL));
+    }
+}
+
+
+void test_hashmap_expiring()
+{
+    time_t now = time(NULL);
+
+    hashmap_init(&map, 10);
+
+    hashmap_add_expiring(&map, "stale", "1", 0, now - 1);
+    hashmap_add_expiring(&map, "fresh", "2", 0, now + 100);
+    hashmap_add(&map, "idle", "3");
+
+    /* Gone on lookup, even before gc runs */
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_get(&map, "stale", NULL));
+    TEST_ASSERT_EQUAL_INT(1, map.stripes[0].expirations);
+    TEST_ASSERT_EQUAL_INT(2, map.size);
+
+    hashmap_add_expiring(&map, "stale", "1", 0, now - 1);
+    hashmap_gc(&map);
+    TEST_ASSERT_EQUAL_INT(2, map.stripes[0].expirations);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, "fresh", NULL));
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get(&map, "idle", NULL));
+}
+
+
+void test_hashmap_stale_grace()
+{
+    time_t now = time(NULL);
+    char *value;
+    unsigned long expires;
+
+    hashmap_init(&map, 10);
+    map.grace = 100;
+
+    hashmap_add_expiring(&map, "stale", "1", 0, now - 1);
+    hashmap_add_expiring(&map, "dead", "2", 0, now - 101);
+
+    /* Within grace, an expired entry is only a miss */
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_get(&map, "stale", NULL));
+    TEST_ASSERT_EQUAL_INT(0, map.stripes[0].expirations);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, hashmap_get_stale(&map, "stale", &value,
+                                                      &expires));
+    TEST_ASSERT_EQUAL_STRING("1", value);
+    TEST_ASSERT_EQUAL_INT(now - 1, expires);
+    free(value);
+
+    TEST_ASSERT_EQUAL_INT(-1, hashmap_get_stale(&map, "dead", &value,
+                                                   NULL));
+    TEST_ASSERT_NULL(value);
+
+    hashmap_gc(&map);
+    TEST_ASSERT_EQUAL_INT(1, map.stripes[0].expirations);
+    TEST_ASSERT_EQUAL_INT(1, map.size);
+}
+
+
 int main()
 {
     UNITY_BEGIN();
 
     RUN_TEST(test_hashmap_init);
     RUN_TEST(test_hashmap_add_get_indices);
-    RUN_TEST(test_hashmap_add_get_force_hash_collision);
+    RUN_TEST(test_hashmap_add_get_grows);
+    RUN_TEST(test_hashmap_del_reuses_slots);
+    RUN_TEST(test_hashmap_incremental_resize);
+    RUN_TEST(test_hashmap_shrink);
+    RUN_TEST(test_hashmap_update_value);
     RUN_TEST(test_hashmap_size);
     RUN_TEST(test_hashmap_empty);
     /* Passes but takes about 2 seconds to run - normally disabled */
     //RUN_TEST(test_hashmap_timeout_0_gc_noop);
     RUN_TEST(test_hashmap_unlinker);
+    RUN_TEST(test_hashmap_unlinker_replaced);
+    RUN_TEST(test_hashmap_del_value);
     RUN_TEST(test_hashmap_get_null);
+    RUN_TEST(test_hashmap_borrow);
     RUN_TEST(test_hashmap_has_key);
+    RUN_TEST(test_hashmap_add_sized_bytes);
+    RUN_TEST(test_hashmap_max_bytes_evicts_lru);
+    RUN_TEST(test_hashmap_max_entries_evicts_lru);
+    RUN_TEST(test_hashmap_hits_misses);
+    RUN_TEST(test_hashmap_striped_budget);
+    RUN_TEST(test_hashmap_striped_threads);
+    RUN_TEST(test_hashmap_expiring);
+    RUN_TEST(test_hashmap_stale_grace);
 
     return UNITY_END();
 }
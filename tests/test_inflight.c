@@ -0,0 +1,190 @@
+#include "../vendor/unity/unity.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "../src/inflight.h"
+
+
+inflight_map_t map;
+
+
+void setUp()
+{
+    TEST_ASSERT_EQUAL_INT(0, inflight_map_init(&map, INFLIGHT_BUCKETS));
+}
+
+
+void tearDown()
+{
+    inflight_map_destroy(&map);
+}
+
+
+void test_inflight_first_join_leads()
+{
+    bool leader;
+    inflight_t *a, *b;
+
+    a = inflight_join(&map, "http://a/", &leader);
+    TEST_ASSERT_TRUE(leader);
+
+    b = inflight_join(&map, "http://a/", &leader);
+    TEST_ASSERT_FALSE(leader);
+    TEST_ASSERT_EQUAL_PTR(a, b);
+    TEST_ASSERT_EQUAL_INT(1, map.coalesced);
+
+    inflight_release(&map, b);
+    inflight_end(&map, a, false);
+    inflight_release(&map, a);
+}
+
+
+/* Once a fetch ends, the next miss starts a new one. */
+void test_inflight_end_frees_key()
+{
+    bool leader;
+    inflight_t *a, *b;
+
+    a = inflight_join(&map, "http://a/", &leader);
+    inflight_start(&map, a, "/tmp/a", 10, true);
+    inflight_end(&map, a, true);
+
+    b = inflight_join(&map, "http://a/", &leader);
+    TEST_ASSERT_TRUE(leader);
+    TEST_ASSERT_NOT_EQUAL(a, b);
+
+    inflight_release(&map, a);
+    inflight_end(&map, b, false);
+    inflight_release(&map, b);
+}
+
+
+void test_inflight_states()
+{
+    bool leader;
+    size_t written;
+    inflight_t *f = inflight_join(&map, "http://a/", &leader);
+
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_PENDING, inflight_poll(&map, f, &written));
+
+    inflight_start(&map, f, "/tmp/a", 100, true);
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_STREAMING, inflight_poll(&map, f, &written));
+    TEST_ASSERT_EQUAL_STRING("/tmp/a", f->path);
+    TEST_ASSERT_EQUAL_INT(100, f->len);
+
+    inflight_progress(&map, f, 40);
+    inflight_poll(&map, f, &written);
+    TEST_ASSERT_EQUAL_INT(40, written);
+
+    inflight_end(&map, f, true);
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_DONE, inflight_poll(&map, f, &written));
+
+    inflight_end(&map, f, false);   /* already ended */
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_DONE, inflight_poll(&map, f, &written));
+
+    inflight_release(&map, f);
+}
+
+
+/* A fetch that never got its header can't end complete. */
+void test_inflight_end_pending_abandons()
+{
+    bool leader;
+    size_t written;
+    inflight_t *f = inflight_join(&map, "http://a/", &leader);
+
+    inflight_end(&map, f, true);
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_ABANDONED,
+                          inflight_poll(&map, f, &written));
+    inflight_release(&map, f);
+}
+
+
+/* The leader giving up doesn't cut off a fetch whose fill was deferred. */
+void test_inflight_defer()
+{
+    bool leader;
+    size_t written;
+    inflight_t *f = inflight_join(&map, "http://a/", &leader);
+
+    inflight_defer(&map, f);
+    inflight_end(&map, f, false);
+    inflight_release(&map, f);
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_PENDING, inflight_poll(&map, f, &written));
+
+    inflight_start(&map, f, "/tmp/a", 10, true);
+    inflight_progress(&map, f, 10);
+    inflight_end_deferred(&map, f, true);
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_DONE, inflight_poll(&map, f, &written));
+    TEST_ASSERT_EQUAL_INT(10, written);
+    inflight_release(&map, f);
+}
+
+
+void *progress_thread(void *f_vptr)
+{
+    usleep(10000);
+    inflight_progress(&map, (inflight_t *)f_vptr, 64);
+
+    return NULL;
+}
+
+
+void test_inflight_wait_wakes_on_progress()
+{
+    bool leader;
+    size_t written = 0;
+    pthread_t thread;
+    inflight_t *f = inflight_join(&map, "http://a/", &leader);
+
+    inflight_start(&map, f, "/tmp/a", 100, true);
+    pthread_create(&thread, NULL, progress_thread, f);
+
+    TEST_ASSERT_EQUAL_INT(INFLIGHT_STREAMING,
+                          inflight_wait(&map, f, INFLIGHT_STREAMING,
+                                        &written, 5));
+    TEST_ASSERT_EQUAL_INT(64, written);
+
+    pthread_join(thread, NULL);
+    inflight_end(&map, f, false);
+    inflight_release(&map, f);
+}
+
+
+void test_inflight_watch_pokes_eventfd()
+{
+    bool leader;
+    uint64_t n = 0;
+    int efd = eventfd(0, EFD_NONBLOCK);
+    inflight_t *f = inflight_join(&map, "http://a/", &leader);
+
+    TEST_ASSERT_EQUAL_INT(0, inflight_watch(&map, f, efd));
+    inflight_start(&map, f, "/tmp/a", 100, true);
+    TEST_ASSERT_EQUAL_INT(sizeof(n), read(efd, &n, sizeof(n)));
+    TEST_ASSERT_EQUAL_INT(1, n);
+
+    inflight_unwatch(&map, f, efd);
+    inflight_progress(&map, f, 10);
+    TEST_ASSERT_EQUAL_INT(-1, read(efd, &n, sizeof(n)));
+
+    inflight_end(&map, f, false);
+    inflight_release(&map, f);
+    close(efd);
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_inflight_first_join_leads);
+    RUN_TEST(test_inflight_end_frees_key);
+    RUN_TEST(test_inflight_states);
+    RUN_TEST(test_inflight_end_pending_abandons);
+    RUN_TEST(test_inflight_defer);
+    RUN_TEST(test_inflight_wait_wakes_on_progress);
+    RUN_TEST(test_inflight_watch_pokes_eventfd);
+    return UNITY_END();
+}
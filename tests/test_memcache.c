@@ -0,0 +1,206 @@
+#include "../vendor/unity/unity.h"
+
+#include <string.h>
+
+#include "../src/memcache.h"
+
+#define OBJECT_LEN (300 * 1024) /* three objects fill a slab page */
+
+
+memcache_t mc;
+
+
+void setUp()
+{
+    TEST_ASSERT_EQUAL_INT(0, memcache_init(&mc, MEMCACHE_PAGE_SIZE,
+                                           OBJECT_LEN));
+}
+
+
+void tearDown()
+{
+    memcache_destroy(&mc);
+}
+
+
+/* Store `len' bytes of `c' under `key'. Return 0 or -1 if there was no room. */
+int put(const char *key, char c, size_t len)
+{
+    memcache_entry_t *e = memcache_reserve(&mc, key, len);
+
+    if (e == NULL)
+        return -1;
+
+    memset(e->data, c, len);
+    memcache_publish(&mc, e);
+    memcache_release(&mc, e);
+
+    return 0;
+}
+
+
+/* Return true if `key' is cached. */
+bool has(const char *key)
+{
+    memcache_entry_t *e = memcache_get(&mc, key);
+
+    if (e)
+        memcache_release(&mc, e);
+
+    return e != NULL;
+}
+
+
+void test_memcache_get_missing()
+{
+    TEST_ASSERT_NULL(memcache_get(&mc, "http://a/"));
+    TEST_ASSERT_EQUAL_INT(1, mc.misses);
+}
+
+
+void test_memcache_put_get()
+{
+    memcache_entry_t *e;
+
+    TEST_ASSERT_EQUAL_INT(0, put("http://a/", 'a', 100));
+
+    e = memcache_get(&mc, "http://a/");
+    TEST_ASSERT_NOT_NULL(e);
+    TEST_ASSERT_EQUAL_INT(100, e->len);
+    TEST_ASSERT_EACH_EQUAL_UINT8('a', e->data, 100);
+    memcache_release(&mc, e);
+
+    TEST_ASSERT_EQUAL_INT(1, mc.size);
+    TEST_ASSERT_EQUAL_INT(100, mc.bytes);
+    TEST_ASSERT_EQUAL_INT(1, mc.hits);
+}
+
+
+/* A reserved object isn't visible until it is published. */
+void test_memcache_reserve_unpublished()
+{
+    memcache_entry_t *e = memcache_reserve(&mc, "http://a/", 10);
+
+    TEST_ASSERT_NOT_NULL(e);
+    TEST_ASSERT_FALSE(has("http://a/"));
+
+    memcache_release(&mc, e);   /* abandoned, so its chunk is freed */
+    TEST_ASSERT_EQUAL_INT(0, put("http://b/", 'b', 10));
+}
+
+
+void test_memcache_too_large()
+{
+    TEST_ASSERT_NULL(memcache_reserve(&mc, "http://a/", OBJECT_LEN + 1));
+}
+
+
+void test_memcache_replace()
+{
+    memcache_entry_t *e;
+
+    put("http://a/", 'a', 100);
+    put("http://a/", 'b', 200);
+
+    e = memcache_get(&mc, "http://a/");
+    TEST_ASSERT_EQUAL_INT(200, e->len);
+    TEST_ASSERT_EACH_EQUAL_UINT8('b', e->data, 200);
+    memcache_release(&mc, e);
+    TEST_ASSERT_EQUAL_INT(1, mc.size);
+}
+
+
+/* An object deleted while borrowed stays readable until it's released. */
+void test_memcache_del_borrowed()
+{
+    memcache_entry_t *e;
+
+    put("http://a/", 'a', 100);
+    e = memcache_get(&mc, "http://a/");
+    memcache_del(&mc, "http://a/");
+
+    TEST_ASSERT_FALSE(has("http://a/"));
+    TEST_ASSERT_EACH_EQUAL_UINT8('a', e->data, 100);
+    memcache_release(&mc, e);
+    TEST_ASSERT_EQUAL_INT(0, mc.size);
+}
+
+
+/* The CLOCK hand passes over an object that was hit since it last came by. */
+void test_memcache_evicts_cold_object()
+{
+    TEST_ASSERT_EQUAL_INT(0, put("http://a/", 'a', OBJECT_LEN));
+    TEST_ASSERT_EQUAL_INT(0, put("http://b/", 'b', OBJECT_LEN));
+    TEST_ASSERT_EQUAL_INT(0, put("http://c/", 'c', OBJECT_LEN));
+    TEST_ASSERT_TRUE(has("http://a/"));
+    TEST_ASSERT_TRUE(has("http://c/"));
+
+    /* The page is full, so b (never hit) makes room for d */
+    TEST_ASSERT_EQUAL_INT(0, put("http://d/", 'd', OBJECT_LEN));
+    TEST_ASSERT_FALSE(has("http://b/"));
+    TEST_ASSERT_TRUE(has("http://a/"));
+    TEST_ASSERT_TRUE(has("http://d/"));
+    TEST_ASSERT_EQUAL_INT(1, mc.evictions);
+    TEST_ASSERT_EQUAL_INT(1, mc.npages);
+}
+
+
+/* A page emptied by eviction is recarved for the size class that needs it. */
+void test_memcache_recarves_page()
+{
+    put("http://a/", 'a', OBJECT_LEN);
+    put("http://b/", 'b', OBJECT_LEN);
+    put("http://c/", 'c', OBJECT_LEN);
+
+    TEST_ASSERT_EQUAL_INT(0, put("http://small/", 's', 100));
+    TEST_ASSERT_EQUAL_INT(3, mc.evictions);
+    TEST_ASSERT_TRUE(has("http://small/"));
+    TEST_ASSERT_EQUAL_INT(0, put("http://small2/", 's', 100));
+    TEST_ASSERT_EQUAL_INT(3, mc.evictions);
+}
+
+
+void test_memcache_borrowed_not_evicted()
+{
+    memcache_entry_t *borrowed[3];
+    const char *keys[] = { "http://a/", "http://b/", "http://c/" };
+
+    for (int i = 0; i < 3; i++) {
+        put(keys[i], 'a' + i, OBJECT_LEN);
+        borrowed[i] = memcache_get(&mc, keys[i]);
+    }
+
+    TEST_ASSERT_EQUAL_INT(-1, put("http://d/", 'd', OBJECT_LEN));
+
+    for (int i = 0; i < 3; i++)
+        memcache_release(&mc, borrowed[i]);
+
+    TEST_ASSERT_EQUAL_INT(0, put("http://d/", 'd', OBJECT_LEN));
+}
+
+
+void test_memcache_disabled()
+{
+    memcache_t off;
+
+    TEST_ASSERT_EQUAL_INT(0, memcache_init(&off, 0, OBJECT_LEN));
+    TEST_ASSERT_NULL(memcache_reserve(&off, "http://a/", 10));
+    memcache_destroy(&off);
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_memcache_get_missing);
+    RUN_TEST(test_memcache_put_get);
+    RUN_TEST(test_memcache_reserve_unpublished);
+    RUN_TEST(test_memcache_too_large);
+    RUN_TEST(test_memcache_replace);
+    RUN_TEST(test_memcache_del_borrowed);
+    RUN_TEST(test_memcache_evicts_cold_object);
+    RUN_TEST(test_memcache_recarves_page);
+    RUN_TEST(test_memcache_borrowed_not_evicted);
+    RUN_TEST(test_memcache_disabled);
+    return UNITY_END();
+}
@@ -0,0 +1,99 @@
+#include "../vendor/unity/unity.h"
+
+#include "../src/queue.h"
+
+
+queue_t q;
+
+
+void setUp()
+{
+    /* Nothing to do */
+}
+
+
+void tearDown()
+{
+    queue_destroy(&q);
+}
+
+
+void test_queue_init()
+{
+    TEST_ASSERT_EQUAL_INT(0, queue_init(&q, 4));
+    TEST_ASSERT_EQUAL_INT(4, q.buffer_size);
+    TEST_ASSERT_EQUAL_INT(0, q.size);
+}
+
+
+/* Items should come out in the order they were put in. */
+void test_queue_fifo_order()
+{
+    queue_init(&q, 4);
+
+    for (int i = 0; i < 3; i++)
+        queue_put(&q, i);
+
+    TEST_ASSERT_EQUAL_INT(3, q.size);
+
+    for (int i = 0; i < 3; i++)
+        TEST_ASSERT_EQUAL_INT(i, queue_get(&q));
+
+    TEST_ASSERT_EQUAL_INT(0, q.size);
+}
+
+
+/* Indices should wrap around the end of the buffer. */
+void test_queue_wraparound()
+{
+    queue_init(&q, 2);
+
+    for (int i = 0; i < 10; i++) {
+        queue_put(&q, i);
+        TEST_ASSERT_EQUAL_INT(i, queue_get(&q));
+    }
+}
+
+
+/* A full queue should refuse queue_try_put without blocking. */
+void test_queue_try_put_full()
+{
+    queue_init(&q, 2);
+
+    TEST_ASSERT_EQUAL_INT(0, queue_try_put(&q, 1));
+    TEST_ASSERT_EQUAL_INT(0, queue_try_put(&q, 2));
+    TEST_ASSERT_EQUAL_INT(-1, queue_try_put(&q, 3));
+    TEST_ASSERT_EQUAL_INT(2, q.size);
+
+    /* Consuming one item frees a slot */
+    TEST_ASSERT_EQUAL_INT(1, queue_get(&q));
+    TEST_ASSERT_EQUAL_INT(0, queue_try_put(&q, 3));
+    TEST_ASSERT_EQUAL_INT(2, queue_get(&q));
+    TEST_ASSERT_EQUAL_INT(3, queue_get(&q));
+}
+
+
+/* A timed put on a full queue should give up instead of blocking forever. */
+void test_queue_timed_put_full()
+{
+    queue_init(&q, 1);
+
+    TEST_ASSERT_EQUAL_INT(0, queue_timed_put(&q, 1, 1));
+    TEST_ASSERT_EQUAL_INT(-1, queue_timed_put(&q, 2, 0));
+    TEST_ASSERT_EQUAL_INT(1, q.size);
+    TEST_ASSERT_EQUAL_INT(1, queue_get(&q));
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_queue_init);
+    RUN_TEST(test_queue_fifo_order);
+    RUN_TEST(test_queue_wraparound);
+    RUN_TEST(test_queue_try_put_full);
+    RUN_TEST(test_queue_timed_put_full);
+
+    return UNITY_END();
+}
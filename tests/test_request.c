@@ -103,6 +103,121 @@ void test_split_request_full_header_line()
 }
 
 
+void test_request_add_field()
+{
+    strcpy(test_raw_request, raw_request);
+    request_deserialize(&req, test_raw_request, request_length);
+    TEST_ASSERT_FALSE(req.conditional);
+
+    TEST_ASSERT_EQUAL_INT(0, request_add_field(&req, "If-None-Match",
+                                               "\"v\""));
+    TEST_ASSERT_EQUAL_INT(request_length + 20, req.raw_len);
+    TEST_ASSERT_EQUAL_STRING("Cache-Control: max-age=0\r\n"
+                             "If-None-Match: \"v\"\r\n\r\n",
+                             req.raw + request_length - 28);
+}
+
+
+void test_request_conditional()
+{
+    const char conditional[] = "GET http://a/ HTTP/1.1\r\n"
+        "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r\n\r\n";
+
+    strcpy(test_raw_request, conditional);
+    request_deserialize(&req, test_raw_request, strlen(conditional));
+    TEST_ASSERT_TRUE(req.conditional);
+}
+
+
+void test_request_del_field()
+{
+    strcpy(test_raw_request, raw_request);
+    request_deserialize(&req, test_raw_request, request_length);
+
+    TEST_ASSERT_EQUAL_INT(1, request_del_field(&req, "accept-encoding"));
+    TEST_ASSERT_EQUAL_INT(request_length - 32, req.raw_len);
+    TEST_ASSERT_NULL(strstr(req.raw, "gzip"));
+    TEST_ASSERT_NOT_NULL(strstr(req.raw, "Accept-Language: en-US,en;q=0.5\r\n"
+                                "DNT: 1\r\n"));
+    TEST_ASSERT_EQUAL_INT(0, request_del_field(&req, "Accept-Encoding"));
+    TEST_ASSERT_EQUAL_INT(0, request_del_field(&req, "Accept-Lang"));
+}
+
+
+void test_request_accepts()
+{
+    strcpy(test_raw_request, raw_request);
+    request_deserialize(&req, test_raw_request, request_length);
+    TEST_ASSERT_TRUE(request_accepts(&req, "gzip"));
+    TEST_ASSERT_TRUE(request_accepts(&req, "deflate"));
+    TEST_ASSERT_FALSE(request_accepts(&req, "br"));
+
+    free(req.accept_encoding);
+    req.accept_encoding = strdup("br;q=1, GZIP ; q=0, *;q=0.1");
+    TEST_ASSERT_FALSE(request_accepts(&req, "gzip"));
+    TEST_ASSERT_TRUE(request_accepts(&req, "compress"));
+
+    free(req.accept_encoding);
+    req.accept_encoding = NULL;
+    TEST_ASSERT_FALSE(request_accepts(&req, "gzip"));
+}
+
+
+/* Set the request's Range and resolve it against a 1000 byte body. */
+int ranges_of(const char *range, byte_range_t *ranges)
+{
+    free(req.range);
+    req.range = range ? strdup(range) : NULL;
+
+    return request_ranges(&req, 1000, ranges);
+}
+
+
+void test_request_ranges()
+{
+    byte_range_t r[REQ_RANGES_MAX];
+    char many[256] = "bytes=0-0";
+
+    strcpy(test_raw_request, raw_request);
+    request_deserialize(&req, test_raw_request, request_length);
+    TEST_ASSERT_NULL(req.range);
+    TEST_ASSERT_EQUAL_INT(0, ranges_of(NULL, r));
+
+    TEST_ASSERT_EQUAL_INT(1, ranges_of("bytes=0-499", r));
+    TEST_ASSERT_EQUAL_INT(0, r[0].first);
+    TEST_ASSERT_EQUAL_INT(499, r[0].last);
+
+    /* Open-ended and suffix ranges are clipped to the body */
+    TEST_ASSERT_EQUAL_INT(1, ranges_of("bytes=900-", r));
+    TEST_ASSERT_EQUAL_INT(900, r[0].first);
+    TEST_ASSERT_EQUAL_INT(999, r[0].last);
+    TEST_ASSERT_EQUAL_INT(1, ranges_of("bytes=-100", r));
+    TEST_ASSERT_EQUAL_INT(900, r[0].first);
+    TEST_ASSERT_EQUAL_INT(999, r[0].last);
+    TEST_ASSERT_EQUAL_INT(1, ranges_of("bytes=-5000", r));
+    TEST_ASSERT_EQUAL_INT(0, r[0].first);
+    TEST_ASSERT_EQUAL_INT(1, ranges_of("bytes=990-2000", r));
+    TEST_ASSERT_EQUAL_INT(999, r[0].last);
+
+    TEST_ASSERT_EQUAL_INT(2, ranges_of("bytes=0-9, 20-29,1000-", r));
+    TEST_ASSERT_EQUAL_INT(20, r[1].first);
+    TEST_ASSERT_EQUAL_INT(29, r[1].last);
+
+    TEST_ASSERT_EQUAL_INT(-1, ranges_of("bytes=1000-", r));
+    TEST_ASSERT_EQUAL_INT(-1, ranges_of("bytes=-0", r));
+
+    /* Malformed, unknown or costly ranges get the whole body */
+    TEST_ASSERT_EQUAL_INT(0, ranges_of("bytes=5-1", r));
+    TEST_ASSERT_EQUAL_INT(0, ranges_of("bytes=a-b", r));
+    TEST_ASSERT_EQUAL_INT(0, ranges_of("bytes=", r));
+    TEST_ASSERT_EQUAL_INT(0, ranges_of("items=0-1", r));
+    TEST_ASSERT_EQUAL_INT(0, ranges_of("bytes=0-999,0-999", r));
+    for (int i = 0; i < REQ_RANGES_MAX; i++)
+        strcat(many, ",0-0");
+    TEST_ASSERT_EQUAL_INT(0, ranges_of(many, r));
+}
+
+
 int main()
 {
     UNITY_BEGIN();
@@ -110,6 +225,11 @@ int main()
     RUN_TEST(test_request_deserialize_whole);
     RUN_TEST(test_split_request_partial_header_line);
     RUN_TEST(test_split_request_full_header_line);
+    RUN_TEST(test_request_add_field);
+    RUN_TEST(test_request_conditional);
+    RUN_TEST(test_request_del_field);
+    RUN_TEST(test_request_accepts);
+    RUN_TEST(test_request_ranges);
 
     return UNITY_END();
 }
@@ -236,6 +236,288 @@ void test_split_response_partial_content()
 }
 
 
+/* Collects decoded body content for the response_body_feed tests. */
+char decoded[256];
+size_t ndecoded;
+
+void collect(void *arg, const char *buf, size_t len)
+{
+    (void)arg;
+    memcpy(decoded + ndecoded, buf, len);
+    ndecoded += len;
+}
+
+
+void test_parse_header_leaves_body()
+{
+    char buf[256];
+    size_t buflen = response_length;
+
+    memcpy(buf, raw_response, buflen);
+    TEST_ASSERT_EQUAL_INT(1, response_parse_header(&res, buf, &buflen));
+    TEST_ASSERT_EQUAL_INT(39, buflen);
+    TEST_ASSERT_EQUAL_STRING("<html><body><h1>Test</h1></body></html>", buf);
+    TEST_ASSERT_EQUAL_INT(141, res.raw_len);
+    TEST_ASSERT_EQUAL_INT(39, response_content_length(&res));
+}
+void test_parse_header_incomplete()
+{
+    char buf[256];
+    size_t buflen = 90;
+
+    memcpy(buf, raw_response, buflen);
+    TEST_ASSERT_EQUAL_INT(0, response_parse_header(&res, buf, &buflen));
+    TEST_ASSERT_EQUAL_INT(90, buflen);
+}
+void test_body_content_length_split()
+{
+    response_body_t body;
+    char buf[256];
+    size_t buflen = response_length;
+
+    ndecoded = 0;
+    memcpy(buf, raw_response, buflen);
+    response_parse_header(&res, buf, &buflen);
+    response_body_init(&body, &res);
+
+    TEST_ASSERT_EQUAL_INT(10, response_body_feed(&body, buf, 10, collect, 0));
+    TEST_ASSERT_FALSE(body.complete);
+    TEST_ASSERT_EQUAL_INT(29, response_body_feed(&body, buf + 10, 29, collect,
+                                                 0));
+    TEST_ASSERT_TRUE(body.complete);
+    TEST_ASSERT_TRUE(response_body_reusable(&body));
+    TEST_ASSERT_EQUAL_MEMORY(buf, decoded, 39);
+    TEST_ASSERT_EQUAL_INT(39, ndecoded);
+}
+void test_body_chunked_byte_at_a_time()
+{
+    response_body_t body;
+    char buf[256];
+    size_t buflen = chunked_response_length;
+
+    ndecoded = 0;
+    memcpy(buf, chunked_raw_response, buflen);
+    response_parse_header(&res, buf, &buflen);
+    response_body_init(&body, &res);
+
+    /* Every state must survive being cut off at any byte */
+    for (size_t i = 0; i < buflen; i++)
+        TEST_ASSERT_EQUAL_INT(1, response_body_feed(&body, buf + i, 1,
+                                                    collect, 0));
+
+    TEST_ASSERT_TRUE(body.complete);
+    TEST_ASSERT_TRUE(response_body_reusable(&body));
+    TEST_ASSERT_EQUAL_INT(39, ndecoded);
+    TEST_ASSERT_EQUAL_MEMORY("<html><body><h1>Test</h1></body></html>",
+                             decoded, 39);
+}
+void test_body_chunked_extensions_and_trailers()
+{
+    response_body_t body;
+    const char chunks[] =
+        "5;name=value\r\nhello\r\n"
+        "0\r\nExpires: never\r\n\r\n"
+        "HTTP/1.1";
+    size_t len = sizeof(chunks) - 1;
+
+    ndecoded = 0;
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_CHUNKED;
+    body.state = CHUNK_SIZE;
+
+    /* Bytes after the last chunk belong to the next response */
+    TEST_ASSERT_EQUAL_INT(len - 8, response_body_feed(&body, chunks, len,
+                                                      collect, 0));
+    TEST_ASSERT_TRUE(body.complete);
+    TEST_ASSERT_TRUE(body.excess);
+    TEST_ASSERT_FALSE(response_body_reusable(&body));
+    TEST_ASSERT_EQUAL_INT(5, ndecoded);
+    TEST_ASSERT_EQUAL_MEMORY("hello", decoded, 5);
+}
+void test_body_chunked_malformed()
+{
+    response_body_t body;
+
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_CHUNKED;
+    body.state = CHUNK_SIZE;
+
+    TEST_ASSERT_EQUAL_INT(-1, response_body_feed(&body, "zz\r\n", 4,
+                                                 collect, 0));
+}
+void test_body_chunked_cut_off()
+{
+    response_body_t body;
+
+    ndecoded = 0;
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_CHUNKED;
+    body.state = CHUNK_SIZE;
+
+    response_body_feed(&body, "5\r\nhel", 6, collect, 0);
+    TEST_ASSERT_EQUAL_INT(0, response_body_feed(&body, NULL, 0, collect, 0));
+    TEST_ASSERT_FALSE(body.complete);
+}
+void test_body_until_close()
+{
+    response_body_t body;
+
+    ndecoded = 0;
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_UNTIL_CLOSE;
+
+    TEST_ASSERT_EQUAL_INT(3, response_body_feed(&body, "abc", 3, collect, 0));
+    TEST_ASSERT_FALSE(body.complete);
+    TEST_ASSERT_EQUAL_INT(0, response_body_feed(&body, NULL, 0, collect, 0));
+    TEST_ASSERT_TRUE(body.complete);
+    TEST_ASSERT_FALSE(response_body_reusable(&body));
+    TEST_ASSERT_EQUAL_INT(3, ndecoded);
+}
+void test_body_advance()
+{
+    response_body_t body;
+
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_LENGTH;
+    body.remaining = 100;
+
+    response_body_advance(&body, 60);
+    TEST_ASSERT_EQUAL_INT(40, body.remaining);
+    TEST_ASSERT_FALSE(body.complete);
+    response_body_advance(&body, 40);
+    TEST_ASSERT_TRUE(body.complete);
+    TEST_ASSERT_TRUE(response_body_reusable(&body));
+
+    /* A close-delimited body only ends at EOF */
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_UNTIL_CLOSE;
+    response_body_advance(&body, 60);
+    TEST_ASSERT_FALSE(body.complete);
+}
+
+
+void test_parse_date()
+{
+    TEST_ASSERT_EQUAL_INT(1542085260,
+                          response_parse_date("Tue, 13 Nov 2018 05:01:00 GMT"));
+    TEST_ASSERT_EQUAL_INT(-1, response_parse_date("0"));
+    TEST_ASSERT_EQUAL_INT(-1, response_parse_date(NULL));
+}
+
+
+void test_cache_control_has()
+{
+    long value = -1;
+
+    TEST_ASSERT_TRUE(cache_control_has("public, max-age=60", "max-age",
+                                       &value));
+    TEST_ASSERT_EQUAL_INT(60, value);
+    TEST_ASSERT_TRUE(cache_control_has("S-MAXAGE=\"5\"", "s-maxage", &value));
+    TEST_ASSERT_EQUAL_INT(5, value);
+    TEST_ASSERT_TRUE(cache_control_has("public,no-store", "no-store", NULL));
+    TEST_ASSERT_FALSE(cache_control_has("no-storex", "no-store", NULL));
+    TEST_ASSERT_FALSE(cache_control_has("max-age", "max-age", &value));
+    TEST_ASSERT_FALSE(cache_control_has(NULL, "private", NULL));
+}
+
+
+void test_response_ttl()
+{
+    const time_t date = 1542085260;
+    long age;
+
+    hashmap_add(&res.header.fields, "Date", "Tue, 13 Nov 2018 05:01:00 GMT");
+
+    /* No freshness information, so the default applies */
+    TEST_ASSERT_EQUAL_INT(50, response_ttl(&res, date + 10, 60, &age));
+    TEST_ASSERT_EQUAL_INT(10, age);
+
+    hashmap_add(&res.header.fields, "Expires", "Tue, 13 Nov 2018 05:02:00 GMT");
+    TEST_ASSERT_EQUAL_INT(50, response_ttl(&res, date + 10, 0, &age));
+
+    /* max-age beats Expires, and a larger Age beats the clock */
+    hashmap_add(&res.header.fields, "Cache-Control", "public, max-age=3600");
+    hashmap_add(&res.header.fields, "Age", "100");
+    TEST_ASSERT_EQUAL_INT(3500, response_ttl(&res, date + 10, 0, &age));
+    TEST_ASSERT_EQUAL_INT(100, age);
+
+    hashmap_add(&res.header.fields, "Age", "4000");
+    TEST_ASSERT_EQUAL_INT(0, response_ttl(&res, date + 10, 0, &age));
+
+    hashmap_add(&res.header.fields, "Cache-Control", "private, max-age=60");
+    TEST_ASSERT_EQUAL_INT(0, response_ttl(&res, date, 0, &age));
+}
+
+
+void test_response_ttl_vary()
+{
+    long age;
+
+    hashmap_add(&res.header.fields, "Vary", "accept-encoding");
+    TEST_ASSERT_EQUAL_INT(60, response_ttl(&res, time(NULL), 60, &age));
+
+    hashmap_add(&res.header.fields, "Content-Encoding", "gzip");
+    TEST_ASSERT_EQUAL_INT(0, response_ttl(&res, time(NULL), 60, &age));
+
+    hashmap_del(&res.header.fields, "Content-Encoding");
+    hashmap_add(&res.header.fields, "Vary", "Accept-Encoding, Cookie");
+    TEST_ASSERT_EQUAL_INT(0, response_ttl(&res, time(NULL), 60, &age));
+
+    hashmap_add(&res.header.fields, "Vary", "*");
+    TEST_ASSERT_EQUAL_INT(0, response_ttl(&res, time(NULL), 60, &age));
+}
+
+
+void test_response_compressible()
+{
+    TEST_ASSERT_FALSE(response_compressible(&res));
+
+    hashmap_add(&res.header.fields, "Content-Type", "text/html; charset=utf-8");
+    TEST_ASSERT_TRUE(response_compressible(&res));
+
+    hashmap_add(&res.header.fields, "Content-Type", "application/jsonp");
+    TEST_ASSERT_FALSE(response_compressible(&res));
+
+    hashmap_add(&res.header.fields, "Content-Type", "application/json");
+    TEST_ASSERT_TRUE(response_compressible(&res));
+
+    hashmap_add(&res.header.fields, "Cache-Control", "max-age=5, no-transform");
+    TEST_ASSERT_FALSE(response_compressible(&res));
+
+    hashmap_del(&res.header.fields, "Cache-Control");
+    hashmap_add(&res.header.fields, "Content-Encoding", "br");
+    TEST_ASSERT_FALSE(response_compressible(&res));
+}
+
+
+void test_response_stored_fields()
+{
+    char buf[128];
+    char header[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Tue, 13 Nov 2018 05:01:00 GMT\r\n"
+        "Content-Type: text/html\r\n"
+        "Connection: keep-alive, X-Hop\r\n"
+        "X-Hop: 1\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "ETag: \"v1\",\r\n"
+        " \"v2\"\r\n"
+        "\r\n";
+    const char stored[] =
+        "Content-Type: text/html\r\n"
+        "ETag: \"v1\",\r\n"
+        " \"v2\"\r\n";
+
+    TEST_ASSERT_EQUAL_INT(0, response_deserialize(&res, header,
+                                                  strlen(header)));
+    TEST_ASSERT_EQUAL_INT(strlen(stored),
+                          response_stored_fields(&res, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY(stored, buf, strlen(stored));
+
+    TEST_ASSERT_EQUAL_INT(-1, response_stored_fields(&res, buf, 10));
+}
+
+
 int main()
 {
     UNITY_BEGIN();
@@ -248,6 +530,21 @@ int main()
     RUN_TEST(test_split_response_full_header_line);
     RUN_TEST(test_split_response_complete_header);
     RUN_TEST(test_split_response_partial_content);
+    RUN_TEST(test_parse_header_leaves_body);
+    RUN_TEST(test_parse_header_incomplete);
+    RUN_TEST(test_body_content_length_split);
+    RUN_TEST(test_body_chunked_byte_at_a_time);
+    RUN_TEST(test_body_chunked_extensions_and_trailers);
+    RUN_TEST(test_body_chunked_malformed);
+    RUN_TEST(test_body_chunked_cut_off);
+    RUN_TEST(test_body_until_close);
+    RUN_TEST(test_body_advance);
+    RUN_TEST(test_parse_date);
+    RUN_TEST(test_cache_control_has);
+    RUN_TEST(test_response_ttl);
+    RUN_TEST(test_response_ttl_vary);
+    RUN_TEST(test_response_compressible);
+    RUN_TEST(test_response_stored_fields);
 
     return UNITY_END();
 }
@@ -0,0 +1,95 @@
+#include "../vendor/unity/unity.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/uring.h"
+
+
+uring_t ring;
+char path[32];
+int fd = -1;
+
+
+void setUp()
+{
+    if (uring_init(&ring, 5) == -1)
+        TEST_IGNORE_MESSAGE("io_uring unavailable");
+
+    strcpy(path, "/tmp/test_uring_XXXXXX");
+    fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd > -1);
+}
+
+
+void tearDown()
+{
+    uring_destroy(&ring);
+    if (fd > -1) {
+        close(fd);
+        unlink(path);
+        fd = -1;
+    }
+}
+
+
+/* Queued writes should all land when the batch is run. */
+void test_uring_queue_write()
+{
+    char buf[8] = "";
+
+    TEST_ASSERT_EQUAL_INT(0, uring_queue_write(&ring, fd, "abcd", 4, 0));
+    TEST_ASSERT_EQUAL_INT(0, uring_queue_write(&ring, fd, "efgh", 4, 4));
+    TEST_ASSERT_EQUAL_INT(0, uring_run(&ring));
+
+    TEST_ASSERT_EQUAL_INT(8, pread(fd, buf, sizeof(buf), 0));
+    TEST_ASSERT_EQUAL_MEMORY("abcdefgh", buf, 8);
+}
+
+
+/* A file spanning several batches should arrive intact after its header. */
+void test_uring_send_file()
+{
+    int sv[2];
+    size_t len = URING_NBUFS * URING_BUFLEN * 2 + 123;
+    size_t nrecvd = 0;
+    ssize_t n;
+    char *data = malloc(len), *recvd = malloc(len + 3);
+
+    for (size_t i = 0; i < len; i++)
+        data[i] = 'a' + i % 26;
+    TEST_ASSERT_EQUAL_INT(len, write(fd, data, len));
+
+    /* Large enough that the sends never block on the reader */
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    int bufsz = len * 2;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+
+    TEST_ASSERT_EQUAL_INT(0, uring_queue_send(&ring, sv[0], "HDR", 3));
+    TEST_ASSERT_EQUAL_INT(len, uring_send_file(&ring, sv[0], fd, 0, len));
+    close(sv[0]);
+
+    while ((n = read(sv[1], recvd + nrecvd, len + 3 - nrecvd)) > 0)
+        nrecvd += n;
+    close(sv[1]);
+
+    TEST_ASSERT_EQUAL_INT(len + 3, nrecvd);
+    TEST_ASSERT_EQUAL_MEMORY("HDR", recvd, 3);
+    TEST_ASSERT_EQUAL_MEMORY(data, recvd + 3, len);
+
+    free(data);
+    free(recvd);
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_uring_queue_write);
+    RUN_TEST(test_uring_send_file);
+    return UNITY_END();
+}
@@ -0,0 +1,127 @@
+#include "../vendor/unity/unity.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../src/workqueue.h"
+
+
+workqueue_t q;
+int items[40];                  /* only their addresses are queued */
+
+
+void setUp()
+{
+    TEST_ASSERT_EQUAL_INT(0, workqueue_init(&q, 2));
+}
+
+
+void tearDown()
+{
+    workqueue_destroy(&q);
+}
+
+
+void test_workqueue_fifo_order()
+{
+    for (int round = 0; round < 2; round++) {
+        TEST_ASSERT_EQUAL_INT(0, workqueue_put(&q, &items[0]));
+        TEST_ASSERT_EQUAL_INT(0, workqueue_put(&q, &items[1]));
+        TEST_ASSERT_EQUAL_PTR(&items[0], workqueue_get(&q));
+        TEST_ASSERT_EQUAL_PTR(&items[1], workqueue_get(&q));
+    }
+}
+
+
+void test_workqueue_full_drops()
+{
+    workqueue_put(&q, &items[0]);
+    workqueue_put(&q, &items[1]);
+
+    TEST_ASSERT_EQUAL_INT(-1, workqueue_put(&q, &items[2]));
+    TEST_ASSERT_EQUAL_INT(1, q.dropped);
+    TEST_ASSERT_EQUAL_INT(2, q.queued);
+}
+
+
+/* An unbounded queue grows, keeping the order of a ring that wrapped. */
+void test_workqueue_unbounded_grows()
+{
+    workqueue_destroy(&q);
+    TEST_ASSERT_EQUAL_INT(0, workqueue_init(&q, 0));
+
+    for (int i = 0; i < 10; i++)
+        workqueue_put(&q, &items[i]);
+    for (int i = 0; i < 5; i++)
+        TEST_ASSERT_EQUAL_PTR(&items[i], workqueue_get(&q));
+
+    for (int i = 10; i < 40; i++)
+        TEST_ASSERT_EQUAL_INT(0, workqueue_put(&q, &items[i]));
+    TEST_ASSERT_TRUE(q.nslots > WORKQUEUE_INIT_SLOTS);
+
+    for (int i = 5; i < 40; i++)
+        TEST_ASSERT_EQUAL_PTR(&items[i], workqueue_get(&q));
+    TEST_ASSERT_EQUAL_INT(0, q.len);
+}
+
+
+/* A closed queue still hands out what was queued before it was closed. */
+void test_workqueue_close_drains()
+{
+    workqueue_put(&q, &items[0]);
+    workqueue_close(&q);
+
+    TEST_ASSERT_EQUAL_INT(-1, workqueue_put(&q, &items[1]));
+    TEST_ASSERT_EQUAL_PTR(&items[0], workqueue_get(&q));
+    TEST_ASSERT_NULL(workqueue_get(&q));
+}
+
+
+void *getter(void *result_vptr)
+{
+    *(void **)result_vptr = workqueue_get(&q);
+
+    return NULL;
+}
+
+
+void test_workqueue_get_waits()
+{
+    pthread_t thread;
+    void *result = &items[2];
+
+    pthread_create(&thread, NULL, getter, &result);
+    usleep(10000);
+    TEST_ASSERT_EQUAL_PTR(&items[2], result);
+
+    workqueue_put(&q, &items[0]);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_EQUAL_PTR(&items[0], result);
+}
+
+
+/* Closing wakes a get waiting on an empty queue. */
+void test_workqueue_close_wakes()
+{
+    pthread_t thread;
+    void *result = &items[2];
+
+    pthread_create(&thread, NULL, getter, &result);
+    usleep(10000);
+    workqueue_close(&q);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_NULL(result);
+}
+
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_workqueue_fifo_order);
+    RUN_TEST(test_workqueue_full_drops);
+    RUN_TEST(test_workqueue_unbounded_grows);
+    RUN_TEST(test_workqueue_close_drains);
+    RUN_TEST(test_workqueue_get_waits);
+    RUN_TEST(test_workqueue_close_wakes);
+    return UNITY_END();
+}